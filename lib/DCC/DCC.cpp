@@ -9,7 +9,7 @@ uint8_t resetPacket[3] = {0x00, 0x00, 0};
 #define  ACK_SAMPLE_THRESHOLD      500      /**< The threshold that the exponentially-smoothed analogRead samples (after subtracting the baseline current) must cross to establish ACKNOWLEDGEMENT.*/
 
 
-void IDCCChannel::sendThrottle(int iReg, LocoAddress addr, uint8_t tSpeed, uint8_t tDirection){
+void IDCCChannel::sendThrottle(int iReg, LocoAddress addr, uint8_t tSpeed, uint8_t tDirection, uint8_t steps, bool fl){
     uint8_t b[5];                         // save space for checksum byte
     uint8_t nB = 0;
 
@@ -19,15 +19,30 @@ void IDCCChannel::sendThrottle(int iReg, LocoAddress addr, uint8_t tSpeed, uint8
     }
 
     b[nB++] = lowByte(iAddr);
-    b[nB++] = B00111111;  // 128-step speed control byte (0x3F)
-    b[nB++] = (tSpeed & 0x7F) | ( (tDirection & 0x1) << 7); 
+    if(steps==14 || steps==28) {
+        // 01DCSSSS: moving speeds 2..127 become steps 1..14 (1..28)
+        uint8_t step = tSpeed<2 ? 0 : 1 + (tSpeed-2)*steps/126;
+        uint8_t v;
+        if(steps==14) {
+            // SSSS: 0 stop, 1 e-stop, 2..15 steps 1..14; C is FL
+            v = (step!=0 ? step+1 : tSpeed&1) | (fl ? 0x10 : 0);
+        } else {
+            // SSSSC: 0 stop, 2 e-stop, 4..31 steps 1..28; C is the least significant bit
+            uint8_t s5 = step!=0 ? step+3 : (tSpeed&1)<<1;
+            v = (s5&1)<<4 | s5>>1;
+        }
+        b[nB++] = B01000000 | (tDirection & 0x1) << 5 | v;
+    } else {
+        b[nB++] = B00111111;  // 128-step speed control byte (0x3F)
+        b[nB++] = (tSpeed & 0x7F) | ( (tDirection & 0x1) << 7); 
+    }
     
-    DCC_LOGI("iReg %d, addr %d, speed=%d %c", iReg, addr, tSpeed, (tDirection==1)?'F':'B');
+    DCC_LOGI("iReg %d, addr %d, speed=%d %c", iReg, addr.addr(), tSpeed, (tDirection==1)?'F':'B');
     
     loadPacket(iReg, b, nB, 0);
 }
 void IDCCChannel::sendFunctionGroup(int iReg, LocoAddress addr, DCCFnGroup group, uint32_t fn) {
-    DCC_LOGI("iReg %d, addr %d, group=%d fn=%08x", iReg, addr, (uint8_t)group, fn);
+    DCC_LOGI("iReg %d, addr %d, group=%d fn=%08x", iReg, addr.addr(), (uint8_t)group, (unsigned)fn);
     switch(group) {
         case DCCFnGroup::F0_4: 
             // move FL(F0) to 5th bit
@@ -74,7 +89,7 @@ void IDCCChannel::sendFunction(int iReg, LocoAddress addr, uint8_t fByte, uint8_
         b[nB++] = eByte;
     }
 
-    DCC_LOGI("iReg %d, addr %d, fByte=%02x eByte=%02x", iReg, addr, fByte, eByte);
+    DCC_LOGI("iReg %d, addr %d, fByte=%02x eByte=%02x", iReg, addr.addr(), fByte, eByte);
 
     /* 
     NMRA DCC norm ask for two DCC packets instead of only one:
@@ -86,15 +101,15 @@ void IDCCChannel::sendFunction(int iReg, LocoAddress addr, uint8_t fByte, uint8_
 
 }
 
-void IDCCChannel::sendAccessory(uint16_t addr11, bool thrown) {
+void IDCCChannel::sendAccessory(uint16_t addr11, bool thrown, bool on) {
     if(addr11>0) {
         addr11--;
     }
-    sendAccessory( (addr11>>2) + 1U, addr11 & 0x3, thrown);
+    sendAccessory( (addr11>>2) + 1U, addr11 & 0x3, thrown, on);
 }
 
-void IDCCChannel::sendAccessory(uint16_t addr9, uint8_t ch, bool thrown) {
-    DCC_LOGI("addr=%d, ch=%d, thrown=%c", addr9, ch, thrown?'Y':'N');
+void IDCCChannel::sendAccessory(uint16_t addr9, uint8_t ch, bool thrown, bool on) {
+    DCC_LOGI("addr=%d, ch=%d, thrown=%c, on=%c", addr9, ch, thrown?'Y':'N', on?'Y':'N');
 
     uint8_t b[3];     // save space for checksum byte
 
@@ -107,8 +122,9 @@ void IDCCChannel::sendAccessory(uint16_t addr9, uint8_t ch, bool thrown) {
     By convention these bits (bits 4-6 of the second data byte) are in ones complement. "
     https://www.nmra.org/sites/default/files/s-9.2.1_2012_07.pdf
     */
-    // second byte is of the form 1AAACDDD, where C should be 1, and the least significant D represent throw/close
+    // second byte is of the form 1AAACDDD, where C activates/deactivates output, and the least significant D represent throw/close
     b[1] = ( ((addr9>>6 & 0x7) << 4 ) ^ B01110000 )
+        | (on?0x8:0)
         | (ch & 0x3) << 1 
         | (thrown?0x1:0) 
         | B10000000   ;
@@ -58,18 +58,24 @@ public:
 
     virtual bool getPower()=0;
 
-    void sendThrottle(int slot, LocoAddress addr, uint8_t tSpeed, uint8_t tDirection);
+    /**
+     * @param tSpeed 0 stop, 1 emergency stop, 2..127 moving; scaled down for 14 and 28 step decoders.
+     * @param steps 14, 28 or 128.
+     * @param fl F0, which 14 step decoders take from the speed instruction.
+     */
+    void sendThrottle(int slot, LocoAddress addr, uint8_t tSpeed, uint8_t tDirection, uint8_t steps=128, bool fl=false);
     void sendFunctionGroup(int slot, LocoAddress addr, DCCFnGroup group, uint32_t fn);
     void sendFunction(int slot, LocoAddress addr, uint8_t fByte, uint8_t eByte=0);
     /**
      * @param addr11 is 1-based.
+     * @param on activates (true) or deactivates (false) the output.
      */
-    void sendAccessory(uint16_t addr11, bool thr);
+    void sendAccessory(uint16_t addr11, bool thr, bool on=true);
     /** 
      * @param addr9 is 1-based
      * @param ch is 0-based.
      */
-    void sendAccessory(uint16_t addr9, uint8_t ch, bool);
+    void sendAccessory(uint16_t addr9, uint8_t ch, bool thr, bool on);
     virtual uint16_t readCurrentAdc()=0;
 
     int16_t readCVProg(int cv);
@@ -361,7 +367,7 @@ protected:
         }
 
         size_t slot = it->second;
-        DCC_LOGI("Found slot %d for reg %d", slot, iReg);
+        DCC_LOGI("Found slot %d for reg %d", (int)slot, iReg);
         if(R.slotMap.size()==1) {
             // if it's last last slot, remove it and load Idle packet into slot 1
             loadPacket(1, idlePacket, 2, 0);
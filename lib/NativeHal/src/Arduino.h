@@ -0,0 +1,92 @@
+#pragma once
+/**
+ * Arduino-ESP32 core API for host (native) builds, backed by POSIX.
+ *
+ * Time comes from CLOCK_MONOTONIC, GPIO and ADC are a simulated pin table (see NativeHal.h),
+ * Serial is stdin/stdout, log output goes to stderr.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "binary.h"
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+#include "HardwareSerial.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define IRAM_ATTR
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT         0x01
+#define OUTPUT        0x02
+#define PULLUP        0x04
+#define INPUT_PULLUP  0x05
+#define PULLDOWN      0x08
+#define INPUT_PULLDOWN 0x09
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+
+using std::min;
+using std::max;
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+typedef enum {
+    ADC_0db,
+    ADC_2_5db,
+    ADC_6db,
+    ADC_11db
+} adc_attenuation_t;
+
+uint16_t analogRead(uint8_t pin);
+void analogSetPinAttenuation(uint8_t pin, adc_attenuation_t attenuation);
+
+
+#define ARDUHAL_LOG_FORMAT(letter, format)  "[" #letter "][%s:%u] %s(): " format "\r\n", __FILE__, __LINE__, __FUNCTION__
+
+/// not format-checked, same as the ESP32 core: the sources log size_t etc. with %d
+int log_printf(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+#define ets_printf log_printf
+
+#define log_e(format, ...) log_printf(ARDUHAL_LOG_FORMAT(E, format), ##__VA_ARGS__)
+#define log_w(format, ...) log_printf(ARDUHAL_LOG_FORMAT(W, format), ##__VA_ARGS__)
+#define log_i(format, ...) log_printf(ARDUHAL_LOG_FORMAT(I, format), ##__VA_ARGS__)
+#define log_d(...)
+#define log_v(...)
+
+
+class EspClass {
+public:
+    /// Ends the process; a supervisor (or test script) starts it again.
+    [[noreturn]] void restart();
+    uint32_t getFreeHeap() { return 0; }
+};
+
+extern EspClass ESP;
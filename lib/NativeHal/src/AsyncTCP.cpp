@@ -0,0 +1,300 @@
+#include "AsyncTCP.h"
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+
+/// Same interval as tcp_poll of AsyncTCP.
+static const uint32_t POLL_INTERVAL_MS = 500;
+static const int SERVICE_WAIT_MS = 5;
+
+/**
+ * Registry of open sockets and the thread serving them.
+ * Callbacks run with the lock held, so a client is never closed by loop() in the middle of its callback.
+ * space() and write() don't take it: on the station they go to the lwIP thread, not the async_tcp task, and
+ * a server may write under its own lock from loop() while a callback waits for that lock.
+ */
+struct AsyncTcpService {
+    std::recursive_mutex lock;
+    std::vector<AsyncServer*> servers;
+    std::vector<AsyncClient*> clients;
+    std::thread thread;
+    int wakeFd[2] = {-1, -1};
+
+    /// Never destroyed: servers and clients may be globals that close their sockets at exit.
+    static AsyncTcpService& get() {
+        static AsyncTcpService *s = new AsyncTcpService;
+        return *s;
+    }
+
+    void add(AsyncServer *s) {
+        std::lock_guard<std::recursive_mutex> lk(lock);
+        servers.push_back(s);
+        start();
+    }
+
+    void add(AsyncClient *c) {
+        std::lock_guard<std::recursive_mutex> lk(lock);
+        clients.push_back(c);
+        start();
+    }
+
+    void remove(AsyncServer *s) {
+        std::lock_guard<std::recursive_mutex> lk(lock);
+        servers.erase(std::remove(servers.begin(), servers.end(), s), servers.end());
+    }
+
+    void remove(AsyncClient *c) {
+        std::lock_guard<std::recursive_mutex> lk(lock);
+        clients.erase(std::remove(clients.begin(), clients.end(), c), clients.end());
+    }
+
+    bool has(AsyncClient *c) {
+        return std::find(clients.begin(), clients.end(), c)!=clients.end();
+    }
+
+    void start() {
+        if(thread.joinable()) { wake(); return; }
+        if(pipe(wakeFd)==0) {
+            fcntl(wakeFd[0], F_SETFL, O_NONBLOCK);
+            fcntl(wakeFd[1], F_SETFL, O_NONBLOCK);
+        }
+        thread = std::thread([this]() { run(); });
+        thread.detach();
+    }
+
+    void wake() {
+        char c = 0;
+        if(wakeFd[1]>=0 && ::write(wakeFd[1], &c, 1)<0) {}
+    }
+
+    void run();
+    void accept(AsyncServer *s);
+    void receive(AsyncClient *c);
+    void timers(uint32_t now);
+};
+
+static void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+void AsyncTcpService::run() {
+    std::vector<pollfd> fds;
+    std::vector<void*> owners;
+    for(;;) {
+        fds.clear();
+        owners.clear();
+        fds.push_back({wakeFd[0], POLLIN, 0});
+        owners.push_back(nullptr);
+        {
+            std::lock_guard<std::recursive_mutex> lk(lock);
+            for(auto s: servers) { fds.push_back({s->fd, POLLIN, 0}); owners.push_back(s); }
+            for(auto c: clients) { fds.push_back({c->fd, POLLIN, 0}); owners.push_back(c); }
+        }
+        int n = poll(fds.data(), fds.size(), SERVICE_WAIT_MS);
+        if(n>0 && (fds[0].revents & POLLIN)) {
+            char buf[16];
+            while(::read(wakeFd[0], buf, sizeof(buf))>0) {}
+        }
+
+        std::lock_guard<std::recursive_mutex> lk(lock);
+        for(size_t i=1; n>0 && i<fds.size(); i++) {
+            if(fds[i].revents==0) continue;
+            AsyncServer *s = nullptr;
+            for(auto x: servers) if(x==owners[i] && x->fd==fds[i].fd) s = x;
+            if(s!=nullptr) { accept(s); continue; }
+            AsyncClient *c = (AsyncClient*)owners[i];
+            if(has(c) && c->fd==fds[i].fd) receive(c);
+        }
+        timers(millis());
+    }
+}
+
+void AsyncTcpService::accept(AsyncServer *s) {
+    for(;;) {
+        int fd = ::accept(s->fd, nullptr, nullptr);
+        if(fd<0) return;
+        AsyncClient *c = new AsyncClient(fd);
+        if(s->noDelay) c->setNoDelay(true);
+        add(c);
+        if(s->connectCb) s->connectCb(s->connectArg, c);
+    }
+}
+
+void AsyncTcpService::receive(AsyncClient *c) {
+    char buf[1460];
+    for(;;) {
+        ssize_t n = ::recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if(n>0) {
+            c->lastRx = millis();
+            if(c->dataCb) c->dataCb(c->dataArg, c, buf, n);
+            // callback may have closed the client
+            if(!has(c)) return;
+            continue;
+        }
+        if(n<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)) return;
+        if(n<0 && c->errorCb) c->errorCb(c->errorArg, c, -errno);
+        c->close(true);
+        return;
+    }
+}
+
+void AsyncTcpService::timers(uint32_t now) {
+    // copy, callbacks may close clients
+    std::vector<AsyncClient*> list = clients;
+    for(auto c: list) {
+        if(!has(c)) continue;
+        if(c->rxTimeout!=0 && now-c->lastRx >= c->rxTimeout*1000) {
+            c->lastRx = now;
+            if(c->timeoutCb) c->timeoutCb(c->timeoutArg, c, c->rxTimeout*1000);
+        }
+        if(!has(c)) continue;
+        if(now-c->lastPoll >= POLL_INTERVAL_MS) {
+            c->lastPoll = now;
+            if(c->pollCb) c->pollCb(c->pollArg, c);
+        }
+    }
+}
+
+
+AsyncClient::AsyncClient(int fd): fd(fd) {
+    setNonBlocking(fd);
+    lastRx = lastPoll = millis();
+}
+
+AsyncClient::~AsyncClient() {
+    release();
+}
+
+bool AsyncClient::connect(IPAddress ip, uint16_t port) {
+    if(fd>=0) return false;
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if(s<0) return false;
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = (uint32_t)ip;
+    a.sin_port = htons(port);
+    if(::connect(s, (sockaddr*)&a, sizeof(a))!=0) {
+        ::close(s);
+        return false;
+    }
+    setNonBlocking(s);
+    fd = s;
+    lastRx = lastPoll = millis();
+    AsyncTcpService &svc = AsyncTcpService::get();
+    std::lock_guard<std::recursive_mutex> lk(svc.lock);
+    svc.add(this);
+    if(connectCb) connectCb(connectArg, this);
+    return true;
+}
+
+bool AsyncClient::release() {
+    AsyncTcpService &svc = AsyncTcpService::get();
+    std::lock_guard<std::recursive_mutex> lk(svc.lock);
+    if(fd<0) return false;
+    svc.remove(this);
+    std::lock_guard<std::mutex> io(ioLock);
+    ::close(fd);
+    fd = -1;
+    return true;
+}
+
+void AsyncClient::close(bool now) {
+    AsyncTcpService &svc = AsyncTcpService::get();
+    std::lock_guard<std::recursive_mutex> lk(svc.lock);
+    if(release() && discardCb) discardCb(discardArg, this);
+}
+
+size_t AsyncClient::space() {
+    std::lock_guard<std::mutex> io(ioLock);
+    return room();
+}
+
+size_t AsyncClient::room() {
+    if(fd<0) return 0;
+    int queued = 0;
+    if(ioctl(fd, SIOCOUTQ, &queued)<0) return 0;
+    return queued < (int)SND_BUF ? SND_BUF-queued : 0;
+}
+
+size_t AsyncClient::add(const char *data, size_t size, uint8_t apiflags) {
+    std::lock_guard<std::mutex> io(ioLock);
+    if(fd<0 || data==nullptr || size==0) return 0;
+    size_t free = room();
+    if(free==0) return 0;
+    ssize_t n = ::send(fd, data, size<free ? size : free, MSG_DONTWAIT|MSG_NOSIGNAL);
+    return n>0 ? n : 0;
+}
+
+void AsyncClient::setNoDelay(bool nodelay) {
+    int v = nodelay ? 1 : 0;
+    if(fd>=0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
+}
+
+IPAddress AsyncClient::remoteIP() const {
+    sockaddr_in a = {};
+    socklen_t l = sizeof(a);
+    if(fd<0 || getpeername(fd, (sockaddr*)&a, &l)!=0) return IPAddress();
+    return IPAddress(a.sin_addr.s_addr);
+}
+
+uint16_t AsyncClient::remotePort() const {
+    sockaddr_in a = {};
+    socklen_t l = sizeof(a);
+    if(fd<0 || getpeername(fd, (sockaddr*)&a, &l)!=0) return 0;
+    return ntohs(a.sin_port);
+}
+
+IPAddress AsyncClient::localIP() const {
+    sockaddr_in a = {};
+    socklen_t l = sizeof(a);
+    if(fd<0 || getsockname(fd, (sockaddr*)&a, &l)!=0) return IPAddress();
+    return IPAddress(a.sin_addr.s_addr);
+}
+
+uint16_t AsyncClient::localPort() const {
+    sockaddr_in a = {};
+    socklen_t l = sizeof(a);
+    if(fd<0 || getsockname(fd, (sockaddr*)&a, &l)!=0) return 0;
+    return ntohs(a.sin_port);
+}
+
+
+void AsyncServer::begin() {
+    if(fd>=0) return;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd<0) return;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = (uint32_t)addr;
+    a.sin_port = htons(port);
+    if(bind(fd, (sockaddr*)&a, sizeof(a))!=0 || listen(fd, 5)!=0) {
+        log_e("Can't listen on port %d: %s", port, strerror(errno));
+        ::close(fd);
+        fd = -1;
+        return;
+    }
+    setNonBlocking(fd);
+    AsyncTcpService::get().add(this);
+}
+
+void AsyncServer::end() {
+    if(fd<0) return;
+    AsyncTcpService::get().remove(this);
+    ::close(fd);
+    fd = -1;
+}
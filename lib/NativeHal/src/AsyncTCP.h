@@ -0,0 +1,124 @@
+#pragma once
+/**
+ * AsyncTCP API on POSIX sockets. One service thread, like the async_tcp task on ESP32, polls all sockets
+ * and runs the callbacks (onClient, onData, onDisconnect, onTimeout, onPoll); they run concurrently with loop().
+ *
+ * Send buffer space is limited to the lwIP default, so write() accepts partial data like on the station.
+ * close() calls onDisconnect in the calling thread, as AsyncTCP does. Acks are not reported.
+ */
+
+#include <Arduino.h>
+#include <functional>
+#include <mutex>
+
+#include "IPAddress.h"
+
+class AsyncClient;
+
+#define ASYNC_WRITE_FLAG_COPY 0x01
+#define ASYNC_WRITE_FLAG_MORE 0x02
+
+typedef std::function<void(void*, AsyncClient*)> AcConnectHandler;
+typedef std::function<void(void*, AsyncClient*, size_t len, uint32_t time)> AcAckHandler;
+typedef std::function<void(void*, AsyncClient*, int8_t error)> AcErrorHandler;
+typedef std::function<void(void*, AsyncClient*, void *data, size_t len)> AcDataHandler;
+typedef std::function<void(void*, AsyncClient*, uint32_t time)> AcTimeoutHandler;
+
+class AsyncClient {
+public:
+    /// Send buffer of lwIP in Arduino-ESP32 (CONFIG_TCP_SND_BUF_DEFAULT).
+    static const size_t SND_BUF = 5744;
+
+    AsyncClient(): fd(-1) {}
+    ~AsyncClient();
+
+    /// Blocking connect; onConnect is called before it returns.
+    bool connect(IPAddress ip, uint16_t port);
+    void close(bool now=false);
+    void stop() { close(false); }
+    int8_t abort() { close(true); return 0; }
+
+    bool connected() const { return fd>=0; }
+    bool disconnected() const { return fd<0; }
+    bool freeable() const { return fd<0; }
+
+    /// Free room in the send buffer.
+    size_t space();
+    bool canSend() { return space()>0; }
+
+    /// Queues as much of data as there is room for. @return bytes accepted
+    size_t add(const char *data, size_t size, uint8_t apiflags=ASYNC_WRITE_FLAG_COPY);
+    bool send() { return true; }
+    size_t write(const char *data) { return write(data, strlen(data)); }
+    size_t write(const char *data, size_t size, uint8_t apiflags=ASYNC_WRITE_FLAG_COPY) { return add(data, size, apiflags); }
+
+    /// seconds without received data before onTimeout, 0 disables
+    void setRxTimeout(uint32_t timeout) { rxTimeout = timeout; }
+    uint32_t getRxTimeout() const { return rxTimeout; }
+    void setNoDelay(bool nodelay);
+    uint16_t getMss() const { return 1436; }
+
+    IPAddress remoteIP() const;
+    uint16_t remotePort() const;
+    IPAddress localIP() const;
+    uint16_t localPort() const;
+
+    void onConnect(AcConnectHandler cb, void *arg=nullptr) { connectCb = cb; connectArg = arg; }
+    void onDisconnect(AcConnectHandler cb, void *arg=nullptr) { discardCb = cb; discardArg = arg; }
+    void onAck(AcAckHandler cb, void *arg=nullptr) { ackCb = cb; ackArg = arg; }
+    void onError(AcErrorHandler cb, void *arg=nullptr) { errorCb = cb; errorArg = arg; }
+    void onData(AcDataHandler cb, void *arg=nullptr) { dataCb = cb; dataArg = arg; }
+    void onTimeout(AcTimeoutHandler cb, void *arg=nullptr) { timeoutCb = cb; timeoutArg = arg; }
+    void onPoll(AcConnectHandler cb, void *arg=nullptr) { pollCb = cb; pollArg = arg; }
+
+private:
+    friend class AsyncServer;
+    friend struct AsyncTcpService;
+
+    explicit AsyncClient(int fd);
+
+    int fd;
+    uint32_t rxTimeout = 0;
+    uint32_t lastRx = 0;
+    uint32_t lastPoll = 0;
+
+    AcConnectHandler connectCb;     void *connectArg = nullptr;
+    AcConnectHandler discardCb;     void *discardArg = nullptr;
+    AcAckHandler ackCb;             void *ackArg = nullptr;
+    AcErrorHandler errorCb;         void *errorArg = nullptr;
+    AcDataHandler dataCb;           void *dataArg = nullptr;
+    AcTimeoutHandler timeoutCb;     void *timeoutArg = nullptr;
+    AcConnectHandler pollCb;        void *pollArg = nullptr;
+
+    /// Guards fd in space(), add() and release()
+    std::mutex ioLock;
+
+    /// Closes the socket; @return false if it was already closed
+    bool release();
+    /// space() with ioLock held
+    size_t room();
+};
+
+class AsyncServer {
+public:
+    AsyncServer(IPAddress addr, uint16_t port): addr(addr), port(port) {}
+    AsyncServer(uint16_t port): addr(0u), port(port) {}
+    ~AsyncServer() { end(); }
+
+    void onClient(AcConnectHandler cb, void *arg) { connectCb = cb; connectArg = arg; }
+    void begin();
+    void end();
+    void setNoDelay(bool nodelay) { noDelay = nodelay; }
+    bool getNoDelay() const { return noDelay; }
+    uint8_t status() const { return fd>=0 ? 1 : 0; }
+
+private:
+    friend struct AsyncTcpService;
+
+    IPAddress addr;
+    uint16_t port;
+    int fd = -1;
+    bool noDelay = false;
+    AcConnectHandler connectCb;
+    void *connectArg = nullptr;
+};
@@ -0,0 +1,14 @@
+#pragma once
+/// mDNS responder; host builds don't advertise, clients connect to localhost or a fixed address.
+
+#include <Arduino.h>
+
+class MDNSResponder {
+public:
+    bool begin(const char *hostName) { return true; }
+    void end() {}
+    void setInstanceName(const char *name) {}
+    bool addService(const char *service, const char *proto, uint16_t port) { return true; }
+};
+
+extern MDNSResponder MDNS;
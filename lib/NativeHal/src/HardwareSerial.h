@@ -0,0 +1,32 @@
+#pragma once
+
+#include "Stream.h"
+
+/// Serial port of the station, mapped to stdin/stdout of the process.
+class HardwareSerial: public Stream {
+public:
+    HardwareSerial(int inFd, int outFd): inFd(inFd), outFd(outFd) {}
+
+    void begin(unsigned long baud) {}
+    void end() {}
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t readBytes(char *buffer, size_t length) override;
+    using Stream::readBytes;
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t size) override;
+    using Print::write;
+
+    operator bool() const { return true; }
+
+private:
+    int inFd;
+    int outFd;
+    int peeked = -1;
+    bool eof = false;
+};
+
+extern HardwareSerial Serial;
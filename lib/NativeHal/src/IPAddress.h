@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "WString.h"
+#include "Print.h"
+
+/// IPv4 address; uint32_t form is in network byte order, like in_addr and Arduino-ESP32.
+class IPAddress: public Printable {
+public:
+    IPAddress(): addr(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+        bytes[0] = a; bytes[1] = b; bytes[2] = c; bytes[3] = d;
+    }
+    IPAddress(uint32_t a): addr(a) {}
+
+    operator uint32_t() const { return addr; }
+    uint8_t operator[](int i) const { return bytes[i]; }
+    bool operator==(const IPAddress &o) const { return addr==o.addr; }
+    bool operator!=(const IPAddress &o) const { return addr!=o.addr; }
+
+    String toString() const {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+        return String(buf);
+    }
+
+    size_t printTo(Print &p) const override { return p.print(toString()); }
+
+private:
+    union {
+        uint8_t bytes[4];
+        uint32_t addr;
+    };
+};
@@ -0,0 +1,25 @@
+#pragma once
+/**
+ * Host side of the simulated pins: what a test or simulation uses to play the hardware around the station.
+ * All functions are thread-safe.
+ */
+
+#include <stdint.h>
+
+namespace NativeHal {
+
+    static const uint8_t PIN_COUNT = 40;
+
+    /// Level seen by digitalRead() on an input pin (buttons, sensors).
+    void setInput(uint8_t pin, int level);
+
+    /// Value returned by analogRead(), 0..4095 (e.g. track current sense).
+    void setAnalog(uint8_t pin, uint16_t value);
+
+    /// Last level written by digitalWrite().
+    int outputLevel(uint8_t pin);
+
+    /// Number of digitalWrite() calls that changed the pin level, e.g. to count DCC signal edges.
+    uint32_t edgeCount(uint8_t pin);
+
+}
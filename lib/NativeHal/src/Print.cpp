@@ -0,0 +1,24 @@
+#include "Print.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+size_t Print::printf(const char *format, ...) {
+    char buf[64];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if(n<0) return 0;
+    if(n<(int)sizeof(buf)) return write((const uint8_t*)buf, n);
+
+    char *big = (char*)malloc(n+1);
+    if(big==nullptr) return 0;
+    va_start(args, format);
+    vsnprintf(big, n+1, format, args);
+    va_end(args);
+    size_t r = write((const uint8_t*)big, n);
+    free(big);
+    return r;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "WString.h"
+#include "Printable.h"
+
+class Print {
+public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buf, size_t size) {
+        size_t n = 0;
+        while(size--) {
+            if(write(*buf++)==0) break;
+            n++;
+        }
+        return n;
+    }
+    size_t write(const char *str) { return str==nullptr ? 0 : write((const uint8_t*)str, strlen(str)); }
+    size_t write(const char *buf, size_t size) { return write((const uint8_t*)buf, size); }
+
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+
+    size_t printf(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+    size_t print(const char *s) { return write(s); }
+    size_t print(const String &s) { return write(s.c_str(), s.length()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char v, int base=DEC) { return print(String(v, base)); }
+    size_t print(int v, int base=DEC) { return print(String(v, base)); }
+    size_t print(unsigned int v, int base=DEC) { return print(String(v, base)); }
+    size_t print(long v, int base=DEC) { return print(String(v, base)); }
+    size_t print(unsigned long v, int base=DEC) { return print(String(v, base)); }
+    size_t print(double v, int digits=2) { return print(String(v, digits)); }
+    size_t print(const Printable &x) { return x.printTo(*this); }
+
+    size_t println() { return write("\r\n", 2); }
+    template<typename T> size_t println(const T &v) { size_t n = print(v); return n+println(); }
+    template<typename T> size_t println(const T &v, int base) { size_t n = print(v, base); return n+println(); }
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "Print.h"
+
+/// Arduino Stream. Reads don't wait for data: a host process has no reason to block in them.
+class Stream: public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    void setTimeout(unsigned long ms) { timeout = ms; }
+    unsigned long getTimeout() const { return timeout; }
+
+    virtual size_t readBytes(char *buffer, size_t length) {
+        size_t n = 0;
+        while(n<length) {
+            int c = read();
+            if(c<0) break;
+            buffer[n++] = (char)c;
+        }
+        return n;
+    }
+    size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char*)buffer, length); }
+
+protected:
+    unsigned long timeout = 1000;
+};
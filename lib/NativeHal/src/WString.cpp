@@ -0,0 +1,51 @@
+#include "WString.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <strings.h>
+
+static std::string toBase(unsigned long v, unsigned char base) {
+    if(base<2 || base>36) base = 10;
+    char buf[8*sizeof(long)+1];
+    char *p = buf+sizeof(buf);
+    *--p = 0;
+    do {
+        unsigned d = v % base;
+        *--p = d<10 ? '0'+d : 'A'+d-10;
+        v /= base;
+    } while(v!=0);
+    return p;
+}
+
+String::String(long v, unsigned char base) {
+    if(v<0 && base==10) s = "-" + toBase(-(unsigned long)v, base);
+    else s = toBase((unsigned long)v, base);
+}
+
+String::String(unsigned long v, unsigned char base): s(toBase(v, base)) {}
+
+String::String(double v, unsigned int decimals) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", (int)decimals, v);
+    s = buf;
+}
+
+bool String::equalsIgnoreCase(const String &o) const {
+    return strcasecmp(s.c_str(), o.s.c_str())==0;
+}
+
+void String::trim() {
+    size_t b = 0, e = s.size();
+    while(b<e && isspace((unsigned char)s[b])) b++;
+    while(e>b && isspace((unsigned char)s[e-1])) e--;
+    s = s.substr(b, e-b);
+}
+
+void String::toUpperCase() {
+    for(auto &c: s) c = toupper((unsigned char)c);
+}
+
+void String::toLowerCase() {
+    for(auto &c: s) c = tolower((unsigned char)c);
+}
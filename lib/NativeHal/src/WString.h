@@ -0,0 +1,78 @@
+#pragma once
+/// Arduino String, on top of std::string.
+
+#include <stdint.h>
+#include <string>
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+class String {
+public:
+    String() {}
+    String(const char *s): s(s!=nullptr ? s : "") {}
+    String(const std::string &s): s(s) {}
+    explicit String(char c): s(1, c) {}
+    explicit String(unsigned char v, unsigned char base=10): String((unsigned long)v, base) {}
+    explicit String(int v, unsigned char base=10): String((long)v, base) {}
+    explicit String(unsigned int v, unsigned char base=10): String((unsigned long)v, base) {}
+    explicit String(long v, unsigned char base=10);
+    explicit String(unsigned long v, unsigned char base=10);
+    explicit String(double v, unsigned int decimals=2);
+
+    const char* c_str() const { return s.c_str(); }
+    unsigned int length() const { return s.size(); }
+    bool isEmpty() const { return s.empty(); }
+
+    char charAt(unsigned int i) const { return i<s.size() ? s[i] : 0; }
+    char operator[](unsigned int i) const { return charAt(i); }
+
+    int indexOf(char c, unsigned int from=0) const { return pos(s.find(c, from)); }
+    int indexOf(const String &str, unsigned int from=0) const { return pos(s.find(str.s, from)); }
+    int lastIndexOf(char c) const { return pos(s.rfind(c)); }
+
+    String substring(unsigned int from) const { return from<s.size() ? String(s.substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const {
+        return from<s.size() && to>from ? String(s.substr(from, to-from)) : String();
+    }
+
+    bool startsWith(const String &p) const { return s.compare(0, p.s.size(), p.s)==0; }
+    bool endsWith(const String &p) const {
+        return s.size()>=p.s.size() && s.compare(s.size()-p.s.size(), p.s.size(), p.s)==0;
+    }
+    bool equals(const String &o) const { return s==o.s; }
+    bool equalsIgnoreCase(const String &o) const;
+
+    long toInt() const { return strtol(s.c_str(), nullptr, 10); }
+    float toFloat() const { return strtof(s.c_str(), nullptr); }
+
+    void trim();
+    void toUpperCase();
+    void toLowerCase();
+
+    String& operator+=(const String &o) { s += o.s; return *this; }
+    String& operator+=(const char *o) { s += o; return *this; }
+    String& operator+=(char c) { s += c; return *this; }
+    String& operator+=(int v) { return *this += String(v); }
+    String& operator+=(unsigned int v) { return *this += String(v); }
+    String& operator+=(long v) { return *this += String(v); }
+    String& operator+=(unsigned long v) { return *this += String(v); }
+
+    bool concat(const String &o) { s += o.s; return true; }
+
+    bool operator==(const String &o) const { return s==o.s; }
+    bool operator==(const char *o) const { return s==o; }
+    bool operator!=(const String &o) const { return s!=o.s; }
+    bool operator!=(const char *o) const { return s!=o; }
+    bool operator<(const String &o) const { return s<o.s; }
+
+private:
+    std::string s;
+    static int pos(size_t p) { return p==std::string::npos ? -1 : (int)p; }
+};
+
+template<typename T>
+inline String operator+(const String &a, const T &b) { String r(a); r += b; return r; }
+inline String operator+(const char *a, const String &b) { String r(a); r += b; return r; }
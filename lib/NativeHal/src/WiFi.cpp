@@ -0,0 +1,215 @@
+#include "WiFi.h"
+#include "ESPmDNS.h"
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+
+WiFiClass WiFi;
+MDNSResponder MDNS;
+
+static void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+
+WiFiClient::WiFiClient(int fd): sock(std::make_shared<Socket>(fd)) {
+    setNonBlocking(fd);
+}
+
+WiFiClient::Socket::~Socket() {
+    if(fd>=0) ::close(fd);
+}
+
+int WiFiClient::available() {
+    if(!sock || sock->fd<0) return 0;
+    int n = 0;
+    if(ioctl(sock->fd, FIONREAD, &n)<0) return 0;
+    return n + (sock->peeked>=0 ? 1 : 0);
+}
+
+int WiFiClient::read() {
+    uint8_t c;
+    return readBytes((char*)&c, 1)==1 ? c : -1;
+}
+
+int WiFiClient::peek() {
+    if(!sock || sock->fd<0) return -1;
+    if(sock->peeked<0) {
+        uint8_t c;
+        if(::recv(sock->fd, &c, 1, MSG_DONTWAIT)==1) sock->peeked = c;
+    }
+    return sock->peeked;
+}
+
+size_t WiFiClient::readBytes(char *buffer, size_t length) {
+    if(!sock || sock->fd<0 || length==0) return 0;
+    size_t n = 0;
+    if(sock->peeked>=0) {
+        buffer[n++] = sock->peeked;
+        sock->peeked = -1;
+    }
+    ssize_t r = ::recv(sock->fd, buffer+n, length-n, MSG_DONTWAIT);
+    if(r>0) n += r;
+    return n;
+}
+
+size_t WiFiClient::write(const uint8_t *buf, size_t size) {
+    if(!sock || sock->fd<0) return 0;
+    size_t done = 0;
+    while(done<size) {
+        ssize_t n = ::send(sock->fd, buf+done, size-done, MSG_NOSIGNAL|MSG_DONTWAIT);
+        if(n>0) { done += n; continue; }
+        if(n<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)) {
+            pollfd p = { sock->fd, POLLOUT, 0 };
+            if(poll(&p, 1, 1000)<=0) break;
+            continue;
+        }
+        break;
+    }
+    return done;
+}
+
+uint8_t WiFiClient::connected() {
+    if(!sock || sock->fd<0) return 0;
+    if(sock->peeked>=0) return 1;
+    uint8_t c;
+    ssize_t r = ::recv(sock->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+    if(r>0) return 1;
+    if(r<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)) return 1;
+    return 0;
+}
+
+void WiFiClient::stop() {
+    sock.reset();
+}
+
+IPAddress WiFiClient::remoteIP() const {
+    sockaddr_in a = {};
+    socklen_t l = sizeof(a);
+    if(!sock || getpeername(sock->fd, (sockaddr*)&a, &l)!=0) return IPAddress();
+    return IPAddress(a.sin_addr.s_addr);
+}
+
+uint16_t WiFiClient::remotePort() const {
+    sockaddr_in a = {};
+    socklen_t l = sizeof(a);
+    if(!sock || getpeername(sock->fd, (sockaddr*)&a, &l)!=0) return 0;
+    return ntohs(a.sin_port);
+}
+
+
+void WiFiServer::begin(uint16_t p) {
+    if(p!=0) port = p;
+    end();
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd<0) return;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_ANY);
+    a.sin_port = htons(port);
+    if(bind(fd, (sockaddr*)&a, sizeof(a))!=0 || listen(fd, maxClients)!=0) {
+        log_e("Can't listen on port %d: %s", port, strerror(errno));
+        ::close(fd);
+        fd = -1;
+        return;
+    }
+    setNonBlocking(fd);
+}
+
+void WiFiServer::end() {
+    if(fd>=0) ::close(fd);
+    fd = -1;
+}
+
+WiFiClient WiFiServer::available() {
+    if(fd<0) return WiFiClient();
+    int c = ::accept(fd, nullptr, nullptr);
+    if(c<0) return WiFiClient();
+    if(noDelay) {
+        int one = 1;
+        setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return WiFiClient(c);
+}
+
+
+uint8_t WiFiUDP::begin(uint16_t port) {
+    stop();
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd<0) return 0;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_ANY);
+    a.sin_port = htons(port);
+    if(bind(fd, (sockaddr*)&a, sizeof(a))!=0) {
+        log_e("Can't bind UDP port %d: %s", port, strerror(errno));
+        stop();
+        return 0;
+    }
+    setNonBlocking(fd);
+    return 1;
+}
+
+void WiFiUDP::stop() {
+    if(fd>=0) ::close(fd);
+    fd = -1;
+    rxLen = rxPos = 0;
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port) {
+    txAddr = ip;
+    txPort = port;
+    txLen = 0;
+    return 1;
+}
+
+size_t WiFiUDP::write(const uint8_t *buf, size_t size) {
+    size_t n = size < (size_t)(MAX_PACKET-txLen) ? size : MAX_PACKET-txLen;
+    memcpy(tx+txLen, buf, n);
+    txLen += n;
+    return n;
+}
+
+int WiFiUDP::endPacket() {
+    if(fd<0) return 0;
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = (uint32_t)txAddr;
+    a.sin_port = htons(txPort);
+    ssize_t n = sendto(fd, tx, txLen, MSG_DONTWAIT, (sockaddr*)&a, sizeof(a));
+    txLen = 0;
+    return n>=0 ? 1 : 0;
+}
+
+int WiFiUDP::parsePacket() {
+    rxLen = rxPos = 0;
+    if(fd<0) return 0;
+    sockaddr_in a = {};
+    socklen_t l = sizeof(a);
+    ssize_t n = recvfrom(fd, rx, sizeof(rx), MSG_DONTWAIT, (sockaddr*)&a, &l);
+    if(n<=0) return 0;
+    rxLen = n;
+    remoteAddr = IPAddress(a.sin_addr.s_addr);
+    remotePortNum = ntohs(a.sin_port);
+    return rxLen;
+}
+
+int WiFiUDP::read(uint8_t *buf, size_t len) {
+    int n = rxLen-rxPos;
+    if((size_t)n>len) n = len;
+    memcpy(buf, rx+rxPos, n);
+    rxPos += n;
+    return n;
+}
@@ -0,0 +1,28 @@
+#pragma once
+/// WiFi station API for host builds: the host network is always "connected", servers listen on all interfaces.
+
+#include <Arduino.h>
+
+#include "IPAddress.h"
+#include "WiFiClient.h"
+#include "WiFiServer.h"
+#include "WiFiUdp.h"
+
+typedef enum {
+    WL_IDLE_STATUS = 0,
+    WL_NO_SSID_AVAIL = 1,
+    WL_SCAN_COMPLETED = 2,
+    WL_CONNECTED = 3,
+    WL_CONNECT_FAILED = 4,
+    WL_CONNECTION_LOST = 5,
+    WL_DISCONNECTED = 6
+} wl_status_t;
+
+class WiFiClass {
+public:
+    wl_status_t status() { return WL_CONNECTED; }
+    IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+    bool setSleep(bool) { return true; }
+};
+
+extern WiFiClass WiFi;
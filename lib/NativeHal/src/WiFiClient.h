@@ -0,0 +1,41 @@
+#pragma once
+
+#include <memory>
+
+#include "Stream.h"
+#include "IPAddress.h"
+
+/// Non-blocking TCP connection. Copies share the socket, which is closed when the last copy goes away or stop() is called.
+class WiFiClient: public Stream {
+public:
+    WiFiClient() {}
+    explicit WiFiClient(int fd);
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t readBytes(char *buffer, size_t length) override;
+    using Stream::readBytes;
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    /// Waits while the socket's send buffer is full, like lwIP writes do.
+    size_t write(const uint8_t *buf, size_t size) override;
+    using Print::write;
+
+    uint8_t connected();
+    operator bool() { return connected(); }
+    void stop();
+
+    IPAddress remoteIP() const;
+    uint16_t remotePort() const;
+    int fd() const { return sock ? sock->fd : -1; }
+
+private:
+    struct Socket {
+        int fd;
+        int peeked = -1;
+        explicit Socket(int fd): fd(fd) {}
+        ~Socket();
+    };
+    std::shared_ptr<Socket> sock;
+};
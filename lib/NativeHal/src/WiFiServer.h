@@ -0,0 +1,27 @@
+#pragma once
+
+#include "WiFiClient.h"
+
+/// Listening TCP socket, polled by available() from loop().
+class WiFiServer {
+public:
+    WiFiServer(uint16_t port=80, uint8_t maxClients=4): port(port), maxClients(maxClients) {}
+    ~WiFiServer() { end(); }
+
+    void begin(uint16_t port=0);
+    void end();
+    void close() { end(); }
+    void setNoDelay(bool nodelay) { noDelay = nodelay; }
+
+    /// Next pending connection, or an unconnected client.
+    WiFiClient available();
+    WiFiClient accept() { return available(); }
+
+    operator bool() const { return fd>=0; }
+
+private:
+    uint16_t port;
+    uint8_t maxClients;
+    int fd = -1;
+    bool noDelay = false;
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Stream.h"
+#include "IPAddress.h"
+
+/// Non-blocking UDP socket with Arduino's packet API.
+class WiFiUDP: public Stream {
+public:
+    ~WiFiUDP() { stop(); }
+
+    uint8_t begin(uint16_t port);
+    void stop();
+
+    int beginPacket(IPAddress ip, uint16_t port);
+    int endPacket();
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t size) override;
+    using Print::write;
+
+    /// Receives next datagram. @return its size, 0 if there is none
+    int parsePacket();
+    int available() override { return rxLen-rxPos; }
+    int read() override { return rxPos<rxLen ? rx[rxPos++] : -1; }
+    int read(uint8_t *buf, size_t len);
+    int read(char *buf, size_t len) { return read((uint8_t*)buf, len); }
+    int peek() override { return rxPos<rxLen ? rx[rxPos] : -1; }
+    void flush() override { rxPos = rxLen; }
+
+    IPAddress remoteIP() const { return remoteAddr; }
+    uint16_t remotePort() const { return remotePortNum; }
+
+private:
+    static const int MAX_PACKET = 1460;
+
+    int fd = -1;
+    uint8_t rx[MAX_PACKET];
+    int rxLen = 0;
+    int rxPos = 0;
+    IPAddress remoteAddr;
+    uint16_t remotePortNum = 0;
+
+    uint8_t tx[MAX_PACKET];
+    int txLen = 0;
+    IPAddress txAddr;
+    uint16_t txPort = 0;
+};
@@ -0,0 +1,132 @@
+#include "esp32-hal-timer.h"
+
+#include <atomic>
+#include <thread>
+#include <time.h>
+#include <errno.h>
+
+static const uint32_t APB_CLK_HZ = 80000000;
+/// Alarms fired back to back after the thread was delayed; beyond that the schedule restarts from now.
+static const uint32_t MAX_CATCH_UP = 1000;
+
+struct hw_timer_s {
+    uint8_t num;
+    std::atomic<uint16_t> divider;
+    std::atomic<uint64_t> alarm{0};
+    std::atomic<bool> autoreload{false};
+    std::atomic<bool> alarmEnabled{false};
+    std::atomic<bool> started{false};
+    std::atomic<void (*)(void)> fn{nullptr};
+    /// incremented by every change of the schedule, so the thread restarts its deadline
+    std::atomic<uint32_t> version{0};
+    std::atomic<bool> quit{false};
+    std::thread thread;
+
+    void run();
+};
+
+static void addNs(timespec &t, uint64_t ns) {
+    ns += t.tv_nsec;
+    t.tv_sec += ns / 1000000000;
+    t.tv_nsec = ns % 1000000000;
+}
+
+static bool before(const timespec &a, const timespec &b) {
+    return a.tv_sec<b.tv_sec || (a.tv_sec==b.tv_sec && a.tv_nsec<b.tv_nsec);
+}
+
+void hw_timer_s::run() {
+    timespec next;
+    uint32_t ver = version-1;
+    while(!quit) {
+        void (*f)(void) = fn;
+        uint64_t periodNs = (uint64_t)divider * alarm * 1000000000 / APB_CLK_HZ;
+        if(!started || !alarmEnabled || f==nullptr || periodNs==0) {
+            timespec idle = {0, 1000000};
+            nanosleep(&idle, nullptr);
+            ver = version-1;
+            continue;
+        }
+        if(ver!=version) {
+            ver = version;
+            clock_gettime(CLOCK_MONOTONIC, &next);
+            addNs(next, periodNs);
+        }
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr)==EINTR) {}
+
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint32_t n = 0;
+        while(!before(now, next) && n<MAX_CATCH_UP && ver==version) {
+            f();
+            n++;
+            addNs(next, periodNs);
+            if(!autoreload) {
+                alarmEnabled = false;
+                break;
+            }
+        }
+        if(n==MAX_CATCH_UP) {
+            next = now;
+            addNs(next, periodNs);
+        }
+    }
+}
+
+hw_timer_t * timerBegin(uint8_t num, uint16_t divider, bool countUp) {
+    hw_timer_t *t = new hw_timer_t;
+    t->num = num;
+    t->divider = divider==0 ? 1 : divider;
+    t->started = true;
+    t->thread = std::thread([t]() { t->run(); });
+    return t;
+}
+
+void timerEnd(hw_timer_t *timer) {
+    if(timer==nullptr) return;
+    timer->quit = true;
+    if(timer->thread.joinable()) timer->thread.join();
+    delete timer;
+}
+
+void timerAttachInterrupt(hw_timer_t *timer, void (*fn)(void), bool edge) {
+    timer->fn = fn;
+    timer->version++;
+}
+
+void timerDetachInterrupt(hw_timer_t *timer) {
+    timer->fn = nullptr;
+    timer->version++;
+}
+
+void timerAlarmWrite(hw_timer_t *timer, uint64_t alarmValue, bool autoreload) {
+    timer->alarm = alarmValue;
+    timer->autoreload = autoreload;
+    timer->version++;
+}
+
+void timerAlarmEnable(hw_timer_t *timer) {
+    timer->alarmEnabled = true;
+    timer->version++;
+}
+
+void timerAlarmDisable(hw_timer_t *timer) {
+    timer->alarmEnabled = false;
+}
+
+bool timerAlarmEnabled(hw_timer_t *timer) {
+    return timer->alarmEnabled;
+}
+
+void timerStart(hw_timer_t *timer) {
+    timer->started = true;
+    timer->version++;
+}
+
+void timerStop(hw_timer_t *timer) {
+    timer->started = false;
+}
+
+bool timerStarted(hw_timer_t *timer) {
+    return timer->started;
+}
@@ -0,0 +1,26 @@
+#pragma once
+/**
+ * Hardware timer API of Arduino-ESP32. Each timer is a thread that sleeps until the next alarm
+ * (APB clock of 80 MHz divided by the prescaler) and calls the attached function, which runs
+ * concurrently with loop() like an ISR on the other core.
+ * Alarms missed because the host was busy are fired back to back, so the number of ticks is kept.
+ */
+
+#include <stdint.h>
+
+typedef struct hw_timer_s hw_timer_t;
+
+hw_timer_t * timerBegin(uint8_t num, uint16_t divider, bool countUp);
+void timerEnd(hw_timer_t *timer);
+
+void timerAttachInterrupt(hw_timer_t *timer, void (*fn)(void), bool edge);
+void timerDetachInterrupt(hw_timer_t *timer);
+
+void timerAlarmWrite(hw_timer_t *timer, uint64_t alarmValue, bool autoreload);
+void timerAlarmEnable(hw_timer_t *timer);
+void timerAlarmDisable(hw_timer_t *timer);
+bool timerAlarmEnabled(hw_timer_t *timer);
+
+void timerStart(hw_timer_t *timer);
+void timerStop(hw_timer_t *timer);
+bool timerStarted(hw_timer_t *timer);
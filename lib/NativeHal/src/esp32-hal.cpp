@@ -0,0 +1,155 @@
+#include "Arduino.h"
+#include "NativeHal.h"
+
+#include <atomic>
+#include <stdarg.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+
+static uint64_t monotonicUs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/// Time starts at 0 at process start, like on the station after reset.
+static const uint64_t startUs = monotonicUs();
+
+uint32_t millis() { return (monotonicUs()-startUs) / 1000; }
+
+uint32_t micros() { return monotonicUs()-startUs; }
+
+void delayMicroseconds(uint32_t us) {
+    timespec ts = { (time_t)(us/1000000), (long)(us%1000000)*1000 };
+    while(nanosleep(&ts, &ts)!=0 && errno==EINTR) {}
+}
+
+void delay(uint32_t ms) { delayMicroseconds(ms*1000); }
+
+void yield() { sched_yield(); }
+
+
+struct Pin {
+    std::atomic<uint8_t> mode{0};
+    std::atomic<uint8_t> out{0};
+    std::atomic<uint8_t> in{HIGH};
+    std::atomic<uint16_t> analog{0};
+    std::atomic<uint32_t> edges{0};
+};
+
+static Pin pins[NativeHal::PIN_COUNT];
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    if(pin<NativeHal::PIN_COUNT) pins[pin].mode = mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+    if(pin>=NativeHal::PIN_COUNT) return;
+    uint8_t v = val ? HIGH : LOW;
+    if(pins[pin].out.exchange(v)!=v) pins[pin].edges++;
+}
+
+/// Output pins read back what was written, like on ESP32.
+int digitalRead(uint8_t pin) {
+    if(pin>=NativeHal::PIN_COUNT) return LOW;
+    return (pins[pin].mode & OUTPUT) ? pins[pin].out.load() : pins[pin].in.load();
+}
+
+uint16_t analogRead(uint8_t pin) {
+    return pin<NativeHal::PIN_COUNT ? pins[pin].analog.load() : 0;
+}
+
+void analogSetPinAttenuation(uint8_t pin, adc_attenuation_t attenuation) {}
+
+namespace NativeHal {
+
+    void setInput(uint8_t pin, int level) {
+        if(pin<PIN_COUNT) pins[pin].in = level ? HIGH : LOW;
+    }
+
+    void setAnalog(uint8_t pin, uint16_t value) {
+        if(pin<PIN_COUNT) pins[pin].analog = value>4095 ? 4095 : value;
+    }
+
+    int outputLevel(uint8_t pin) {
+        return pin<PIN_COUNT ? pins[pin].out.load() : LOW;
+    }
+
+    uint32_t edgeCount(uint8_t pin) {
+        return pin<PIN_COUNT ? pins[pin].edges.load() : 0;
+    }
+
+}
+
+
+int log_printf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vfprintf(stderr, fmt, args);
+    va_end(args);
+    return n;
+}
+
+
+EspClass ESP;
+
+void EspClass::restart() {
+    fflush(stdout);
+    exit(0);
+}
+
+
+HardwareSerial Serial(STDIN_FILENO, STDOUT_FILENO);
+
+int HardwareSerial::available() {
+    if(peeked>=0) return 1;
+    if(eof) return 0;
+    pollfd p = { inFd, POLLIN, 0 };
+    return poll(&p, 1, 0)>0 && (p.revents & (POLLIN|POLLHUP)) ? 1 : 0;
+}
+
+int HardwareSerial::read() {
+    if(peeked>=0) {
+        int c = peeked;
+        peeked = -1;
+        return c;
+    }
+    uint8_t c;
+    if(available()==0) return -1;
+    ssize_t n = ::read(inFd, &c, 1);
+    if(n<=0) { eof = n==0; return -1; }
+    return c;
+}
+
+int HardwareSerial::peek() {
+    if(peeked<0) peeked = read();
+    return peeked;
+}
+
+size_t HardwareSerial::readBytes(char *buffer, size_t length) {
+    size_t n = 0;
+    if(length>0 && peeked>=0) {
+        buffer[n++] = peeked;
+        peeked = -1;
+    }
+    if(n<length && available()>0) {
+        ssize_t r = ::read(inFd, buffer+n, length-n);
+        if(r>0) n += r;
+        else eof = r==0;
+    }
+    return n;
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t size) {
+    size_t done = 0;
+    while(done<size) {
+        ssize_t n = ::write(outFd, buf+done, size-done);
+        if(n<0 && errno==EINTR) continue;
+        if(n<=0) break;
+        done += n;
+    }
+    return done;
+}
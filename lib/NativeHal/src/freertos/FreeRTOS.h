@@ -0,0 +1,41 @@
+#pragma once
+/// The part of FreeRTOS used by the station and LocoNet2, on POSIX threads. A tick is 1 ms.
+
+#include <stdint.h>
+#include <atomic>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define errQUEUE_EMPTY 0
+#define errQUEUE_FULL 0
+
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+#define portTICK_PERIOD_MS 1
+#define configTICK_RATE_HZ 1000
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define configMAX_PRIORITIES 25
+
+/// Critical sections are a spinlock, as on a dual-core ESP32.
+typedef struct {
+    std::atomic_flag lock = ATOMIC_FLAG_INIT;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {}
+
+inline void vPortEnterCritical(portMUX_TYPE *mux) { while(mux->lock.test_and_set(std::memory_order_acquire)) {} }
+inline void vPortExitCritical(portMUX_TYPE *mux) { mux->lock.clear(std::memory_order_release); }
+
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+#define portENTER_CRITICAL_ISR(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_ISR(mux) vPortExitCritical(mux)
+#define taskENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define taskEXIT_CRITICAL(mux) vPortExitCritical(mux)
+#define portYIELD_FROM_ISR()
@@ -0,0 +1,225 @@
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <string.h>
+#include <pthread.h>
+
+using Clock = std::chrono::steady_clock;
+
+/// Waits on cv until pred is true or wait ticks pass. @return pred()
+template<class Pred>
+static bool waitFor(std::condition_variable &cv, std::unique_lock<std::mutex> &lk, TickType_t wait, Pred pred) {
+    if(wait==portMAX_DELAY) {
+        cv.wait(lk, pred);
+        return true;
+    }
+    return cv.wait_for(lk, std::chrono::milliseconds(wait), pred);
+}
+
+
+struct NativeTask {
+    std::mutex m;
+    std::condition_variable cv;
+    uint32_t notifications = 0;
+};
+
+static thread_local NativeTask *currentTask = nullptr;
+
+struct TaskStart {
+    TaskFunction_t fn;
+    void *param;
+    NativeTask *task;
+};
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stackDepth, void *param,
+        UBaseType_t priority, TaskHandle_t *created) {
+    NativeTask *t = new NativeTask;
+    TaskStart *s = new TaskStart{fn, param, t};
+    pthread_t th;
+    int r = pthread_create(&th, nullptr, [](void *p) -> void* {
+        TaskStart s = *(TaskStart*)p;
+        delete (TaskStart*)p;
+        currentTask = s.task;
+        s.fn(s.param);
+        return nullptr;
+    }, s);
+    if(r!=0) {
+        delete s;
+        delete t;
+        return pdFAIL;
+    }
+    if(name!=nullptr) {
+        char n[16];
+        strncpy(n, name, sizeof(n)-1);
+        n[sizeof(n)-1] = 0;
+        pthread_setname_np(th, n);
+    }
+    pthread_detach(th);
+    if(created!=nullptr) *created = t;
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if(task==nullptr || task==currentTask) pthread_exit(nullptr);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    if(currentTask==nullptr) currentTask = new NativeTask;
+    return currentTask;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+TickType_t xTaskGetTickCount() {
+    static const Clock::time_point start = Clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now()-start).count();
+}
+
+void xTaskNotifyGive(TaskHandle_t task) {
+    if(task==nullptr) return;
+    std::lock_guard<std::mutex> lk(task->m);
+    task->notifications++;
+    task->cv.notify_one();
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t wait) {
+    NativeTask *t = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lk(t->m);
+    if(!waitFor(t->cv, lk, wait, [t]{ return t->notifications>0; })) return 0;
+    uint32_t n = t->notifications;
+    t->notifications = clearOnExit ? 0 : n-1;
+    return n;
+}
+
+
+struct NativeQueue {
+    std::mutex m;
+    std::condition_variable cv;
+    UBaseType_t length;
+    UBaseType_t itemSize;
+    std::deque<std::vector<uint8_t>> items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+    NativeQueue *q = new NativeQueue;
+    q->length = length;
+    q->itemSize = itemSize;
+    return q;
+}
+
+void vQueueDelete(QueueHandle_t q) { delete q; }
+
+static BaseType_t queueSend(QueueHandle_t q, const void *item, TickType_t wait, bool front) {
+    std::unique_lock<std::mutex> lk(q->m);
+    if(!waitFor(q->cv, lk, wait, [q]{ return q->items.size() < q->length; })) return errQUEUE_FULL;
+    const uint8_t *p = (const uint8_t*)item;
+    if(front) q->items.emplace_front(p, p+q->itemSize);
+    else q->items.emplace_back(p, p+q->itemSize);
+    q->cv.notify_all();
+    return pdPASS;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait) { return queueSend(q, item, wait, false); }
+
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item, TickType_t wait) { return queueSend(q, item, wait, true); }
+
+static BaseType_t queueReceive(QueueHandle_t q, void *item, TickType_t wait, bool remove) {
+    std::unique_lock<std::mutex> lk(q->m);
+    if(!waitFor(q->cv, lk, wait, [q]{ return !q->items.empty(); })) return errQUEUE_EMPTY;
+    memcpy(item, q->items.front().data(), q->itemSize);
+    if(remove) {
+        q->items.pop_front();
+        q->cv.notify_all();
+    }
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait) { return queueReceive(q, item, wait, true); }
+
+BaseType_t xQueuePeek(QueueHandle_t q, void *item, TickType_t wait) { return queueReceive(q, item, wait, false); }
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+    std::lock_guard<std::mutex> lk(q->m);
+    return q->items.size();
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q) {
+    std::lock_guard<std::mutex> lk(q->m);
+    return q->length - q->items.size();
+}
+
+BaseType_t xQueueReset(QueueHandle_t q) {
+    std::lock_guard<std::mutex> lk(q->m);
+    q->items.clear();
+    q->cv.notify_all();
+    return pdPASS;
+}
+
+
+struct NativeSemaphore {
+    std::mutex m;
+    std::condition_variable cv;
+    bool isMutex;
+    UBaseType_t max;
+    UBaseType_t count;
+    /// owner and recursion depth of a mutex
+    std::thread::id owner;
+    UBaseType_t depth = 0;
+};
+
+static SemaphoreHandle_t newSemaphore(bool isMutex, UBaseType_t max, UBaseType_t initial) {
+    NativeSemaphore *s = new NativeSemaphore;
+    s->isMutex = isMutex;
+    s->max = max;
+    s->count = initial;
+    return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() { return newSemaphore(true, 1, 1); }
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() { return newSemaphore(true, 1, 1); }
+
+SemaphoreHandle_t xSemaphoreCreateBinary() { return newSemaphore(false, 1, 0); }
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial) { return newSemaphore(false, max, initial); }
+
+void vSemaphoreDelete(SemaphoreHandle_t s) { delete s; }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait) {
+    std::unique_lock<std::mutex> lk(s->m);
+    std::thread::id me = std::this_thread::get_id();
+    if(s->isMutex && s->depth>0 && s->owner==me) {
+        s->depth++;
+        return pdTRUE;
+    }
+    if(!waitFor(s->cv, lk, wait, [s]{ return s->count>0; })) return pdFALSE;
+    s->count--;
+    if(s->isMutex) {
+        s->owner = me;
+        s->depth = 1;
+    }
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s) {
+    std::lock_guard<std::mutex> lk(s->m);
+    if(s->isMutex) {
+        if(s->depth==0 || s->owner!=std::this_thread::get_id()) return pdFALSE;
+        if(--s->depth>0) return pdTRUE;
+    } else if(s->count>=s->max) {
+        return pdFALSE;
+    }
+    s->count++;
+    s->cv.notify_one();
+    return pdTRUE;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct NativeQueue* QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+void vQueueDelete(QueueHandle_t q);
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait);
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait);
+BaseType_t xQueuePeek(QueueHandle_t q, void *item, TickType_t wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q);
+BaseType_t xQueueReset(QueueHandle_t q);
+
+#define xQueueSendToBack xQueueSend
+inline BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item, BaseType_t *woken) { return xQueueSend(q, item, 0); }
+inline BaseType_t xQueueReceiveFromISR(QueueHandle_t q, void *item, BaseType_t *woken) { return xQueueReceive(q, item, 0); }
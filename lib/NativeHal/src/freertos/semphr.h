@@ -0,0 +1,18 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct NativeSemaphore* SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+SemaphoreHandle_t xSemaphoreCreateBinary();
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial);
+void vSemaphoreDelete(SemaphoreHandle_t s);
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s);
+/// Mutexes here are all recursive, so these are the same as the plain calls.
+inline BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t s, TickType_t wait) { return xSemaphoreTake(s, wait); }
+inline BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t s) { return xSemaphoreGive(s); }
+inline BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t s, BaseType_t *woken) { return xSemaphoreGive(s); }
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *);
+typedef struct NativeTask* TaskHandle_t;
+
+/// Starts a thread; priority and stack size have no meaning on host.
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stackDepth, void *param,
+    UBaseType_t priority, TaskHandle_t *created);
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stackDepth, void *param,
+    UBaseType_t priority, TaskHandle_t *created, BaseType_t core) {
+    return xTaskCreate(fn, name, stackDepth, param, priority, created);
+}
+
+/// nullptr ends the calling task. Other tasks can't be stopped from outside on host.
+void vTaskDelete(TaskHandle_t task);
+
+/// Handle of the calling thread; threads not made by xTaskCreate (main loop, AsyncTCP) get one on first use.
+TaskHandle_t xTaskGetCurrentTaskHandle();
+
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
+
+void xTaskNotifyGive(TaskHandle_t task);
+inline void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken) { xTaskNotifyGive(task); }
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t wait);
@@ -0,0 +1,66 @@
+#pragma once
+/**
+ * Pending accessory commands waiting for their turn on the track.
+ * A new command to an address that is already waiting replaces the old one.
+ */
+
+#include <stdint.h>
+
+class AccessoryQueue {
+public:
+
+    struct Command {
+        uint16_t addr;
+        bool thrown;
+        /// broadcast OPC_SW_REQ to LocoNet when command is sent to track
+        bool echo;
+    };
+
+    struct Stats {
+        uint32_t queued;     ///< commands accepted
+        uint32_t coalesced;  ///< commands that replaced a pending command to the same address
+        uint32_t dropped;    ///< commands rejected because queue was full
+        uint32_t sent;       ///< commands sent to track
+        uint16_t depth;
+        uint16_t maxDepth;
+    };
+
+    static const uint8_t SIZE = 32;
+
+    bool empty() const { return count==0; }
+    uint8_t size() const { return count; }
+    uint8_t available() const { return SIZE-count; }
+
+    bool push(const Command &c) {
+        for(uint8_t i=0, j=head; i<count; i++, j=(j+1)%SIZE) {
+            if(buf[j].addr == c.addr) {
+                buf[j] = c;
+                stats.coalesced++;
+                return true;
+            }
+        }
+        if(count==SIZE) { stats.dropped++; return false; }
+        buf[(head+count)%SIZE] = c;
+        count++;
+        stats.queued++;
+        if(count>stats.maxDepth) stats.maxDepth = count;
+        return true;
+    }
+
+    const Command& front() const { return buf[head]; }
+
+    void pop() {
+        if(count==0) return;
+        head = (head+1)%SIZE;
+        count--;
+        stats.sent++;
+    }
+
+    const Stats& getStats() { stats.depth = count; return stats; }
+
+private:
+    Command buf[SIZE];
+    uint8_t head = 0;
+    uint8_t count = 0;
+    Stats stats = {};
+};
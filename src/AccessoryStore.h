@@ -0,0 +1,61 @@
+#pragma once
+/**
+ * Flat state table for the whole accessory address space.
+ * 2 bits of state and 1 "in roster" bit per address, constant-time access.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+enum class TurnoutState {
+    CLOSED=0, THROWN=1, UNKNOWN=2
+};
+
+class AccessoryStore {
+public:
+
+    /// LocoNet switch addresses are 11 bits, 1-based.
+    static const uint16_t MAX_ADDR = 2048;
+
+    AccessoryStore() { clear(); }
+
+    void clear() {
+        memset(states, 0, sizeof(states));
+        memset(roster, 0, sizeof(roster));
+    }
+
+    static bool valid(uint16_t addr) { return addr>=1 && addr<=MAX_ADDR; }
+
+    TurnoutState get(uint16_t addr) const {
+        if(!valid(addr)) return TurnoutState::UNKNOWN;
+        uint16_t i = addr-1;
+        return (TurnoutState)( ((states[i>>2] >> ((i&3)<<1)) & 0x3) ^ ENC );
+    }
+
+    void set(uint16_t addr, TurnoutState st) {
+        if(!valid(addr)) return;
+        uint16_t i = addr-1;
+        uint8_t sh = (i&3)<<1;
+        states[i>>2] = (states[i>>2] & ~(0x3<<sh)) | ( ((uint8_t)st ^ ENC) << sh );
+    }
+
+    bool inRoster(uint16_t addr) const {
+        if(!valid(addr)) return false;
+        uint16_t i = addr-1;
+        return (roster[i>>3] & (1<<(i&7))) != 0;
+    }
+
+    void setInRoster(uint16_t addr, bool v) {
+        if(!valid(addr)) return;
+        uint16_t i = addr-1;
+        if(v) roster[i>>3] |= 1<<(i&7);
+        else  roster[i>>3] &= ~(1<<(i&7));
+    }
+
+private:
+    /// Stored value is state^ENC so that zeroed memory reads as UNKNOWN.
+    static const uint8_t ENC = (uint8_t)TurnoutState::UNKNOWN;
+
+    uint8_t states[MAX_ADDR/4];
+    uint8_t roster[MAX_ADDR/8];
+};
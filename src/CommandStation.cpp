@@ -1,3 +1,202 @@
 #include "CommandStation.h"
 
-CommandStation CS;
\ No newline at end of file
+#include <algorithm>
+
+#include "LnRoute.h"
+#include "LocoNetStateCache.h"
+
+CommandStation CS;
+
+static_assert(CommandStation::MAX_ROUTES<=16 && CommandStation::MAX_ROUTE_STEPS<=16, "route and step must fit TurnoutJournal::routeArg");
+static_assert(CommandStation::MAX_TURNOUTS < TurnoutJournal::MAX_CP_ENTRIES, "no room for routes in checkpoint");
+
+void CommandStation::loadTurnouts() {
+    for(const auto &t: turnoutRoster) accessories.setInRoster(t.addr11, false);
+    turnoutRoster.clear();
+    for(auto &rt: routes) rt.nSteps = 0;
+    turnoutJournal.load([](void *ctx, TurnoutJournal::RecordKind kind, const TurnoutJournal::Entry &e) {
+        CommandStation &cs = *(CommandStation*)ctx;
+        switch(kind) {
+            case TurnoutJournal::RecordKind::DEFINE:
+                cs.addToRoster(e.addr, e.id);
+                // fallthrough
+            case TurnoutJournal::RecordKind::STATE:
+                if(cs.accessories.inRoster(e.addr) )
+                    cs.accessories.set(e.addr, e.thrown ? TurnoutState::THROWN : TurnoutState::CLOSED);
+                break;
+            case TurnoutJournal::RecordKind::REMOVE:
+                cs.removeFromRoster(e.addr);
+                break;
+            case TurnoutJournal::RecordKind::ROUTE: {
+                Route &rt = cs.routes[TurnoutJournal::routeOf(e.id)-1];
+                uint8_t step = TurnoutJournal::stepOf(e.id);
+                if(e.addr==0) { rt.nSteps = step; break; }
+                rt.steps[step] = {e.addr, e.thrown ? TurnoutState::THROWN : TurnoutState::CLOSED};
+                rt.nSteps = step+1;
+                break;
+            }
+        }
+    }, this);
+    CS_DEBUGF("CommandStation::loadTurnouts: %d turnouts\n", (int)turnoutRoster.size() );
+    notifyTurnoutChange(0);
+}
+
+bool CommandStation::addToRoster(uint16_t addr11, int id) {
+    if(!AccessoryStore::valid(addr11)) return false;
+    auto it = std::lower_bound(turnoutRoster.begin(), turnoutRoster.end(), addr11, 
+        [](const TurnoutData &t, uint16_t a) { return t.addr11 < a; } );
+    if(it != turnoutRoster.end() && it->addr11 == addr11) {
+        if(it->id != id) notifyTurnoutChange(0);
+        it->id = id;
+        return true;
+    }
+    if(turnoutRoster.size() >= MAX_TURNOUTS) {
+        CS_DEBUGF("CommandStation::addToRoster: roster full, %d not added\n", addr11);
+        return false;
+    }
+    turnoutRoster.insert(it, {addr11, id});
+    accessories.setInRoster(addr11, true);
+    notifyTurnoutChange(0);
+    return true;
+}
+
+void CommandStation::removeFromRoster(uint16_t addr11) {
+    auto it = std::lower_bound(turnoutRoster.begin(), turnoutRoster.end(), addr11, 
+        [](const TurnoutData &t, uint16_t a) { return t.addr11 < a; } );
+    if(it == turnoutRoster.end() || it->addr11 != addr11) return;
+    turnoutRoster.erase(it);
+    accessories.setInRoster(addr11, false);
+    notifyTurnoutChange(0);
+}
+
+void CommandStation::compactTurnouts() {
+    turnoutJournal.checkpointBegin();
+    for(const auto &t: turnoutRoster) {
+        turnoutJournal.checkpointAdd({t.addr11, (uint8_t)t.id, accessories.get(t.addr11)==TurnoutState::THROWN});
+    }
+    for(uint8_t id=1; id<=MAX_ROUTES; id++) {
+        const Route &rt = routes[id-1];
+        for(uint8_t i=0; i<rt.nSteps; i++)
+            turnoutJournal.checkpointAdd({rt.steps[i].addr11, TurnoutJournal::routeArg(id, i), rt.steps[i].state==TurnoutState::THROWN},
+                TurnoutJournal::RecordKind::ROUTE);
+    }
+    turnoutJournal.checkpointCommit();
+}
+
+void CommandStation::onSlotTimer(uint8_t slot) {
+    LocoData &dd = getSlot(slot);
+    if(!dd.allocated()) return;
+    uint32_t timeout = dd.age==SlotAge::ACTIVE ? purgeActiveMs : purgeCommonMs;
+    if(timeout==0) return;
+    uint32_t idle = millis() - dd.lastActivity;
+    if(idle < timeout) {
+        // touched since timer was set, wait for the rest of timeout
+        slotTimers.schedule(slot-1, timeout-idle, millis());
+        return;
+    }
+    if(dd.age==SlotAge::ACTIVE) {
+        CS_DEBUGF("CommandStation::onSlotTimer: slot %d is now common\n", slot);
+        dd.age = SlotAge::COMMON;
+        dd.lastActivity = millis();
+        for(auto l: slotListeners) l->onSlotPurge(slot, SlotAge::COMMON);
+        if(purgeCommonMs!=0) slotTimers.schedule(slot-1, purgeCommonMs, millis());
+    } else {
+        CS_DEBUGF("CommandStation::onSlotTimer: slot %d is purged\n", slot);
+        setLocoSpeed(slot, 0);
+        for(auto l: slotListeners) l->onSlotPurge(slot, SlotAge::FREE);
+        releaseLocoSlot(slot);
+    }
+}
+
+bool CommandStation::setRoute(uint8_t id, const RouteStep *steps, uint8_t nSteps) {
+    if(id<1 || id>MAX_ROUTES || nSteps>MAX_ROUTE_STEPS) return false;
+    uint16_t total = nSteps;
+    for(uint8_t i=0; i<MAX_ROUTES; i++) if(i!=id-1) total += routes[i].nSteps;
+    if(total > MAX_ROUTE_STEPS_TOTAL) {
+        CS_DEBUGF("CommandStation::setRoute: no room for %d steps of route %d\n", nSteps, id);
+        return false;
+    }
+    for(uint8_t i=0; i<nSteps; i++)
+        if(!AccessoryStore::valid(steps[i].addr11) || steps[i].state==TurnoutState::UNKNOWN) return false;
+
+    Route &r = routes[id-1];
+    for(uint8_t i=0; i<nSteps; i++) {
+        r.steps[i] = steps[i];
+        if(!turnoutJournal.appendRouteStep(id, i, steps[i].addr11, steps[i].state==TurnoutState::THROWN)) compactPending = true;
+    }
+    if(nSteps<MAX_ROUTE_STEPS && !turnoutJournal.appendRouteStep(id, nSteps, 0, false)) compactPending = true;
+    r.nSteps = nSteps;
+    notifyTurnoutChange(0);
+    return true;
+}
+
+uint8_t CommandStation::getRoute(uint8_t id, RouteStep *steps) const {
+    if(!isRouteDefined(id)) return 0;
+    const Route &r = routes[id-1];
+    for(uint8_t i=0; i<r.nSteps; i++) steps[i] = r.steps[i];
+    return r.nSteps;
+}
+
+bool CommandStation::fireRoute(uint8_t id) {
+    if(!isRouteDefined(id)) return false;
+    const Route &r = routes[id-1];
+    if(accQueue.available() < r.nSteps) {
+        CS_DEBUGF("CommandStation::fireRoute: no room for route %d\n", id);
+        return false;
+    }
+    CS_DEBUGF("CommandStation::fireRoute: route %d, %d steps\n", id, r.nSteps);
+    for(uint8_t i=0; i<r.nSteps; i++) {
+        const RouteStep &st = r.steps[i];
+        recordTurnoutState(st.addr11, st.state);
+        accQueue.push({st.addr11, st.state==TurnoutState::THROWN, true});
+    }
+    return true;
+}
+
+void CommandStation::accessoryLoop() {
+    if(dccMain==nullptr) return;
+    uint32_t now = millis();
+    if( (int32_t)(now-accDeadline) < 0 ) return;
+
+    if(accPhase==AccPhase::PULSE) {
+        dccMain->sendAccessory(accCurrent.addr, accCurrent.thrown, false);
+        accPhase = AccPhase::IDLE;
+        accDeadline = now + accGapMs;
+        return;
+    }
+
+    if(accQueue.empty()) return;
+    accCurrent = accQueue.front();
+    accQueue.pop();
+
+    dccMain->sendAccessory(accCurrent.addr, accCurrent.thrown, true);
+    if(accCurrent.echo && locoNet!=nullptr) {
+        LnMsg ttt = makeSwRec(accCurrent.addr, true, accCurrent.thrown);
+        LnRoute::broadcast(locoNet, ttt, LnOrigin::STATION, this);
+    }
+
+    if(accPulseMs>0) {
+        accPhase = AccPhase::PULSE;
+        accDeadline = now + accPulseMs;
+    } else {
+        accDeadline = now + accGapMs;
+    }
+}
+
+void CommandStation::switchRequest(const LnMsg &msg) {
+    uint8_t sw2 = msg.srq.sw2;
+    if( (sw2 & OPC_SW_REQ_OUT)==0 || LocoNetStateCache::isInterrogation(msg) ) return;
+    uint16_t addr11 = (msg.srq.sw1 | (sw2 & 0x0F)<<7) + 1;
+    accessoryFromLocoNet(addr11, (sw2 & OPC_SW_REQ_DIR)==0);
+}
+
+void CommandStation::loop() {
+    swInbox.drain([this](const LnMsg &msg) { switchRequest(msg); });
+    accessoryLoop();
+    turnoutJournal.loop();
+    if(compactPending || turnoutJournal.needsCompaction()) {
+        compactPending = false;
+        compactTurnouts();
+    }
+    slotTimers.loop(millis());
+}
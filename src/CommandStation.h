@@ -6,12 +6,20 @@
  */
 
 #include <etl/map.h>
+#include <etl/vector.h>
 #include <etl/bitset.h>
 
 #include "DCC.h"
 #include "LocoAddress.h"
 #include <LocoNet.h>
 
+#include "TurnoutJournal.h"
+#include "AccessoryStore.h"
+#include "AccessoryQueue.h"
+#include "TimerWheel.h"
+#include "LocoRoster.h"
+#include "LnInbox.h"
+
 
 #define CS_DEBUG
 
@@ -23,22 +31,83 @@
 #endif
 
 
-enum class TurnoutState {
-    CLOSED=0, THROWN=1
-};
-
-class CommandStation {
+/**
+ * Also a LocoNet consumer: OPC_SW_REQ from the bus is queued in onMessage and executed in loop(),
+ * so CS state is only changed from the main loop.
+ */
+class CommandStation: public LocoNetConsumer {
 public:
 
     static const uint8_t MAX_SLOTS = 10;
+
+    /// Slot aging stages, LocoNet-style: idle in-use slots become common, idle common slots are freed.
+    enum class SlotAge: uint8_t { ACTIVE, COMMON, FREE };
+
+    /// Gets notified when a slot is demoted because of inactivity, or when its state changes.
+    class SlotListener {
+    public:
+        virtual void onSlotPurge(uint8_t slot, SlotAge age) = 0;
+        /// Any change of slot state, whoever made it. Called often, must be cheap.
+        virtual void onSlotChange(uint8_t slot) {}
+    };
+
+    /// Gets notified when a roster turnout changes state, or when turnout or route rosters change.
+    class TurnoutListener {
+    public:
+        /// @param addr11 turnout that changed state, or 0 if roster entries were added, removed or renumbered.
+        /// Called from main loop, must be cheap.
+        virtual void onTurnoutChange(uint16_t addr11) = 0;
+    };
+
+    const static uint32_t DEFAULT_PURGE_ACTIVE_MS = 200000;
+    const static uint32_t DEFAULT_PURGE_COMMON_MS = 200000;
     
-    CommandStation(): dccMain(nullptr), dccProg(nullptr), locoNet(nullptr) { 
-        loadTurnouts();  
-    }
+    CommandStation(): dccMain(nullptr), dccProg(nullptr), locoNet(nullptr),
+        slotTimers( [](void *ctx, uint8_t id) { ((CommandStation*)ctx)->onSlotTimer(id+1); }, this) { }
 
     void setDccMain(IDCCChannel * ch) { dccMain = ch; }
     void setDccProg(IDCCChannel * ch) { dccProg = ch; }
-    void setLocoNetBus(LocoNetBus *bus) { locoNet = bus; }
+    /// Bus for accessory echoes; CS also subscribes to it for switch requests.
+    void setLocoNetBus(LocoNetBus *bus) {
+        locoNet = bus;
+        if(bus!=nullptr) bus->addConsumer(this);
+    }
+    void setTurnoutStorage(JournalStorage *st) { turnoutJournal.setStorage(st); }
+    /// Roster that gives speed steps of newly allocated slots; may be nullptr.
+    void setLocoRoster(const LocoRoster *r) { roster = r; }
+    const LocoRoster* getLocoRoster() const { return roster; }
+
+    /// Switch requests received from LocoNet, sent to track and journal, and housekeeping that must not run
+    /// inside command handlers (turnout journal commits and compaction, slot purging).
+    void loop();
+
+    /// Queues OPC_SW_REQ for loop(). Accessory echoes of CS are broadcast with CS as sender and don't come back here.
+    LN_STATUS onMessage(const LnMsg &msg) override {
+        if(msg.data[0]==OPC_SW_REQ && LnRoute::origin()!=LnOrigin::STATION) swInbox.push(msg);
+        return LN_DONE;
+    }
+
+    LnInbox<16>::Stats getSwitchInboxStats() const { return swInbox.getStats(); }
+
+    void addSlotListener(SlotListener *l) { slotListeners.push_back(l); }
+
+    void addTurnoutListener(TurnoutListener *l) { turnoutListeners.push_back(l); }
+
+    /// Idle times before an active slot becomes common and a common slot is freed. 0 disables the stage.
+    void setSlotPurgeTimes(uint32_t activeMs, uint32_t commonMs) { purgeActiveMs = activeMs; purgeCommonMs = commonMs; }
+
+    /// Marks slot as used by a throttle, restarting its purge timeout.
+    void touchLocoSlot(uint8_t slot) {
+        if(slot<1 || slot>MAX_SLOTS) return;
+        LocoData &dd = getSlot(slot);
+        dd.lastActivity = millis();
+        dd.age = SlotAge::ACTIVE;
+    }
+
+    SlotAge getLocoSlotAge(uint8_t slot) {
+        if(slot<1 || slot>MAX_SLOTS || !getSlot(slot).allocated()) return SlotAge::FREE;
+        return getSlot(slot).age;
+    }
 
     void setPowerState(bool v) {
         if( dccMain!=nullptr ) dccMain->setPower(v);
@@ -52,43 +121,38 @@ public:
 
 
     /* Define turnout object structures */
+    /// Roster entry. State of any accessory address is kept in AccessoryStore, see getTurnoutState().
     struct TurnoutData {
         uint16_t addr11;	
         //uint8_t subAddr;
         int id;
-        TurnoutState tStatus;
     };
 
-    const static int MAX_TURNOUTS = 15;
-    using TurnoutMap = etl::map<uint16_t, TurnoutData, MAX_TURNOUTS>;
-    TurnoutMap turnoutData;
+    const static int MAX_TURNOUTS = 64;
+    /// Roster sorted by address.
+    using TurnoutList = etl::vector<TurnoutData, MAX_TURNOUTS>;
 
-    uint16_t getTurnoutCount() { return turnoutData.size(); }
-    
-    void loadTurnouts() {
-        turnoutData[6] = { 6, 0, TurnoutState::CLOSED };
-        turnoutData[7] = { 7, 1, TurnoutState::CLOSED };
-        turnoutData[10] = { 10, 2, TurnoutState::CLOSED };
-        turnoutData[11] = { 11, 3, TurnoutState::CLOSED };
-        
-        /*sendDCCppCmd("T");
-        waitForDCCpp();
-        int t = 0;
-        while(Serial.available()>0) {
-            char data[maxCommandLength];
-            sprintf(data, "%s", readResponse().c_str() );
-            if (strlen(data)==0) break;
-            int addr, sub, stat, id;
-            int ret = sscanf(data, "%*c %d %d %d %d", &id, &addr, &sub, &stat );
-            turnoutData[t] = { ((addr-1)*4+1) + (sub&0x3) , id, stat==0 ? 2 : 4};
-            t++;
-        }*/
+    uint16_t getTurnoutCount() { return turnoutRoster.size(); }
+
+    /// Loads turnout roster from journal storage (checkpoint + replay, no writes).
+    void loadTurnouts();
+
+    const TurnoutJournal::Stats& getTurnoutJournalStats() { return turnoutJournal.getStats(); }
+
+    const TurnoutList& getTurnouts() {
+        return turnoutRoster;
     }
 
-    //const TurnoutData& getTurnout(uint16_t i) { return turnoutData[i]; }
+    TurnoutState getTurnoutState(uint16_t addr11) const { return accessories.get(addr11); }
+
+    bool isTurnoutInRoster(uint16_t addr11) const { return accessories.inRoster(addr11); }
 
-    const TurnoutMap& getTurnouts() {
-        return turnoutData;
+    /// Removes a turnout from the roster and journals it. Its state is still kept in the state table.
+    bool removeTurnout(uint16_t addr11) {
+        if(!accessories.inRoster(addr11)) return false;
+        removeFromRoster(addr11);
+        if(!turnoutJournal.appendRemove(addr11)) compactPending = true;
+        return true;
     }
 
     TurnoutState turnoutToggle(uint16_t aAddr, bool fromRoster) {
@@ -99,6 +163,45 @@ public:
         return turnoutAction(aAddr, fromRoster, (int)newStat);
     }
 
+    /// Accessory request received from LocoNet (OPC_SW_REQ). It is queued to DCC, but not echoed back to LocoNet.
+    /// Called from loop(); other bus members reach it through onMessage.
+    void accessoryFromLocoNet(uint16_t addr11, bool thrown) {
+        recordTurnoutState(addr11, thrown ? TurnoutState::THROWN : TurnoutState::CLOSED);
+        accQueue.push({addr11, thrown, false});
+    }
+
+    /// Time the accessory output is kept on and pause after it before next accessory command. Pulse of 0 sends no "off" packet.
+    void setAccessoryTiming(uint16_t pulseMs, uint16_t gapMs) { accPulseMs = pulseMs; accGapMs = gapMs; }
+
+    const AccessoryQueue::Stats& getAccessoryStats() { return accQueue.getStats(); }
+
+    /* Routes: stored sets of turnout positions, fired as one batch. Kept in the turnout journal. */
+    struct RouteStep {
+        uint16_t addr11;
+        TurnoutState state;
+    };
+    const static uint8_t MAX_ROUTES = 16;
+    const static uint8_t MAX_ROUTE_STEPS = 16;
+    /// steps of all routes together, so roster and routes fit one journal checkpoint
+    const static uint8_t MAX_ROUTE_STEPS_TOTAL = TurnoutJournal::MAX_CP_ENTRIES - MAX_TURNOUTS;
+
+    /**
+     * Defines or replaces a route and appends it to the journal. If power is lost before the journal
+     * is committed, the route may come back with only its first steps.
+     * @param id is 1-based. Route with 0 steps is deleted.
+     * @param steps CLOSED or THROWN positions of valid accessory addresses.
+     * @return false if id or a step is invalid, or the steps don't fit MAX_ROUTE_STEPS_TOTAL.
+     */
+    bool setRoute(uint8_t id, const RouteStep *steps, uint8_t nSteps);
+
+    bool isRouteDefined(uint8_t id) const { return id>=1 && id<=MAX_ROUTES && routes[id-1].nSteps>0; }
+
+    /// @return number of steps copied to steps (at most MAX_ROUTE_STEPS), 0 if route is not defined.
+    uint8_t getRoute(uint8_t id, RouteStep *steps) const;
+
+    /// Queues all route steps, or none of them if queue has no room.
+    bool fireRoute(uint8_t id);
+
     bool isSlotAllocated(uint8_t slot) {
         if(slot<1 || slot>MAX_SLOTS) return true;
         return slots[slot-1].allocated();
@@ -134,8 +237,13 @@ public:
         _slot.fn = LocoData::Fns();
         _slot.refreshing = false;
         _slot.speed = 0;
-        _slot.speedMode = LocoData::SpeedMode::S128;
+        uint8_t steps = roster!=nullptr ? roster->speedSteps(addr) : 128;
+        _slot.speedMode = steps==14 ? LocoData::SpeedMode::S14 : steps==28 ? LocoData::SpeedMode::S28 : LocoData::SpeedMode::S128;
+        _slot.lastActivity = millis();
+        _slot.age = SlotAge::ACTIVE;
         locoSlot[addr] = slot;
+        if(purgeActiveMs!=0) slotTimers.schedule(slot-1, purgeActiveMs, millis());
+        notifySlotChange(slot);
     }
 
     uint8_t findOrAllocateLocoSlot(LocoAddress addr) {
@@ -152,8 +260,10 @@ public:
         uint8_t i = slot-1;
         CS_DEBUGF("CommandStation::releaseLocoSlot: releasing slot %d\n", slot); 
         setLocoSlotRefresh(slot, false);
+        slotTimers.cancel(i);
         locoSlot.erase( slots[i].addr );        
         slots[i].deallocate();
+        notifySlotChange(slot);
     }
 
     void setLocoSlotRefresh(uint8_t slot, bool refresh) {
@@ -162,6 +272,7 @@ public:
         if(dd.refreshing == refresh) return;
         CS_DEBUGF("CommandStation::setLocoSlotRefresh: slot %d refresh %d\n", slot, refresh); 
         dd.refreshing = refresh;
+        notifySlotChange(slot);
         if(refresh) {
             
         } else {
@@ -174,6 +285,7 @@ public:
         if(dd.fn[fn] == val) return;
 
         dd.fn[fn] = val;
+        notifySlotChange(slot);
         DCCFnGroup fg;
         
         uint32_t ifn = dd.fn.value<uint32_t>();
@@ -183,28 +295,37 @@ public:
         else if(fn<21) fg = DCCFnGroup::F13_20;
         else           fg = DCCFnGroup::F21_28;
         dccMain->sendFunctionGroup(slot, dd.addr, fg, ifn);
+        if(fn==0 && dd.speedMode==LocoData::SpeedMode::S14) sendThrottle(slot, dd);
     }
 
     void setLocoFns(uint8_t slot, uint32_t m, uint32_t f ) {
         LocoData &dd = getSlot(slot);
         uint32_t v = dd.fn.value<uint32_t>();
         // if required bits (m) intersect function group bits (GM) and these bits (f^v != 0) differ from current
-        // update bits (v=) and set function group
+        // update required bits (v=), keeping the others of the group, and set function group
         #define CHECK_SEND(GM, FG)  if(  ( (m&GM)!=0) && ( ( (v^f)&m&GM)!=0 ) )  \
-            { v = (v&(0xFFFFFFFF&~GM)) | (f&m&GM);   dccMain->sendFunctionGroup(slot, dd.addr, FG, v ); }  
+            { v = (v&~(m&GM)) | (f&m&GM);   dccMain->sendFunctionGroup(slot, dd.addr, FG, v ); }  
 
         CHECK_SEND(     0x1F, DCCFnGroup::F0_4);
         CHECK_SEND(    0x1E0, DCCFnGroup::F5_8);
         CHECK_SEND(   0x1E00, DCCFnGroup::F9_12);
         CHECK_SEND( 0x1FE000, DCCFnGroup::F13_20);
-        CHECK_SEND(0x1FE0000, DCCFnGroup::F21_28);
+        CHECK_SEND(0x1FE00000, DCCFnGroup::F21_28);
+        uint32_t changed = dd.fn.value<uint32_t>() ^ v;
         dd.fn = LocoData::Fns( v );
+        if(changed!=0) notifySlotChange(slot);
+        if( (changed & 1) && dd.speedMode==LocoData::SpeedMode::S14) sendThrottle(slot, dd);
     }
 
     bool getLocoFn(uint8_t slot, uint8_t fn) {
         return  getSlot(slot).fn[fn] != 0;
     }
 
+    /// Bit N is function FN.
+    uint32_t getLocoFns(uint8_t slot) {
+        return getSlot(slot).fn.value<uint32_t>();
+    }
+
     /**
      *  @param speed DCC speed (0=sop, 1=EMGR stop)
      *  @param dir 1 - FWD, 0 - REW
@@ -213,7 +334,25 @@ public:
         LocoData &dd = getSlot(slot);
         if(dd.dir==dir) return; 
         dd.dir = dir;
-        dccMain->sendThrottle(slot, dd.addr, dd.speed, dd.dir);
+        notifySlotChange(slot);
+        sendThrottle(slot, dd);
+    }
+
+    LocoAddress getLocoAddr(uint8_t slot) {
+        return getSlot(slot).addr;
+    }
+
+    /// 14, 28 or 128
+    uint8_t getLocoSpeedSteps(uint8_t slot) {
+        switch(getSlot(slot).speedMode) {
+            case LocoData::SpeedMode::S14: return 14;
+            case LocoData::SpeedMode::S28: return 28;
+            default: return 128;
+        }
+    }
+
+    bool getLocoSlotRefresh(uint8_t slot) {
+        return getSlot(slot).refreshing;
     }
 
     uint8_t getLocoDir(uint8_t slot) { 
@@ -225,7 +364,8 @@ public:
         LocoData &dd = getSlot(slot);
         if(dd.speed == spd) return;
         dd.speed = spd;
-        dccMain->sendThrottle(slot, dd.addr, dd.speed, dd.dir);
+        notifySlotChange(slot);
+        sendThrottle(slot, dd);
     }
 
     /// Returns DCC-formatted speed (0-stop, 1-EMGR stop, ...)
@@ -266,6 +406,7 @@ private:
     IDCCChannel * dccMain;
     IDCCChannel * dccProg;
     LocoNetBus* locoNet;
+    const LocoRoster *roster = nullptr;
 
     struct LocoData {
         using Fns = etl::bitset<29>;
@@ -276,52 +417,106 @@ private:
         int8_t dir;
         Fns fn;
         bool refreshing;
+        uint32_t lastActivity;
+        SlotAge age;
         bool allocated() { return addr.isValid(); }
         void deallocate() { addr = LocoAddress(); }
     };
 
+    /// Speed instruction in the decoder's speed step mode.
+    void sendThrottle(uint8_t slot, const LocoData &dd) {
+        uint8_t steps = dd.speedMode==LocoData::SpeedMode::S14 ? 14 : dd.speedMode==LocoData::SpeedMode::S28 ? 28 : 128;
+        dccMain->sendThrottle(slot, dd.addr, dd.speed, dd.dir, steps, dd.fn[0]);
+    }
+
     etl::map<LocoAddress, uint8_t, MAX_SLOTS> locoSlot;
 
+    AccessoryStore accessories;
+    TurnoutList turnoutRoster;
+    TurnoutJournal turnoutJournal;
+    /// journal ring was full; state table already has the change, loop() writes it with a checkpoint
+    bool compactPending = false;
+
+    bool addToRoster(uint16_t addr11, int id);
+    void removeFromRoster(uint16_t addr11);
+
+    /// Updates state table, and journal if turnout is in roster.
+    void recordTurnoutState(uint16_t addr11, TurnoutState st) {
+        if(accessories.get(addr11) == st) return;
+        accessories.set(addr11, st);
+        if(accessories.inRoster(addr11) ) {
+            if(!turnoutJournal.appendState(addr11, st==TurnoutState::THROWN)) compactPending = true;
+            notifyTurnoutChange(addr11);
+        }
+    }
+
+    etl::vector<TurnoutListener*, 2> turnoutListeners;
+
+    void notifyTurnoutChange(uint16_t addr11) {
+        for(auto l: turnoutListeners) l->onTurnoutChange(addr11);
+    }
+
+    LnInbox<16> swInbox;
+    /// Executes an OPC_SW_REQ from swInbox. "Off" requests and interrogation are ignored, CS makes its own output pulse.
+    void switchRequest(const LnMsg &msg);
+
+    AccessoryQueue accQueue;
+    enum class AccPhase: uint8_t { IDLE, PULSE };
+    AccPhase accPhase = AccPhase::IDLE;
+    AccessoryQueue::Command accCurrent;
+    uint32_t accDeadline = 0;
+    uint16_t accPulseMs = 100;
+    uint16_t accGapMs = 50;
+
+    /// Sends queued accessory commands to track, one at a time with on/off pulse.
+    void accessoryLoop();
+
+    struct Route {
+        uint8_t nSteps;
+        RouteStep steps[MAX_ROUTE_STEPS];
+    };
+    Route routes[MAX_ROUTES] = {};
+
+    /// Writes current roster as a new journal checkpoint.
+    void compactTurnouts();
+
     LocoData slots[MAX_SLOTS]; ///< slot 1 has index 0 in this array. Slot 0 is invalid.
     LocoData & getSlot(uint8_t slot) { return slots[slot-1]; }
 
+    /// Timer i is purge timer of slot i+1.
+    TimerWheel<MAX_SLOTS> slotTimers;
+    uint32_t purgeActiveMs = DEFAULT_PURGE_ACTIVE_MS;
+    uint32_t purgeCommonMs = DEFAULT_PURGE_COMMON_MS;
+    etl::vector<SlotListener*, 4> slotListeners;
+
+    void onSlotTimer(uint8_t slot);
+
+    void notifySlotChange(uint8_t slot) {
+        for(auto l: slotListeners) l->onSlotChange(slot);
+    }
+
     TurnoutState turnoutAction(uint16_t aAddr, bool fromRoster, int8_t newStat) {
         CS_DEBUGF("CommandStation::turnoutAction addr=%d named=%d new state=%d\n", aAddr, fromRoster, newStat );
 
-        if(fromRoster) {
-            auto t = turnoutData.find(aAddr);
-            if(t != turnoutData.end() ) {
-                // turnout command
-                if (newStat==-1) 
-                    newStat = t->second.tStatus==TurnoutState::CLOSED ? 0 : 1;
-                
-                //sendDCCppCmd("T "+String(turnoutData[t].id)+" "+newStat);
-                //dccMain.sendAccessory(turnoutData[t].addr, turnoutData[t].subAddr, newStat);
-                t->second.tStatus = (TurnoutState)newStat;
-
-                //DEBUGS(String("parsed new status ")+newStat );
+        if(newStat==-1) 
+            newStat = accessories.get(aAddr)==TurnoutState::THROWN ? (int)TurnoutState::CLOSED : (int)TurnoutState::THROWN;
+
+        if(!accessories.inRoster(aAddr)) {
+            int id = 1; // after the highest id, which is not the roster size once turnouts were removed
+            for(const auto &t: turnoutRoster) if(t.id >= id) id = t.id+1;
+            accessories.set(aAddr, (TurnoutState)newStat);
+            if(fromRoster) {
+                CS_DEBUGF("CommandStation::turnoutAction: %d is not in roster\n", aAddr);
+            } else if(addToRoster(aAddr, id)) {
+                if(!turnoutJournal.appendDefine(aAddr, id, newStat==1)) compactPending = true;
             }
         } else {
-            if(newStat==-1) 
-                newStat=(int)TurnoutState::THROWN;
-
-            if(turnoutData.capacity()>0) {
-                // add turnout to roster
-                turnoutData[aAddr] = {aAddr, int(turnoutData.size()+1), (TurnoutState)newStat};
-            }
+            recordTurnoutState(aAddr, (TurnoutState)newStat);
         }
 
-        // send to DCC
-        dccMain->sendAccessory(aAddr, newStat==1);
-        // send to LocoNet
-        // FIXME: this is a dirty hack. 
-        // If LocoNet calls this function, it will be bounced back to bus.
-        // Fortunately, right now, accessory commands from LocoNet do not get propagated to DCC
-        // and this command is only called from WiThrottle code.
-        if(locoNet!=nullptr) {
-            LnMsg ttt = makeSwRec(aAddr, true, newStat==1);
-            locoNet->broadcast(ttt);
-        }
+        // send to DCC and to LocoNet. Commands that came from LocoNet go through accessoryFromLocoNet 
+        // and are not bounced back to bus.
+        accQueue.push({aAddr, newStat==1, true});
         
         //sendDCCppCmd("a "+String(addr)+" "+sub+" "+int(newStat) );
 
@@ -0,0 +1,400 @@
+#include "DccExServer.h"
+
+#include <stdarg.h>
+
+
+void DccExServer::begin() {
+    server.begin();
+    MDNS.addService("dccex","tcp", port);
+    lastPower = CS.getPowerState();
+}
+
+void DccExServer::loop() {
+    for(int i=0; i<MAX_CLIENTS; i++) {
+        WiFiClient &cli = clients[i];
+        Channel &ch = channels[i];
+        if(!cli) {
+            ch.stream = nullptr;
+            cli = server.available();
+            if(!cli) continue;
+            DCCEX_LOGI("New client %d", i);
+            ch.stream = &cli;
+            ch.rxLen = 0; ch.inCmd = false; ch.overflow = false; ch.txLen = 0;
+        }
+        readChannel(ch);
+    }
+    if(channels[MAX_CLIENTS].stream!=nullptr) readChannel(channels[MAX_CLIENTS]);
+
+    bool p = CS.getPowerState();
+    if(p!=lastPower) {
+        lastPower = p;
+        broadcast("<p%d>", p ? 1 : 0);
+    }
+    if(dirtySlots!=0) {
+        for(uint8_t s=1; s<=CommandStation::MAX_SLOTS; s++)
+            if( (dirtySlots & (1UL<<s)) && CS.isSlotAllocated(s) ) locoState(nullptr, s);
+        dirtySlots = 0;
+    }
+
+    for(auto &ch: channels) flush(ch);
+}
+
+void DccExServer::readChannel(Channel &ch) {
+    int a = ch.stream->available();
+    while(a>0) {
+        char buf[64];
+        size_t n = ch.stream->readBytes(buf, a<(int)sizeof(buf) ? a : sizeof(buf));
+        if(n==0) break;
+        a -= n;
+        for(size_t i=0; i<n; i++) {
+            char c = buf[i];
+            if(c=='<') {
+                ch.inCmd = true; ch.overflow = false; ch.rxLen = 0;
+            } else if(!ch.inCmd) {
+                // whitespace and garbage between commands
+            } else if(c=='>') {
+                ch.inCmd = false;
+                if(ch.overflow) { stats.overflows++; continue; }
+                ch.rx[ch.rxLen] = 0;
+                processCmd(ch, ch.rx, ch.rxLen);
+            } else if(ch.rxLen < RX_SIZE-1) {
+                ch.rx[ch.rxLen++] = c;
+            } else {
+                ch.overflow = true;
+            }
+        }
+    }
+}
+
+/**
+ * Parses "<op p1 p2 ...>" (without brackets) in place. Non-numeric parameters (like MAIN in <1 MAIN>) are skipped,
+ * the first letter of the first one is kept as keyword (A in <J A>). Up to two "quoted strings" are kept too.
+ */
+void DccExServer::processCmd(Channel &ch, char *cmd, uint8_t len) {
+    if(len==0) return;
+    stats.commands++;
+    char op = cmd[0];
+    int p[MAX_PARAMS];
+    uint8_t np = 0;
+    char key = 0;
+    char *str[2];
+    uint8_t ns = 0;
+    char *s = cmd+1;
+    while(np<MAX_PARAMS) {
+        while(*s==' ') s++;
+        if(*s==0) break;
+        if(*s=='"') {
+            char *q = strchr(s+1, '"');
+            if(ns<2) str[ns++] = s+1;
+            if(q==nullptr) break;
+            *q = 0;
+            s = q+1;
+            continue;
+        }
+        char *e;
+        long v = strtol(s, &e, 10);
+        if(e==s) {
+            if(key==0) key = *s;
+            while(*s!=0 && *s!=' ') s++;
+            continue;
+        }
+        p[np++] = v;
+        s = e;
+    }
+
+    switch(op) {
+        case '0':
+        case '1':
+            CS.setPowerState(op=='1'); // broadcast from loop()
+            break;
+        case 's':
+            reply(ch, "<p%d>", CS.getPowerState() ? 1 : 0);
+            reply(ch, "<iDCC-EX V-4.0.0 / ESP32 / LOCONET_CS G-LocoNetControlStation>");
+            break;
+        case '#':
+            reply(ch, "<# %d>", CommandStation::MAX_SLOTS);
+            break;
+        case 't':
+            throttle(ch, p, np);
+            break;
+        case 'F': {
+            if(np<3 || p[1]<0 || p[1]>28) { reply(ch, "<X>"); break; }
+            uint8_t slot = CS.findOrAllocateLocoSlot(cabAddr(p[0]));
+            if(slot==0) { reply(ch, "<X>"); break; }
+            CS.touchLocoSlot(slot);
+            CS.setLocoFn(slot, p[1], p[2]!=0);
+            break;
+        }
+        case '-':
+            if(np==0) {
+                for(uint8_t s=1; s<=CommandStation::MAX_SLOTS; s++)
+                    if(CS.isSlotAllocated(s)) CS.releaseLocoSlot(s);
+            } else {
+                uint8_t slot = CS.findLocoSlot(cabAddr(p[0]));
+                if(slot!=0) CS.releaseLocoSlot(slot);
+            }
+            break;
+        case 'a':
+            accessory(ch, p, np);
+            break;
+        case 'T':
+            turnout(ch, p, np);
+            break;
+        case 'J':
+            if(key=='A') { routes(ch, p, np); break; }
+            if(key=='R') { roster(ch, p, np, str, ns); break; }
+            stats.unknown++;
+            reply(ch, "<X>");
+            break;
+        case 'R':
+            progRead(ch, p, np);
+            break;
+        case 'W':
+            progWrite(ch, p, np);
+            break;
+        case 'B':
+            progWriteBit(ch, p, np);
+            break;
+        case 'w':
+            if(np<3) { reply(ch, "<X>"); break; }
+            CS.writeCvMain(cabAddr(p[0]), p[1], p[2]);
+            break;
+        case 'b':
+            if(np<4) { reply(ch, "<X>"); break; }
+            CS.writeCvMainBit(cabAddr(p[0]), p[1], p[2], p[3]!=0);
+            break;
+        default:
+            stats.unknown++;
+            reply(ch, "<X>");
+            break;
+    }
+}
+
+/**
+ * <t cab speed dir>, speed -1 is emergency stop, 0..126; reply is broadcast as <l>.
+ * Legacy <t reg cab speed dir> is also answered with <T reg speed dir>. <t cab> asks for loco state.
+ */
+void DccExServer::throttle(Channel &ch, int *p, uint8_t np) {
+    int cab, speed, dir;
+    if(np==1) {
+        uint8_t slot = CS.findLocoSlot(cabAddr(p[0]));
+        if(slot==0) reply(ch, "<l %d -1 128 0>", p[0]);
+        else locoState(&ch, slot);
+        return;
+    } else if(np==3) {
+        cab = p[0]; speed = p[1]; dir = p[2];
+    } else if(np==4) {
+        cab = p[1]; speed = p[2]; dir = p[3];
+    } else {
+        reply(ch, "<X>");
+        return;
+    }
+    if(cab<1 || speed<-1 || speed>126) { reply(ch, "<X>"); return; }
+    uint8_t slot = CS.findOrAllocateLocoSlot(cabAddr(cab));
+    if(slot==0) { reply(ch, "<X>"); return; }
+    CS.touchLocoSlot(slot);
+    CS.setLocoDir(slot, dir ? 1 : 0);
+    CS.setLocoSpeed(slot, speed<0 ? 1 : speed==0 ? 0 : speed+1);
+    if(np==4) reply(ch, "<T %d %d %d>", p[0], speed, dir ? 1 : 0);
+}
+
+/// <l cab reg speedByte functMap>; to one channel or, if ch is nullptr, to all.
+void DccExServer::locoState(Channel *ch, uint8_t slot) {
+    int cab = CS.getLocoAddr(slot).addr();
+    int spd = CS.getLocoSpeed(slot) | (CS.getLocoDir(slot) ? 0x80 : 0);
+    unsigned fns = CS.getLocoFns(slot) & 0x1FFFFFFF;
+    if(ch==nullptr) broadcast("<l %d %d %d %u>", cab, slot, spd, fns);
+    else reply(*ch, "<l %d %d %d %u>", cab, slot, spd, fns);
+}
+
+/// <a addr sub state> (addr 1..511, sub 0..3) or <a linear state> (1..2044); state 1 is thrown.
+void DccExServer::accessory(Channel &ch, int *p, uint8_t np) {
+    int addr, state;
+    if(np==3) {
+        addr = (p[0]-1)*4 + p[1] + 1;
+        state = p[2];
+    } else if(np==2) {
+        addr = p[0];
+        state = p[1];
+    } else {
+        reply(ch, "<X>");
+        return;
+    }
+    if(addr<1 || addr>AccessoryStore::MAX_ADDR) { reply(ch, "<X>"); return; }
+    CS.turnoutAction(addr, false, state ? TurnoutState::THROWN : TurnoutState::CLOSED);
+}
+
+/// <T> lists roster turnouts as <H id addr sub state>, <T id state> sets one by roster id, <T id> removes it (<O> or <X>).
+void DccExServer::turnout(Channel &ch, int *p, uint8_t np) {
+    const auto &list = CS.getTurnouts();
+    if(np==0) {
+        if(list.empty()) { reply(ch, "<X>"); return; }
+        for(const auto &t: list) {
+            reply(ch, "<H %d %d %d %d>", t.id, (t.addr11-1)/4+1, (t.addr11-1)%4,
+                CS.getTurnoutState(t.addr11)==TurnoutState::THROWN ? 1 : 0);
+        }
+        return;
+    }
+    if(np==1) {
+        for(const auto &t: list) {
+            if(t.id!=p[0]) continue;
+            CS.removeTurnout(t.addr11);
+            reply(ch, "<O>");
+            return;
+        }
+    }
+    if(np==2) {
+        for(const auto &t: list) {
+            if(t.id!=p[0]) continue;
+            TurnoutState st = CS.turnoutAction(t.addr11, true, p[1] ? TurnoutState::THROWN : TurnoutState::CLOSED);
+            reply(ch, "<H %d %d>", t.id, st==TurnoutState::THROWN ? 1 : 0);
+            return;
+        }
+    }
+    reply(ch, "<X>");
+}
+
+/**
+ * <J A> lists routes as <jA id1 id2 ...>, <J A id> answers <jA id R "Route id">, or <jA id X> if there is none.
+ * <J A id linear state [linear state]...> defines a route of accessory positions (state 1 is thrown),
+ * <J A id 0> deletes it; both answer <O> or <X>.
+ */
+void DccExServer::routes(Channel &ch, int *p, uint8_t np) {
+    if(np==0) {
+        char b[4*CommandStation::MAX_ROUTES+8];
+        int n = snprintf(b, sizeof(b), "<jA");
+        for(uint8_t id=1; id<=CommandStation::MAX_ROUTES; id++)
+            if(CS.isRouteDefined(id)) n += snprintf(b+n, sizeof(b)-n, " %d", id);
+        reply(ch, "%s>", b);
+        return;
+    }
+    if(p[0]<1 || p[0]>CommandStation::MAX_ROUTES) { reply(ch, "<X>"); return; }
+    uint8_t id = p[0];
+    if(np==1) {
+        if(CS.isRouteDefined(id)) reply(ch, "<jA %d R \"Route %d\">", id, id);
+        else reply(ch, "<jA %d X>", id);
+        return;
+    }
+    if(np==2 && p[1]==0) {
+        reply(ch, CS.setRoute(id, nullptr, 0) ? "<O>" : "<X>");
+        return;
+    }
+    if( (np-1)%2 != 0 ) { reply(ch, "<X>"); return; }
+    CommandStation::RouteStep steps[CommandStation::MAX_ROUTE_STEPS];
+    uint8_t n = 0;
+    for(uint8_t i=1; i+1<np; i+=2) {
+        if(p[i]<1 || p[i]>AccessoryStore::MAX_ADDR) { reply(ch, "<X>"); return; }
+        steps[n++] = { (uint16_t)p[i], p[i+1] ? TurnoutState::THROWN : TurnoutState::CLOSED };
+    }
+    reply(ch, CS.setRoute(id, steps, n) ? "<O>" : "<X>");
+}
+
+/// <R cv> -> <r cv value>, <R cv cbNum cbSub> -> <r cbNum|cbSub|cv value>; value is -1 on failure.
+void DccExServer::progRead(Channel &ch, int *p, uint8_t np) {
+    if(np!=1 && np!=3) { reply(ch, "<X>"); return; }
+    int16_t v = CS.readCVProg(p[0]);
+    if(np==1) reply(ch, "<r %d %d>", p[0], v);
+    else reply(ch, "<r %d|%d|%d %d>", p[1], p[2], p[0], v);
+}
+
+/// <W cv value> -> <r cv value>, <W cv value cbNum cbSub> -> <r cbNum|cbSub|cv value>
+void DccExServer::progWrite(Channel &ch, int *p, uint8_t np) {
+    if(np!=2 && np!=4) { reply(ch, "<X>"); return; }
+    int v = CS.writeCvProg(p[0], p[1]) ? p[1] : -1;
+    if(np==2) reply(ch, "<r %d %d>", p[0], v);
+    else reply(ch, "<r %d|%d|%d %d>", p[2], p[3], p[0], v);
+}
+
+/// <B cv bit value> -> <r cv bit value>, <B cv bit value cbNum cbSub> -> <r cbNum|cbSub|cv bit value>
+void DccExServer::progWriteBit(Channel &ch, int *p, uint8_t np) {
+    if( (np!=3 && np!=5) || p[1]<0 || p[1]>7 ) { reply(ch, "<X>"); return; }
+    int v = CS.writeCvProgBit(p[0], p[1], p[2]!=0) ? (p[2]!=0) : -1;
+    if(np==3) reply(ch, "<r %d %d %d>", p[0], p[1], v);
+    else reply(ch, "<r %d|%d|%d %d %d>", p[3], p[4], p[0], p[1], v);
+}
+
+/**
+ * <J R> lists roster cabs as <jR cab ...>; <J R cab> answers <jR cab "name" "F0/F1/...">.
+ * Edits (DCC-EX has its roster compiled in): <J R cab steps "name" "F0/F1/..."> adds or replaces a loco,
+ * steps is 14, 28 or 128; <J R cab 0> removes it. Answered with <O> or <X>, written to flash by LocoRoster::loop().
+ */
+void DccExServer::roster(Channel &ch, int *p, uint8_t np, char **str, uint8_t ns) {
+    const LocoRoster *r = CS.getLocoRoster();
+    LocoRoster::Loco l;
+    if(np==0) {
+        char buf[4 + LocoRoster::MAX_LOCOS*6 + 2];
+        int n = snprintf(buf, sizeof(buf), "<jR");
+        for(uint16_t i=0; r!=nullptr && r->at(i, l); i++) n += snprintf(buf+n, sizeof(buf)-n, " %d", l.addr.addr());
+        buf[n++] = '>';
+        append(ch, buf, n);
+        return;
+    }
+    if(p[0]<1 || p[0]>10239) { reply(ch, "<X>"); return; }
+    LocoAddress addr = cabAddr(p[0]);
+    if(np==1 && ns==0) {
+        if(r==nullptr || !r->find(addr, l)) { reply(ch, "<X>"); return; }
+        char buf[16 + LocoRoster::NAME_MAX + LocoRoster::LABELS_MAX];
+        int n = snprintf(buf, sizeof(buf), "<jR %d \"%s\" \"", p[0], l.name);
+        const char *lb = l.labels;
+        for(uint8_t f=0; f<l.labelCount; f++) {
+            size_t len = strlen(lb);
+            if(f>0) buf[n++] = '/';
+            memcpy(buf+n, lb, len);
+            n += len;
+            lb += len+1;
+        }
+        buf[n++] = '"';
+        buf[n++] = '>';
+        append(ch, buf, n);
+        return;
+    }
+    if(editRoster==nullptr || np!=2) { reply(ch, "<X>"); return; }
+    if(p[1]==0 && ns==0) {
+        reply(ch, editRoster->remove(addr) ? "<O>" : "<X>");
+        return;
+    }
+    if(ns==0 || (p[1]!=14 && p[1]!=28 && p[1]!=128)) { reply(ch, "<X>"); return; }
+    const char *labels[LocoRoster::MAX_FUNCTIONS];
+    uint8_t nl = 0;
+    for(char *lb = ns>1 ? str[1] : nullptr; lb!=nullptr && nl<LocoRoster::MAX_FUNCTIONS; ) {
+        labels[nl++] = lb;
+        lb = strchr(lb, '/');
+        if(lb!=nullptr) *lb++ = 0;
+    }
+    reply(ch, editRoster->put(addr, str[0], p[1], labels, nl) ? "<O>" : "<X>");
+}
+
+void DccExServer::reply(Channel &ch, const char *fmt, ...) {
+    char buf[64];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if(n>0) append(ch, buf, n<(int)sizeof(buf) ? n : sizeof(buf)-1);
+}
+
+void DccExServer::broadcast(const char *fmt, ...) {
+    char buf[64];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if(n<=0) return;
+    for(auto &ch: channels)
+        if(ch.stream!=nullptr) append(ch, buf, n<(int)sizeof(buf) ? n : sizeof(buf)-1);
+}
+
+void DccExServer::append(Channel &ch, const char *s, uint16_t len) {
+    if(ch.txLen+len > TX_SIZE) flush(ch);
+    memcpy(ch.tx+ch.txLen, s, len);
+    ch.txLen += len;
+}
+
+void DccExServer::flush(Channel &ch) {
+    if(ch.txLen==0) return;
+    if(ch.stream!=nullptr) {
+        ch.stream->write((const uint8_t*)ch.tx, ch.txLen);
+        stats.writes++;
+    }
+    ch.txLen = 0;
+}
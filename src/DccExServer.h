@@ -0,0 +1,127 @@
+/**
+ * DCC-EX (DCC++) native text protocol, over TCP and optionally a serial stream.
+ * Commands are bound directly to CommandStation, there are no LocoNet slots in between.
+ *
+ * Supported: power <0>/<1>, status <s>, throttle <t>, functions <F>, forget <->, accessories <a>,
+ * roster turnouts <T>, programming track <R>/<W>/<B>, main track CV <w>/<b>, slot count <#>,
+ * route list <J A>. Routes are defined with <J A id linear state ...>, an extension: DCC-EX itself
+ * defines them in EX-RAIL.
+ *
+ * Commands are parsed in place in the receive buffer of each channel.
+ * Replies and broadcasts are collected per channel and written once per loop().
+ *
+ * @see https://dcc-ex.com/reference/software/command-reference.html
+ */
+#pragma once
+
+#include <WiFi.h>
+#include <WiFiServer.h>
+#include <ESPmDNS.h>
+
+#include "CommandStation.h"
+
+
+#define DCCEX_DEBUG_
+
+#ifdef DCCEX_DEBUG
+#define DCCEX_LOGI(format, ...)  log_printf(ARDUHAL_LOG_FORMAT(I, format), ##__VA_ARGS__)
+#else
+#define DCCEX_LOGI(...)
+#endif
+
+
+class DccExServer: public CommandStation::SlotListener {
+public:
+
+    static const uint16_t DEFAULT_PORT = 2560;
+
+    struct Stats {
+        uint32_t commands;
+        uint32_t unknown;    ///< answered with <X>
+        uint32_t overflows;  ///< commands too long for receive buffer, dropped
+        uint32_t writes;
+    };
+
+    /// @param serial optional stream (e.g. USB serial) served in addition to TCP clients
+    DccExServer(uint16_t port=DEFAULT_PORT, Stream *serial=nullptr): port(port), server(port) {
+        channels[MAX_CLIENTS].stream = serial;
+    }
+
+    void begin();
+
+    void end() {
+        server.end();
+    }
+
+    /// Accepts clients, handles received commands, sends broadcasts, then writes out everything. Call from main loop.
+    void loop();
+
+    void onSlotPurge(uint8_t slot, CommandStation::SlotAge age) override {}
+
+    void onSlotChange(uint8_t slot) override {
+        if(slot<32) dirtySlots |= 1UL<<slot;
+    }
+
+    const Stats& getStats() const { return stats; }
+
+    /// Roster that <J R> edits go to; without it the roster can only be listed.
+    void setLocoRoster(LocoRoster *r) { editRoster = r; }
+
+private:
+
+    const uint16_t port;
+
+    const static int MAX_CLIENTS = 4;
+    /// roster edit with name and labels is the longest command
+    const static int RX_SIZE = 192;
+    const static int TX_SIZE = 512;
+    /// route definition is the longest command
+    const static int MAX_PARAMS = 2 + 2*CommandStation::MAX_ROUTE_STEPS;
+
+    WiFiServer server;
+    WiFiClient clients[MAX_CLIENTS];
+
+    struct Channel {
+        Stream *stream = nullptr;
+        char rx[RX_SIZE];
+        uint8_t rxLen = 0;
+        bool inCmd = false;    ///< between '<' and '>'
+        bool overflow = false; ///< rest of current command is dropped
+        char tx[TX_SIZE];
+        uint16_t txLen = 0;
+    };
+    /// TCP clients, then serial
+    Channel channels[MAX_CLIENTS+1];
+
+    static_assert(CommandStation::MAX_SLOTS<32, "dirtySlots is 32 bits");
+    uint32_t dirtySlots = 0;
+    LocoRoster *editRoster = nullptr;
+    bool lastPower = false;
+
+    Stats stats = {};
+
+    void readChannel(Channel &ch);
+    void processCmd(Channel &ch, char *cmd, uint8_t len);
+
+    /// Appends formatted reply to channel's output.
+    void reply(Channel &ch, const char *fmt, ...) __attribute__ ((format (printf, 3, 4)));
+    void broadcast(const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+    void append(Channel &ch, const char *s, uint16_t len);
+    void flush(Channel &ch);
+
+    void locoState(Channel *ch, uint8_t slot);
+
+    void throttle(Channel &ch, int *p, uint8_t np);
+    void accessory(Channel &ch, int *p, uint8_t np);
+    void turnout(Channel &ch, int *p, uint8_t np);
+    void routes(Channel &ch, int *p, uint8_t np);
+    void roster(Channel &ch, int *p, uint8_t np, char **str, uint8_t ns);
+    void progRead(Channel &ch, int *p, uint8_t np);
+    void progWrite(Channel &ch, int *p, uint8_t np);
+    void progWriteBit(Channel &ch, int *p, uint8_t np);
+
+    /// DCC-EX cabs below 128 are short addresses.
+    static LocoAddress cabAddr(int cab) {
+        return cab<128 ? LocoAddress::shortAddr(cab) : LocoAddress::longAddr(cab);
+    }
+};
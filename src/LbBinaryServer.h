@@ -0,0 +1,313 @@
+/**
+ * Binary variant of LocoNet over TCP, for tools that don't need the text protocol of LbServer.
+ *
+ * Both directions carry frames of [type][seq][len][payload]:
+ *  - MSG: payload is one LocoNet message. Client numbers its frames; server numbers frames it sends.
+ *  - ACK (server only): client frames up to and including seq, except NAKed ones, are on the bus. len=0.
+ *  - NAK (server only): client frame seq was not sent; payload is one NakReason byte.
+ *
+ * A client may send many frames in one segment; they are answered with one ACK (plus NAKs) per segment.
+ * Messages from the bus, including ones sent by clients, are framed once in loop() and appended to each
+ * client's output buffer. Server seq numbers are shared by all clients, so a client that does not read and
+ * loses frames sees a gap; it is disconnected if its buffer stays full for SLOW_CLIENT_MS.
+ */
+#pragma once
+
+#include <WiFi.h>
+#include <ESPmDNS.h>
+#include <AsyncTCP.h>
+
+#include <LocoNet.h>
+#include <atomic>
+#include <mutex>
+
+#include "LnRoute.h"
+#include "LnInbox.h"
+
+
+#define LBB_DEBUG
+
+#ifdef LBB_DEBUG
+#define LBB_LOGI(format, ...)  do{ log_printf(ARDUHAL_LOG_FORMAT(I, format), ##__VA_ARGS__); }while(0)
+#else
+#define LBB_LOGI(...)
+#endif
+
+
+class LbBinaryServer: public LocoNetConsumer {
+
+public:
+
+    enum FrameType: uint8_t { MSG=0x01, ACK=0x02, NAK=0x03 };
+    enum NakReason: uint8_t { BAD_MSG=1, BUS_ERROR=2 };
+
+    static const uint8_t HEADER_SIZE = 3;
+    static const uint8_t MAX_PAYLOAD = sizeof(LnMsg::data);
+
+    struct Stats {
+        uint32_t rxFrames;
+        uint32_t rxBytes;
+        uint32_t naks;
+        uint32_t protocolErrors; ///< unknown frame type or length; client is disconnected
+        uint32_t txFrames;
+        uint32_t txBytes;
+        uint32_t txWrites;
+        uint32_t dropped;        ///< bus messages lost because inbox was full
+        uint32_t clientDrops;    ///< frames not given to a client because its buffer was full
+        uint32_t slowClosed;     ///< clients disconnected for not reading
+    };
+
+    LbBinaryServer(const uint16_t port, LocoNetBus * const bus): bus(bus), port(port), server(port) {
+        bus->addConsumer(this);
+
+        server.onClient( [this](void*, AsyncClient* cli ) { onConnect(cli); }, nullptr);
+    }
+
+    void begin() {
+        MDNS.addService("lbbinary","tcp", port);
+        server.begin();
+    }
+
+    void end() {
+        server.end();
+    }
+
+    /// Starts and releases clients, sends bus messages to them.
+    void loop() {
+        for(auto &c: clients) {
+            switch(c.state.load(std::memory_order_acquire)) {
+                case NEW: {
+                    c.txLen = 0;
+                    c.fullSince = 0;
+                    uint8_t st = NEW;
+                    // stays CLOSED if client is already gone
+                    c.state.compare_exchange_strong(st, ACTIVE, std::memory_order_acq_rel);
+                    break;
+                }
+                case CLOSED:
+                    delete c.cli;
+                    c.cli = nullptr;
+                    c.state.store(FREE, std::memory_order_release);
+                    clientCount--;
+                    break;
+            }
+        }
+        if(!txInbox.empty()) sendPending();
+        for(auto &c: clients) if(active(c)) flush(c);
+    }
+
+    LN_STATUS onMessage(const lnMsg& msg) override {
+        if(clientCount.load(std::memory_order_relaxed)==0) return LN_DONE;
+        txInbox.push(msg);
+        return LN_DONE;
+    }
+
+    const Stats& getStats() {
+        stats.dropped = txInbox.getStats().dropped;
+        return stats;
+    }
+
+private:
+
+    LocoNetBus *bus;
+
+    uint16_t port;
+
+    AsyncServer server;
+
+    const static int MAX_CLIENTS = 5;
+
+    const static int TX_QUEUE_SIZE = 64;
+    /// Output buffer of each client, one TCP segment.
+    const static int TX_BUF_SIZE = 1436;
+    const static int FRAME_MAX = HEADER_SIZE+MAX_PAYLOAD;
+    /// Answer to one received segment: ACK and a NAK per frame at most.
+    const static int ACK_BUF_SIZE = 64;
+    /// A client whose buffer has not drained for this long is disconnected.
+    const static uint32_t SLOW_CLIENT_MS = 2000;
+
+    enum ClientState: uint8_t {
+        FREE,
+        NEW,     ///< connected, not set up by loop() yet
+        ACTIVE,
+        CLOSED,  ///< disconnected, not released yet
+    };
+
+    struct Client {
+        /// FREE->NEW only in AsyncTCP task, other transitions only in loop()
+        std::atomic<uint8_t> state{FREE};
+        AsyncClient *cli = nullptr;
+        /// AsyncTCP task only: frame received partially in previous segment
+        uint8_t rx[FRAME_MAX];
+        uint8_t rxLen = 0;
+        /// serializes writes of AsyncTCP task (ACK/NAK) and loop() (output buffer), so frames are not mixed
+        std::mutex writeLock;
+        /// loop() only
+        uint8_t tx[TX_BUF_SIZE];
+        uint16_t txLen = 0;
+        uint32_t fullSince = 0;   ///< millis() of first frame dropped for this client, 0 if keeping up
+    };
+    Client clients[MAX_CLIENTS];
+    /// clients not FREE
+    std::atomic<uint8_t> clientCount{0};
+
+    LnInbox<TX_QUEUE_SIZE> txInbox;
+    uint8_t txSeq = 0;
+
+    Stats stats = {};
+
+    static bool active(const Client &c) { return c.state.load(std::memory_order_acquire)==ACTIVE; }
+
+    /// AsyncTCP task: claims a free client slot.
+    void onConnect(AsyncClient *cli) {
+        int i = 0;
+        while(i<MAX_CLIENTS && clients[i].state.load(std::memory_order_acquire)!=FREE) i++;
+        if(i==MAX_CLIENTS) {
+            LBB_LOGI("onConnect: Not accepting client: %s", cli->remoteIP().toString().c_str() );
+            cli->close();
+            return;
+        }
+        Client &c = clients[i];
+        c.cli = cli;
+        c.rxLen = 0;
+        clientCount++;
+        c.state.store(NEW, std::memory_order_release);
+        LBB_LOGI("onConnect: New client %d: %s", i, cli->remoteIP().toString().c_str() );
+        cli->setNoDelay(true);
+
+        cli->onDisconnect([this, i](void*, AsyncClient*) {
+            LBB_LOGI("onDisconnect: Client %d disconnected", i);
+            clients[i].state.store(CLOSED, std::memory_order_release);
+        });
+
+        cli->onData( [this, i](void*, AsyncClient*, void *data, size_t len) {
+            processRx(clients[i], (const uint8_t*)data, len);
+        });
+
+        cli->onError([i](void*, AsyncClient*, int8_t err) {
+            LBB_LOGI("onError(%d): %d", i, err);
+        });
+        cli->onTimeout([i](void*, AsyncClient* cli, uint32_t time) {
+            LBB_LOGI("onTimeout(%d): %u", i, (unsigned)time);
+            cli->close();
+        });
+    }
+
+    /// Splits data into frames, handles them and answers the whole segment with one write.
+    void processRx(Client &c, const uint8_t *data, size_t len) {
+        stats.rxBytes += len;
+        uint8_t ack[ACK_BUF_SIZE];
+        uint8_t t = 0;
+        bool acked = false;
+        uint8_t ackSeq = 0;
+
+        while(len>0) {
+            const uint8_t *f;
+            if(c.rxLen==0 && len>=HEADER_SIZE && len>=HEADER_SIZE+(size_t)data[2]) {
+                // whole frame in this segment, use it in place
+                f = data;
+            } else {
+                // collect header, then payload, in carry buffer
+                uint8_t need = c.rxLen<HEADER_SIZE ? HEADER_SIZE : HEADER_SIZE+c.rx[2];
+                size_t n = need-c.rxLen;
+                if(n>len) n = len;
+                memcpy(c.rx+c.rxLen, data, n);
+                c.rxLen += n; data += n; len -= n;
+                if(c.rxLen==HEADER_SIZE && c.rx[2]>0 && c.rx[2]<=MAX_PAYLOAD) continue;
+                if(c.rxLen<need) break;
+                f = c.rx;
+            }
+            uint8_t type = f[0], seq = f[1], plen = f[2];
+            if(type!=MSG || plen>MAX_PAYLOAD) {
+                stats.protocolErrors++;
+                LBB_LOGI("Client %d: bad frame type %d len %d, closing", (int)(&c-clients), type, plen);
+                c.cli->close();
+                return;
+            }
+            if(f==data) { data += HEADER_SIZE+plen; len -= HEADER_SIZE+plen; }
+            c.rxLen = 0;
+            stats.rxFrames++;
+
+            uint8_t reason = processMsg(f+HEADER_SIZE, plen);
+            if(reason==0) {
+                acked = true;
+                ackSeq = seq;
+            } else if(t+HEADER_SIZE+1 <= ACK_BUF_SIZE-HEADER_SIZE) {
+                ack[t++] = NAK; ack[t++] = seq; ack[t++] = 1; ack[t++] = reason;
+                stats.naks++;
+            }
+        }
+        if(acked) { ack[t++] = ACK; ack[t++] = ackSeq; ack[t++] = 0; }
+        if(t>0) {
+            std::lock_guard<std::mutex> guard(c.writeLock);
+            c.cli->write((const char*)ack, t);
+        }
+    }
+
+    /// @return 0 if message was sent, NakReason otherwise.
+    uint8_t processMsg(const uint8_t *p, uint8_t len) {
+        LnMsg msg;
+        uint8_t chk = 0;
+        for(uint8_t i=0; i<len; i++) chk ^= p[i];
+        if(len<2 || (p[0]&0x80)==0 || chk!=0xFF) return BAD_MSG;
+        memcpy(msg.data, p, len);
+        if(msg.length()!=len) return BAD_MSG;
+
+        txInbox.push(msg); // echo to all clients
+        LN_STATUS ret = LnRoute::broadcast(bus, msg, LnOrigin::LBBINARY, this);
+        return ret==LN_DONE ? 0 : BUS_ERROR;
+    }
+
+    /// Frames each queued message once and appends it to the output buffer of every active client.
+    void sendPending() {
+        uint32_t now = millis();
+        stats.txFrames += txInbox.drain([&](const LnMsg &msg) {
+            uint8_t f[FRAME_MAX];
+            uint8_t ln = msg.length();
+            if(ln > MAX_PAYLOAD) ln = MAX_PAYLOAD;
+            f[0] = MSG;
+            f[1] = txSeq++;
+            f[2] = ln;
+            memcpy(f+HEADER_SIZE, msg.data, ln);
+            uint8_t n = HEADER_SIZE+ln;
+            for(auto &c: clients) {
+                if(!active(c)) continue;
+                if(c.txLen + n > TX_BUF_SIZE) {
+                    stats.clientDrops++;
+                    if(c.fullSince==0) c.fullSince = now | 1;
+                    continue;
+                }
+                memcpy(c.tx + c.txLen, f, n);
+                c.txLen += n;
+            }
+        });
+    }
+
+    /// Writes the whole frames of client's output buffer that fit into its send buffer. Disconnects a client
+    /// that has been dropping frames for SLOW_CLIENT_MS.
+    void flush(Client &c) {
+        if(c.txLen>0) {
+            std::lock_guard<std::mutex> guard(c.writeLock);
+            size_t space = c.cli->space();
+            size_t t = 0;
+            while(t<c.txLen && t+HEADER_SIZE+c.tx[t+2] <= space) t += HEADER_SIZE+c.tx[t+2];
+            if(t>0) {
+                c.cli->write((const char*)c.tx, t);
+                stats.txBytes += t;
+                stats.txWrites++;
+                c.txLen -= t;
+                memmove(c.tx, c.tx+t, c.txLen);
+            }
+        }
+        if(c.fullSince==0) return;
+        if(c.txLen <= TX_BUF_SIZE/2) {
+            c.fullSince = 0;
+        } else if(millis()-c.fullSince > SLOW_CLIENT_MS) {
+            LBB_LOGI("Disconnecting slow client %d", (int)(&c-clients));
+            stats.slowClosed++;
+            c.fullSince = 0;
+            c.cli->close();
+        }
+    }
+
+};
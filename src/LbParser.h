@@ -0,0 +1,138 @@
+#pragma once
+/**
+ * Line parser for LocoNet over TCP client input, one instance per client.
+ *
+ * Complete lines are decoded in place from the TCP receive buffer. Only a line split
+ * across two segments is copied, into a small carry buffer. Overlong lines are skipped
+ * up to the next line end, so a garbled client can't corrupt the following lines.
+ */
+
+#include <Arduino.h>
+#include <LocoNet.h>
+
+
+class LbParser {
+public:
+
+    enum class Line: uint8_t {
+        SEND,       ///< valid SEND line, message decoded
+        OTHER,      ///< some other command, ignored
+        MALFORMED   ///< SEND line with bad hex, length or checksum
+    };
+
+    struct Stats {
+        uint32_t lines;
+        uint32_t messages;
+        uint32_t malformed;
+        uint32_t overflows;  ///< lines longer than LINE_MAX, dropped
+    };
+
+    /// "SEND" and up to 16 bytes with some spare whitespace
+    static const uint8_t LINE_MAX = 100;
+
+    /**
+     * Parses received data, calling onLine(Line, const LnMsg&, const char *line, size_t len) for each complete line.
+     */
+    template<typename F>
+    void feed(const char *data, size_t len, F onLine) {
+        const char *end = data+len;
+        while(data<end) {
+            const char *eol = data;
+            while(eol<end && *eol!='\n' && *eol!='\r') eol++;
+            if(eol==end) { // incomplete line, keep for next segment
+                append(data, end-data);
+                return;
+            }
+            if(!skipping) {
+                if(carryLen==0) line(data, eol-data, onLine);
+                else if(append(data, eol-data)) line(carry, carryLen, onLine);
+            }
+            skipping = false;
+            carryLen = 0;
+            data = eol+1;
+        }
+    }
+
+    const Stats& getStats() const { return stats; }
+
+    /**
+     * Decodes "SEND XX XX ..." into msg.
+     * Every byte must be exactly 2 hex digits, and their count must match message length.
+     */
+    static Line decode(const char *s, size_t len, LnMsg &msg) {
+        if(len<4 || memcmp(s, "SEND", 4)!=0 || (len>4 && s[4]!=' ' && s[4]!='\t') ) return Line::OTHER;
+        uint8_t n = 0;
+        uint8_t chk = 0;
+        for(size_t i=4; i<len; ) {
+            char c = s[i];
+            if(c==' ' || c=='\t') { i++; continue; }
+            if(i+1>=len || n>=sizeof(msg.data)) return Line::MALFORMED;
+            uint8_t hi = hexVal(c), lo = hexVal(s[i+1]);
+            if( (hi|lo) & 0xF0 ) return Line::MALFORMED;
+            if(i+2<len && s[i+2]!=' ' && s[i+2]!='\t') return Line::MALFORMED;
+            msg.data[n] = hi<<4 | lo;
+            chk ^= msg.data[n];
+            n++;
+            i += 2;
+        }
+        if(n<2 || (msg.data[0] & 0x80)==0 || msg.length()!=n || chk!=0xFF) return Line::MALFORMED;
+        return Line::SEND;
+    }
+
+private:
+
+    /// @return hex digit value, 0xFF for anything else
+    static uint8_t hexVal(char c) {
+        static const uint8_t HEX_VAL[256] = {
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0,   1,   2,   3,   4,   5,   6,   7,   8,   9,   0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xA, 0xB, 0xC, 0xD, 0xE, 0xF, 0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xA, 0xB, 0xC, 0xD, 0xE, 0xF, 0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+            0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        };
+        return HEX_VAL[(uint8_t)c];
+    }
+
+    char carry[LINE_MAX];
+    uint8_t carryLen = 0;
+    /// rest of an overlong line is being dropped
+    bool skipping = false;
+
+    Stats stats = {};
+
+    bool append(const char *s, size_t len) {
+        if(skipping) return false;
+        if(carryLen+len > LINE_MAX) {
+            stats.overflows++;
+            skipping = true;
+            carryLen = 0;
+            return false;
+        }
+        memcpy(carry+carryLen, s, len);
+        carryLen += len;
+        return true;
+    }
+
+    template<typename F>
+    void line(const char *s, size_t len, F &onLine) {
+        if(len==0) return; // CRLF
+        stats.lines++;
+        LnMsg msg;
+        Line l = decode(s, len, msg);
+        if(l==Line::SEND) stats.messages++;
+        else if(l==Line::MALFORMED) stats.malformed++;
+        onLine(l, msg, s, len);
+    }
+
+};
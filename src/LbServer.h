@@ -1,5 +1,12 @@
 /**
  * @see http://loconetovertcp.sourceforge.net/Protocol/LoconetOverTcp.html
+ *
+ * Received lines are parsed and sent to the bus in the AsyncTCP task. Client slots are claimed there too;
+ * everything else about a client (cache replay, output, release) happens in loop().
+ *
+ * Bus messages are formatted once and appended to each client's own output buffer. A client that does not
+ * read loses messages once its buffer is full, and is disconnected if it stays behind for SLOW_CLIENT_MS;
+ * other clients are not held back by it.
  */
 #pragma once
 
@@ -9,8 +16,13 @@
 
 #include <ln_opc.h>
 #include <LocoNet.h>
-#include <etl/queue.h>
-#include <etl/set.h>
+#include <atomic>
+#include <mutex>
+
+#include "LocoNetStateCache.h"
+#include "LnRoute.h"
+#include "LbParser.h"
+#include "LnInbox.h"
 
 
 #define LB_DEBUG
@@ -23,9 +35,6 @@
 #define LB_LOGD(...) 
 #endif
 
-
-#define FROM_HEX(c) (   ((c)>'9') ? ((c) & ~0x20)-'A'+0xA : ((c)-'0')   )
-
 class LbServer: public LocoNetConsumer {
 
 public:
@@ -34,35 +43,7 @@ public:
         //server = Server(port);
         bus->addConsumer(this);
 
-        server.onClient( [this](void*, AsyncClient* cli ) {
-            if(clients.full()) {
-                LB_LOGI("onConnect: Not accepting client: %s", cli->remoteIP().toString().c_str() );
-                cli->close();
-                return;
-            }
-            clients.insert(cli);
-            LB_LOGI("onConnect: New client(%X): %s", (intptr_t)cli, cli->remoteIP().toString().c_str() );
-            cli->write("VERSION ESP32 WiFi 0.1");
-
-            cli->onDisconnect([this](void*, AsyncClient* cli) {
-                LB_LOGI("onDisconnect: Client(%X) disconnected", (intptr_t)cli );
-                clients.erase(cli);
-            });
-
-            cli->onData( [this](void*, AsyncClient* cli, void *data, size_t len) {
-                for(size_t i=0; i<len; i++)
-                    processRx( ((char*)data)[i], cli);
-            });
-
-            cli->onError([this](void*, AsyncClient* cli, int8_t err) { 
-                LB_LOGI("onError(%X): %d", (intptr_t)cli, err);  
-            });
-            cli->onTimeout([this](void*, AsyncClient* cli, uint32_t time) { 
-                LB_LOGI("onTimeout(%X): %d", (intptr_t)cli, time); 
-                cli->close(); 
-            });
-
-        }, nullptr);
+        server.onClient( [this](void*, AsyncClient* cli ) { onConnect(cli); }, nullptr);
     }
 
     void begin() {
@@ -75,17 +56,68 @@ public:
     }
 
 
+    /// Interrogation requests from clients are answered from this cache when it is complete.
+    void setStateCache(LocoNetStateCache *cache) { stateCache = cache; }
+
+    struct TxStats {
+        uint32_t queued;
+        uint32_t dropped;       ///< messages lost because queue was full
+        uint32_t sent;          ///< messages taken from queue and formatted
+        uint32_t writes;        ///< writes to clients
+        uint32_t clientDrops;   ///< messages not given to a client because its buffer was full
+        uint32_t slowClosed;    ///< clients disconnected for not reading
+        uint16_t maxDepth;
+    };
+
+    const TxStats& getTxStats() {
+        auto s = txInbox.getStats();
+        txStats.queued = s.queued;
+        txStats.dropped = s.dropped;
+        txStats.maxDepth = s.maxBacklog;
+        return txStats;
+    }
+
+    /// Starts and releases clients, answers interrogations from cache and sends bus messages to clients.
     void loop() {
-        if (!clients.empty()) {
-            while(!txQueue.empty()) {
-                sendMessage(txQueue.front());
-                txQueue.pop();
+        for(auto &c: clients) {
+            switch(c.state.load(std::memory_order_acquire)) {
+                case NEW: {
+                    c.replay = LocoNetStateCache::Cursor();
+                    c.txLen = 0;
+                    c.fullSince = 0;
+                    c.interrogate.store(false, std::memory_order_relaxed);
+                    uint8_t st = NEW;
+                    // stays CLOSED if client is already gone
+                    c.state.compare_exchange_strong(st, ACTIVE, std::memory_order_acq_rel);
+                    break;
+                }
+                case ACTIVE:
+                    if(stateCache!=nullptr && c.interrogate.exchange(false, std::memory_order_acquire)
+                            && !stateCache->interrogate(c.replay) ) {
+                        // cache was invalidated meanwhile, ask the bus after all
+                        LnRoute::broadcast(bus, c.interrogation, LnOrigin::LBSERVER, this);
+                    }
+                    break;
+                case CLOSED:
+                    // AsyncTCP does not touch a client after its disconnect callback
+                    delete c.cli;
+                    c.cli = nullptr;
+                    c.state.store(FREE, std::memory_order_release);
+                    clientCount--;
+                    break;
             }
         }
+        if (!txInbox.empty()) sendPending();
+        for(auto &c: clients) {
+            if(!active(c)) continue;
+            if(stateCache!=nullptr && c.replay.active) fillReplay(c);
+            flush(c);
+        }
     }
 
     LN_STATUS onMessage(const lnMsg& msg) override {
-        if( !txQueue.full() && !clients.empty() ) txQueue.push(msg);
+        if(clientCount.load(std::memory_order_relaxed)==0) return LN_DONE;
+        txInbox.push(msg);
         return LN_DONE;
     }
 
@@ -96,64 +128,197 @@ private:
     uint16_t port;
 
     AsyncServer server;
-    etl::set<AsyncClient*, 5> clients;
-
-    etl::queue<LnMsg, 5> txQueue;
-
-    LocoNetMessageBuffer lbBuf;
-    const static int LB_BUF_SIZE = 100;
-    char lbStr[LB_BUF_SIZE];
-    int lbPos = 0;
-
-    void processRx(char v, AsyncClient *cli) {
-        lbStr[lbPos] = v;
-        if(v=='\n' || v=='\r') {
-            if(lbPos==0) return; // deal with CRLF ending
-            lbStr[lbPos] = ' '; lbStr[lbPos+1]=0;
-            LB_LOGD("Processing string '%s'", lbStr);
-            if(strncmp("SEND ", lbStr, 5)==0) {
-                for(uint8_t i=5; i<=lbPos; i++) {
-                    if(lbStr[i]==' ') {
-                        uint8_t val = FROM_HEX(lbStr[i-2])<<4 | FROM_HEX(lbStr[i-1]);
-                        LB_LOGD("LbServer::loop adding byte %02x from chars '%c' '%c' (pos %d)", val, lbStr[i-2], lbStr[i-1], i);
-                        LnMsg *msg = lbBuf.addByte(val);
-                        if(msg!=nullptr) {
-                            
-                            sendMessage(*msg); // echo
-                            LN_STATUS ret = bus->broadcast(*msg, this);
-
-                            if(ret==LN_DONE) cli->write("SENT OK\n"); else
-                            if(ret==LN_RETRY_ERROR) cli->write("SENT ERROR LN_RETRY_ERROR\n"); else
-                            cli->write("SENT ERROR generic\n"); 
-                            break;
-                        }
-                    }
-                }
-            } else {
-                LB_LOGI("Got line but it's not SEND: '%s'", lbStr);
-            }
-            lbPos=0;
-        } else {
-            lbPos++;
+
+    const static int MAX_CLIENTS = 5;
+
+    const static int TX_QUEUE_SIZE = 64;
+    /// Output buffer of each client, one TCP segment.
+    const static int TX_BUF_SIZE = 1436;
+    /// Longest RECEIVE line
+    const static int TX_LINE_MAX = 7 + 3*sizeof(LnMsg::data) + 1;
+    /// A client whose buffer has not drained for this long is disconnected.
+    const static uint32_t SLOW_CLIENT_MS = 2000;
+
+    enum ClientState: uint8_t {
+        FREE,
+        NEW,     ///< connected, not set up by loop() yet
+        ACTIVE,
+        CLOSED,  ///< disconnected, not released yet
+    };
+
+    struct Client {
+        /// FREE->NEW only in AsyncTCP task, other transitions only in loop()
+        std::atomic<uint8_t> state{FREE};
+        AsyncClient *cli = nullptr;
+        /// AsyncTCP task only
+        LbParser parser;
+        /// set by AsyncTCP task when an interrogation is answered from cache, replay is started by loop()
+        std::atomic<bool> interrogate{false};
+        LnMsg interrogation;
+        /// serializes writes of AsyncTCP task (replies) and loop() (output buffer), so lines are not mixed
+        std::mutex writeLock;
+        /// loop() only
+        LocoNetStateCache::Cursor replay;
+        char tx[TX_BUF_SIZE];
+        uint16_t txLen = 0;
+        uint32_t fullSince = 0;   ///< millis() of first message dropped for this client, 0 if keeping up
+    };
+    Client clients[MAX_CLIENTS];
+    /// clients not FREE
+    std::atomic<uint8_t> clientCount{0};
+
+    /// filled from any task that broadcasts, drained in loop()
+    LnInbox<TX_QUEUE_SIZE> txInbox;
+    TxStats txStats = {};
+
+    LocoNetStateCache *stateCache = nullptr;
+
+    static bool active(const Client &c) { return c.state.load(std::memory_order_acquire)==ACTIVE; }
+
+    /// AsyncTCP task: claims a free client slot.
+    void onConnect(AsyncClient *cli) {
+        int i = 0;
+        while(i<MAX_CLIENTS && clients[i].state.load(std::memory_order_acquire)!=FREE) i++;
+        if(i==MAX_CLIENTS) {
+            LB_LOGI("onConnect: Not accepting client: %s", cli->remoteIP().toString().c_str() );
+            cli->close();
+            return;
         }
+        Client &c = clients[i];
+        c.cli = cli;
+        c.parser = LbParser();
+        clientCount++;
+        c.state.store(NEW, std::memory_order_release);
+        LB_LOGI("onConnect: New client %d: %s", i, cli->remoteIP().toString().c_str() );
+        // SENT replies are short writes; without this they wait for the client's delayed ACK
+        cli->setNoDelay(true);
+        reply(c, "VERSION ESP32 WiFi 0.1\n");
+
+        cli->onDisconnect([this, i](void*, AsyncClient*) {
+            LB_LOGI("onDisconnect: Client %d disconnected", i);
+            clients[i].state.store(CLOSED, std::memory_order_release);
+        });
+
+        cli->onData( [this, i](void*, AsyncClient* cli, void *data, size_t len) {
+            Client &c = clients[i];
+            c.parser.feed((const char*)data, len,
+                [this, &c](LbParser::Line l, const LnMsg &msg, const char *s, size_t n) {
+                    processLine(c, l, msg, s, n);
+                });
+        });
+
+        cli->onError([i](void*, AsyncClient*, int8_t err) {
+            LB_LOGI("onError(%d): %d", i, err);
+        });
+        cli->onTimeout([i](void*, AsyncClient* cli, uint32_t time) {
+            LB_LOGI("onTimeout(%d): %u", i, (unsigned)time);
+            cli->close();
+        });
+    }
+
+    /// AsyncTCP task.
+    void processLine(Client &c, LbParser::Line l, const LnMsg &msg, const char *s, size_t len) {
+        switch(l) {
+            case LbParser::Line::OTHER:
+                LB_LOGI("Got line but it's not SEND: '%.*s'", (int)len, s);
+                return;
+            case LbParser::Line::MALFORMED:
+                LB_LOGI("Malformed SEND: '%.*s'", (int)len, s);
+                reply(c, "SENT ERROR malformed\n");
+                return;
+            case LbParser::Line::SEND:
+                break;
+        }
+
+        txInbox.push(msg); // echo
+        if(stateCache!=nullptr && LocoNetStateCache::isInterrogation(msg) && stateCache->complete() ) {
+            // answered from cache in loop(), physical bus is not interrogated again
+            c.interrogation = msg;
+            c.interrogate.store(true, std::memory_order_release);
+            reply(c, "SENT OK\n");
+            return;
+        }
+        LN_STATUS ret = LnRoute::broadcast(bus, msg, LnOrigin::LBSERVER, this);
+
+        if(ret==LN_DONE) reply(c, "SENT OK\n"); else
+        if(ret==LN_RETRY_ERROR) reply(c, "SENT ERROR LN_RETRY_ERROR\n"); else
+        reply(c, "SENT ERROR generic\n"); 
     }
 
-    void sendMessage(const LnMsg &msg) {
-        
-        char ttt[LB_BUF_SIZE] = "RECEIVE";
-        uint t = strlen(ttt);
+    /// Writes "RECEIVE XX XX ...\n" (no terminating zero). @return number of chars written, at most TX_LINE_MAX.
+    static uint formatMessage(const LnMsg &msg, char *ttt) {
+        static const char HEX_DIGITS[] = "0123456789ABCDEF";
+        memcpy(ttt, "RECEIVE", 7);
+        uint t = 7;
         uint8_t ln = msg.length();
+        if(ln > sizeof(msg.data)) ln = sizeof(msg.data);
         for(int j=0; j<ln; j++) {
-            t += sprintf(ttt+t, " %02X", msg.data[j]);
+            uint8_t v = msg.data[j];
+            ttt[t++] = ' ';
+            ttt[t++] = HEX_DIGITS[v>>4];
+            ttt[t++] = HEX_DIGITS[v & 0x0F];
         }
-        LB_LOGD("Transmitting '%s'", ttt );
-        t += sprintf(ttt+t, "\n");
-        for (auto cli: clients) {
-            size_t len = cli->write(ttt);
-            if(len != t) {
-                LB_LOGI("cli(%x) tx length mismatch: expected %d, actual %d", (intptr_t)cli, t, len);
+        ttt[t++] = '\n';
+        return t;
+    }
+
+    /// AsyncTCP task: writes a reply line directly, between lines written by flush().
+    static void reply(Client &c, const char *line) {
+        std::lock_guard<std::mutex> guard(c.writeLock);
+        c.cli->write(line);
+    }
+
+    /// Formats each queued message once and appends it to the output buffer of every active client.
+    void sendPending() {
+        uint32_t now = millis();
+        txStats.sent += txInbox.drain([&](const LnMsg &msg) {
+            char line[TX_LINE_MAX];
+            uint n = formatMessage(msg, line);
+            for(auto &c: clients) {
+                if(!active(c)) continue;
+                if(c.txLen + n > TX_BUF_SIZE) {
+                    txStats.clientDrops++;
+                    if(c.fullSince==0) c.fullSince = now | 1;
+                    continue;
+                }
+                memcpy(c.tx + c.txLen, line, n);
+                c.txLen += n;
             }
+        });
+    }
+
+    /// Appends as many cached state messages as fit into client's output buffer.
+    void fillReplay(Client &c) {
+        LnMsg msg;
+        while(TX_BUF_SIZE - c.txLen >= TX_LINE_MAX && stateCache->next(c.replay, msg) ) {
+            c.txLen += formatMessage(msg, c.tx + c.txLen);
+        }
+    }
+
+    /// Writes the whole lines of client's output buffer that fit into its send buffer. Disconnects a client
+    /// that has been dropping messages for SLOW_CLIENT_MS.
+    void flush(Client &c) {
+        if(c.txLen>0) {
+            std::lock_guard<std::mutex> guard(c.writeLock);
+            size_t space = c.cli->space();
+            uint16_t t = c.txLen < space ? c.txLen : space;
+            while(t>0 && c.tx[t-1]!='\n') t--;
+            if(t>0) {
+                c.cli->write(c.tx, t);
+                txStats.writes++;
+                c.txLen -= t;
+                memmove(c.tx, c.tx+t, c.txLen);
+            }
+        }
+        if(c.fullSince==0) return;
+        if(c.txLen <= TX_BUF_SIZE/2) {
+            c.fullSince = 0;
+        } else if(millis()-c.fullSince > SLOW_CLIENT_MS) {
+            LB_LOGI("Disconnecting slow client %d", (int)(&c-clients));
+            txStats.slowClosed++;
+            c.fullSince = 0;
+            c.cli->close();
         }
     }
 
-};
\ No newline at end of file
+};
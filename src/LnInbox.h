@@ -0,0 +1,123 @@
+#pragma once
+/**
+ * Bounded inbox that decouples a consumer from LocoNetBus::broadcast.
+ *
+ * broadcast() calls every consumer in the broadcasting task (phy receive, AsyncTCP, main loop).
+ * A consumer that is slow or must run in its own task pushes messages here from onMessage
+ * and processes them later with drain() from its own task. push() never blocks: when the inbox
+ * is full the message is dropped and counted.
+ *
+ * Any number of tasks may push, only one task may drain. Lock-free, after D. Vyukov's bounded queue.
+ * Message origin (LnRoute::origin()) is kept and restored while the message is handled.
+ */
+
+#include <Arduino.h>
+#include <LocoNet.h>
+#include <atomic>
+
+#include "LnRoute.h"
+
+
+template<uint16_t N>
+class LnInbox {
+public:
+
+    static_assert( N>=2 && (N & (N-1))==0, "inbox size must be a power of 2" );
+
+    struct Stats {
+        uint32_t queued;
+        uint32_t delivered;
+        uint32_t dropped;     ///< inbox was full
+        uint16_t backlog;     ///< messages waiting now
+        uint16_t maxBacklog;
+    };
+
+    LnInbox() {
+        for(uint16_t i=0; i<N; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    /// Task to wake with xTaskNotifyGive on every push; nullptr if the consumer polls.
+    void setTask(TaskHandle_t t) { task = t; }
+
+    /// Call from onMessage. @return false if the message was dropped.
+    bool push(const LnMsg &msg) {
+        uint32_t pos = tail.load(std::memory_order_relaxed);
+        Cell *c;
+        for(;;) {
+            c = &cells[pos & (N-1)];
+            int32_t dif = (int32_t)(c->seq.load(std::memory_order_acquire) - pos);
+            if(dif==0) {
+                if(tail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+            } else if(dif<0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        c->msg = msg;
+        c->origin = LnRoute::origin();
+        c->seq.store(pos+1, std::memory_order_release);
+        queued.fetch_add(1, std::memory_order_relaxed);
+        if(task!=nullptr) xTaskNotifyGive(task);
+        return true;
+    }
+
+    /**
+     * Handles up to max waiting messages with f(const LnMsg&), in the origin they were broadcast with.
+     * Call only from the consumer's task. @return number of messages handled.
+     */
+    template<typename F>
+    uint16_t drain(F f, uint16_t max=N) {
+        uint16_t b = backlog();
+        if(b>maxBacklog.load(std::memory_order_relaxed)) maxBacklog.store(b, std::memory_order_relaxed);
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint16_t n = 0;
+        while(n<max) {
+            Cell &c = cells[h & (N-1)];
+            if(c.seq.load(std::memory_order_acquire) != h+1) break;
+            {
+                LnRoute::OriginScope s(c.origin);
+                f(c.msg);
+            }
+            c.seq.store(h+N, std::memory_order_release);
+            h++;
+            n++;
+        }
+        head.store(h, std::memory_order_relaxed);
+        delivered.store(delivered.load(std::memory_order_relaxed)+n, std::memory_order_relaxed);
+        return n;
+    }
+
+    bool empty() const { return backlog()==0; }
+
+    /// Any task; exact only in the draining task.
+    uint16_t backlog() const { return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed); }
+
+    /// Any task, e.g. a status page.
+    Stats getStats() const {
+        return Stats{ queued.load(std::memory_order_relaxed), delivered.load(std::memory_order_relaxed),
+            dropped.load(std::memory_order_relaxed), backlog(), maxBacklog.load(std::memory_order_relaxed) };
+    }
+
+private:
+
+    struct Cell {
+        std::atomic<uint32_t> seq;
+        LnMsg msg;
+        LnOrigin origin;
+    };
+
+    Cell cells[N];
+    std::atomic<uint32_t> tail{0};
+    /// head, delivered and maxBacklog are written only by the draining task; atomic so stats can be read from others
+    std::atomic<uint32_t> head{0};
+
+    std::atomic<uint32_t> queued{0};
+    std::atomic<uint32_t> dropped{0};
+    std::atomic<uint32_t> delivered{0};
+    std::atomic<uint16_t> maxBacklog{0};
+
+    TaskHandle_t task = nullptr;
+
+};
@@ -0,0 +1,167 @@
+#pragma once
+/**
+ * Records every message routed over LocoNetBus, with its origin and time of broadcast, into a RAM ring.
+ * The newest N messages can be written out at any time in capture format, and fed back with LnReplay.
+ *
+ * Capture format, all integers little-endian:
+ *  - header: "LNCP", version byte (1)
+ *  - records until end of stream: time since previous record in us (LEB128 varint, 0 for the first one),
+ *    origin byte (LnOrigin), message bytes (length is given by the message itself).
+ */
+
+#include <Arduino.h>
+#include <LocoNet.h>
+#include <atomic>
+
+#include "LnRoute.h"
+
+
+namespace LnCapture {
+    static const char MAGIC[4] = {'L','N','C','P'};
+    static const uint8_t VERSION = 1;
+    static const uint8_t HEADER_SIZE = sizeof(MAGIC)+1;
+    /// varint, origin, message
+    static const uint8_t MAX_RECORD_SIZE = 5+1+sizeof(LnMsg::data);
+}
+
+
+template<uint16_t N>
+class LnRecorder: public LocoNetConsumer {
+public:
+
+    static_assert( N>=2 && (N & (N-1))==0, "recorder size must be a power of 2" );
+
+    struct Stats {
+        uint32_t recorded;
+        uint32_t overwritten;  ///< recorded before the newest N
+        uint32_t torn;         ///< overwritten while being written out, skipped
+    };
+
+    LnRecorder(LocoNetBus * const bus) {
+        bus->addConsumer(this);
+    }
+
+    /// Recording is on from start; pause it to keep the ring from moving while looking at a problem.
+    void setEnabled(bool en) { enabled = en; }
+    bool isEnabled() const { return enabled; }
+
+    void clear() {
+        start.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    /// Called from any broadcasting task; lock-free, records never block the bus.
+    LN_STATUS onMessage(const lnMsg& msg) override {
+        if(!enabled) return LN_DONE;
+        uint32_t i = head.fetch_add(1, std::memory_order_relaxed);
+        Record &r = ring[i & (N-1)];
+        r.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        r.us = micros();
+        r.origin = LnRoute::origin();
+        r.msg = msg;
+        r.seq.store(i+1, std::memory_order_release);
+        return LN_DONE;
+    }
+
+    /// Dump in progress, written out a chunk at a time by dumpStep().
+    struct DumpCursor {
+        bool active = false;
+        size_t total = 0;       ///< bytes written so far
+        uint32_t next = 0;
+        uint32_t end = 0;
+        uint32_t prevUs = 0;
+        bool first = true;
+        uint8_t buf[256];
+        uint16_t len = 0;
+        uint16_t pos = 0;       ///< written part of buf
+    };
+
+    /// Starts a dump of the messages recorded so far, oldest first, in capture format.
+    void dumpBegin(DumpCursor &c) {
+        c.end = head.load(std::memory_order_acquire);
+        c.next = start.load(std::memory_order_relaxed);
+        if(c.end-c.next > N) c.next = c.end-N;
+        c.first = true;
+        c.prevUs = 0;
+        c.total = 0;
+        memcpy(c.buf, LnCapture::MAGIC, sizeof(LnCapture::MAGIC));
+        c.buf[sizeof(LnCapture::MAGIC)] = LnCapture::VERSION;
+        c.len = LnCapture::HEADER_SIZE;
+        c.pos = 0;
+        c.active = true;
+    }
+
+    /**
+     * Writes at most one buffer of the dump, so a capture does not hold up the main loop.
+     * Recording goes on meanwhile; records overwritten before they are written out are skipped.
+     * @return false when the dump is complete or output does not take data any more
+     */
+    bool dumpStep(DumpCursor &c, Print &out) {
+        if(!c.active) return false;
+        if(c.pos==c.len) c.pos = c.len = 0;
+        if(c.pos==0) fill(c);
+        size_t n = c.len>c.pos ? out.write(c.buf+c.pos, c.len-c.pos) : 0;
+        c.pos += n;
+        c.total += n;
+        if(n==0) c.active = false;
+        return c.active;
+    }
+
+    /// Writes the whole dump at once. @return bytes written
+    size_t dump(Print &out) {
+        DumpCursor c;
+        dumpBegin(c);
+        while(dumpStep(c, out)) {}
+        return c.total;
+    }
+
+    Stats getStats() const {
+        uint32_t rec = head.load(std::memory_order_relaxed) - start.load(std::memory_order_relaxed);
+        return Stats{ rec, rec>N ? rec-N : 0, torn };
+    }
+
+private:
+
+    struct Record {
+        /// index+1 once the record is complete, 0 while it is being written
+        std::atomic<uint32_t> seq{0};
+        uint32_t us;
+        LnOrigin origin;
+        LnMsg msg;
+    };
+
+    Record ring[N];
+    std::atomic<uint32_t> head{0};
+    /// first index after clear()
+    std::atomic<uint32_t> start{0};
+    volatile bool enabled = true;
+
+    uint32_t torn = 0;
+
+    /// Appends records at the cursor to its buffer while they fit.
+    void fill(DumpCursor &c) {
+        for(; c.next!=c.end && c.len+LnCapture::MAX_RECORD_SIZE <= (int)sizeof(c.buf); c.next++) {
+            const Record &r = ring[c.next & (N-1)];
+            if(r.seq.load(std::memory_order_acquire) != c.next+1) { torn++; continue; }
+            uint32_t us = r.us;
+            LnOrigin o = r.origin;
+            LnMsg msg = r.msg;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(r.seq.load(std::memory_order_relaxed) != c.next+1) { torn++; continue; }
+
+            uint32_t d = c.first ? 0 : us-c.prevUs;
+            c.first = false;
+            c.prevUs = us;
+            do {
+                c.buf[c.len++] = (d & 0x7F) | (d>0x7F ? 0x80 : 0);
+                d >>= 7;
+            } while(d!=0);
+            c.buf[c.len++] = (uint8_t)o;
+            uint8_t ln = msg.length();
+            if(ln > sizeof(msg.data)) ln = sizeof(msg.data);
+            memcpy(c.buf+c.len, msg.data, ln);
+            c.len += ln;
+        }
+    }
+
+};
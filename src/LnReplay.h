@@ -0,0 +1,134 @@
+#pragma once
+/**
+ * Feeds a capture written by LnRecorder back into LocoNetBus, with the recorded origin of each message,
+ * at original speed, faster, or as fast as possible. Consumers on the bus (LocoNetSlotManager, servers,
+ * and the phy, if attached) see the messages as if they came from their routes again.
+ *
+ * Only needs the bus and micros(), so it runs on the station as well as in a host build.
+ */
+
+#include <Arduino.h>
+#include <LocoNet.h>
+
+#include "LnRoute.h"
+#include "LnRecorder.h"
+
+
+class LnReplay {
+public:
+
+    /// speed factor that sends everything without waiting
+    static const uint16_t FLAT_OUT = 0;
+
+    struct Stats {
+        uint32_t messages;
+        uint32_t failed;     ///< broadcast did not return LN_DONE
+        uint32_t maxLateUs;  ///< worst delay of a message after its due time
+        bool corrupt;        ///< capture ended in the middle of a record, or had invalid data
+    };
+
+    LnReplay(LocoNetBus * const bus): bus(bus) {}
+
+    /**
+     * @param capture capture data, must stay valid until replay is done
+     * @param speed 1 plays with recorded timing, 2 twice as fast etc; FLAT_OUT ignores timing
+     * @return false if the header is not valid
+     */
+    bool begin(const uint8_t *capture, size_t len, uint16_t speed=1) {
+        stats = {};
+        data = nullptr;
+        if(len<LnCapture::HEADER_SIZE || memcmp(capture, LnCapture::MAGIC, sizeof(LnCapture::MAGIC))!=0
+            || capture[sizeof(LnCapture::MAGIC)]!=LnCapture::VERSION) return false;
+        data = capture;
+        end = capture+len;
+        pos = capture+LnCapture::HEADER_SIZE;
+        this->speed = speed;
+        dueUs = 0;
+        elapsedUs = 0;
+        lastUs = micros();
+        pending = next();
+        return true;
+    }
+
+    void stop() { pending = false; }
+
+    bool done() const { return !pending; }
+
+    /// Broadcasts all messages that are due. @return true while there are messages left.
+    bool loop() {
+        uint32_t now = micros();
+        elapsedUs += now-lastUs;
+        lastUs = now;
+        while(pending) {
+            uint64_t due = speed==FLAT_OUT ? 0 : dueUs/speed;
+            if(due > elapsedUs) break;
+            if(elapsedUs-due > stats.maxLateUs) stats.maxLateUs = elapsedUs-due;
+            if(LnRoute::broadcast(bus, msg, origin) != LN_DONE) stats.failed++;
+            stats.messages++;
+            pending = next();
+        }
+        return pending;
+    }
+
+    /// Broadcasts the whole capture now, ignoring timing. @return messages sent
+    uint32_t runAll() {
+        while(pending) {
+            if(LnRoute::broadcast(bus, msg, origin) != LN_DONE) stats.failed++;
+            stats.messages++;
+            pending = next();
+        }
+        return stats.messages;
+    }
+
+    const Stats& getStats() const { return stats; }
+
+private:
+
+    LocoNetBus *bus;
+
+    const uint8_t *data = nullptr;
+    const uint8_t *end = nullptr;
+    const uint8_t *pos = nullptr;
+    uint16_t speed = 1;
+
+    /// next message, valid while pending
+    bool pending = false;
+    LnMsg msg;
+    LnOrigin origin;
+    /// recorded time of next message since first one
+    uint64_t dueUs;
+    /// replay time, accumulated so it doesn't wrap with micros()
+    uint64_t elapsedUs;
+    uint32_t lastUs;
+
+    Stats stats = {};
+
+    /// Decodes the record at pos. @return false at end of capture.
+    bool next() {
+        if(pos==end) return false;
+        uint32_t d = 0;
+        uint8_t shift = 0;
+        for(;;) {
+            if(pos==end || shift>28) return corrupt();
+            uint8_t b = *pos++;
+            d |= (uint32_t)(b & 0x7F) << shift;
+            shift += 7;
+            if((b & 0x80)==0) break;
+        }
+        if(end-pos < 3 || *pos >= (uint8_t)LnOrigin::COUNT || (pos[1] & 0x80)==0) return corrupt();
+        origin = (LnOrigin)*pos++;
+        size_t avail = end-pos;
+        memcpy(msg.data, pos, avail<sizeof(msg.data) ? avail : sizeof(msg.data));
+        uint8_t ln = msg.length();
+        if(ln<2 || ln>sizeof(msg.data) || ln>avail) return corrupt();
+        pos += ln;
+        dueUs += d;
+        return true;
+    }
+
+    bool corrupt() {
+        stats.corrupt = true;
+        return false;
+    }
+
+};
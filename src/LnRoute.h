@@ -0,0 +1,114 @@
+#pragma once
+/**
+ * Origin tagging for messages routed over LocoNetBus, and echo matching for routes whose medium
+ * sends back what it is given.
+ *
+ * LocoNetBus only knows the sender consumer, so origin is kept in a task-local variable
+ * set for the duration of a broadcast. Consumers are called synchronously from broadcast
+ * and can ask LnRoute::origin() where the message came from.
+ */
+
+#include <Arduino.h>
+#include <LocoNet.h>
+#include <atomic>
+
+
+enum class LnOrigin: uint8_t {
+    PHY = 0,     ///< physical bus; also anything broadcast outside of an OriginScope
+    LBSERVER,
+    LBBINARY,
+    SERIAL_LINK,
+    SLOTMAN,
+    STATION,     ///< command station itself (accessory echoes, local sensors)
+    COUNT
+};
+
+class LnRoute {
+public:
+
+    /// Origin of the message currently being broadcast in this task.
+    static LnOrigin origin() { return current(); }
+
+    class OriginScope {
+    public:
+        OriginScope(LnOrigin o): prev(current()) { current() = o; }
+        ~OriginScope() { current() = prev; }
+    private:
+        const LnOrigin prev;
+    };
+
+    static LN_STATUS broadcast(LocoNetBus *bus, const LnMsg &msg, LnOrigin o, const LocoNetConsumer *sender=nullptr) {
+        OriginScope s(o);
+        return bus->broadcast(msg, sender);
+    }
+
+    /// Echoes dropped by given route.
+    static uint32_t suppressed(LnOrigin o) { return counters()[(uint8_t)o].load(std::memory_order_relaxed); }
+    static void countSuppressed(LnOrigin o) { counters()[(uint8_t)o].fetch_add(1, std::memory_order_relaxed); }
+
+private:
+    static LnOrigin& current() {
+        static thread_local LnOrigin o = LnOrigin::PHY;
+        return o;
+    }
+
+    static std::atomic<uint32_t>* counters() {
+        static std::atomic<uint32_t> c[(uint8_t)LnOrigin::COUNT] = {};
+        return c;
+    }
+};
+
+
+/**
+ * Messages a route has written to a medium that returns each of them once, in order: a LocoBuffer-style
+ * interface or another station's wire. A received message equal to the oldest one not yet returned is its
+ * echo. Each written message cancels at most one received message, so a genuine repeat from the far side
+ * can only take the place of an echo, which then goes through instead; no message is lost.
+ *
+ * Not for media that don't echo (LoconetOverTcp clients): there it would cancel genuine repeats.
+ * Used from one task only.
+ */
+template<uint8_t SIZE=16>
+class LnEchoMatch {
+public:
+    /// An echo not back after this long is not expected any more.
+    static const uint16_t TIMEOUT_MS = 250;
+
+    LnEchoMatch(LnOrigin route): route(route) {}
+
+    void sent(const LnMsg &msg) {
+        if(count==SIZE) pop(); // oldest is overdue
+        Entry &e = entries[(first+count) % SIZE];
+        e.msg = msg;
+        e.time = millis();
+        count++;
+    }
+
+    /// Checks a received message and counts it as suppressed if it is the next echo.
+    bool isEcho(const LnMsg &msg) {
+        uint32_t now = millis();
+        while(count>0 && now-entries[first].time >= TIMEOUT_MS) pop();
+        if(count==0) return false;
+        const LnMsg &e = entries[first].msg;
+        uint8_t len = msg.length();
+        if(len>sizeof(msg.data) || e.length()!=len || memcmp(e.data, msg.data, len)!=0) return false;
+        pop();
+        LnRoute::countSuppressed(route);
+        return true;
+    }
+
+    /// Echoes still expected.
+    uint8_t pending() const { return count; }
+
+private:
+    struct Entry {
+        LnMsg msg;
+        uint32_t time;
+    };
+    const LnOrigin route;
+    Entry entries[SIZE];
+    uint8_t first = 0;
+    uint8_t count = 0;
+
+    void pop() { first = (first+1) % SIZE; count--; }
+};
@@ -0,0 +1,210 @@
+#pragma once
+/**
+ * Transmit scheduler for messages generated by the command station.
+ * Replies (LACK, slot data) go before informational broadcasts, a pending message
+ * with the same merge key is replaced by the newer one, and transmissions are spaced
+ * by LocoNet bus timing so bursts don't collide with throttle traffic.
+ *
+ * push() may be called from any task; loop() and flush() only from the task that owns the queue.
+ * A message is broadcast to all consumers once; when the phy reports a failure, only the phy
+ * gets it again.
+ */
+
+#include <Arduino.h>
+#include <LocoNet.h>
+#include <mutex>
+
+#include "LnRoute.h"
+
+
+class LnTxQueue {
+public:
+
+    /// replies to requests (LACK, slot data) and informational broadcasts
+    enum Priority: uint8_t { REPLY=0, INFO=1 };
+
+    struct Stats {
+        uint32_t queued;
+        uint32_t sent;
+        uint32_t merged;     ///< messages that replaced a pending one with the same key
+        uint32_t retries;    ///< sent to phy again
+        uint32_t collisions;
+        uint32_t dropped;    ///< queue full or retries exhausted
+        uint16_t depth;
+        uint16_t maxDepth;
+    };
+
+    static const uint8_t SIZE = 16; ///< per priority
+    static const uint8_t MAX_RETRIES = 3;
+    static const uint16_t BIT_US = 60;
+    /// carrier detect backoff, 20 bit times
+    static const uint16_t CD_BACKOFF_US = 20*BIT_US;
+
+    LnTxQueue(LocoNetBus * const bus, const LocoNetConsumer *sender, LnOrigin origin): 
+        bus(bus), sender(sender), origin(origin) {}
+
+    /// Physical bus interface, for retries. Without it a failed broadcast is dropped.
+    void setPhy(LocoNetConsumer *p) { phy = p; }
+
+    /// Merge key for messages describing a slot, e.g. slot data of given opcode.
+    static uint16_t slotKey(uint8_t opc, uint8_t slot) { return opc<<8 | slot; }
+
+    /**
+     * @param key pending message with the same non-zero key is replaced instead of queueing a new one.
+     */
+    bool push(const LnMsg &msg, Priority prio, uint16_t key=0) {
+        std::lock_guard<std::mutex> lk(lock);
+        if(key!=0) {
+            for(uint8_t p=REPLY; p<=INFO; p++) {
+                Entry *e = find(p, key);
+                if(e==nullptr) continue;
+                stats.merged++;
+                if(p<=prio) { e->msg = msg; e->tries = 0; e->gen++; return true; }
+                // pending as low priority, but now needed sooner
+                e->key = 0; e->dead = true;
+                break;
+            }
+        }
+        Ring &r = rings[prio];
+        if(r.count==SIZE) { stats.dropped++; return false; }
+        Entry &e = r.buf[(r.head+r.count)%SIZE];
+        e.msg = msg;
+        e.key = key;
+        e.tries = 0;
+        e.dead = false;
+        e.gen++;
+        r.count++;
+        stats.queued++;
+        uint16_t d = rings[REPLY].count + rings[INFO].count;
+        if(d>stats.maxDepth) stats.maxDepth = d;
+        return true;
+    }
+
+    bool empty() const {
+        std::lock_guard<std::mutex> lk(lock);
+        return rings[REPLY].count==0 && rings[INFO].count==0;
+    }
+
+    uint8_t available(Priority prio) const {
+        std::lock_guard<std::mutex> lk(lock);
+        return SIZE - rings[prio].count;
+    }
+
+    /// Sends next message(s) when bus timing allows. Call from main loop.
+    void loop() {
+        while(!empty() && (int32_t)(micros()-nextTxUs) >= 0) sendNext();
+    }
+
+    /// Sends everything now, waiting out bus timing in between. Use before blocking calls.
+    void flush() {
+        while(!empty()) {
+            int32_t w = nextTxUs - micros();
+            if(w>0) delayMicroseconds(w);
+            sendNext();
+        }
+    }
+
+    Stats getStats() const {
+        std::lock_guard<std::mutex> lk(lock);
+        Stats s = stats;
+        s.depth = rings[REPLY].count + rings[INFO].count;
+        return s;
+    }
+
+private:
+
+    struct Entry {
+        LnMsg msg;
+        uint16_t key;
+        uint8_t tries;
+        bool dead;   ///< superseded by a higher priority copy
+        uint8_t gen; ///< changes when msg is replaced, so a merge during transmission is not lost
+    };
+    struct Ring {
+        Entry buf[SIZE];
+        uint8_t head = 0;
+        uint8_t count = 0;
+    };
+
+    LocoNetBus * const bus;
+    const LocoNetConsumer * const sender;
+    const LnOrigin origin;
+    LocoNetConsumer *phy = nullptr;
+    /// rings and stats; not held while sending
+    mutable std::mutex lock;
+    Ring rings[2];
+    uint32_t nextTxUs = 0;
+    Stats stats = {};
+
+    Entry* find(uint8_t prio, uint16_t key) {
+        Ring &r = rings[prio];
+        for(uint8_t i=0, j=r.head; i<r.count; i++, j=(j+1)%SIZE)
+            if(r.buf[j].key==key) return &r.buf[j];
+        return nullptr;
+    }
+
+    void pop(Ring &r) {
+        r.head = (r.head+1)%SIZE;
+        r.count--;
+    }
+
+    void sendNext() {
+        LnMsg msg;
+        uint8_t tries, gen;
+        Priority prio;
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            prio = rings[REPLY].count>0 ? REPLY : INFO;
+            Ring &r = rings[prio];
+            Entry &e = r.buf[r.head];
+            if(e.dead) { pop(r); return; }
+            msg = e.msg;
+            tries = e.tries;
+            gen = e.gen;
+        }
+
+        uint8_t len = msg.length();
+        LN_STATUS ret;
+        if(tries==0) {
+            ret = LnRoute::broadcast(bus, msg, origin, sender);
+        } else {
+            LnRoute::OriginScope o(origin);
+            ret = phy->onMessage(msg);
+        }
+        // message takes 10 bit times per byte on the wire, then bus is idle for CD backoff
+        nextTxUs = micros() + len*10*BIT_US + CD_BACKOFF_US;
+
+        std::lock_guard<std::mutex> lk(lock);
+        // only this task pops, so the entry is still at head; pushes can only have replaced its message
+        Ring &r = rings[prio];
+        Entry &e = r.buf[r.head];
+        if(e.gen!=gen) return;
+
+        switch(ret) {
+            case LN_DONE:
+                stats.sent++;
+                pop(r);
+                break;
+            case LN_COLLISION:
+                stats.collisions++;
+                // fallthrough
+            case LN_CD_BACKOFF:
+            case LN_PRIO_BACKOFF:
+            case LN_NETWORK_BUSY:
+            case LN_RETRY_ERROR:
+                if(phy==nullptr || ++e.tries > MAX_RETRIES) {
+                    stats.dropped++;
+                    pop(r);
+                } else {
+                    stats.retries++;
+                    nextTxUs += e.tries * CD_BACKOFF_US;
+                }
+                break;
+            default:
+                stats.dropped++;
+                pop(r);
+                break;
+        }
+    }
+
+};
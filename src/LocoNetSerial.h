@@ -3,39 +3,153 @@
 #include <LocoNet.h>
 #include <Stream.h>
 
+#include "LnRoute.h"
+#include "LnInbox.h"
+
+/**
+ * LocoNet over a serial stream (e.g. USB to a PC), raw LocoNet bytes in both directions.
+ *
+ * Everything available is read in one pass and framed here; each outgoing message is written with one call.
+ * Serviced either from loop() or from its own task, see begin().
+ *
+ * If the peer returns everything written to it (a LocoBuffer, or a bridge to another bus), setEchoing()
+ * keeps those echoes off the bus; otherwise every message would come back onto it once more.
+ */
 class LocoNetSerial: public LocoNetConsumer {
 
 public:
+
+    struct Stats {
+        uint32_t rxBytes;
+        uint32_t rxMessages;
+        uint32_t framingErrors;  ///< bytes outside of a message, or message cut short by next opcode
+        uint32_t checksumErrors;
+        uint32_t txMessages;
+        uint32_t echoes;         ///< received messages that were echoes of our own, not broadcast
+        uint32_t lastLatencyUs;  ///< from reading a message from stream to its broadcast returning
+        uint32_t maxLatencyUs;
+    };
+
+    /// Read chunk, also bytes read per pass at most.
+    static const uint8_t RX_CHUNK = 64;
+    /// Task mode: poll interval for received bytes. Outgoing messages wake the task right away.
+    static const uint8_t TASK_POLL_MS = 1;
+
     LocoNetSerial(Stream * const str, LocoNetBus * const bus) : stream(str), bus(bus) {
         bus->addConsumer(this);
     }
 
-    void begin() {}
+    /// @param ownTask service the stream from a separate task instead of loop().
+    void begin(bool ownTask=false, uint8_t prio=2, uint32_t stackSize=3072) {
+        if(!ownTask || task!=nullptr) return;
+        xTaskCreate(taskFn, "LnSerial", stackSize, this, prio, &task);
+        inbox.setTask(task);
+    }
 
     void end() {}
 
     void loop() {
-        if(stream->available() ) {
-            uint8_t inByte = stream->read();
-            lnMsg *msg = buf.addByte(inByte);
-            if(msg != nullptr) {
-                bus->broadcast(*msg, this);
-            }
-        }
+        if(task==nullptr) process();
     }
 
+    /// Stream is written from loop() or own task, not in the broadcasting task.
     virtual LN_STATUS onMessage(const lnMsg& msg) {
-        uint8_t ln = msg.length();
-        for(int j=0; j<ln; j++) {
-            stream->write(msg.data[j]);
-        }
+        inbox.push(msg);
         return LN_DONE;
     }
 
+    /// Peer sends back every message written to it. Call before begin().
+    void setEchoing(bool v) { echoing = v; }
+
+    const Stats& getStats() const { return stats; }
+
+    LnInbox<32>::Stats getInboxStats() const { return inbox.getStats(); }
+
 private:
     Stream *stream;
     LocoNetBus * bus;
 
-    LocoNetMessageBuffer buf;
+    TaskHandle_t task = nullptr;
+
+    /// message being received
+    LnMsg rx;
+    uint8_t rxPos = 0;
+    uint8_t rxLen = 0;
+    /// when current chunk was read
+    uint32_t rxUs = 0;
+
+    LnInbox<32> inbox;
+
+    bool echoing = false;
+    LnEchoMatch<> echoes{LnOrigin::SERIAL_LINK};
+
+    Stats stats = {};
+
+    static void taskFn(void *arg) {
+        LocoNetSerial *s = (LocoNetSerial*)arg;
+        for(;;) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TASK_POLL_MS));
+            s->process();
+        }
+    }
+
+    void process() {
+        inbox.drain([this](const LnMsg &msg) {
+            uint8_t ln = msg.length();
+            if(ln > sizeof(msg.data)) ln = sizeof(msg.data);
+            stream->write(msg.data, ln);
+            stats.txMessages++;
+            if(echoing) echoes.sent(msg);
+        });
+
+        int n = stream->available();
+        while(n>0) {
+            uint8_t buf[RX_CHUNK];
+            size_t r = stream->readBytes(buf, n<RX_CHUNK ? n : RX_CHUNK);
+            if(r==0) break;
+            rxUs = micros();
+            stats.rxBytes += r;
+            for(size_t i=0; i<r; i++) rxByte(buf[i]);
+            n -= r;
+        }
+    }
+
+    void rxByte(uint8_t b) {
+        if(b & 0x80) {
+            if(rxPos!=0) stats.framingErrors++; // previous message incomplete
+            rx.data[0] = b;
+            rxPos = 1;
+            // length is in opcode bits 5-6, or in the second byte for 0xE0..0xFF
+            switch(b & 0x60) {
+                case 0x00: rxLen = 2; break;
+                case 0x20: rxLen = 4; break;
+                case 0x40: rxLen = 6; break;
+                default: rxLen = 0; break;
+            }
+            return;
+        }
+        if(rxPos==0) { stats.framingErrors++; return; }
+        if(rxPos==1 && rxLen==0) {
+            if(b<2 || b>sizeof(rx.data)) {
+                stats.framingErrors++;
+                rxPos = 0;
+                return;
+            }
+            rxLen = b;
+        }
+        rx.data[rxPos++] = b;
+        if(rxPos<rxLen) return;
+
+        rxPos = 0;
+        uint8_t chk = 0;
+        for(uint8_t i=0; i<rxLen; i++) chk ^= rx.data[i];
+        if(chk!=0xFF) { stats.checksumErrors++; return; }
+        stats.rxMessages++;
+        if(echoing && echoes.isEcho(rx)) { stats.echoes++; return; }
+
+        LnRoute::broadcast(bus, rx, LnOrigin::SERIAL_LINK, this);
+        stats.lastLatencyUs = micros()-rxUs;
+        if(stats.lastLatencyUs > stats.maxLatencyUs) stats.maxLatencyUs = stats.lastLatencyUs;
+    }
 
-};
\ No newline at end of file
+};
@@ -21,10 +21,15 @@ static LocoAddress lnAddr(uint16_t addr) {
     return LocoAddress::longAddr(addr);
 }
 
-    LocoNetSlotManager::LocoNetSlotManager(LocoNetBus * const ln): _ln(ln) {
+    LocoNetSlotManager::LocoNetSlotManager(LocoNetBus * const ln): _ln(ln), txQueue(ln, this, LnOrigin::SLOTMAN) {
         for(int i=0; i<MAX_SLOTS; i++) {
             initSlot(i);
         }
+        initSlot(0);
+        freeSlot = _slots[0];
+        LnMsg t; t.sd = freeSlot;
+        writeChecksum(t);
+        freeSlot.chksum = t.sd.chksum;
 
         ln->addConsumer(this);
     }
@@ -44,6 +49,8 @@ static LocoAddress lnAddr(uint16_t addr) {
         sd.snd = 0; 
         sd.id1 = i; 
         sd.id2 = 0;
+        _exFns[i] = 0; // deltas of a new loco are not taken against functions of the previous one
+        slotChanged(i);
     }
 
     #define LNSM_LOGI_SLOT(TAG, I, S) LNSM_LOGI( TAG \
@@ -68,9 +75,22 @@ static LocoAddress lnAddr(uint16_t addr) {
                 }
                 
                 LNSM_LOGI("OPC_LOCO_ADR for addr %d, slot is %d", ADDR(msg->la.adr_hi, msg->la.adr_lo), slot);
+                CS.touchLocoSlot(slot);
                 sendSlotData(slot);
                 break;
             }
+            case OPC_EXP_REQ_SLOT: {
+                int slot = locateSlot( msg->data[1], msg->data[2] );
+                if(slot<=0) {
+                    LNSM_LOGI("OPC_EXP_REQ_SLOT for addr %d, no available slots", ADDR(msg->data[1], msg->data[2]) );
+                    sendLack(OPC_EXP_REQ_SLOT);
+                    break;
+                }
+                LNSM_LOGI("OPC_EXP_REQ_SLOT for addr %d, slot is %d", ADDR(msg->data[1], msg->data[2]), slot);
+                CS.touchLocoSlot(slot);
+                sendSlotData(slot, true);
+                break;
+            }
             case OPC_MOVE_SLOTS: {
                 if( msg->sm.dest!=msg->sm.src || !slotValid(msg->sm.dest) || !slotValid(msg->sm.src) ) {
                     sendLack(OPC_MOVE_SLOTS);
@@ -78,7 +98,9 @@ static LocoAddress lnAddr(uint16_t addr) {
                     uint8_t slot = msg->ss.slot;
                     LNSM_LOGI("OPC_MOVE_SLOTS NULL MOVE for slot %d", slot );
                     _slots[slot].stat |= LOCO_IN_USE;
+                    slotChanged(slot);
                     CS.setLocoSlotRefresh(slot, true);
+                    CS.touchLocoSlot(slot);
                     sendSlotData(slot);
                 }
                 break;
@@ -92,15 +114,52 @@ static LocoAddress lnAddr(uint16_t addr) {
             case OPC_LOCO_SND: {
                 uint8_t slot = msg->ls.slot;
                 if( !slotValid(slot) ) { sendLack(OPC_LOCO_SND); break; } 
+                countFn(FN_CLASSIC, msg);
                 processSnd(slot, msg->ls.snd);
                 break;
             }
             case OPC_LOCO_DIRF: {
                 uint8_t slot = msg->ldf.slot;
                 if( !slotValid(slot) ) { sendLack(OPC_LOCO_DIRF); break; } 
+                countFn(FN_CLASSIC, msg);
                 processDirf(slot, msg->ldf.dirf);
                 break;
             }
+            case OPC_LOCO_F9F12: {
+                uint8_t slot = msg->data[1];
+                if( !slotValid(slot) ) { sendLack(OPC_LOCO_F9F12); break; } 
+                countFn(FN_EXPANDED, msg);
+                LNSM_LOGI("OPC_LOCO_F9F12 slot %d fn %02x", slot, msg->data[2]);
+                applyFns(slot, 0x1E00, (msg->data[2] & 0x0F) << 9);
+                break;
+            }
+            case OPC_UHLI_FUN: {
+                // D4 20 slot group fn
+                uint8_t slot = msg->data[2];
+                uint8_t v = msg->data[4];
+                if(msg->data[1]!=0x20) break;
+                if( !slotValid(slot) ) { sendLack(OPC_UHLI_FUN); break; } 
+                countFn(FN_EXPANDED, msg);
+                LNSM_LOGI("OPC_UHLI_FUN slot %d group %02x fn %02x", slot, msg->data[3], v);
+                switch(msg->data[3]) {
+                    case 0x07: applyFns(slot, 0x7F<<5, (v&0x7F)<<5); break;
+                    case 0x05: applyFns(slot, 1<<12 | 1<<20 | 1<<28, (v>>4&1)<<12 | (v>>5&1)<<20 | (uint32_t)(v>>6&1)<<28 ); break;
+                    case 0x08: applyFns(slot, 0x7F<<13, (v&0x7F)<<13); break;
+                    case 0x09: applyFns(slot, 0x7F<<21, (v&0x7F)<<21); break;
+                    default: break;
+                }
+                break;
+            }
+            case OPC_EXP_SEND_FUNCTION_OR_SPEED_AND_DIR: {
+                uint16_t slot = (msg->data[1] & 0x07)<<7 | msg->data[2];
+                if( !slotValid(slot) ) { sendLack(OPC_EXP_SEND_FUNCTION_OR_SPEED_AND_DIR); break; } 
+                if( (msg->data[1] & 0xF8) >= 0x10) countFn(FN_EXPANDED, msg);
+                processExpFn(slot, msg->data[1] & 0xF8, msg->data[4]); // data[3] is throttle ID
+                break;
+            }
+            case OPC_IMM_PACKET:
+                if(isImmFnPacket(msg)) countFn(FN_IMMEDIATE, msg);
+                break;
             case OPC_LOCO_SPD : {
                 uint8_t slot = msg->lsp.slot;
                 if( !slotValid(slot) ) { sendLack(OPC_LOCO_SPD); break; } 
@@ -129,6 +188,7 @@ static LocoAddress lnAddr(uint16_t addr) {
                 _slot.adr2 = m.adr2;
                 _slot.id1 = m.id1;
                 _slot.id2 = m.id2;
+                slotChanged(slot);
 
                 //_slot = msg->sd;
 
@@ -136,11 +196,23 @@ static LocoAddress lnAddr(uint16_t addr) {
 
                 break;
             }
+            case OPC_EXP_WR_SL_DATA:
+                if(!EXP_SLOTS_SUPPORTED) break;
+                countFn(FN_EXPANDED, msg);
+                processExpSlotWrite(msg->data);
+                break;
             case OPC_RQ_SL_DATA: {
-                uint8_t slot = msg->sr.slot;
-                if( !slotValid(slot) ) { sendLack(OPC_RQ_SL_DATA); break;} 
-                LNSM_LOGI("OPC_RQ_SL_DATA slot %d", slot);
-                sendSlotData(slot);
+                // bit 0x40 in second byte requests expanded slot, lower bits are slot number bits 7-9
+                bool expanded = (msg->sr.pcmd & 0x40) != 0;
+                uint16_t slot = msg->sr.slot | (expanded ? (msg->sr.pcmd & 0x07)<<7 : 0);
+                if(expanded) {
+                    if( !slotValid(slot) ) { sendLack(OPC_RQ_SL_DATA); break;} 
+                    sendSlotData(slot, true);
+                    break;
+                }
+                if(slot==0 || slot>=LN_SLOTS) { sendLack(OPC_RQ_SL_DATA); break;} 
+                // no logging here, JMRI reads all slots in a row on connect
+                slotRequests[slot>>5] |= 1UL<<(slot&31);
                 break;
             }
             default: break;
@@ -158,6 +230,8 @@ static LocoAddress lnAddr(uint16_t addr) {
             if(slot==0) { return 0; }
             CS.initLocoSlot(slot, addr);
             initSlot(slot, hi, lo);
+            uint8_t steps = CS.getLocoSpeedSteps(slot);
+            if(steps!=128) _slots[slot].stat = (_slots[slot].stat & ~DEC_MODE_MASK) | (steps==14 ? DEC_MODE_14 : DEC_MODE_28);
         }
         return slot;
     }
@@ -165,36 +239,178 @@ static LocoAddress lnAddr(uint16_t addr) {
     void LocoNetSlotManager::releaseSlot(uint8_t slot) {
         CS.releaseLocoSlot(slot);
         _slots[slot].stat &= ~STAT1_SL_BUSY;
+        slotChanged(slot);
+    }
+
+    void LocoNetSlotManager::slotImage(uint8_t slot, LnMsg &out) {
+        if(slotValid(slot)) {
+            if( (chkValid & (1UL<<slot)) == 0) {
+                out.sd = _slots[slot];
+                writeChecksum(out);
+                _slots[slot].chksum = out.sd.chksum;
+                chkValid |= 1UL<<slot;
+            }
+            out.sd = _slots[slot];
+        } else {
+            // slot number is both in slot and id1 fields, so they cancel out in XOR checksum
+            out.sd = freeSlot;
+            out.sd.slot = slot;
+            out.sd.id1 = slot;
+        }
     }
 
-    void LocoNetSlotManager::sendSlotData(uint8_t slot) {        
+    void LocoNetSlotManager::sendSlotRequests() {
+        for(uint8_t w=0; w<4; w++) {
+            // half of the queue keeps the bus busy; the other half is for LACKs and replies that arrive during a scan
+            while(slotRequests[w]!=0 && txQueue.available(LnTxQueue::REPLY) > LnTxQueue::SIZE/2) {
+                uint8_t b = __builtin_ctz(slotRequests[w]);
+                slotRequests[w] &= ~(1UL<<b);
+                uint8_t slot = w*32 + b;
+                LnMsg m;
+                slotImage(slot, m);
+                txQueue.push(m, LnTxQueue::REPLY, LnTxQueue::slotKey(OPC_SL_RD_DATA, slot));
+            }
+        }
+    }
+
+    /*
+     * Expanded slot layout (OPC_EXP_RD_SL_DATA/OPC_EXP_WR_SL_DATA):
+     * 0:opc 1:size=21 2:slot bits 7-9 3:slot bits 0-6 4:stat 5:adr 6:adr2 7:trk 8:spd
+     * 9:F12<<4|F20<<5|F28<<6 10:dirf 11:F5-F11 12:F13-F19 13:F21-F27 14:ss2 18:id1 19:id2 20:chksum
+     */
+    void LocoNetSlotManager::sendSlotData(uint8_t slot, bool expanded, LnTxQueue::Priority prio) {        
         LnMsg ret;        
-        ret.sd = _slots[slot];
-        rwSlotDataMsg *s = &ret.sd;
-        
-        LNSM_LOGI_SLOT("Sending", slot, (*s));
+        const rwSlotDataMsg &s = _slots[slot];
+
+        if(expanded && EXP_SLOTS_SUPPORTED) {
+            uint32_t f = CS.getLocoFns(slot);
+            uint8_t *d = ret.data;
+            memset(d, 0, OPC_EXP_SLOT_SIZE);
+            d[0] = OPC_EXP_RD_SL_DATA;
+            d[1] = OPC_EXP_SLOT_SIZE;
+            d[2] = (slot>>7) & 0x07;
+            d[3] = slot & 0x7F;
+            d[4] = s.stat;
+            d[5] = s.adr;
+            d[6] = s.adr2;
+            d[7] = s.trk;
+            d[8] = s.spd;
+            d[9] = (f>>12 & 1)<<4 | (f>>20 & 1)<<5 | (f>>28 & 1)<<6;
+            d[10] = s.dirf;
+            d[11] = (f>>5) & 0x7F;
+            d[12] = (f>>13) & 0x7F;
+            d[13] = (f>>21) & 0x7F;
+            d[14] = s.ss2;
+            d[18] = s.id1;
+            d[19] = s.id2;
+            writeChecksum(ret);
+        } else {
+            // expanded request falls back to classic reply, throttle then uses classic protocol
+            slotImage(slot, ret);
+        }
         
-        writeChecksum(ret);
-        _ln->broadcast(ret, this);
+        txQueue.push(ret, prio, LnTxQueue::slotKey(ret.data[0], slot));
     }
 
     void LocoNetSlotManager::sendLack(uint8_t cmd, uint8_t arg) {
         LnMsg lack = makeLongAck(cmd, arg); 
-        _ln->broadcast(lack, this);
+        txQueue.push(lack, LnTxQueue::REPLY);
     }
 
     void LocoNetSlotManager::processDirf(uint8_t slot, uint v) {
         LNSM_LOGI("OPC_LOCO_DIRF slot %d dirf %02x", slot, v);
         _slots[slot].dirf = v;
+        slotChanged(slot);
+        CS.touchLocoSlot(slot);
         uint8_t dir = ((v & DIRF_DIR) == DIRF_DIR) ? 1 : 0;
         CS.setLocoDir(slot, dir);
         CS.setLocoFns(slot, 0x1F, (v & B00001111)<<1 | (v & B00010000)>>4 );  // fn order in this byte is 04321
     }
 
+    void LocoNetSlotManager::countFn(FnPath path, const lnMsg *msg) {
+        fnStats.messages[path]++;
+        fnStats.bytes[path] += msg->length();
+    }
+
+    /// True if OPC_IMM_PACKET carries a DCC function group packet (how throttles send F9+ without expanded slots).
+    bool LocoNetSlotManager::isImmFnPacket(const lnMsg *msg) {
+        const uint8_t *d = msg->data;
+        if(d[1]!=11 || d[2]!=0x7F) return false;
+        uint8_t n = (d[3]>>4) & 0x07;
+        uint8_t b[5];
+        for(uint8_t i=0; i<5; i++) b[i] = d[5+i] | ((d[4]>>i) & 1)<<7;
+        uint8_t i = (b[0]>=0xC0 && b[0]<0xE8) ? 2 : 1; // long or short address
+        if(i>=n) return false;
+        uint8_t in = b[i];
+        return (in & 0xE0)==0x80 || (in & 0xE0)==0xA0 || in==0xDE || in==0xDF;
+    }
+
+    void LocoNetSlotManager::applyFns(uint8_t slot, uint32_t mask, uint32_t fns) {
+        CS.touchLocoSlot(slot);
+        CS.setLocoFns(slot, mask, fns);
+        uint32_t f = CS.getLocoFns(slot);
+        _exFns[slot] = f & 0x1FFFFE00;
+        rwSlotDataMsg &s = _slots[slot];
+        s.dirf = (s.dirf & ~0x1F) | (f & 1)<<4 | ((f>>1) & 0x0F);
+        s.snd = (f>>5) & 0x0F;
+        slotChanged(slot);
+    }
+
+    void LocoNetSlotManager::processExpFn(uint8_t slot, uint8_t group, uint8_t v) {
+        LNSM_LOGI("OPC_EXP_SEND_FUNCTION_OR_SPEED_AND_DIR slot %d group %02x val %02x", slot, group, v);
+        switch(group) {
+            case 0x00: // speed, forward
+            case 0x08: { // speed, reverse
+                uint8_t dir = group==0x00 ? 1 : 0;
+                if(dir) _slots[slot].dirf |= DIRF_DIR; else _slots[slot].dirf &= ~DIRF_DIR;
+                slotChanged(slot);
+                CS.setLocoDir(slot, dir);
+                processSpd(slot, v);
+                break;
+            }
+            case 0x10: // F0 is bit 4, F1-F4 bits 0-3, F5, F6 bits 5, 6
+                applyFns(slot, 0x7F, (v & 0x0F)<<1 | (v & 0x10)>>4 | (v & 0x60) );
+                break;
+            case 0x18: applyFns(slot, 0x7F<<7, (v & 0x7F)<<7); break;
+            case 0x20: applyFns(slot, 0x7F<<14, (v & 0x7F)<<14); break;
+            case 0x28: // F21-F27, F28 off
+            case 0x30: // F21-F27, F28 on
+                applyFns(slot, 0xFF<<21, (v & 0x7F)<<21 | (group==0x30 ? 1UL<<28 : 0) );
+                break;
+            default: break;
+        }
+    }
+
+    void LocoNetSlotManager::processExpSlotWrite(const uint8_t *d) {
+        uint16_t slot = (d[2] & 0x07)<<7 | d[3];
+        if( !slotValid(slot) ) { sendLack(OPC_EXP_WR_SL_DATA); return; }
+        rwSlotDataMsg &_slot = _slots[slot];
+
+        if(_slot.stat != d[4]) processStat1(slot, d[4]);
+        if( !CS.isSlotAllocated(slot) ) return;
+        if(_slot.spd != d[8]) processSpd(slot, d[8]);
+        if(_slot.dirf != d[10]) processDirf(slot, d[10]);
+        applyFns(slot, 0x1FFFFFE0, 
+            (d[11] & 0x7F)<<5 | (d[9]>>4 & 1)<<12 | (d[12] & 0x7F)<<13 | (d[9]>>5 & 1)<<20 
+            | (uint32_t)(d[13] & 0x7F)<<21 | (uint32_t)(d[9]>>6 & 1)<<28 );
+
+        _slot.adr = d[5];
+        _slot.adr2 = d[6];
+        _slot.trk = d[7];
+        _slot.ss2 = d[14];
+        _slot.id1 = d[18];
+        _slot.id2 = d[19];
+        slotChanged(slot);
+
+        LNSM_LOGI_SLOT("OPC_EXP_WR_SL_DATA", slot, _slot);
+    }
+
     void LocoNetSlotManager::processSnd(uint8_t slot, uint8_t snd) {
         LNSM_LOGI("OPC_LOCO_SND slot %d snd %02x", slot, snd);
+        CS.touchLocoSlot(slot);
         CS.setLocoFns(slot, 0x1E0, snd << 5 );
         _slots[slot].snd = snd;
+        slotChanged(slot);
     }
 
     void LocoNetSlotManager::processStat1(uint8_t slot, uint8_t stat) {
@@ -209,13 +425,118 @@ static LocoAddress lnAddr(uint16_t addr) {
 
             CS.setLocoSlotRefresh(slot, (stat & STAT1_SL_ACTIVE) != 0);
         }
+        CS.touchLocoSlot(slot);
         _slots[slot].stat = stat;
+        slotChanged(slot);
     }
 
     void LocoNetSlotManager::processSpd(uint8_t slot, uint8_t spd) {
         LNSM_LOGI("OPC_LOCO_SPD slot %d spd %d", slot, spd);
+        CS.touchLocoSlot(slot);
         CS.setLocoSpeed(slot, spd);
         _slots[slot].spd = spd;
+        slotChanged(slot);
+    }
+
+    void LocoNetSlotManager::onSlotPurge(uint8_t slot, CommandStation::SlotAge age) {
+        if( !slotValid(slot) ) return;
+        rwSlotDataMsg &s = _slots[slot];
+        if(age == CommandStation::SlotAge::COMMON) {
+            s.stat = (s.stat & ~LOCOSTAT_MASK) | LOCO_COMMON;
+        } else if(age == CommandStation::SlotAge::FREE) {
+            s.stat = (s.stat & ~LOCOSTAT_MASK) | LOCO_FREE;
+        }
+        slotChanged(slot);
+        LNSM_LOGI("Purge slot %d, stat1 %02x", slot, s.stat);
+        sendShort(OPC_SLOT_STAT1, slot, s.stat);
+    }
+
+    void LocoNetSlotManager::sendDeltas() {
+        uint32_t d = dirtySlots;
+        dirtySlots = 0;
+        for(uint8_t slot=0; d!=0; slot++, d>>=1) 
+            if( (d&1) && slotValid(slot) ) sendSlotDelta(slot);
+    }
+
+    uint8_t LocoNetSlotManager::sendShort(uint8_t opc, uint8_t slot, uint8_t val) {
+        LnMsg m;
+        m.data[0] = opc;
+        m.data[1] = slot;
+        m.data[2] = val;
+        writeChecksum(m);
+        txQueue.push(m, LnTxQueue::INFO, LnTxQueue::slotKey(opc, slot));
+        return 4;
+    }
+
+    uint8_t LocoNetSlotManager::sendExpFn(uint8_t slot, uint8_t group, uint8_t val) {
+        LnMsg m;
+        m.data[0] = OPC_EXP_SEND_FUNCTION_OR_SPEED_AND_DIR;
+        m.data[1] = group | ((slot>>7) & 0x07);
+        m.data[2] = slot & 0x7F;
+        m.data[3] = 0; // throttle ID
+        m.data[4] = val;
+        writeChecksum(m);
+        txQueue.push(m, LnTxQueue::INFO);
+        return 6;
+    }
+
+    void LocoNetSlotManager::sendSlotDelta(uint8_t slot) {
+        rwSlotDataMsg &s = _slots[slot];
+        uint32_t bytes = 0;
+        uint8_t msgs = 0;
+
+        if(!CS.isSlotAllocated(slot)) {
+            if( (s.stat & LOCOSTAT_MASK) != LOCO_FREE) {
+                s.stat = (s.stat & ~LOCOSTAT_MASK) | LOCO_FREE;
+                bytes += sendShort(OPC_SLOT_STAT1, slot, s.stat); msgs++;
+            }
+        } else {
+            LocoAddress a = CS.getLocoAddr(slot);
+            uint8_t adr = a.isShort() ? a.addr() : (a.addr() & 0x7F);
+            uint8_t adr2 = a.isShort() ? 0 : (a.addr()>>7) & 0x7F;
+            uint32_t f = CS.getLocoFns(slot);
+            uint8_t dirf = (CS.getLocoDir(slot) ? DIRF_DIR : 0) | (f & 1)<<4 | ((f>>1) & 0x0F);
+            uint8_t snd = (f>>5) & 0x0F;
+
+            if(adr!=s.adr || adr2!=s.adr2 || ( (s.stat & LOCOSTAT_MASK)==LOCO_FREE && CS.getLocoSlotRefresh(slot) ) ) {
+                // slot was taken by someone else than LocoNet (e.g. WiThrottle), whole slot is new
+                s.adr = adr;
+                s.adr2 = adr2;
+                s.stat = (s.stat & ~LOCOSTAT_MASK) | LOCO_IN_USE;
+                s.spd = CS.getLocoSpeed(slot);
+                s.dirf = (s.dirf & ~0x3F) | dirf;
+                s.snd = snd;
+                _exFns[slot] = f & 0x1FFFFE00;
+                sendSlotData(slot, false, LnTxQueue::INFO);
+                bytes += 14; msgs++;
+            } else {
+                uint8_t spd = CS.getLocoSpeed(slot);
+                if(spd != s.spd) {
+                    s.spd = spd;
+                    bytes += sendShort(OPC_LOCO_SPD, slot, spd); msgs++;
+                }
+                if(dirf != (s.dirf & 0x3F)) {
+                    s.dirf = (s.dirf & ~0x3F) | dirf;
+                    bytes += sendShort(OPC_LOCO_DIRF, slot, s.dirf); msgs++;
+                }
+                if(snd != s.snd) {
+                    s.snd = snd;
+                    bytes += sendShort(OPC_LOCO_SND, slot, snd); msgs++;
+                }
+                uint32_t ch = (f ^ _exFns[slot]) & 0x1FFFFE00;
+                _exFns[slot] = f & 0x1FFFFE00;
+                if(ch & 0x1E00) { bytes += sendShort(OPC_LOCO_F9F12, slot, (f>>9) & 0x0F); msgs++; }
+                if(ch & 1UL<<13) { bytes += sendExpFn(slot, 0x18, (f>>7) & 0x7F); msgs++; }
+                if(ch & 0x7FUL<<14) { bytes += sendExpFn(slot, 0x20, (f>>14) & 0x7F); msgs++; }
+                if(ch & 0xFFUL<<21) { bytes += sendExpFn(slot, (f & 1UL<<28) ? 0x30 : 0x28, (f>>21) & 0x7F); msgs++; }
+            }
+        }
+        if(msgs==0) return;
+        slotChanged(slot);
+        deltaStats.changes++;
+        deltaStats.messages += msgs;
+        deltaStats.bytes += bytes;
+        deltaStats.fullSlotBytes += 14;
     }
 
 void LocoNetSlotManager::sendProgData(progTaskMsg ret, uint8_t pstat, uint8_t value ) {
@@ -232,7 +553,7 @@ void LocoNetSlotManager::sendProgData(progTaskMsg ret, uint8_t pstat, uint8_t va
     
     LnMsg msg; msg.pt = ret;
     writeChecksum(msg);
-    _ln->broadcast(msg, this);
+    txQueue.push(msg, LnTxQueue::REPLY);
 }
 
 void LocoNetSlotManager::processProgMsg(const progTaskMsg &msg) {
@@ -246,6 +567,7 @@ void LocoNetSlotManager::processProgMsg(const progTaskMsg &msg) {
             case DIR_BYTE_ON_SRVC_TRK: {
                 LNSM_LOGI("Read byte on prog CV%d", cv);
                 sendLack(PROG_LACK, 1); // ack ok
+                txQueue.flush(); // prog track operation blocks for a long time
                 int16_t ret = CS.readCVProg(cv);
                 sendProgData(msg, (ret>=0) ? 0 : PSTAT_READ_FAIL, ret>=0?ret:0);
                 break;
@@ -253,6 +575,7 @@ void LocoNetSlotManager::processProgMsg(const progTaskMsg &msg) {
             case SRVC_TRK_RESERVED: {// make it a verify command.
                 LNSM_LOGI("Verify byte on prog CV%d==%d", cv, val);
                 sendLack(PROG_LACK, 1); // ack ok
+                txQueue.flush(); // prog track operation blocks for a long time
                 bool ret = CS.verifyCVProg(cv, val);
                 sendProgData(msg, ret?0:PSTAT_READ_FAIL, val);
                 break;
@@ -266,6 +589,7 @@ void LocoNetSlotManager::processProgMsg(const progTaskMsg &msg) {
             case DIR_BYTE_ON_SRVC_TRK: {
                 LNSM_LOGI("Write byte on prog CV%d=%d", cv, val);
                 sendLack(PROG_LACK, 1); // ack ok
+                txQueue.flush(); // prog track operation blocks for a long time
                 bool ret = CS.writeCvProg(cv, val);
                 sendProgData(msg, ret?0:PSTAT_WRITE_FAIL, val);
                 break;
@@ -3,31 +3,145 @@
 #include <Arduino.h>
 #include <LocoNet.h>
 #include "CommandStation.h"
-
-class LocoNetSlotManager : public LocoNetConsumer {
+#include "LnTxQueue.h"
+#include "LnInbox.h"
+
+// Expanded slot and function opcodes, not defined in all versions of ln_opc.h
+
+#ifndef OPC_LOCO_F9F12
+#define OPC_LOCO_F9F12 0xA3
+#endif
+#ifndef OPC_EXP_REQ_SLOT
+#define OPC_EXP_REQ_SLOT 0xBE
+#endif
+#ifndef OPC_UHLI_FUN
+#define OPC_UHLI_FUN 0xD4
+#endif
+#ifndef OPC_EXP_SEND_FUNCTION_OR_SPEED_AND_DIR
+#define OPC_EXP_SEND_FUNCTION_OR_SPEED_AND_DIR 0xD5
+#endif
+#ifndef OPC_EXP_RD_SL_DATA
+#define OPC_EXP_RD_SL_DATA 0xE6
+#endif
+#ifndef OPC_EXP_WR_SL_DATA
+#define OPC_EXP_WR_SL_DATA 0xEE
+#endif
+/// size of 0xE6/0xEE messages
+#ifndef OPC_EXP_SLOT_SIZE
+#define OPC_EXP_SLOT_SIZE 21
+#endif
+
+class LocoNetSlotManager : public LocoNetConsumer, public CommandStation::SlotListener {
 
 public:
     LocoNetSlotManager(LocoNetBus * const ln);
 
     void initSlot(uint8_t i, uint8_t addrHi=0, uint8_t addrLo=0);
 
+    /// Messages are processed in loop(): programming may block, and CS is only touched from main loop.
     LN_STATUS onMessage(const lnMsg& msg) override {
-        processMessage(&msg);
+        inbox.push(msg);
         return LN_DONE;
     }
 
     void processMessage(const lnMsg* msg);
 
+    /// Processes received messages, answers pending slot reads, broadcasts slot changes and transmits queued messages. Call from main loop.
+    void loop() { 
+        inbox.drain([this](const LnMsg &msg) { processMessage(&msg); });
+        if( (slotRequests[0] | slotRequests[1] | slotRequests[2] | slotRequests[3]) != 0) sendSlotRequests();
+        if(dirtySlots!=0 && millis()-dirtySince >= DELTA_WINDOW_MS) sendDeltas();
+        txQueue.loop(); 
+    }
+
+    /// Slot numbers answered to OPC_RQ_SL_DATA. Slots that CS does not have are reported as free.
+    static const uint8_t LN_SLOTS = 120;
+
+    LnTxQueue::Stats getTxStats() const { return txQueue.getStats(); }
+
+    /// Physical bus interface; failed transmissions are retried on it only.
+    void setPhy(LocoNetConsumer *phy) { txQueue.setPhy(phy); }
+
+    LnInbox<32>::Stats getInboxStats() const { return inbox.getStats(); }
+
+    /// Broadcasts new slot status when CS purges an idle slot.
+    void onSlotPurge(uint8_t slot, CommandStation::SlotAge age) override;
+
+    /// Marks slot for comparing with CS state; differences are broadcast after DELTA_WINDOW_MS.
+    void onSlotChange(uint8_t slot) override {
+        if(slot>=32) return;
+        if(dirtySlots==0) dirtySince = millis();
+        dirtySlots |= 1UL<<slot;
+    }
+
+    /// Changes made to a slot within this time are sent together.
+    static const uint16_t DELTA_WINDOW_MS = 50;
+
+    /// Bus cost of slot changes made by command station itself, compared to sending full slot data for each.
+    struct DeltaStats {
+        uint32_t changes;       ///< slots that differed from LocoNet view
+        uint32_t messages;
+        uint32_t bytes;
+        uint32_t fullSlotBytes; ///< what OPC_SL_RD_DATA per change would cost
+    };
+
+    const DeltaStats& getDeltaStats() const { return deltaStats; }
+
+    /// How function changes arrive: classic DIRF/SND, DCC packets in OPC_IMM_PACKET or expanded opcodes.
+    enum FnPath { FN_CLASSIC=0, FN_IMMEDIATE, FN_EXPANDED, FN_PATH_COUNT };
+
+    struct FnStats {
+        uint32_t messages[FN_PATH_COUNT];
+        uint32_t bytes[FN_PATH_COUNT];
+    };
+
+    const FnStats& getFnStats() const { return fnStats; }
+
 
 private:
 
     LocoNetBus * const _ln;
 
+    LnTxQueue txQueue;
+
+    LnInbox<32> inbox;
+
     static const int MAX_SLOTS = CommandStation::MAX_SLOTS;
 
     rwSlotDataMsg _slots[MAX_SLOTS];
+
+    FnStats fnStats = {};
+
+    /// F9-F28 (bit N is FN) as known on LocoNet; F0-F8 are in dirf and snd of _slots.
+    uint32_t _exFns[MAX_SLOTS] = {};
+
+    /// Bit N set: checksum in _slots[N] is up to date.
+    uint32_t chkValid = 0;
+    void slotChanged(uint8_t slot) { chkValid &= ~(1UL<<slot); }
+    /// Image of a free slot, slot number 0. Its checksum is valid for any slot number, see slotImage().
+    rwSlotDataMsg freeSlot;
+    /// Slot data ready for transmission, with checksum.
+    void slotImage(uint8_t slot, LnMsg &out);
+
+    /// Bitmap of requested classic slot reads, answered in bulk from loop() as queue space allows.
+    uint32_t slotRequests[4] = {};
+    void sendSlotRequests();
+
+    static_assert(MAX_SLOTS<=32, "dirtySlots is 32 bits");
+    uint32_t dirtySlots = 0;
+    uint32_t dirtySince = 0;
+    DeltaStats deltaStats = {};
+
+    void sendDeltas();
+    /// Sends smallest set of messages that brings LocoNet view of slot (_slots) up to CS state.
+    void sendSlotDelta(uint8_t slot);
+    uint8_t sendShort(uint8_t opc, uint8_t slot, uint8_t val);
+    uint8_t sendExpFn(uint8_t slot, uint8_t group, uint8_t val);
+
+    /// LnMsg of the LocoNet library may be too short for 21-byte expanded slot messages.
+    static constexpr bool EXP_SLOTS_SUPPORTED = sizeof(LnMsg) >= OPC_EXP_SLOT_SIZE;
     
-    bool slotValid(uint8_t slot) {
+    bool slotValid(uint16_t slot) {
         return (slot>=1) && (slot < MAX_SLOTS);
     }
 
@@ -35,7 +149,18 @@ private:
 
     void releaseSlot(uint8_t slot);
 
-    void sendSlotData(uint8_t slot);
+    void sendSlotData(uint8_t slot, bool expanded=false, LnTxQueue::Priority prio=LnTxQueue::REPLY);
+
+    void countFn(FnPath path, const lnMsg *msg);
+
+    static bool isImmFnPacket(const lnMsg *msg);
+
+    /// Sets functions in CS and updates dirf/snd in slot data.
+    void applyFns(uint8_t slot, uint32_t mask, uint32_t fns);
+
+    void processExpFn(uint8_t slot, uint8_t group, uint8_t data);
+
+    void processExpSlotWrite(const uint8_t *d);
 
     void sendLack(uint8_t cmd, uint8_t arg=0);
 
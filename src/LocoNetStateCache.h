@@ -0,0 +1,182 @@
+#pragma once
+/**
+ * Last known state of sensors (OPC_INPUT_REP) and switches (OPC_SW_REP, OPC_SW_REQ)
+ * seen on the LocoNet bus, packed into bit arrays.
+ *
+ * When a PC connects and sends stationary interrogation, the cached state
+ * can be sent back to it instead of asking all devices on physical bus again.
+ */
+
+#include <Arduino.h>
+#include <LocoNet.h>
+
+
+class LocoNetStateCache: public LocoNetConsumer {
+public:
+
+    static const uint16_t MAX_SENSORS = 4096;
+    static const uint16_t MAX_SWITCHES = 2048;
+    /// After last interrogation seen on bus, wait this long for all replies before cache is considered complete.
+    static const uint32_t INTERROGATE_SETTLE_MS = 5000;
+
+    struct Stats {
+        uint32_t hits;      ///< interrogations answered from cache
+        uint32_t misses;    ///< interrogations passed to bus
+        uint32_t served;    ///< messages generated from cache
+        uint32_t updates;   ///< state messages seen on bus
+    };
+
+    /// Position of a replay; one per client.
+    struct Cursor {
+        uint16_t pos = 0;
+        bool active = false;
+    };
+
+    LocoNetStateCache(LocoNetBus * const bus) {
+        bus->addConsumer(this);
+        clear();
+    }
+
+    void clear() {
+        memset(bits, 0, sizeof(bits));
+        interrogated = false;
+    }
+
+    /// Forget that cache is complete, so the next interrogation goes to bus.
+    void invalidate() { interrogated = false; }
+
+    /// Switches 1017-1020 are reserved for stationary interrogate command.
+    static bool isInterrogateAddr(uint16_t addr) { return addr>=1017 && addr<=1020; }
+
+    static bool isInterrogation(const LnMsg &msg) {
+        return msg.data[0]==OPC_SW_REQ && isInterrogateAddr(swAddr(msg.data[1], msg.data[2]));
+    }
+
+    /// True if cache has seen a full interrogation and can answer the next one.
+    bool complete() const {
+        return interrogated && millis()-lastInterrogation > INTERROGATE_SETTLE_MS;
+    }
+
+    /**
+     * Call for interrogation requests coming from a client.
+     * @return true if the cache will answer (start a replay with cursor), false if request must go to bus.
+     */
+    bool interrogate(Cursor &c) {
+        if(!complete()) {
+            stats.misses++;
+            return false;
+        }
+        stats.hits++;
+        if(!c.active) {
+            c.pos = 0;
+            c.active = true;
+        }
+        return true;
+    }
+
+    /// Produces next cached state message for replay. @return false when replay is finished.
+    bool next(Cursor &c, LnMsg &out) {
+        if(!c.active) return false;
+        while(c.pos < TOTAL) {
+            uint16_t p = c.pos;
+            // skip empty bytes of "known" bits quickly
+            if( (p&7)==0 && knownByte(p)==0 ) { c.pos += 8; continue; }
+            c.pos++;
+            if(getBit(KNOWN, p)) {
+                makeMessage(p, out);
+                stats.served++;
+                return true;
+            }
+        }
+        c.active = false;
+        return false;
+    }
+
+    LN_STATUS onMessage(const lnMsg& msg) override {
+        switch(msg.data[0]) {
+            case OPC_INPUT_REP: {
+                uint16_t a0 = ( (msg.data[1] | (msg.data[2]&0x0F)<<7) << 1 ) | ( (msg.data[2] & 0x20)>>5 );
+                set(SENSOR + a0, (msg.data[2] & 0x10)!=0 );
+                stats.updates++;
+                break;
+            }
+            case OPC_SW_REP: {
+                uint16_t a0 = swAddr(msg.data[1], msg.data[2]) - 1;
+                uint8_t sn2 = msg.data[2];
+                if(sn2 & 0x40) { // input level report
+                    set( ((sn2 & 0x10) ? SW_INPUT : AUX_INPUT) + a0, (sn2 & 0x20)!=0 );
+                } else if(sn2 & 0x30) { // output report, closed or thrown output is on
+                    set( SW_OUTPUT + a0, (sn2 & 0x10)!=0 );
+                }
+                stats.updates++;
+                break;
+            }
+            case OPC_SW_REQ: {
+                uint16_t addr = swAddr(msg.data[1], msg.data[2]);
+                if(isInterrogateAddr(addr)) {
+                    interrogated = true;
+                    lastInterrogation = millis();
+                } else if(msg.data[2] & 0x10) { // output on
+                    set( SW_OUTPUT + addr-1, (msg.data[2] & 0x20)==0 );
+                }
+                break;
+            }
+            default: break;
+        }
+        return LN_DONE;
+    }
+
+    const Stats& getStats() const { return stats; }
+
+private:
+
+    /// Bit positions of cached items. Sensors and switches are 0-based here.
+    enum: uint16_t {
+        SENSOR = 0,
+        SW_OUTPUT = SENSOR + MAX_SENSORS,  ///< value bit is "thrown"
+        AUX_INPUT = SW_OUTPUT + MAX_SWITCHES,
+        SW_INPUT = AUX_INPUT + MAX_SWITCHES,
+        TOTAL = SW_INPUT + MAX_SWITCHES
+    };
+    enum Plane { KNOWN=0, VALUE=1 };
+
+    uint8_t bits[2][TOTAL/8];
+
+    bool interrogated;
+    uint32_t lastInterrogation = 0;
+
+    Stats stats = {};
+
+    static uint16_t swAddr(uint8_t sw1, uint8_t sw2) { return (sw1 | (sw2 & 0x0F)<<7) + 1; }
+
+    bool getBit(Plane pl, uint16_t p) const { return (bits[pl][p>>3] & (1<<(p&7)))!=0; }
+    uint8_t knownByte(uint16_t p) const { return bits[KNOWN][p>>3]; }
+
+    void set(uint16_t p, bool v) {
+        if(p>=TOTAL) return;
+        bits[KNOWN][p>>3] |= 1<<(p&7);
+        if(v) bits[VALUE][p>>3] |= 1<<(p&7);
+        else  bits[VALUE][p>>3] &= ~(1<<(p&7));
+    }
+
+    void makeMessage(uint16_t p, LnMsg &out) {
+        bool v = getBit(VALUE, p);
+        if(p < SW_OUTPUT) {
+            uint16_t a0 = p - SENSOR;
+            out.data[0] = OPC_INPUT_REP;
+            out.data[1] = (a0>>1) & 0x7F;
+            out.data[2] = 0x40 | ((a0>>8) & 0x0F) | ((a0&1) ? 0x20 : 0) | (v ? 0x10 : 0);
+        } else {
+            uint16_t a0;
+            uint8_t flags;
+            if(p < AUX_INPUT)     { a0 = p - SW_OUTPUT; flags = v ? 0x10 : 0x20; }
+            else if(p < SW_INPUT) { a0 = p - AUX_INPUT; flags = 0x40 | (v ? 0x20 : 0); }
+            else                  { a0 = p - SW_INPUT;  flags = 0x40 | 0x10 | (v ? 0x20 : 0); }
+            out.data[0] = OPC_SW_REP;
+            out.data[1] = a0 & 0x7F;
+            out.data[2] = ((a0>>7) & 0x0F) | flags;
+        }
+        writeChecksum(out);
+    }
+
+};
@@ -0,0 +1,292 @@
+#include "LocoRoster.h"
+
+#include <Arduino.h>
+#include <strings.h>
+
+static const char MAGIC[4] = {'L','R','S','T'};
+
+/// One loco of the image being written; strings point into the old image or into pending edits.
+struct RosterSource {
+    uint16_t key;
+    uint8_t speedSteps;
+    uint8_t labelCount;
+    uint8_t labelsLen;
+    const char *name;
+    const char *labels;
+};
+
+uint32_t LocoRoster::checksum(const uint8_t *buf, size_t len) {
+    uint32_t h = 2166136261u; // FNV-1a
+    while(len--) {
+        h ^= *buf++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+uint8_t LocoRoster::copyText(char *d, const char *s, uint8_t max) {
+    uint8_t n = 0;
+    for(; s!=nullptr && *s!=0 && n<max; s++) {
+        char c = *s;
+        // delimiters of WiThrottle lists: ]\[ }|{ <;>
+        if(c<' ' || strchr("[]{}|\\<>;", c)!=nullptr) c = '_';
+        d[n++] = c;
+    }
+    d[n] = 0;
+    return n;
+}
+
+const uint8_t* LocoRoster::validImage(uint8_t bank) const {
+    size_t bs = bankSize();
+    const uint8_t *p = storage->data() + bank*bs;
+    const Header *h = (const Header*)p;
+    if(memcmp(h->magic, MAGIC, sizeof(MAGIC))!=0) return nullptr;
+    if(h->count > MAX_LOCOS || h->size > bs) return nullptr;
+    size_t strings = sizeof(Header) + h->count*(sizeof(Entry)+sizeof(uint16_t));
+    if(h->size < strings) return nullptr;
+    if(checksum(p+sizeof(Header), h->size-sizeof(Header)) != h->checksum) return nullptr;
+    // a matching checksum with bad offsets would still be fatal, check them once here
+    const Entry *e = (const Entry*)(p+sizeof(Header));
+    const uint16_t *idx = (const uint16_t*)(p+sizeof(Header)+h->count*sizeof(Entry));
+    for(uint16_t i=0; i<h->count; i++) {
+        if(e[i].nameOff<strings || e[i].nameOff>=h->size || e[i].labelsOff<strings || e[i].labelsOff>h->size) return nullptr;
+        if(idx[i]>=h->count) return nullptr;
+    }
+    if(h->size>strings && p[h->size-1]!=0) return nullptr;
+    return p;
+}
+
+bool LocoRoster::begin(RosterStorage *st) {
+    storage = st;
+    image = nullptr;
+    pendingCount = 0;
+    if(storage==nullptr || storage->data()==nullptr || bankSize()==0) return false;
+    for(uint8_t b=0; b<2; b++) {
+        const uint8_t *p = validImage(b);
+        if(p==nullptr) continue;
+        if(image==nullptr || ((const Header*)p)->generation > header()->generation) {
+            image = p;
+            activeBank = b;
+        }
+    }
+    if(image==nullptr) {
+        LR_LOGI("No roster image");
+        return false;
+    }
+    LR_LOGI("Roster generation %u, %d locos", (unsigned)generation(), size());
+    return true;
+}
+
+void LocoRoster::toLoco(const Entry &e, Loco &out) const {
+    out.addr = keyAddr(e.key);
+    out.speedSteps = e.speedSteps;
+    out.name = (const char*)image + e.nameOff;
+    out.labelCount = e.labelCount;
+    out.labels = (const char*)image + e.labelsOff;
+}
+
+bool LocoRoster::at(uint16_t i, Loco &out) const {
+    if(i>=size()) return false;
+    toLoco(entries()[i], out);
+    return true;
+}
+
+bool LocoRoster::atByName(uint16_t i, Loco &out) const {
+    if(i>=size()) return false;
+    toLoco(entries()[nameIndex()[i]], out);
+    return true;
+}
+
+bool LocoRoster::find(LocoAddress addr, Loco &out) const {
+    stats.lookups++;
+    uint16_t key = addrKey(addr);
+    const Entry *e = entries();
+    int lo = 0, hi = (int)size()-1;
+    while(lo<=hi) {
+        int mid = (lo+hi)/2;
+        if(e[mid].key==key) {
+            toLoco(e[mid], out);
+            return true;
+        }
+        if(e[mid].key<key) lo = mid+1; else hi = mid-1;
+    }
+    return false;
+}
+
+bool LocoRoster::findByName(const char *name, Loco &out) const {
+    stats.lookups++;
+    const Entry *e = entries();
+    const uint16_t *idx = nameIndex();
+    int lo = 0, hi = (int)size()-1;
+    while(lo<=hi) {
+        int mid = (lo+hi)/2;
+        int c = strcasecmp((const char*)image + e[idx[mid]].nameOff, name);
+        if(c==0) {
+            toLoco(e[idx[mid]], out);
+            return true;
+        }
+        if(c<0) lo = mid+1; else hi = mid-1;
+    }
+    return false;
+}
+
+LocoRoster::Pending* LocoRoster::findPending(LocoAddress addr) {
+    for(uint8_t i=0; i<pendingCount; i++)
+        if(addrKey(pending[i].addr)==addrKey(addr)) return &pending[i];
+    return nullptr;
+}
+
+LocoRoster::Pending* LocoRoster::newPending(LocoAddress addr) {
+    if(pendingCount==MAX_PENDING) return nullptr;
+    Pending *p = &pending[pendingCount++];
+    p->addr = addr;
+    return p;
+}
+
+uint8_t LocoRoster::pendingAdds() const {
+    uint8_t n = 0;
+    Loco l;
+    for(uint8_t i=0; i<pendingCount; i++)
+        if(!pending[i].removed && !find(pending[i].addr, l)) n++;
+    return n;
+}
+
+bool LocoRoster::put(LocoAddress addr, const char *name, uint8_t speedSteps, const char * const *labels, uint8_t labelCount) {
+    if(!addr.isValid() || addr.addr()>(addr.isLong() ? 10239 : 127) || name==nullptr
+        || (speedSteps!=14 && speedSteps!=28 && speedSteps!=128) || labelCount>MAX_FUNCTIONS) {
+        stats.rejectedEdits++;
+        return false;
+    }
+    size_t need = 0;
+    for(uint8_t i=0; i<labelCount; i++) need += (labels!=nullptr && labels[i]!=nullptr ? strlen(labels[i]) : 0) + 1;
+    if(need > LABELS_MAX) { stats.rejectedEdits++; return false; }
+
+    Pending *p = findPending(addr);
+    if(p==nullptr) {
+        Loco l;
+        if(!find(addr, l) && size()+pendingAdds() >= MAX_LOCOS) { stats.rejectedEdits++; return false; }
+        p = newPending(addr);
+        if(p==nullptr) { stats.rejectedEdits++; return false; }
+    }
+    uint16_t len = 0;
+    for(uint8_t i=0; i<labelCount; i++)
+        len += copyText(p->labels+len, labels!=nullptr ? labels[i] : nullptr, LABELS_MAX-1-len) + 1;
+    p->removed = false;
+    p->speedSteps = speedSteps;
+    p->labelCount = labelCount;
+    p->labelsLen = len;
+    copyText(p->name, name, NAME_MAX);
+    editTime = millis();
+    return true;
+}
+
+bool LocoRoster::remove(LocoAddress addr) {
+    Loco l;
+    bool inImage = find(addr, l);
+    Pending *p = findPending(addr);
+    if(p==nullptr) {
+        if(!inImage) return false;
+        p = newPending(addr);
+        if(p==nullptr) { stats.rejectedEdits++; return false; }
+    }
+    p->removed = true;
+    editTime = millis();
+    return true;
+}
+
+void LocoRoster::loop() {
+    if(pendingCount==0) return;
+    if(pendingCount<MAX_PENDING && millis()-editTime < REBUILD_DELAY_MS) return;
+    if(!rebuild()) editTime = millis(); // retry later
+}
+
+bool LocoRoster::rebuild() {
+    if(pendingCount==0) return true;
+    if(storage==nullptr || bankSize()==0) { stats.rebuildFailures++; return false; }
+
+    RosterSource *src = (RosterSource*)malloc((MAX_LOCOS+MAX_PENDING)*sizeof(RosterSource));
+    if(src==nullptr) { stats.rebuildFailures++; return false; }
+
+    // merge image and pending edits, in address order
+    uint16_t n = 0;
+    for(uint16_t i=0; i<size(); i++) {
+        const Entry &e = entries()[i];
+        if(findPending(keyAddr(e.key))!=nullptr) continue;
+        const char *labels = (const char*)image + e.labelsOff;
+        const char *l = labels;
+        for(uint8_t f=0; f<e.labelCount; f++) l += strlen(l)+1;
+        src[n++] = RosterSource{e.key, e.speedSteps, e.labelCount, (uint8_t)(l-labels), (const char*)image + e.nameOff, labels};
+    }
+    for(uint8_t i=0; i<pendingCount; i++) {
+        const Pending &p = pending[i];
+        if(p.removed) continue;
+        RosterSource s{addrKey(p.addr), p.speedSteps, p.labelCount, p.labelsLen, p.name, p.labels};
+        uint16_t j = n++;
+        for(; j>0 && src[j-1].key>s.key; j--) src[j] = src[j-1];
+        src[j] = s;
+    }
+    if(n>MAX_LOCOS) n = MAX_LOCOS; // can't happen, put() checks
+
+    size_t strings = sizeof(Header) + n*(sizeof(Entry)+sizeof(uint16_t));
+    size_t total = strings;
+    for(uint16_t i=0; i<n; i++) total += strlen(src[i].name)+1 + src[i].labelsLen;
+    uint8_t *buf = total<=bankSize() ? (uint8_t*)malloc(total) : nullptr;
+    if(buf==nullptr) {
+        LR_LOGI("Can't build roster image of %d bytes", (int)total);
+        free(src);
+        stats.rebuildFailures++;
+        return false;
+    }
+
+    Header *h = (Header*)buf;
+    Entry *e = (Entry*)(buf+sizeof(Header));
+    uint16_t *idx = (uint16_t*)(buf+sizeof(Header)+n*sizeof(Entry));
+    size_t pos = strings;
+    for(uint16_t i=0; i<n; i++) {
+        const RosterSource &s = src[i];
+        e[i].key = s.key;
+        e[i].speedSteps = s.speedSteps;
+        e[i].labelCount = s.labelCount;
+        e[i].nameOff = pos;
+        size_t ln = strlen(s.name)+1;
+        memcpy(buf+pos, s.name, ln);
+        pos += ln;
+        e[i].labelsOff = pos;
+        memcpy(buf+pos, s.labels, s.labelsLen);
+        pos += s.labelsLen;
+
+        uint16_t j = i;
+        for(; j>0 && strcasecmp(src[idx[j-1]].name, s.name)>0; j--) idx[j] = idx[j-1];
+        idx[j] = i;
+    }
+    free(src);
+
+    memcpy(h->magic, MAGIC, sizeof(MAGIC));
+    h->generation = generation()+1;
+    h->count = n;
+    h->reserved = 0xFFFF;
+    h->size = total;
+    h->checksum = checksum(buf+sizeof(Header), total-sizeof(Header));
+
+    // header goes last, an interrupted write leaves the bank without magic
+    uint8_t bank = image==nullptr ? 0 : 1-activeBank;
+    size_t off = bank*bankSize();
+    size_t eraseLen = (total + RosterStorage::ERASE_SIZE-1) / RosterStorage::ERASE_SIZE * RosterStorage::ERASE_SIZE;
+    bool ok = storage->erase(off, eraseLen)
+        && storage->write(off+sizeof(Header), buf+sizeof(Header), total-sizeof(Header))
+        && storage->write(off, buf, sizeof(Header));
+    free(buf);
+
+    const uint8_t *p = ok ? validImage(bank) : nullptr;
+    if(p==nullptr) {
+        LR_LOGI("Roster write to bank %d failed", bank);
+        stats.rebuildFailures++;
+        return false;
+    }
+    image = p;
+    activeBank = bank;
+    pendingCount = 0;
+    stats.rebuilds++;
+    LR_LOGI("Roster generation %u written, %d locos, %d bytes", (unsigned)generation(), n, (int)total);
+    return true;
+}
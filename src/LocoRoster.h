@@ -0,0 +1,264 @@
+#pragma once
+/**
+ * Loco roster: name, speed steps and function labels of known locos, kept in flash.
+ *
+ * The roster is a read-only image that is used in place through a memory mapping and never copied to RAM.
+ * Image layout (little-endian):
+ *  - header: "LRST", generation, entry count, image size, checksum over the rest of the image
+ *  - entries sorted by address (short addresses first), fixed size
+ *  - name index: entry numbers sorted by name (case-insensitive)
+ *  - strings: NUL-terminated names and function labels
+ *
+ * Storage is split into two banks. Edits are collected in RAM and loop() writes a new image,
+ * with the next generation, into the bank not in use. The valid image with higher generation is used.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <LocoAddress.h>
+
+
+#define LR_DEBUG
+
+#ifdef LR_DEBUG
+#include <Arduino.h>
+#define LR_LOGI(format, ...)  log_printf(ARDUHAL_LOG_FORMAT(I, format), ##__VA_ARGS__)
+#else
+#define LR_LOGI(...)
+#endif
+
+
+/// Flash area that can be read through a pointer.
+class RosterStorage {
+public:
+    virtual size_t size() const = 0;
+    /// Whole storage, read-only; reflects writes.
+    virtual const uint8_t* data() const = 0;
+    /// pos and len are multiples of ERASE_SIZE
+    virtual bool erase(size_t pos, size_t len) = 0;
+    virtual bool write(size_t pos, const uint8_t *buf, size_t len) = 0;
+
+    static const size_t ERASE_SIZE = 4096;
+};
+
+#ifdef ESP32
+
+#include <esp_partition.h>
+
+/// Roster storage in a data partition (see partitions.csv), mapped into data address space.
+class PartitionRosterStorage: public RosterStorage {
+public:
+    /// Partition subtype used for the roster, in the custom range 0x40-0xFE.
+    static const uint8_t SUBTYPE = 0x40;
+
+    PartitionRosterStorage(const char *label="roster"): label(label) {}
+
+    bool begin() {
+        part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)SUBTYPE, label);
+        if(part==nullptr) return false;
+        const void *p;
+        if(esp_partition_mmap(part, 0, part->size, SPI_FLASH_MMAP_DATA, &p, &mapHandle)!=ESP_OK) return false;
+        mapped = (const uint8_t*)p;
+        return true;
+    }
+
+    size_t size() const override { return part!=nullptr ? part->size : 0; }
+    const uint8_t* data() const override { return mapped; }
+    bool erase(size_t pos, size_t len) override { return esp_partition_erase_range(part, pos, len)==ESP_OK; }
+    bool write(size_t pos, const uint8_t *buf, size_t len) override { return esp_partition_write(part, pos, buf, len)==ESP_OK; }
+
+private:
+    const char *label;
+    const esp_partition_t *part = nullptr;
+    const uint8_t *mapped = nullptr;
+    spi_flash_mmap_handle_t mapHandle;
+};
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/// File-backed stand-in for host builds, mirrored in RAM so it can be read through a pointer.
+class FileRosterStorage: public RosterStorage {
+public:
+    FileRosterStorage(const char *path, size_t size): _size(size) {
+        buf = (uint8_t*)malloc(size);
+        memset(buf, 0xFF, size);
+        f = fopen(path, "r+b");
+        if(f!=nullptr) {
+            if(fread(buf, 1, size, f)!=size) {}
+        } else {
+            f = fopen(path, "w+b");
+            if(f!=nullptr) fwrite(buf, 1, size, f);
+        }
+    }
+    ~FileRosterStorage() { if(f!=nullptr) fclose(f); free(buf); }
+    size_t size() const override { return _size; }
+    const uint8_t* data() const override { return buf; }
+    bool erase(size_t pos, size_t len) override {
+        memset(buf+pos, 0xFF, len);
+        return sync(pos, len);
+    }
+    bool write(size_t pos, const uint8_t *data, size_t len) override {
+        for(size_t i=0; i<len; i++) buf[pos+i] &= data[i]; // like NOR flash
+        return sync(pos, len);
+    }
+private:
+    FILE *f;
+    uint8_t *buf;
+    size_t _size;
+    bool sync(size_t pos, size_t len) {
+        if(f==nullptr) return false;
+        fseek(f, pos, SEEK_SET);
+        return fwrite(buf+pos, 1, len, f)==len && fflush(f)==0;
+    }
+};
+
+#endif
+
+
+class LocoRoster {
+public:
+
+    static const uint16_t MAX_LOCOS = 64;
+    static const uint8_t NAME_MAX = 20;
+    /// All function labels of one loco, with their terminating NULs.
+    static const uint8_t LABELS_MAX = 128;
+    static const uint8_t MAX_FUNCTIONS = 29;
+    /// Edits waiting for the next image write.
+    static const uint8_t MAX_PENDING = 4;
+    /// Delay between an edit and writing the image, so a series of edits makes one image.
+    static const uint32_t REBUILD_DELAY_MS = 2000;
+
+    /// Roster entry; strings point into the mapped image.
+    struct Loco {
+        LocoAddress addr;
+        uint8_t speedSteps;     ///< 14, 28 or 128
+        const char *name;
+        uint8_t labelCount;
+        const char *labels;     ///< labelCount NUL-terminated strings, one after another
+
+        /// Label of function fn, or nullptr.
+        const char* label(uint8_t fn) const {
+            if(fn>=labelCount) return nullptr;
+            const char *l = labels;
+            while(fn--) l += strlen(l)+1;
+            return l;
+        }
+    };
+
+    struct Stats {
+        uint32_t lookups;
+        uint32_t rebuilds;
+        uint32_t rebuildFailures;
+        uint32_t rejectedEdits;  ///< roster or pending edits full, or invalid data
+    };
+
+    LocoRoster(): storage(nullptr) {}
+
+    /// Finds the newest valid image in storage. @return false if there is none (roster is empty then).
+    bool begin(RosterStorage *st);
+
+    uint16_t size() const { return image!=nullptr ? header()->count : 0; }
+
+    /// Changes every time a new image is written; 0 while there is none.
+    uint32_t generation() const { return image!=nullptr ? header()->generation : 0; }
+
+    /// i-th entry in address order.
+    bool at(uint16_t i, Loco &out) const;
+    /// i-th entry in name order.
+    bool atByName(uint16_t i, Loco &out) const;
+
+    /// Binary search by address.
+    bool find(LocoAddress addr, Loco &out) const;
+    /// Binary search by name, case-insensitive.
+    bool findByName(const char *name, Loco &out) const;
+
+    /// Speed steps of a roster loco, or 128 if it is not in roster.
+    uint8_t speedSteps(LocoAddress addr) const {
+        Loco l;
+        return find(addr, l) ? l.speedSteps : 128;
+    }
+
+    /**
+     * Adds or replaces a loco. Written to flash later by loop(); until then lookups return old data.
+     * Characters that have a meaning in WiThrottle lists are replaced in name and labels.
+     * @param labels labelCount labels for F0, F1...; may be nullptr.
+     */
+    bool put(LocoAddress addr, const char *name, uint8_t speedSteps, const char * const *labels=nullptr, uint8_t labelCount=0);
+    bool remove(LocoAddress addr);
+
+    bool hasPendingEdits() const { return pendingCount>0; }
+
+    /// Writes pending edits as a new image, after REBUILD_DELAY_MS or when edit list is full. Call from main loop.
+    void loop();
+
+    /// Writes pending edits now. @return false if image could not be written; edits are kept then.
+    bool rebuild();
+
+    const Stats& getStats() const { return stats; }
+
+private:
+
+    struct Header {
+        char magic[4];
+        uint32_t generation;
+        uint16_t count;
+        uint16_t reserved;
+        uint32_t size;
+        uint32_t checksum;
+    } __attribute__((packed));
+
+    struct Entry {
+        uint16_t key;       ///< see addrKey()
+        uint8_t speedSteps;
+        uint8_t labelCount;
+        uint16_t nameOff;   ///< from image start
+        uint16_t labelsOff;
+    } __attribute__((packed));
+
+    struct Pending {
+        LocoAddress addr;
+        bool removed;
+        uint8_t speedSteps;
+        uint8_t labelCount;
+        uint8_t labelsLen;
+        char name[NAME_MAX+1];
+        char labels[LABELS_MAX];
+    };
+
+    RosterStorage *storage;
+    /// mapped image, nullptr if there is none
+    const uint8_t *image = nullptr;
+    uint8_t activeBank = 0;
+
+    Pending pending[MAX_PENDING];
+    uint8_t pendingCount = 0;
+    uint32_t editTime = 0;
+
+    mutable Stats stats = {};
+
+    const Header* header() const { return (const Header*)image; }
+    const Entry* entries() const { return (const Entry*)(image+sizeof(Header)); }
+    const uint16_t* nameIndex() const { return (const uint16_t*)(image+sizeof(Header)+size()*sizeof(Entry)); }
+
+    size_t bankSize() const { return storage->size()/2 / RosterStorage::ERASE_SIZE * RosterStorage::ERASE_SIZE; }
+
+    /// Sort key: short addresses first, then long ones.
+    static uint16_t addrKey(LocoAddress a) { return (a.isLong() ? 0x8000 : 0) | a.addr(); }
+    static LocoAddress keyAddr(uint16_t k) { return (k & 0x8000) ? LocoAddress::longAddr(k & 0x3FFF) : LocoAddress::shortAddr(k & 0x7F); }
+
+    void toLoco(const Entry &e, Loco &out) const;
+    /// @return image in given bank if it is valid.
+    const uint8_t* validImage(uint8_t bank) const;
+    Pending* findPending(LocoAddress addr);
+    Pending* newPending(LocoAddress addr);
+    /// Number of pending edits that add a loco not in the image.
+    uint8_t pendingAdds() const;
+
+    static uint32_t checksum(const uint8_t *buf, size_t len);
+    /// Copies s into d, replacing list delimiters of WiThrottle. @return length
+    static uint8_t copyText(char *d, const char *s, uint8_t max);
+};
@@ -0,0 +1,214 @@
+#pragma once
+/**
+ * Local reactions to sensor events, e.g. stop a loco when it enters a protected block, without waiting for a PC to react.
+ *
+ * Sensor messages are matched against a table indexed by sensor address right in the LocoNet receive path; matching
+ * rules are only marked there. loop() executes marked rules, so CommandStation is only used from the main loop.
+ * Rules are loaded in setup(), before bus traffic starts.
+ *
+ * Rule text, one rule per line, '#' starts a comment:
+ *   <sensor> active|inactive stop|estop <slot|short|long> <n>
+ *   <sensor> active|inactive close|throw acc <addr>
+ */
+
+#include <Arduino.h>
+#include <LocoNet.h>
+#include <atomic>
+#include <string.h>
+#include <etl/vector.h>
+
+#include "CommandStation.h"
+
+
+class ReflexRules: public LocoNetConsumer {
+public:
+
+    enum class Action: uint8_t {
+        STOP,       ///< set speed to 0
+        ESTOP,      ///< emergency stop
+        CLOSE,      ///< close accessory
+        THROW       ///< throw accessory
+    };
+
+    enum class Target: uint8_t {
+        SLOT, SHORT_ADDR, LONG_ADDR, ACCESSORY
+    };
+
+    struct Rule {
+        uint16_t sensor;     ///< 1-based sensor address
+        bool onActive;       ///< fire when sensor goes active (true) or inactive (false)
+        Action action;
+        Target target;
+        uint16_t targetAddr; ///< slot number, loco address or accessory address depending on target
+    };
+
+    struct Stats {
+        uint32_t events;         ///< sensor events checked
+        uint32_t fired;          ///< rules executed
+        uint32_t coalesced;      ///< rule matched again before loop() executed it
+        uint32_t lastReactionUs; ///< from sensor message to DCC packet loaded
+        uint32_t maxReactionUs;
+    };
+
+    static const uint16_t MAX_SENSORS = 4096;
+    static const uint8_t MAX_RULES = 32;
+
+    ReflexRules(LocoNetBus * const bus) {
+        memset(hasRule, 0, sizeof(hasRule));
+        bus->addConsumer(this);
+    }
+
+    /// Adds rule, keeping the table sorted by sensor address.
+    bool addRule(const Rule &r) {
+        if(rules.full() || r.sensor<1 || r.sensor>MAX_SENSORS) return false;
+        auto it = rules.begin();
+        while(it!=rules.end() && it->sensor <= r.sensor) ++it;
+        rules.insert(it, r);
+        uint16_t i = r.sensor-1;
+        hasRule[i>>3] |= 1<<(i&7);
+        return true;
+    }
+
+    void clear() {
+        rules.clear();
+        memset(hasRule, 0, sizeof(hasRule));
+        for(auto &p: pending) p.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * Replaces rules with ones parsed from text, see file comment.
+     * @return number of rules, or -(line number) of first bad line; no rules are kept then.
+     */
+    int load(const char *text) {
+        clear();
+        int lineNo = 0;
+        while(text!=nullptr && *text!=0) {
+            lineNo++;
+            const char *eol = strchr(text, '\n');
+            size_t len = eol!=nullptr ? eol-text : strlen(text);
+            char line[80];
+            if(len>=sizeof(line)) len = sizeof(line)-1;
+            memcpy(line, text, len);
+            line[len] = 0;
+            text = eol!=nullptr ? eol+1 : nullptr;
+
+            char *hash = strchr(line, '#');
+            if(hash!=nullptr) *hash = 0;
+            Rule r;
+            if(!parseRule(line, r)) {
+                char *p = line;
+                while(*p==' ' || *p=='\t' || *p=='\r') p++;
+                if(*p==0) continue;
+                clear();
+                return -lineNo;
+            }
+            if(!addRule(r)) { clear(); return -lineNo; }
+        }
+        return rules.size();
+    }
+
+    /// Matches sensor messages; any task. Nothing is executed here, see loop().
+    LN_STATUS onMessage(const lnMsg& msg) override {
+        if(msg.data[0] != OPC_INPUT_REP) return LN_DONE;
+        uint32_t t0 = micros() | 1;
+        uint16_t i = ( (msg.data[1] | (msg.data[2]&0x0F)<<7) << 1 ) | ( (msg.data[2] & 0x20)>>5 );
+        events.fetch_add(1, std::memory_order_relaxed);
+        if( (hasRule[i>>3] & (1<<(i&7))) == 0 ) return LN_DONE;
+
+        bool active = (msg.data[2] & 0x10) != 0;
+        uint16_t sensor = i+1;
+        // binary search for first rule of this sensor
+        uint8_t lo = 0, hi = rules.size();
+        while(lo<hi) {
+            uint8_t mid = (lo+hi)/2;
+            if(rules[mid].sensor < sensor) lo = mid+1; else hi = mid;
+        }
+        bool marked = false;
+        for(; lo<rules.size() && rules[lo].sensor==sensor; lo++) {
+            if(rules[lo].onActive != active) continue;
+            // keeps time of the first event until loop() gets to it
+            uint32_t none = 0;
+            if(!pending[lo].compare_exchange_strong(none, t0, std::memory_order_release)) coalesced++;
+            marked = true;
+        }
+        if(marked) anyPending.store(true, std::memory_order_release);
+        return LN_DONE;
+    }
+
+    /// Executes rules marked by onMessage. Call from main loop.
+    void loop() {
+        if(!anyPending.exchange(false, std::memory_order_acquire)) return;
+        for(uint8_t i=0; i<rules.size(); i++) {
+            uint32_t t0 = pending[i].exchange(0, std::memory_order_acquire);
+            if(t0==0) continue;
+            fire(rules[i]);
+            stats.lastReactionUs = micros()-t0;
+            if(stats.lastReactionUs > stats.maxReactionUs) stats.maxReactionUs = stats.lastReactionUs;
+        }
+    }
+
+    Stats getStats() const {
+        Stats s = stats;
+        s.events = events.load(std::memory_order_relaxed);
+        s.coalesced = coalesced.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+
+    etl::vector<Rule, MAX_RULES> rules;
+    uint8_t hasRule[MAX_SENSORS/8];
+    /// micros() of the sensor message that matched rule i, 0 if not matched since last loop()
+    std::atomic<uint32_t> pending[MAX_RULES] = {};
+    std::atomic<bool> anyPending{false};
+    std::atomic<uint32_t> events{0};
+    std::atomic<uint32_t> coalesced{0};
+    /// loop() only
+    Stats stats = {};
+
+    static bool parseRule(const char *line, Rule &r) {
+        unsigned sensor, addr;
+        char ev[10], act[10], tgt[10];
+        if(sscanf(line, "%u %9s %9s %9s %u", &sensor, ev, act, tgt, &addr)!=5) return false;
+        if(strcmp(ev, "active")==0) r.onActive = true; else
+        if(strcmp(ev, "inactive")==0) r.onActive = false; else return false;
+        if(strcmp(act, "stop")==0) r.action = Action::STOP; else
+        if(strcmp(act, "estop")==0) r.action = Action::ESTOP; else
+        if(strcmp(act, "close")==0) r.action = Action::CLOSE; else
+        if(strcmp(act, "throw")==0) r.action = Action::THROW; else return false;
+        if(strcmp(tgt, "slot")==0) r.target = Target::SLOT; else
+        if(strcmp(tgt, "short")==0) r.target = Target::SHORT_ADDR; else
+        if(strcmp(tgt, "long")==0) r.target = Target::LONG_ADDR; else
+        if(strcmp(tgt, "acc")==0) r.target = Target::ACCESSORY; else return false;
+        // accessory actions only for accessories, and the other way round
+        if( (r.target==Target::ACCESSORY) != (r.action==Action::CLOSE || r.action==Action::THROW) ) return false;
+        if(sensor>MAX_SENSORS || addr>0xFFFF) return false;
+        r.sensor = sensor;
+        r.targetAddr = addr;
+        return true;
+    }
+
+    void fire(const Rule &r) {
+        stats.fired++;
+        if(r.target == Target::ACCESSORY) {
+            CS.turnoutAction(r.targetAddr, true, r.action==Action::THROW ? TurnoutState::THROWN : TurnoutState::CLOSED);
+            return;
+        }
+        uint8_t slot = 0;
+        switch(r.target) {
+            case Target::SLOT:
+                if(r.targetAddr>=1 && r.targetAddr<=CommandStation::MAX_SLOTS && CS.isSlotAllocated(r.targetAddr)) slot = r.targetAddr;
+                break;
+            case Target::SHORT_ADDR: slot = CS.findLocoSlot(LocoAddress::shortAddr(r.targetAddr)); break;
+            case Target::LONG_ADDR: slot = CS.findLocoSlot(LocoAddress::longAddr(r.targetAddr)); break;
+            case Target::ACCESSORY: break;
+        }
+        if(slot==0) return;
+        switch(r.action) {
+            case Action::STOP: CS.setLocoSpeed(slot, 0); break;
+            case Action::ESTOP: CS.setLocoSpeed(slot, 1); break;
+            default: break;
+        }
+    }
+
+};
@@ -0,0 +1,126 @@
+#pragma once
+/**
+ * Hierarchical timer wheel for a fixed set of timers identified by index 0..N-1.
+ * Scheduling and cancelling is O(1); loop() does work only when a tick has passed,
+ * and then only for timers in the current bucket, regardless of how many timers are pending.
+ *
+ * Two levels of 64 buckets: with 100ms tick, level 0 covers 6.4s and level 1 covers 409.6s.
+ * Longer timeouts are parked in the farthest bucket and re-evaluated when it cascades.
+ */
+
+#include <stdint.h>
+
+template<uint8_t N, uint16_t TICK_MS=100>
+class TimerWheel {
+public:
+
+    typedef void (*Callback)(void *ctx, uint8_t id);
+
+    static const uint8_t BUCKETS = 64;
+    static const uint8_t NONE = 0xFF;
+
+    static_assert(N < NONE, "too many timers");
+
+    TimerWheel(Callback cb, void *ctx): cb(cb), ctx(ctx) {
+        for(uint8_t l=0; l<LEVELS; l++)
+            for(uint8_t b=0; b<BUCKETS; b++) head[l][b] = NONE;
+        for(uint8_t i=0; i<N; i++) bucket[i] = NONE;
+    }
+
+    /**
+     * (Re)starts timer id to fire after delayMs from nowMs. Ticks that have passed since the last loop()
+     * (wheel idle, or loop() held up) are counted in, so the timer does not fire early when loop() catches up.
+     */
+    void schedule(uint8_t id, uint32_t delayMs, uint32_t nowMs) {
+        if(id>=N) return;
+        unlink(id);
+        uint32_t behind = (nowMs - lastMs) / TICK_MS;
+        // +1 because current tick has partially passed already; timers never fire early
+        expire[id] = curTick + behind + (delayMs + TICK_MS-1) / TICK_MS + 1;
+        insert(id);
+    }
+
+    void cancel(uint8_t id) {
+        if(id<N) unlink(id);
+    }
+
+    bool pending(uint8_t id) const { return id<N && bucket[id]!=NONE; }
+
+    /// Advances wheel to current time, firing expired timers.
+    void loop(uint32_t nowMs) {
+        while(nowMs - lastMs >= TICK_MS) {
+            lastMs += TICK_MS;
+            tick();
+        }
+    }
+
+private:
+
+    static const uint8_t LEVELS = 2;
+
+    const Callback cb;
+    void * const ctx;
+
+    uint32_t curTick = 0;
+    uint32_t lastMs = 0;
+
+    uint32_t expire[N];
+    uint8_t next[N];
+    uint8_t prev[N];
+    /// level*BUCKETS + bucket index, or NONE if timer is not pending.
+    uint8_t bucket[N];
+    uint8_t head[LEVELS][BUCKETS];
+
+    void insert(uint8_t id) {
+        uint8_t b;
+        int32_t d = expire[id] - curTick;
+        if(d <= 0) {
+            b = curTick % BUCKETS; // overdue, fire on this tick
+        } else if(d < BUCKETS) {
+            b = expire[id] % BUCKETS;
+        } else {
+            uint32_t blocks = expire[id]/BUCKETS - curTick/BUCKETS;
+            if(blocks >= BUCKETS) blocks = BUCKETS-1;
+            b = BUCKETS + (curTick/BUCKETS + blocks) % BUCKETS;
+        }
+        uint8_t &h = head[b/BUCKETS][b%BUCKETS];
+        bucket[id] = b;
+        prev[id] = NONE;
+        next[id] = h;
+        if(h!=NONE) prev[h] = id;
+        h = id;
+    }
+
+    void unlink(uint8_t id) {
+        uint8_t b = bucket[id];
+        if(b==NONE) return;
+        if(prev[id]!=NONE) next[prev[id]] = next[id];
+        else head[b/BUCKETS][b%BUCKETS] = next[id];
+        if(next[id]!=NONE) prev[next[id]] = prev[id];
+        bucket[id] = NONE;
+    }
+
+    void tick() {
+        curTick++;
+        uint8_t i0 = curTick % BUCKETS;
+        if(i0==0) {
+            // move timers of the next level 1 bucket down to level 0 (or park them again)
+            uint8_t &h = head[1][(curTick/BUCKETS) % BUCKETS];
+            uint8_t id = h;
+            h = NONE;
+            while(id!=NONE) {
+                uint8_t nx = next[id];
+                bucket[id] = NONE;
+                insert(id);
+                id = nx;
+            }
+        }
+        uint8_t &h = head[0][i0];
+        while(h!=NONE) {
+            uint8_t id = h;
+            unlink(id);
+            cb(ctx, id); // callback may reschedule the timer
+        }
+    }
+
+};
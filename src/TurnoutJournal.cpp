@@ -0,0 +1,259 @@
+#include "TurnoutJournal.h"
+
+#include <Arduino.h>
+
+/*
+ * Record: [0] kind<<6 | epoch, [1] addr bits 0-7, [2] check<<4 | thrown<<3 | addr bits 8-10, [3] arg (id).
+ * Checkpoint header: 'T' 'J' gen_lo gen_hi count idx_lo epoch<<2|idx_hi crc8,
+ * followed by count entries of: addr_lo, thrown<<7|route<<6|addr_hi, id, 0.
+ * CRC runs over entries first, then first 7 header bytes.
+ */
+
+static const uint8_t CP_MAGIC0 = 'T';
+static const uint8_t CP_MAGIC1 = 'J';
+
+uint8_t TurnoutJournal::crc8(uint8_t crc, const uint8_t *buf, size_t len) {
+    while(len--) {
+        crc ^= *buf++;
+        for(uint8_t i=0; i<8; i++)
+            crc = (crc & 0x80) ? (crc<<1) ^ 0x31 : (crc<<1);
+    }
+    return crc;
+}
+
+uint8_t TurnoutJournal::recordCheck(const uint8_t *r) {
+    uint8_t x = r[0] ^ r[1] ^ (r[2] & 0x0F) ^ r[3];
+    return (x ^ (x>>4) ^ 0xA) & 0x0F; // 0xA makes an all-zero record invalid
+}
+
+void TurnoutJournal::packRecord(uint8_t *r, uint8_t tag, uint16_t addr, bool thrown, uint8_t arg) {
+    r[0] = tag;
+    r[1] = addr & 0xFF;
+    r[2] = ((addr>>8) & 0x07) | (thrown ? 0x08 : 0);
+    r[3] = arg;
+    r[2] |= recordCheck(r) << 4;
+}
+
+void TurnoutJournal::setStorage(JournalStorage *st) {
+    storage = st;
+    hasCheckpoint = false;
+    tornRecord = false;
+    ringRecords = 0;
+    if(storage==nullptr) return;
+    blockSize = storage->eraseSize();
+    if(blockSize!=0) {
+        // two banks and at least two ring blocks, so the block being erased is never the one replay starts in
+        size_t blocks = storage->size()/blockSize;
+        size_t n = blocks<4 ? 0 : blockSize/RECORD_SIZE;
+        if(n*(blocks-2) > 1023) n = 1023/(blocks-2); // 10 bits of index in checkpoint header
+        if(blockSize < CP_BANK_SIZE || n==0) {
+            TJ_LOGI("storage too small (%d bytes in blocks of %d)", (int)storage->size(), (int)blockSize );
+            storage = nullptr;
+            return;
+        }
+        blockRecords = n;
+        ringRecords = n*(blocks-2);
+        return;
+    }
+    if(storage->size() <= 2*CP_BANK_SIZE + RECORD_SIZE) {
+        TJ_LOGI("storage too small (%d bytes)", (int)storage->size() );
+        storage = nullptr;
+        return;
+    }
+    size_t n = (storage->size() - 2*CP_BANK_SIZE) / RECORD_SIZE;
+    ringRecords = n > 1023 ? 1023 : n; // 10 bits of index in checkpoint header
+    blockRecords = ringRecords;
+}
+
+bool TurnoutJournal::readCheckpointHeader(uint8_t bank, uint16_t &gen, uint8_t &count, uint16_t &idx, uint8_t &epoch) {
+    uint8_t h[CP_HEADER_SIZE];
+    size_t off = bankOffset(bank);
+    storage->read(off, h, CP_HEADER_SIZE);
+    if(h[0]!=CP_MAGIC0 || h[1]!=CP_MAGIC1) return false;
+    count = h[4];
+    if(count > MAX_CP_ENTRIES) return false;
+
+    uint8_t crc = 0;
+    uint8_t e[RECORD_SIZE];
+    for(uint8_t i=0; i<count; i++) {
+        storage->read(off + CP_HEADER_SIZE + i*RECORD_SIZE, e, RECORD_SIZE);
+        crc = crc8(crc, e, RECORD_SIZE);
+    }
+    if(crc8(crc, h, CP_HEADER_SIZE-1) != h[CP_HEADER_SIZE-1]) return false;
+
+    gen = h[2] | h[3]<<8;
+    idx = h[5] | (h[6]&0x03)<<8;
+    epoch = h[6]>>2;
+    return idx<ringRecords && epoch<EPOCH_COUNT;
+}
+
+bool TurnoutJournal::load(void (*apply)(void *ctx, RecordKind kind, const Entry &e), void *ctx) {
+    if(storage==nullptr) return false;
+
+    uint16_t gen[2], idx[2];
+    uint8_t count[2], epoch[2];
+    bool valid[2];
+    for(uint8_t b=0; b<2; b++)
+        valid[b] = readCheckpointHeader(b, gen[b], count[b], idx[b], epoch[b]);
+
+    if(!valid[0] && !valid[1]) {
+        TJ_LOGI("no checkpoint found");
+        hasCheckpoint = false;
+        writeIdx = startIdx = 0;
+        writeEpoch = startEpoch = 0;
+        return false;
+    }
+    uint8_t b = !valid[1] ? 0
+              : !valid[0] ? 1
+              : (int16_t)(gen[1]-gen[0]) > 0 ? 1 : 0;
+    activeBank = b;
+    generation = gen[b];
+    startIdx = idx[b];
+    startEpoch = epoch[b];
+    hasCheckpoint = true;
+
+    uint8_t r[RECORD_SIZE];
+    Entry e;
+    for(uint8_t i=0; i<count[b]; i++) {
+        storage->read(bankOffset(b) + CP_HEADER_SIZE + i*RECORD_SIZE, r, RECORD_SIZE);
+        e.addr = r[0] | (r[1]&0x07)<<8;
+        e.thrown = (r[1] & 0x80) != 0;
+        e.id = r[2];
+        apply(ctx, (r[1] & 0x40) ? RecordKind::ROUTE : RecordKind::DEFINE, e);
+    }
+
+    uint16_t i = startIdx;
+    uint8_t ep = startEpoch;
+    uint16_t replayed = 0;
+    for(; replayed<ringRecords; replayed++) {
+        storage->read(recordOffset(i), r, RECORD_SIZE);
+        uint8_t kind = r[0]>>6;
+        if( (r[0]&0x3F)!=ep || (r[2]>>4)!=recordCheck(r) ) break; // all 4 kinds are valid
+        e.addr = r[1] | (r[2]&0x07)<<8;
+        e.thrown = (r[2] & 0x08) != 0;
+        e.id = r[3];
+        apply(ctx, (RecordKind)kind, e);
+        if(++i == ringRecords) { i = 0; ep = (ep+1) % EPOCH_COUNT; }
+    }
+    writeIdx = i;
+    writeEpoch = ep;
+
+    // on flash, a record cut short by power loss can't be written over; the ring continues after it
+    // once a checkpoint has moved replay start past it. A block start is erased before use anyway.
+    tornRecord = false;
+    if(blockSize!=0 && replayed<ringRecords && writeIdx%blockRecords!=0) {
+        storage->read(recordOffset(writeIdx), r, RECORD_SIZE);
+        for(uint8_t k=0; k<RECORD_SIZE; k++) if(r[k]!=0xFF) tornRecord = true;
+        if(tornRecord && ++writeIdx == ringRecords) {
+            writeIdx = 0;
+            writeEpoch = (writeEpoch+1) % EPOCH_COUNT;
+        }
+    }
+
+    TJ_LOGI("loaded checkpoint gen %d (%d entries) from bank %d, replayed %d records", generation, count[b], b, replayed);
+    return true;
+}
+
+bool TurnoutJournal::append(RecordKind kind, uint16_t addr, uint8_t arg, bool thrown) {
+    if(storage==nullptr || !hasCheckpoint || tornRecord) return false;
+    if(ringUsed() >= ringRecords) return false; // next record would overwrite replay start
+    if(blockSize!=0 && writeIdx%blockRecords==0) {
+        // entering a block: it must not hold records that are replayed
+        if(ringUsed()>0 && startIdx/blockRecords == writeIdx/blockRecords) return false;
+        if(!eraseBlock(recordOffset(writeIdx))) return false;
+    }
+
+    uint8_t r[RECORD_SIZE];
+    packRecord(r, (uint8_t)kind<<6 | writeEpoch, addr, thrown, arg);
+    // tag byte last: a write cut short by power loss keeps the old epoch there and is not replayed
+    storage->write(recordOffset(writeIdx)+1, r+1, RECORD_SIZE-1);
+    storage->write(recordOffset(writeIdx), r, 1);
+    stats.records++;
+    stats.bytesWritten += RECORD_SIZE;
+
+    if(++writeIdx == ringRecords) {
+        writeIdx = 0;
+        writeEpoch = (writeEpoch+1) % EPOCH_COUNT;
+    }
+    markDirty();
+    return true;
+}
+
+bool TurnoutJournal::eraseBlock(size_t pos) {
+    if(!storage->erase(pos, blockSize)) {
+        TJ_LOGI("erase at %d failed", (int)pos);
+        return false;
+    }
+    stats.erases++;
+    return true;
+}
+
+void TurnoutJournal::checkpointBegin() {
+    cpCount = 0;
+    cpCrc = 0;
+    cpReady = storage!=nullptr && (blockSize==0 || eraseBlock(bankOffset(hasCheckpoint ? 1-activeBank : 0)));
+}
+
+bool TurnoutJournal::checkpointAdd(const Entry &e, RecordKind kind) {
+    if(!cpReady || cpCount>=MAX_CP_ENTRIES) return false;
+    uint8_t bank = hasCheckpoint ? 1-activeBank : 0;
+    uint8_t r[RECORD_SIZE] = {
+        (uint8_t)(e.addr & 0xFF),
+        (uint8_t)( ((e.addr>>8) & 0x07) | (e.thrown ? 0x80 : 0) | (kind==RecordKind::ROUTE ? 0x40 : 0) ),
+        e.id,
+        0 };
+    storage->write(bankOffset(bank) + CP_HEADER_SIZE + cpCount*RECORD_SIZE, r, RECORD_SIZE);
+    stats.bytesWritten += RECORD_SIZE;
+    cpCrc = crc8(cpCrc, r, RECORD_SIZE);
+    cpCount++;
+    return true;
+}
+
+bool TurnoutJournal::checkpointCommit() {
+    if(!cpReady) return false;
+    cpReady = false; // a bank on flash takes one header
+    uint8_t bank = hasCheckpoint ? 1-activeBank : 0;
+    uint16_t gen = generation+1;
+
+    uint8_t h[CP_HEADER_SIZE] = {
+        CP_MAGIC0, CP_MAGIC1,
+        (uint8_t)(gen & 0xFF), (uint8_t)(gen>>8),
+        cpCount,
+        (uint8_t)(writeIdx & 0xFF),
+        (uint8_t)( (writeIdx>>8 & 0x03) | writeEpoch<<2 ),
+        0 };
+    h[CP_HEADER_SIZE-1] = crc8(cpCrc, h, CP_HEADER_SIZE-1);
+    storage->write(bankOffset(bank), h, CP_HEADER_SIZE);
+    stats.bytesWritten += CP_HEADER_SIZE;
+
+    if(!storage->commit()) {
+        TJ_LOGI("checkpoint commit failed");
+        return false;
+    }
+    stats.commits++;
+    stats.compactions++;
+    dirty = false;
+
+    activeBank = bank;
+    generation = gen;
+    startIdx = writeIdx;
+    startEpoch = writeEpoch;
+    hasCheckpoint = true;
+    tornRecord = false;
+    TJ_LOGI("checkpoint gen %d, %d entries, bank %d", generation, cpCount, bank);
+    return true;
+}
+
+void TurnoutJournal::markDirty() {
+    if(!dirty) {
+        dirty = true;
+        dirtySince = millis();
+    }
+}
+
+void TurnoutJournal::loop() {
+    if(dirty && millis()-dirtySince >= COMMIT_DELAY_MS) {
+        dirty = false;
+        if(storage->commit()) stats.commits++;
+    }
+}
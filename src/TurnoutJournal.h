@@ -0,0 +1,260 @@
+#pragma once
+/**
+ * Append-only, wear-levelled journal of turnout roster and route changes.
+ *
+ * Storage layout: two checkpoint banks followed by a ring of 4-byte records.
+ * A checkpoint is a full snapshot of the roster and routes plus the ring position
+ * where journal replay starts. Every turnout throw or roster edit appends
+ * exactly one record, a route one record per step; when the ring fills up, a new checkpoint is written
+ * into the other bank (compaction) and the ring continues from there,
+ * so writes are spread over the whole ring.
+ *
+ * On flash (JournalStorage::eraseSize() not 0) every bank and every ring block starts an erase block.
+ * A bank is erased before a checkpoint is written into it, a ring block when the write position enters it,
+ * and a record is written only into erased bytes. A block still holding records after the replay start
+ * is never erased: the append fails and the caller writes a checkpoint first.
+ *
+ * Boot only reads: newest valid checkpoint is loaded, then records
+ * following it are replayed until the first record of a wrong epoch.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define TJ_DEBUG
+
+#ifdef TJ_DEBUG
+#include <Arduino.h>
+#define TJ_LOGI(format, ...)  log_printf(ARDUHAL_LOG_FORMAT(I, format), ##__VA_ARGS__)
+#else
+#define TJ_LOGI(...)
+#endif
+
+/// Byte-addressable non-volatile memory with explicit commit.
+class JournalStorage {
+public:
+    virtual size_t size() const = 0;
+    virtual void read(size_t pos, uint8_t *buf, size_t len) = 0;
+    /// On flash, only clears bits: bytes must be erased first.
+    virtual void write(size_t pos, const uint8_t *buf, size_t len) = 0;
+    /// Makes all writes since last commit persistent.
+    virtual bool commit() = 0;
+    /// Erase block size of flash, 0 if bytes can be rewritten in place.
+    virtual size_t eraseSize() const { return 0; }
+    /// Sets bytes to 0xFF. pos and len are multiples of eraseSize().
+    virtual bool erase(size_t pos, size_t len) { return true; }
+};
+
+#ifdef ESP32
+
+#include <esp_partition.h>
+
+/// Journal storage in a data partition (see partitions.csv). Writes go straight to flash, commit() has nothing to do.
+class PartitionJournalStorage: public JournalStorage {
+public:
+    /// Partition subtype used for the turnout journal, in the custom range 0x40-0xFE.
+    static const uint8_t SUBTYPE = 0x41;
+
+    PartitionJournalStorage(const char *label="turnouts"): label(label) {}
+
+    bool begin() {
+        part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)SUBTYPE, label);
+        return part!=nullptr;
+    }
+
+    size_t size() const override { return part!=nullptr ? part->size : 0; }
+    void read(size_t pos, uint8_t *buf, size_t len) override {
+        if(esp_partition_read(part, pos, buf, len)!=ESP_OK) memset(buf, 0xFF, len);
+    }
+    void write(size_t pos, const uint8_t *buf, size_t len) override { esp_partition_write(part, pos, buf, len); }
+    bool commit() override { return true; }
+    size_t eraseSize() const override { return SPI_FLASH_SEC_SIZE; }
+    bool erase(size_t pos, size_t len) override { return esp_partition_erase_range(part, pos, len)==ESP_OK; }
+
+private:
+    const char *label;
+    const esp_partition_t *part = nullptr;
+};
+
+#else
+
+#include <stdio.h>
+
+/**
+ * File-backed flash stand-in for host builds. Unwritten bytes read as 0xFF, like erased flash.
+ * With an erase size, writes only clear bits, like NOR flash.
+ */
+class FileJournalStorage: public JournalStorage {
+public:
+    FileJournalStorage(const char *path, size_t size, size_t eraseSize=0): _size(size), _eraseSize(eraseSize) {
+        f = fopen(path, "r+b");
+        if(f==nullptr) {
+            f = fopen(path, "w+b");
+            uint8_t ff = 0xFF;
+            for(size_t i=0; f!=nullptr && i<size; i++) fwrite(&ff, 1, 1, f);
+        }
+    }
+    ~FileJournalStorage() { if(f!=nullptr) fclose(f); }
+    size_t size() const override { return _size; }
+    void read(size_t pos, uint8_t *buf, size_t len) override {
+        if(f==nullptr) return;
+        fseek(f, pos, SEEK_SET);
+        if(fread(buf, 1, len, f) != len) memset(buf, 0xFF, len);
+    }
+    void write(size_t pos, const uint8_t *buf, size_t len) override {
+        if(f==nullptr) return;
+        for(size_t i=0; i<len; i++) {
+            uint8_t b = buf[i];
+            if(_eraseSize!=0) {
+                uint8_t old;
+                read(pos+i, &old, 1);
+                b &= old;
+            }
+            fseek(f, pos+i, SEEK_SET);
+            fwrite(&b, 1, 1, f);
+        }
+    }
+    bool commit() override { return f!=nullptr && fflush(f)==0; }
+    size_t eraseSize() const override { return _eraseSize; }
+    bool erase(size_t pos, size_t len) override {
+        if(f==nullptr) return false;
+        fseek(f, pos, SEEK_SET);
+        uint8_t ff = 0xFF;
+        for(size_t i=0; i<len; i++) fwrite(&ff, 1, 1, f);
+        return true;
+    }
+private:
+    FILE *f;
+    size_t _size;
+    size_t _eraseSize;
+};
+
+#endif
+
+
+class TurnoutJournal {
+public:
+
+    enum class RecordKind: uint8_t {
+        STATE=0, DEFINE=1, REMOVE=2,
+        ROUTE=3   ///< route step: id is routeArg(), addr 0 ends the route at this step
+    };
+
+    struct Entry {
+        uint16_t addr;
+        uint8_t id;
+        bool thrown;
+    };
+
+    /// Route id (1-16) and step number (0-15) packed into Entry::id of a ROUTE record.
+    static uint8_t routeArg(uint8_t route, uint8_t step) { return (route-1)<<4 | (step & 0x0F); }
+    static uint8_t routeOf(uint8_t arg) { return (arg>>4) + 1; }
+    static uint8_t stepOf(uint8_t arg) { return arg & 0x0F; }
+
+    struct Stats {
+        uint32_t records;       ///< journal records appended since boot
+        uint32_t bytesWritten;  ///< bytes written to storage since boot, records and checkpoints
+        uint32_t erases;        ///< erase blocks erased since boot
+        uint32_t commits;
+        uint32_t compactions;
+        uint16_t ringUsed;      ///< records in ring after current checkpoint
+        uint16_t ringSize;
+    };
+
+    static const size_t RECORD_SIZE = 4;
+    static const size_t CP_HEADER_SIZE = 8;
+    /// roster entries plus route steps
+    static const uint8_t MAX_CP_ENTRIES = 128;
+    static const size_t CP_BANK_SIZE = CP_HEADER_SIZE + MAX_CP_ENTRIES*RECORD_SIZE;
+    /// Delay between a change and its commit, so bursts of throws share one flash commit.
+    static const uint32_t COMMIT_DELAY_MS = 2000;
+
+    TurnoutJournal(): storage(nullptr) {}
+
+    void setStorage(JournalStorage *st);
+
+    /**
+     * Loads checkpoint and replays journal records.
+     * @param apply is called for every checkpoint entry (as DEFINE or ROUTE) and every replayed record.
+     * @return false if storage is missing or contains no checkpoint.
+     */
+    bool load(void (*apply)(void *ctx, RecordKind kind, const Entry &e), void *ctx);
+
+    bool appendState(uint16_t addr, bool thrown) { return append(RecordKind::STATE, addr, 0, thrown); }
+    bool appendDefine(uint16_t addr, uint8_t id, bool thrown) { return append(RecordKind::DEFINE, addr, id, thrown); }
+    bool appendRemove(uint16_t addr) { return append(RecordKind::REMOVE, addr, 0, false); }
+    /// @param addr 0 ends the route before this step
+    bool appendRouteStep(uint8_t route, uint8_t step, uint16_t addr, bool thrown) {
+        return append(RecordKind::ROUTE, addr, routeArg(route, step), thrown);
+    }
+
+    /// True when ring is filled over threshold and a checkpoint should be written.
+    bool needsCompaction() const { return storage!=nullptr && (!hasCheckpoint || tornRecord || ringUsed() >= ringRecords*3/4); }
+
+    /// Checkpoint is written as checkpointBegin(), checkpointAdd() for every roster entry and route step, checkpointCommit().
+    void checkpointBegin();
+    /// @param kind DEFINE for a roster entry, ROUTE for a route step (steps of a route in order)
+    bool checkpointAdd(const Entry &e, RecordKind kind=RecordKind::DEFINE);
+    bool checkpointCommit();
+
+    /// Performs delayed commit. Call from main loop.
+    void loop();
+
+    const Stats& getStats() { stats.ringUsed = ringUsed(); stats.ringSize = ringRecords; return stats; }
+
+private:
+    JournalStorage *storage;
+
+    uint16_t ringRecords = 0;
+    /// erase block size of storage, 0 if not flash
+    size_t blockSize = 0;
+    /// ring records in one erase block; the whole ring if not flash
+    uint16_t blockRecords = 0;
+    /// position of next record to write
+    uint16_t writeIdx = 0;
+    uint8_t writeEpoch = 0;
+    /// position where replay starts (recorded in checkpoint)
+    uint16_t startIdx = 0;
+    uint8_t startEpoch = 0;
+
+    uint8_t activeBank = 0;
+    uint16_t generation = 0;
+    bool hasCheckpoint = false;
+    /// flash only: boot found a partly written record at the write position; it is skipped and appends wait for a checkpoint
+    bool tornRecord = false;
+
+    uint8_t cpCount;
+    uint8_t cpCrc;
+    /// bank of the checkpoint in progress is erased
+    bool cpReady = false;
+
+    bool dirty = false;
+    uint32_t dirtySince = 0;
+
+    Stats stats = {};
+
+    static const uint8_t EPOCH_COUNT = 63; // epoch 63 with kind 3 would be an erased byte
+
+    size_t bankSpan() const { return blockSize!=0 ? blockSize : CP_BANK_SIZE; }
+    size_t bankOffset(uint8_t bank) const { return bank * bankSpan(); }
+    size_t recordOffset(uint16_t idx) const {
+        size_t blockSpan = blockSize!=0 ? blockSize : blockRecords*RECORD_SIZE;
+        return 2*bankSpan() + idx/blockRecords*blockSpan + idx%blockRecords*RECORD_SIZE;
+    }
+
+    uint16_t ringUsed() const {
+        return writeIdx>=startIdx && writeEpoch==startEpoch
+            ? writeIdx-startIdx
+            : ringRecords-startIdx+writeIdx;
+    }
+
+    bool append(RecordKind kind, uint16_t addr, uint8_t arg, bool thrown);
+    bool eraseBlock(size_t pos);
+    bool readCheckpointHeader(uint8_t bank, uint16_t &gen, uint8_t &count, uint16_t &idx, uint8_t &epoch);
+    void markDirty();
+
+    static uint8_t crc8(uint8_t crc, const uint8_t *buf, size_t len);
+    static uint8_t recordCheck(const uint8_t *r);
+    static void packRecord(uint8_t *r, uint8_t tag, uint16_t addr, bool thrown, uint8_t arg);
+};
@@ -1,26 +1,43 @@
 #include "WiThrottle.h"
 
 #include <etl/vector.h>
+#include <stdarg.h>
 
 /* Network parameters */
 #define TURNOUT_PREF "LT"
 #define TURNOUT_CLOSED '2'
 #define TURNOUT_THROWN '4'
+#define TURNOUT_UNKNOWN '1'
+#define ROUTE_PREF "IR"
+#define ROUTE_ACTIVE '2'
+#define ROUTE_INACTIVE '4'
     
-/*
-StringSumHelper & operator +(const StringSumHelper &lhs, const LocoAddress a) {
-    return lhs + (a.isShort() ? 'S' : 'L') +a.addr();
+#define LINE_END "\r\n"
+
+/// For "%c%d" formats
+#define ADDR_FMT(a) ((a).isShort() ? 'S' : 'L'), (a).addr()
+
+/// Like String::toInt(): leading spaces, optional sign and digits, 0 if there are none.
+static int toInt(etl::string_view s) {
+    size_t i = 0;
+    while(i<s.size() && s[i]==' ') i++;
+    bool neg = false;
+    if(i<s.size() && (s[i]=='-' || s[i]=='+')) neg = s[i++]=='-';
+    int v = 0;
+    for(; i<s.size() && s[i]>='0' && s[i]<='9'; i++) v = v*10 + (s[i]-'0');
+    return neg ? -v : v;
 }
-*/
 
-String addr2str(const LocoAddress & a) {
-    return (a.isShort() ? 'S' : 'L') + String(a.addr());
+static bool startsWith(etl::string_view s, const char *prefix) {
+    size_t n = strlen(prefix);
+    return s.size()>=n && memcmp(s.data(), prefix, n)==0;
 }
 
-LocoAddress str2addr(String addr) {
-    uint16_t iLocoAddr = addr.substring(1).toInt();
-    if (addr.charAt(0) == 'S') return LocoAddress::shortAddr(iLocoAddr);
-    if (addr.charAt(0) == 'L') return LocoAddress::longAddr(iLocoAddr);
+LocoAddress str2addr(etl::string_view addr) {
+    if(addr.empty()) return LocoAddress();
+    uint16_t iLocoAddr = toInt(addr.substr(1));
+    if (addr[0] == 'S') return LocoAddress::shortAddr(iLocoAddr);
+    if (addr[0] == 'L') return LocoAddress::longAddr(iLocoAddr);
     return LocoAddress();
 }
 
@@ -29,144 +46,250 @@ inline int invert(int value) {
 };
 
 
+void WiThrottleServer::onConnect(AsyncClient *cli) {
+    int i = 0;
+    while(i<MAX_CLIENTS && clientData[i].state.load(std::memory_order_acquire)!=FREE) i++;
+    if(i==MAX_CLIENTS) {
+        WT_LOGI("Not accepting client: %s", cli->remoteIP().toString().c_str() );
+        stats.rejected++;
+        cli->close();
+        return;
+    }
+    ClientData &cc = clientData[i];
+    cc.cli = cli;
+    cc.rxHead.store(0, std::memory_order_relaxed);
+    cc.rxTail.store(0, std::memory_order_relaxed);
+    cc.state.store(NEW, std::memory_order_release);
+    stats.connects++;
+    cli->setNoDelay(true);
+
+    cli->onDisconnect([this, i](void*, AsyncClient*) {
+        WT_LOGI("Client %d disconnected", i);
+        clientData[i].state.store(CLOSED, std::memory_order_release);
+    });
+
+    cli->onData([this, i](void*, AsyncClient*, void *data, size_t len) {
+        ClientData &cc = clientData[i];
+        uint16_t head = cc.rxHead.load(std::memory_order_relaxed);
+        uint16_t room = RX_SIZE - (uint16_t)(head - cc.rxTail.load(std::memory_order_acquire));
+        if(len>room) {
+            stats.rxDropped += len-room;
+            len = room;
+        }
+        for(size_t k=0; k<len; k++) cc.rx[(head+k) & (RX_SIZE-1)] = ((const char*)data)[k];
+        cc.rxHead.store(head+len, std::memory_order_release);
+    });
+
+    cli->onTimeout([](void*, AsyncClient* cli, uint32_t) {
+        cli->close();
+    });
+}
+
 void WiThrottleServer::loop() {
     
     for (int iClient=0; iClient<MAX_CLIENTS; iClient++) {
-        WiFiClient& cli = clients[iClient];
         ClientData& cc = clientData[iClient];
-        if (!cli) {
-            if(cc.connected) clientStop(iClient);
-            cli = server.available();
-            if(cli) { clientStart(iClient); }
-        } 
-        if (cli) { // connected client
-            size_t a = cli.available();
-            while(a-->0) { 
-                /*uint32_t t0 = millis();
-                String dataStr = cli.readStringUntil('\n'); 
-                WT_LOGI("Read new cmd(%d b), took %d ms", dataStr.length(), millis()-t0);
-                */
-                int c = cli.read();
-                if(c==-1) continue;
-                //if(c>=32) WT_LOGI("read char '%c'", c); else WT_LOGI("read char #%d", c);
-                if(c=='\n') {
-                    cc.cmdline[cc.cmdpos] = 0;
-                    processCmd(iClient);
-                    cc.cmdpos = 0;
-                } else {
-                    if (cc.cmdpos<sizeof(cc.cmdline) ) 
-                        cc.cmdline[cc.cmdpos++] = c;
-                }
-                if(cc.heartbeatEnabled) { 
-                    cc.lastHeartbeat = millis();
-                }
-                
-            }
-            if (cc.heartbeatEnabled) {
-                checkHeartbeat(iClient);
+        switch(cc.state.load(std::memory_order_acquire)) {
+            case NEW: {
+                if(!clientStart(iClient)) break;
+                uint8_t st = NEW;
+                // stays CLOSED if client is already gone
+                cc.state.compare_exchange_strong(st, ACTIVE, std::memory_order_acq_rel);
+                readClient(iClient);
+                break;
             }
+            case ACTIVE:
+                readClient(iClient);
+                break;
+            case CLOSED:
+                clientStop(iClient);
+                break;
+        }
+    }
+    hbTimers.loop(millis());
+    for (int iClient=0; iClient<MAX_CLIENTS; iClient++) flush(iClient);
+}
+
+void WiThrottleServer::readClient(int iClient) {
+    ClientData& cc = clientData[iClient];
+    uint16_t tail = cc.rxTail.load(std::memory_order_relaxed);
+    uint16_t head = cc.rxHead.load(std::memory_order_acquire);
+    if(tail==head) return;
+    while(tail!=head) {
+        char c = cc.rx[tail & (RX_SIZE-1)];
+        tail++;
+        if(c=='\n') {
+            processCmd(iClient);
+            cc.cmdpos = 0;
+        } else if (cc.cmdpos<sizeof(cc.cmdline) ) {
+            cc.cmdline[cc.cmdpos++] = c;
         }
-        
     }
+    cc.rxTail.store(tail, std::memory_order_release);
+    if(cc.heartbeatEnabled) hbTimers.schedule(iClient, cc.heartbeatTimeout*1000UL, millis());
+}
+
+WiThrottleServer::Cmd WiThrottleServer::classify(etl::string_view line) {
+    if(line.empty()) return Cmd::UNKNOWN;
+    switch(line[0]) {
+        case '*': return Cmd::HEARTBEAT;
+        case 'P':
+            if(line.size()<3 || line[2]!='A') return Cmd::UNKNOWN;
+            switch(line[1]) {
+                case 'P': return Cmd::POWER;
+                case 'T': return Cmd::TURNOUT;
+                case 'R': return Cmd::ROUTE;
+            }
+            return Cmd::UNKNOWN;
+        case 'N': return Cmd::NAME;
+        case 'H': return Cmd::HW_ID;
+        case 'M': return Cmd::MULTI_THROTTLE;
+        case 'Q': return Cmd::QUIT;
+    }
+    return Cmd::UNKNOWN;
 }
 
 void WiThrottleServer::processCmd(int iClient) {
     ClientData& cc = clientData[iClient];
-    String dataStr = cc.cmdline;
-    WT_LOGI("Read new cmd (%db): %d", dataStr.length(), cc.cmdline[0]);
-    WT_LOGI("WTRX %s", cc.cmdline);
-    switch(dataStr.charAt(0)) {
-    case '*': {
-        if(dataStr.length()>1) {
-            switch(dataStr.charAt(1) ) {
-                case '+' : cc.heartbeatEnabled = true; break;
-                case '-' : cc.heartbeatEnabled = false; break;
-            } 
+    etl::string_view line(cc.cmdline, cc.cmdpos);
+    if(!line.empty() && line.back()=='\r') line.remove_suffix(1);
+    WT_LOGI("WTRX %.*s", (int)line.size(), line.data());
+    touchSlots(iClient);
+    switch(classify(line)) {
+    case Cmd::HEARTBEAT:
+        if(line.size()>1) {
+            switch(line[1]) {
+                case '+' : cc.heartbeatEnabled = true; break; // timer is started after this read
+                case '-' : cc.heartbeatEnabled = false; hbTimers.cancel(iClient); break;
+            }
         }
         break;
-    }             
-    case 'P': {
-        if (dataStr.startsWith("PPA") ) {
-            turnPower(dataStr.charAt(3) );
-        } else if (dataStr.startsWith("PTA")) {
-            char aStatus = dataStr.charAt(3);
-            int aAddr;
-            bool named;
-            if(dataStr.substring(4,6)==TURNOUT_PREF) {
-                // named turnout
-                aAddr = dataStr.substring(6).toInt();
-                named = true;
-            } else {
-                aAddr = dataStr.substring(4).toInt();
-                named = false;
-            }
-            accessoryToggle(aAddr, aStatus, named);
-        } else {}
+    case Cmd::POWER:
+        if(line.size()>3) turnPower(line[3]);
         break;
-    }
-    case 'N': { // device name
-        WT_LOGI("Device ID: %s", cc.cmdline+1 );
-        wifiPrintln(iClient, "*" + String(cc.heartbeatTimeout));
+    case Cmd::TURNOUT: {
+        if(line.size()<4) break;
+        char aStatus = line[3];
+        etl::string_view aAddr = line.substr(4);
+        bool named = startsWith(aAddr, TURNOUT_PREF);
+        if(named) aAddr.remove_prefix(strlen(TURNOUT_PREF));
+        accessoryToggle(toInt(aAddr), aStatus, named);
         break;
     }
-    case 'H': {
-        WT_LOGI("Hardware ID: %s", cc.cmdline+1 );
+    case Cmd::ROUTE: {
+        etl::string_view id = line.substr(line.size()<4 ? line.size() : 4);
+        if(startsWith(id, ROUTE_PREF)) routeSet(toInt(id.substr(strlen(ROUTE_PREF))));
         break;
     }
-    case 'M': {
-        char th = dataStr.charAt(1);
-        char action = dataStr.charAt(2);
-        String actionData = dataStr.substring(3);
-        int delimiter = actionData.indexOf(";");
-        String actionKey = actionData.substring(0, delimiter-1);
-        String actionVal = actionData.substring(delimiter+2);
-        if (action == '+') {
-            locoAdd(th, actionKey, iClient);
-        } else if (action == '-') {
-            locoRelease(th, actionKey, iClient);
-        } else if (action == 'A') {
-            locoAction(th, actionKey, actionVal, iClient);
-        }
+    case Cmd::NAME:
+        WT_LOGI("Device ID: %.*s", (int)line.size()-1, line.data()+1 );
+        reply(iClient, "*%d", cc.heartbeatTimeout);
         break;
-    }
-    case 'Q':
-        // quit
-        clientStop(iClient);
+    case Cmd::HW_ID:
+        WT_LOGI("Hardware ID: %.*s", (int)line.size()-1, line.data()+1 );
+        break;
+    case Cmd::MULTI_THROTTLE:
+        multiThrottle(line, iClient);
         break;
-    default:
+    case Cmd::QUIT:
+        cc.cli->close(); // slots are released when disconnect is seen in loop()
         break;
+    case Cmd::UNKNOWN:
+        break;
+    }
+}
+
+/// M<throttle><action><key><;><value>, e.g. MTAS3<;>V50
+void WiThrottleServer::multiThrottle(etl::string_view line, int iClient) {
+    if(line.size()<3) return;
+    char th = line[1];
+    char action = line[2];
+    etl::string_view actionKey = line.substr(3);
+    etl::string_view actionVal;
+    size_t delimiter = actionKey.find("<;>");
+    if(delimiter != etl::string_view::npos) {
+        actionVal = actionKey.substr(delimiter+3);
+        actionKey = actionKey.substr(0, delimiter);
+    }
+    switch(action) {
+        case '+': locoAdd(th, actionKey, iClient); break;
+        case '-': locoRelease(th, actionKey, iClient); break;
+        case 'A': locoAction(th, actionKey, actionVal, iClient); break;
     }
 }
 
-void WiThrottleServer::clientStart(int iClient) {
-    clients[iClient].flush();
-    clients[iClient].setTimeout(500);
-    WT_LOGI( "New client " );
+bool WiThrottleServer::clientStart(int iClient) {
+    if(!updateHandshake()) return false;
+    WT_LOGI( "New client %d", iClient );
     ClientData & cc = clientData[iClient];
 
-    wifiPrintln(iClient, "VN2.0");
-    wifiPrintln(iClient, "RL0");
-    wifiPrintln(iClient, String("PPA")+powerStatus );
-    wifiPrintln(iClient, "PTT]\\[Turnouts}|{Turnout]\\[Closed}|{"+String(TURNOUT_CLOSED)+"]\\[Thrown}|{"+String(TURNOUT_THROWN) );
-    wifiPrint(iClient, "PTL");
-    for(const auto &t: CS.getTurnouts() ) {
-    //for (int t = 0 ; t<CS.getTurnoutCount(); t++) {
-        //const CommandStation::TurnoutData &tt = CS.getTurnout(t);
-        const CommandStation::TurnoutData &tt = t.second;
-        wifiPrint(iClient, String("]\\[")+TURNOUT_PREF+tt.addr11+"}|{"+tt.id+"}|{"
-            +(tt.tStatus==TurnoutState::THROWN ? TURNOUT_THROWN : TURNOUT_CLOSED) );
-    }
-    wifiPrintln(iClient, "");
-    wifiPrintln(iClient, "*"+String(cc.heartbeatTimeout));
-    cc.connected = true;
+    cc.txLen = 0;
     cc.cmdpos = 0;
+    cc.heartbeatEnabled = false;
+    // written from the shared buffer by flush(), as far as the send buffer takes it each time
+    cc.hsPos = 0;
+    return true;
+}
+
+static char turnoutChar(TurnoutState st) {
+    return st==TurnoutState::THROWN ? TURNOUT_THROWN : st==TurnoutState::CLOSED ? TURNOUT_CLOSED : TURNOUT_UNKNOWN;
+}
+
+void WiThrottleServer::buildHandshake() {
+    stats.handshakeBuilds++;
+    char *b = handshake;
+    const char *end = handshake+sizeof(handshake);
+    // HS_SIZE fits everything, this only guards against miscounting
+    auto put = [&](int n) { if(n>0) b += n < end-b ? n : end-b-1; };
+    turnoutPosCount = 0;
+    const LocoRoster *roster = CS.getLocoRoster();
+    rosterGeneration = roster!=nullptr ? roster->generation() : 0;
+    put(snprintf(b, end-b, "VN2.0" LINE_END "RL%d", roster!=nullptr ? roster->size() : 0));
+    LocoRoster::Loco loco;
+    for(uint16_t i=0; roster!=nullptr && roster->atByName(i, loco); i++)
+        put(snprintf(b, end-b, "]\\[%s}|{%d}|{%c", loco.name, loco.addr.addr(), loco.addr.isShort() ? 'S' : 'L'));
+    put(snprintf(b, end-b, LINE_END "PPA"));
+    powerPos = b-handshake;
+    put(snprintf(b, end-b, "%c" LINE_END, powerStatus));
+    put(snprintf(b, end-b, "PTT]\\[Turnouts}|{Turnout]\\[Closed}|{%c]\\[Thrown}|{%c" LINE_END "PTL", TURNOUT_CLOSED, TURNOUT_THROWN));
+    for(const auto &tt: CS.getTurnouts() ) {
+        put(snprintf(b, end-b, "]\\[" TURNOUT_PREF "%d}|{%d}|{%c", tt.addr11, tt.id, turnoutChar(CS.getTurnoutState(tt.addr11))));
+        turnoutPos[turnoutPosCount++] = b-handshake-1;
+    }
+    put(snprintf(b, end-b, LINE_END "PRT]\\[Routes}|{Route]\\[Active}|{%c]\\[Inactive}|{%c" LINE_END "PRL", ROUTE_ACTIVE, ROUTE_INACTIVE));
+    for(uint8_t r=1; r<=CommandStation::MAX_ROUTES; r++) {
+        if(CS.isRouteDefined(r)) 
+            put(snprintf(b, end-b, "]\\[" ROUTE_PREF "%d}|{Route %d}|{%c", r, r, ROUTE_INACTIVE));
+    }
+    put(snprintf(b, end-b, LINE_END "*%d" LINE_END, HEARTBEAT_TIMEOUT_S));
+    handshakeLen = b-handshake;
+}
+
+bool WiThrottleServer::updateHandshake() {
+    powerStatus = CS.getPowerState() ? '1' : '0';
+    const LocoRoster *roster = CS.getLocoRoster();
+    if(handshakeStale || turnoutPosCount!=CS.getTurnoutCount()
+        || (roster!=nullptr && roster->generation()!=rosterGeneration)) {
+        // offsets move, clients in the middle of the old handshake finish it first
+        for(int i=0; i<MAX_CLIENTS; i++)
+            if(active(i) && clientData[i].hsPos!=HS_DONE) return false;
+        handshakeStale = false;
+        turnoutsChanged = false;
+        buildHandshake();
+        return true;
+    }
+    // states are patched in place, a client in the middle of the handshake gets the new ones too
+    handshake[powerPos] = powerStatus;
+    if(!turnoutsChanged.exchange(false)) return true;
+    stats.handshakePatches++;
+    uint8_t i = 0;
+    for(const auto &tt: CS.getTurnouts() )
+        handshake[turnoutPos[i++]] = turnoutChar(CS.getTurnoutState(tt.addr11));
+    return true;
 }
 
 void WiThrottleServer::clientStop(int iClient) {
-    clients[iClient].stop();
-    WT_LOGI("Client stopping");
-    //alreadyConnected[iClient] = false;
-    //heartbeatEnable[iClient] = false;
+    WT_LOGI("Client %d stopping", iClient);
     ClientData &client = clientData[iClient];
     
     for(const auto& thrSlots: client.slots) {
@@ -175,36 +298,60 @@ void WiThrottleServer::clientStop(int iClient) {
         }
     }
     client.slots.clear();
+    client.txLen = 0;
     client.heartbeatEnabled = false;
-    client.connected = false;
-
+    hbTimers.cancel(iClient);
+    // AsyncTCP does not touch a client after its disconnect callback
+    delete client.cli;
+    client.cli = nullptr;
+    client.state.store(FREE, std::memory_order_release);
 }
 
-void WiThrottleServer::locoAdd(char th, String sLocoAddr, int iClient) {
+void WiThrottleServer::locoAdd(char th, etl::string_view sLocoAddr, int iClient) {
     LocoAddress addr = str2addr(sLocoAddr);
-    wifiPrintln(iClient, String("M")+th+"+"+sLocoAddr+"<;>");
+    if(!addr.isValid()) return;
+    // slot takes its speed steps from loco roster
+    ClientData &client = clientData[iClient];
+    auto thr = client.slots.find(th);
+    bool known = thr!=client.slots.end() && thr->second.find(addr)!=thr->second.end();
+    if(!known && (thr!=client.slots.end() ? thr->second.full() : client.slots.full())) {
+        reply(iClient, "HMThrottle %c is full, loco %c%d not added", th, ADDR_FMT(addr));
+        return;
+    }
+    uint8_t slot = CS.findOrAllocateLocoSlot(addr);
+    if(slot==0) {
+        WT_LOGI("no free slot for loco %c%d", ADDR_FMT(addr));
+        reply(iClient, "HMNo free slot for loco %c%d", ADDR_FMT(addr));
+        return;
+    }
+    uint8_t steps = CS.getLocoSpeedSteps(slot);
+
+    locoReply(iClient, th, '+', addr, "%s", "");
+    const LocoRoster *roster = CS.getLocoRoster();
+    LocoRoster::Loco loco;
+    if(roster!=nullptr && roster->find(addr, loco) && loco.labelCount>0) locoLabels(iClient, th, loco);
     for (int fKey=0; fKey<29; fKey++) {
-        wifiPrintln(iClient, String("M")+th+"A"+sLocoAddr+"<;>F0"+String(fKey));
+        locoReply(iClient, th, 'A', addr, "F0%d", fKey);
     }
-    wifiPrintln(iClient, String("M")+th+"A"+sLocoAddr+"<;>V0");
-    wifiPrintln(iClient, String("M")+th+"A"+sLocoAddr+"<;>R1");
-    wifiPrintln(iClient, String("M")+th+"A"+sLocoAddr+"<;>s1"); // TODO: this is speed steps 128 -> 1, 28->2 14->8
+    locoReply(iClient, th, 'A', addr, "V0");
+    locoReply(iClient, th, 'A', addr, "R1");
+    locoReply(iClient, th, 'A', addr, "s%d", steps==14 ? 8 : steps==28 ? 2 : 1);
 
     //DEBUGS("loco add thr="+String(th)+"; addr"+String(sLocoAddr) );
 
-    uint8_t slot = CS.findOrAllocateLocoSlot(addr);
-    clientData[iClient].slots[th][addr] = slot;
+    client.slots[th][addr] = slot;
     CS.setLocoSlotRefresh(slot, true);
 }
 
-void WiThrottleServer::locoRelease(char th, String sLocoAddr, int iClient) {
-    //wifiPrintln(iClient, String("M")+th+"-"+sLocoAddr+"<;>");
-    WT_LOGI("loco release thr=%c; addr=%s", th, String(sLocoAddr).c_str() );
+void WiThrottleServer::locoRelease(char th, etl::string_view sLocoAddr, int iClient) {
+    WT_LOGI("loco release thr=%c; addr=%.*s", th, (int)sLocoAddr.size(), sLocoAddr.data() );
     ClientData &client = clientData[iClient];
 
-    if(sLocoAddr=="*") { 
+    if(sLocoAddr.size()==1 && sLocoAddr[0]=='*') {
+        auto thr = client.slots.find(th);
+        if(thr==client.slots.end()) return;
         etl::vector<LocoAddress, MAX_LOCOS_PER_THROTTLE> tmp;
-        for(const auto& slot: client.slots[th]) {
+        for(const auto& slot: thr->second) {
             tmp.push_back(slot.first);
         }
         for(const auto& addr: tmp) 
@@ -216,21 +363,26 @@ void WiThrottleServer::locoRelease(char th, String sLocoAddr, int iClient) {
 }
 
 void WiThrottleServer::locoRelease(char th, LocoAddress addr, int iClient) {
-    wifiPrintln(iClient, String("M")+th+"-"+addr2str(addr)+"<;>");
+    locoReply(iClient, th, '-', addr, "%s", "");
     //DEBUGS("loco release thr="+String(th)+"; addr "+String(addr) );
 
     ClientData &client = clientData[iClient];
-    CS.releaseLocoSlot( client.slots[th][addr] );
+    // purged meanwhile: already released
+    uint8_t slot = client.slot(th, addr);
+    if(slot==0) return;
+    CS.releaseLocoSlot(slot);
     client.slots[th].erase(addr);
 }
 
 
-void WiThrottleServer::locoAction(char th, String sLocoAddr, String actionVal, int iClient) {
+void WiThrottleServer::locoAction(char th, etl::string_view sLocoAddr, etl::string_view actionVal, int iClient) {
     //DEBUGS("loco action thr="+String(th)+"; action="+actionVal+"; addr "+sLocoAddr );
     ClientData &client = clientData[iClient];
 
-    if(sLocoAddr=="*") { 
-        for(const auto& slot: client.slots[th]) 
+    if(sLocoAddr.size()==1 && sLocoAddr[0]=='*') {
+        auto thr = client.slots.find(th);
+        if(thr==client.slots.end()) return;
+        for(const auto& slot: thr->second) 
             locoAction(th, slot.first, actionVal, iClient);
     } else {
         LocoAddress iLocoAddr = str2addr(sLocoAddr);
@@ -239,64 +391,81 @@ void WiThrottleServer::locoAction(char th, String sLocoAddr, String actionVal, i
 }
 
 
-void WiThrottleServer::locoAction(char th, LocoAddress iLocoAddr, String actionVal, int iClient) {
+void WiThrottleServer::locoAction(char th, LocoAddress iLocoAddr, etl::string_view actionVal, int iClient) {
     ClientData &client = clientData[iClient];
 
-    uint8_t slot = client.slots[th][iLocoAddr];
-
-    WT_LOGI("loco action thr=%c; action=%s; addr %s ", th, actionVal.c_str(), String(iLocoAddr).c_str() );
-    if (actionVal.startsWith("F1")) {
-        int fKey = actionVal.substring(2).toInt();
-        bool newVal = ! CS.getLocoFn(slot, fKey);
-        CS.setLocoFn(slot, fKey, newVal );
-        wifiPrintln(iClient, String("M")+th+"A"+addr2str(iLocoAddr)+"<;>" + (newVal?"F1":"F0")+String(fKey));
-    }
-    else if (actionVal.startsWith("qV")) {
-        //DEBUGS("query speed for loco "+String(dccLocoAddr) );
-        wifiPrintln(iClient, String("M")+th+"A"+addr2str(iLocoAddr)+"<;>" + "V"+String(CS.getLocoSpeed(slot)));							
-    }
-    else if (actionVal.startsWith("V")) {
-        //DEBUGS("Sending velocity to addr "+String(dccLocoAddr) );
-        CS.setLocoSpeed(slot, actionVal.substring(1).toInt());
-        //sendDCCppCmd("t "+String(iThrottle+1)+" "+dccLocoAddr+"	"+String(locoState[29])+" "+String(locoState[30]));
-    }
-    else if (actionVal.startsWith("qR")) {
-        //DEBUGS("query dir for loco "+String(dccLocoAddr) );
-        wifiPrintln(iClient, String("M")+th+"A"+addr2str(iLocoAddr)+"<;>" + "R"+String(CS.getLocoDir(slot) ));							
-    }
-    else if (actionVal.startsWith("R")) {
-        //DEBUGS("Sending dir to addr "+String(dccLocoAddr) );
-        CS.setLocoDir(slot, actionVal.substring(1).toInt() );
-
-    }
-    else if (actionVal.startsWith("X")) { // EMGR stop
+    // not added, or purged while the throttle still showed it
+    uint8_t slot = client.slot(th, iLocoAddr);
+    if(slot==0) return;
+
+    WT_LOGI("loco action thr=%c; action=%.*s; addr %d ", th, (int)actionVal.size(), actionVal.data(), iLocoAddr.addr() );
+    if(actionVal.empty()) return;
+    char a0 = actionVal[0];
+    char a1 = actionVal.size()>1 ? actionVal[1] : 0;
+    switch(a0) {
+    case 'F':
+        if(a1=='1') { // button pressed
+            int fKey = toInt(actionVal.substr(2));
+            bool newVal = ! CS.getLocoFn(slot, fKey);
+            CS.setLocoFn(slot, fKey, newVal );
+            locoReply(iClient, th, 'A', iLocoAddr, "F%d%d", newVal ? 1 : 0, fKey);
+        }
+        break;
+    case 'q':
+        if(a1=='V') {
+            locoReply(iClient, th, 'A', iLocoAddr, "V%d", CS.getLocoSpeed(slot));
+        } else if(a1=='R') {
+            locoReply(iClient, th, 'A', iLocoAddr, "R%d", CS.getLocoDir(slot));
+        }
+        break;
+    case 'V':
+        CS.setLocoSpeed(slot, toInt(actionVal.substr(1)));
+        break;
+    case 'R':
+        CS.setLocoDir(slot, toInt(actionVal.substr(1)) );
+        break;
+    case 'X': // EMGR stop
         CS.setLocoSpeed(slot, 1);
-        //sendDCCppCmd("t "+String(iThrottle+1)+" "+dccLocoAddr+" -1 "+String(locoState[30]));
-    }
-    else if (actionVal.startsWith("I")) { // idle
-        // sendDCCppCmd("t "+String(iThrottle+1)+" "+dccLocoAddr+" 0 "+String(locoState[30]));
-        CS.setLocoSpeed(slot, 0);
-    }
-    else if (actionVal.startsWith("Q")) { // quit, TODO: kill throttle here
-        //sendDCCppCmd("t "+String(iThrottle+1)+" "+dccLocoAddr+" 0 "+String(locoState[30]));
+        break;
+    case 'I': // idle
+    case 'Q': // quit, TODO: kill throttle here
         CS.setLocoSpeed(slot, 0);
+        break;
     }
 }
 
-void WiThrottleServer::checkHeartbeat(int iClient) {
+void WiThrottleServer::heartbeatTimeout(int iClient) {
     ClientData &c = clientData[iClient];
-    if(! c.heartbeatEnabled) return;
-    
-    if ( (c.lastHeartbeat > 0) && (c.lastHeartbeat + c.heartbeatTimeout*1000 < millis() ) ) {
-        // stop loco
-        WT_LOGI("timeout exceeded: last: %d, current %d", c.lastHeartbeat/1000, millis()/1000 );
-        c.lastHeartbeat = 0;
-        for(const auto& throttle: c.slots)
-            for(const auto& slot: throttle.second) {
-                CS.setLocoSpeed(slot.second, 1); // emgr
-                wifiPrintln(iClient, String("M")+throttle.first+"A"+addr2str(slot.first)+"<;>V"+CS.getLocoSpeed(slot.second));
+    if(!active(iClient) || !c.heartbeatEnabled) return;
+    WT_LOGI("client %d: heartbeat timeout", iClient);
+    stats.heartbeatTimeouts++;
+    for(const auto& throttle: c.slots)
+        for(const auto& slot: throttle.second) {
+            if(slot.second==0) continue;
+            CS.setLocoSpeed(slot.second, 1); // emgr
+            locoReply(iClient, throttle.first, 'A', slot.first, "V%d", CS.getLocoSpeed(slot.second));
+        }
+}
+
+void WiThrottleServer::touchSlots(int iClient) {
+    for(const auto& throttle: clientData[iClient].slots)
+        for(const auto& slot: throttle.second)
+            if(slot.second!=0) CS.touchLocoSlot(slot.second);
+}
+
+void WiThrottleServer::onSlotPurge(uint8_t slot, CommandStation::SlotAge age) {
+    if(age != CommandStation::SlotAge::FREE) return;
+    for (int iClient=0; iClient<MAX_CLIENTS; iClient++) {
+        for(auto& throttle: clientData[iClient].slots) {
+            etl::vector<LocoAddress, MAX_LOCOS_PER_THROTTLE> purged;
+            for(const auto& s: throttle.second) 
+                if(s.second == slot) purged.push_back(s.first);
+            for(const auto& addr: purged) {
+                WT_LOGI("loco %c%d purged from throttle %c", ADDR_FMT(addr), throttle.first);
+                throttle.second.erase(addr);
+                if(active(iClient)) locoReply(iClient, throttle.first, '-', addr, "%s", "");
             }
-        
+        }
     }
 }
 
@@ -314,21 +483,104 @@ void WiThrottleServer::accessoryToggle(int aAddr, char aStatus, bool namedTurnou
         case 'C': 
             newStat = CS.turnoutAction(aAddr, namedTurnout, TurnoutState::CLOSED);
             break;
-        case '3': 
+        case '3': // toggle; '3' is a command only, state is reported as TURNOUT_UNKNOWN
             newStat = CS.turnoutToggle(aAddr, namedTurnout);
             break;
         default: return;
     }
 
+    broadcast("PTA%c%s%d", turnoutChar(newStat), namedTurnout ? TURNOUT_PREF : "", aAddr);
+
+}
+void WiThrottleServer::routeSet(int id) {
+    WT_LOGI("route set, id=%d", id);
+    if(!CS.fireRoute(id)) return;
+    broadcast("PRA%c" ROUTE_PREF "%d", ROUTE_ACTIVE, id);
+}
+
+void WiThrottleServer::reply(int iClient, const char *fmt, ...) {
+    char buf[LINE_MAX];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf)-2, fmt, args);
+    va_end(args);
+    if(n<0) return;
+    if(n>(int)sizeof(buf)-3) n = sizeof(buf)-3;
+    memcpy(buf+n, LINE_END, 2);
+    append(iClient, buf, n+2);
+}
+
+void WiThrottleServer::broadcast(const char *fmt, ...) {
+    char buf[LINE_MAX];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf)-2, fmt, args);
+    va_end(args);
+    if(n<0) return;
+    if(n>(int)sizeof(buf)-3) n = sizeof(buf)-3;
+    memcpy(buf+n, LINE_END, 2);
+    for (int i=0; i<MAX_CLIENTS; i++)
+        if(active(i)) append(i, buf, n+2);
+}
+
+void WiThrottleServer::locoReply(int iClient, char th, char action, LocoAddress addr, const char *fmt, ...) {
+    char buf[LINE_MAX];
+    int n = snprintf(buf, sizeof(buf), "M%c%c%c%d<;>", th, action, ADDR_FMT(addr));
+    va_list args;
+    va_start(args, fmt);
+    int m = vsnprintf(buf+n, sizeof(buf)-2-n, fmt, args);
+    va_end(args);
+    if(m<0) return;
+    n += m;
+    if(n>(int)sizeof(buf)-3) n = sizeof(buf)-3;
+    memcpy(buf+n, LINE_END, 2);
+    append(iClient, buf, n+2);
+}
 
-    char cStat = '3'; // unknown
-    switch(newStat) {
-        case TurnoutState::THROWN: cStat = TURNOUT_THROWN; break;
-        case TurnoutState::CLOSED: cStat = TURNOUT_CLOSED; break;
+void WiThrottleServer::locoLabels(int iClient, char th, const LocoRoster::Loco &loco) {
+    char buf[16 + LocoRoster::LABELS_MAX + 3*LocoRoster::MAX_FUNCTIONS + 2];
+    int n = snprintf(buf, sizeof(buf), "M%cL%c%d<;>", th, ADDR_FMT(loco.addr));
+    const char *l = loco.labels;
+    for(uint8_t f=0; f<loco.labelCount; f++) {
+        size_t ln = strlen(l);
+        memcpy(buf+n, "]\\[", 3);
+        memcpy(buf+n+3, l, ln);
+        n += 3+ln;
+        l += ln+1;
     }
+    memcpy(buf+n, LINE_END, 2);
+    append(iClient, buf, n+2);
+}
 
-    for (int i=0; i<MAX_CLIENTS; i++) {
-        if(clients[i]) wifiPrintln(i, String("PTA")+cStat+(namedTurnout?TURNOUT_PREF:"")+aAddr);
+void WiThrottleServer::append(int iClient, const char *s, uint16_t len) {
+    ClientData &cc = clientData[iClient];
+    if(cc.txLen+len > TX_SIZE) flush(iClient);
+    if(cc.txLen+len > TX_SIZE) {
+        stats.txDropped++;
+        return;
     }
+    memcpy(cc.tx+cc.txLen, s, len);
+    cc.txLen += len;
+}
 
-}
\ No newline at end of file
+void WiThrottleServer::flush(int iClient) {
+    ClientData &cc = clientData[iClient];
+    if(cc.txLen==0 && cc.hsPos==HS_DONE) return;
+    uint8_t st = cc.state.load(std::memory_order_acquire);
+    if(st!=NEW && st!=ACTIVE) {
+        cc.txLen = 0;
+        cc.hsPos = HS_DONE;
+        return;
+    }
+    if(cc.hsPos!=HS_DONE) {
+        cc.hsPos += cc.cli->write(handshake+cc.hsPos, handshakeLen-cc.hsPos);
+        if(cc.hsPos<handshakeLen) return;
+        cc.hsPos = HS_DONE;
+    }
+    if(cc.txLen==0) return;
+    // AsyncClient takes what fits its send buffer, the rest waits for the next flush
+    size_t n = cc.cli->write(cc.tx, cc.txLen);
+    if(n>cc.txLen) n = cc.txLen;
+    memmove(cc.tx, cc.tx+n, cc.txLen-n);
+    cc.txLen -= n;
+}
@@ -2,21 +2,32 @@
  * Based on https://github.com/positron96/withrottle
  * 
  * Also, see JMRI sources, start at java\src\jmri\jmrit\withrottle\DeviceServer.java
+ *
+ * Connections are handled by AsyncTCP callbacks, which only claim client state and queue received bytes.
+ * Commands are executed, and output is written, from loop(), so CommandStation is only used from the main loop.
  */
 
 #pragma once
 
 #include <WiFi.h>
-#include <WiFiServer.h>
 #include <ESPmDNS.h>
+#include <AsyncTCP.h>
+#include <atomic>
 #include <etl/map.h>
 #include <etl/utility.h>
+#include <etl/string_view.h>
 
 #include "CommandStation.h"
+#include "TimerWheel.h"
 
 
 #define WT_DEBUG_
 
+/// Number of simultaneous throttle connections; each takes about 1.5 KB of static RAM.
+#ifndef WT_MAX_CLIENTS
+#define WT_MAX_CLIENTS 16
+#endif
+
 #ifdef WT_DEBUG
 #define WT_LOGI(format, ...)  log_printf(ARDUHAL_LOG_FORMAT(I, format), ##__VA_ARGS__)
 #else
@@ -24,10 +35,22 @@
 #endif
 
 
-class WiThrottleServer {
+class WiThrottleServer: public CommandStation::SlotListener, public CommandStation::TurnoutListener {
 public:
 
-    WiThrottleServer(uint16_t port=44444) : port(port), server(port) {}
+    struct Stats {
+        uint32_t connects;
+        uint32_t rejected;   ///< all client slots in use
+        uint32_t rxDropped;  ///< bytes lost because loop() did not keep up
+        uint32_t txDropped;  ///< lines lost because client did not take output
+        uint32_t heartbeatTimeouts;
+        uint32_t handshakeBuilds;   ///< full serializations of the handshake
+        uint32_t handshakePatches;  ///< turnout states updated in place
+    };
+
+    WiThrottleServer(uint16_t port=44444) : port(port), server(port), hbTimers(heartbeatExpired, this) {
+        server.onClient( [this](void*, AsyncClient* cli) { onConnect(cli); }, nullptr);
+    }
 
     void begin() {
 
@@ -51,35 +74,83 @@ public:
     void notifyPowerStatus(int8_t iClient=-1) {
         bool v = CS.getPowerState();
         powerStatus = v ? '1' : '0';
-        if(iClient==-1) {
-            for (int p=0; p<MAX_CLIENTS; p++) {
-                if (clients[p]) wifiPrintln(p, String("PPA")+powerStatus);
-            }
-        } else if(clients[iClient]) wifiPrintln(iClient, String("PPA")+powerStatus);
+        if(iClient==-1) broadcast("PPA%c", powerStatus);
+        else reply(iClient, "PPA%c", powerStatus);
     }
 
+    /// Starts and stops clients, handles their queued commands and heartbeats, then writes out everything queued for each client at once.
     void loop();
 
+    /// Purged locos are removed from client throttles.
+    void onSlotPurge(uint8_t slot, CommandStation::SlotAge age) override;
+
+    /// Only marks the cached handshake; it is brought up to date when the next client connects.
+    void onTurnoutChange(uint16_t addr11) override {
+        if(addr11==0) handshakeStale = true;
+        else turnoutsChanged = true;
+    }
+
+    const Stats& getStats() const { return stats; }
+
 private:
 
     const uint16_t port;
 
-    const static int MAX_CLIENTS = 3;
+    const static int MAX_CLIENTS = WT_MAX_CLIENTS;
     const static int MAX_THROTTLES_PER_CLIENT = 6;
     const static int MAX_LOCOS_PER_THROTTLE = 2;
-
-    WiFiServer server;
-    WiFiClient clients[MAX_CLIENTS];
+    const static uint16_t HEARTBEAT_TIMEOUT_S = 30;
+    /// Output collected per client between flushes; written early when full.
+    const static int TX_SIZE = 1024;
+    const static int LINE_MAX = 128;
+    /// Received bytes waiting for loop(); power of 2.
+    const static int RX_SIZE = 256;
+
+    static_assert(MAX_CLIENTS < 255, "client index must fit TimerWheel");
+
+    /// Longest turnout and route entries of PTL and PRL lines.
+    const static int HS_TURNOUT_MAX = 20;
+    const static int HS_ROUTE_MAX = 24;
+    /// Longest loco entry of RL line: name, address, S/L.
+    const static int HS_LOCO_MAX = 3+LocoRoster::NAME_MAX+3+5+3+1;
+    /// Handshake lines that don't depend on rosters.
+    const static int HS_FIXED_MAX = 192;
+    const static int HS_SIZE = HS_FIXED_MAX + CommandStation::MAX_TURNOUTS*HS_TURNOUT_MAX + CommandStation::MAX_ROUTES*HS_ROUTE_MAX
+        + LocoRoster::MAX_LOCOS*HS_LOCO_MAX;
+    /// hsPos of a client that has been sent the whole handshake
+    const static uint16_t HS_DONE = 0xFFFF;
+    static_assert(HS_SIZE < HS_DONE, "handshake offsets must fit uint16_t");
+
+    AsyncServer server;
+
+    enum ClientState: uint8_t {
+        FREE,
+        NEW,     ///< connected, handshake not sent yet
+        ACTIVE,
+        CLOSED,  ///< disconnected, slots not released yet
+    };
 
     struct ClientData {
-        bool connected;
-        uint16_t heartbeatTimeout = 30;
+        /// FREE->NEW only in AsyncTCP task, other transitions only in loop()
+        std::atomic<uint8_t> state{FREE};
+        AsyncClient *cli = nullptr;
+
+        /// written by AsyncTCP task at rxHead, read by loop() at rxTail
+        char rx[RX_SIZE];
+        std::atomic<uint16_t> rxHead{0};
+        std::atomic<uint16_t> rxTail{0};
+
+        uint16_t heartbeatTimeout = HEARTBEAT_TIMEOUT_S;
         bool heartbeatEnabled;
-        uint32_t lastHeartbeat;
 
         char cmdline[100];
         size_t cmdpos = 0;
 
+        /// offset of handshake not written yet; it goes out from the shared buffer before anything in tx
+        uint16_t hsPos = HS_DONE;
+        char tx[TX_SIZE];
+        uint16_t txLen = 0;
+
         // each client can have up to 6 multi throttles, each MT can have multiple locos (and slots)
         etl::map< char, etl::map<LocoAddress, uint8_t, MAX_LOCOS_PER_THROTTLE>, MAX_THROTTLES_PER_CLIENT> slots;
         uint8_t slot(char thr, LocoAddress addr) { 
@@ -94,7 +165,55 @@ private:
 
     ClientData clientData[MAX_CLIENTS];
 
+    /// One timer per client, restarted by every received line while heartbeat is enabled.
+    TimerWheel<MAX_CLIENTS> hbTimers;
+
+    Stats stats = {};
+
+    /**
+     * Handshake sent to every new client (version, loco roster, power, turnout and route lists), serialized once.
+     * Rebuilt when rosters change; turnout states and power are patched in place at their offsets.
+     */
+    char handshake[HS_SIZE];
+    uint16_t handshakeLen = 0;
+    uint16_t powerPos = 0;
+    /// offset of state character of each roster turnout, in roster order
+    uint16_t turnoutPos[CommandStation::MAX_TURNOUTS];
+    uint8_t turnoutPosCount = 0;
+    std::atomic<bool> handshakeStale{true};
+    /// loco roster the RL line was built from
+    uint32_t rosterGeneration = 0;
+    std::atomic<bool> turnoutsChanged{false};
+
+    void buildHandshake();
+    /// Brings cached handshake up to date. @return false if it must be rebuilt but a client is still being sent the old one.
+    bool updateHandshake();
+
+    bool active(int iClient) const { return clientData[iClient].state.load(std::memory_order_acquire)==ACTIVE; }
+
+    /// AsyncTCP task: claims a free client slot.
+    void onConnect(AsyncClient *cli);
+    /// Splits queued bytes into lines and runs them.
+    void readClient(int iClient);
+
+    /// Command kinds, from the first characters of a line.
+    enum class Cmd: uint8_t {
+        UNKNOWN,
+        HEARTBEAT,      ///< *+ / *-
+        POWER,          ///< PPA
+        TURNOUT,        ///< PTA
+        ROUTE,          ///< PRA
+        NAME,           ///< N
+        HW_ID,          ///< H
+        MULTI_THROTTLE, ///< M
+        QUIT,           ///< Q
+    };
+
+    static Cmd classify(etl::string_view line);
+
+    /// Parses cmdline in place; nothing is copied or allocated.
     void processCmd(int iClient);
+    void multiThrottle(etl::string_view line, int iClient);
 
     char powerStatus = '0';
 
@@ -104,28 +223,41 @@ private:
     }
 
 
-    void wifiPrintln(int iClient, String v) {
-        clients[iClient].println(v);
-        //WT_LOGI("WTTX %s", v.c_str() );
-    }
-    void wifiPrint(int iClient, String v) {
-        clients[iClient].print(v);
-        //WT_LOGI("WFTX %s", v.c_str() );
-    }
+    /// Appends a formatted line to client's output.
+    void reply(int iClient, const char *fmt, ...) __attribute__ ((format (printf, 3, 4)));
+    /// Formats a line once and appends it to all connected clients.
+    void broadcast(const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+    /// Appends "M<th><action><addr><;>" followed by formatted value.
+    void locoReply(int iClient, char th, char action, LocoAddress addr, const char *fmt, ...) __attribute__ ((format (printf, 6, 7)));
+    /// Appends "M<th>L<addr><;>]\[label0]\[label1..." for a roster loco.
+    void locoLabels(int iClient, char th, const LocoRoster::Loco &loco);
+
+    void append(int iClient, const char *s, uint16_t len);
+    void flush(int iClient);
 
-    void clientStart(int iClient) ;
+    /// @return false if client has to wait for the handshake, it is retried in next loop()
+    bool clientStart(int iClient);
 
     void clientStop(int iClient);
 
-    void locoAdd(char th, String sLocoAddr, int iClient);
+    void locoAdd(char th, etl::string_view sLocoAddr, int iClient);
 
-    void locoRelease(char th, String sLocoAddr, int iClient);
+    void locoRelease(char th, etl::string_view sLocoAddr, int iClient);
     void locoRelease(char th, LocoAddress addr, int iClient);
 
-    void locoAction(char th, String sLocoAddr, String actionVal, int iClient);
-    void locoAction(char th, LocoAddress addr, String actionVal, int iClient);
+    void locoAction(char th, etl::string_view sLocoAddr, etl::string_view actionVal, int iClient);
+    void locoAction(char th, LocoAddress addr, etl::string_view actionVal, int iClient);
 
-    void checkHeartbeat(int iClient);
+    static void heartbeatExpired(void *ctx, uint8_t iClient) {
+        ((WiThrottleServer*)ctx)->heartbeatTimeout(iClient);
+    }
+    /// No heartbeat from client in time, stops its locos.
+    void heartbeatTimeout(int iClient);
+
+    /// Any command from a client counts as activity on all its locos.
+    void touchSlots(int iClient);
 
     void accessoryToggle(int aAddr, char aStatus, bool namedTurnout);
+
+    void routeSet(int id);
 };
\ No newline at end of file
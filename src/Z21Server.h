@@ -0,0 +1,470 @@
+/**
+ * Roco Z21 LAN protocol server (UDP), for Z21 apps and other Z21 throttles.
+ * Commands are mapped directly onto CommandStation, without going through LocoNet.
+ *
+ * Implemented: serial/hardware info, broadcast flags, system state, track power, emergency stop,
+ * loco drive and functions, loco info, turnouts.
+ * Each client subscribes to locos it asked about (up to MAX_LOCO_SUBS, oldest dropped, purged locos removed),
+ * and gets LAN_X_LOCO_INFO for them when they change, whoever changed them. Loco info uses the speed steps of the slot.
+ *
+ * @see Z21 LAN Protokoll Spezifikation, Roco
+ */
+#pragma once
+
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <etl/vector.h>
+
+#include "CommandStation.h"
+
+
+#define Z21_DEBUG_
+
+#ifdef Z21_DEBUG
+#define Z21_LOGI(format, ...)  log_printf(ARDUHAL_LOG_FORMAT(I, format), ##__VA_ARGS__)
+#else
+#define Z21_LOGI(...)
+#endif
+
+
+class Z21Server: public CommandStation::SlotListener {
+public:
+
+    static const uint16_t DEFAULT_PORT = 21105;
+    static const uint8_t MAX_CLIENTS = 16;
+    static const uint8_t MAX_LOCO_SUBS = 16;
+    /// Clients that send nothing for this long are dropped, as a real Z21 does.
+    static const uint32_t CLIENT_TIMEOUT_MS = 60000;
+
+    /// LAN_SET_BROADCASTFLAGS bits
+    enum: uint32_t {
+        BC_DRIVING_SWITCHING = 0x00000001,
+        BC_SYSTEM_STATE      = 0x00000100,
+        BC_ALL_LOCOS         = 0x00010000
+    };
+
+    struct Stats {
+        uint32_t rxPackets;
+        uint32_t rxMessages;
+        uint32_t unknown;     ///< unsupported or malformed messages
+        uint32_t txPackets;
+        uint32_t txMessages;
+        uint16_t clients;
+    };
+
+    Z21Server(uint16_t port=DEFAULT_PORT): port(port) {}
+
+    void begin() {
+        udp.begin(port);
+        lastPower = CS.getPowerState();
+    }
+
+    void end() {
+        udp.stop();
+    }
+
+    /// Handles all waiting datagrams and sends state changes. Call from main loop.
+    void loop() {
+        int len;
+        while( (len = udp.parsePacket()) > 0 ) {
+            if(len > (int)sizeof(rxBuf)) len = sizeof(rxBuf);
+            len = udp.read(rxBuf, len);
+            if(len>0) processPacket(udp.remoteIP(), udp.remotePort(), rxBuf, len);
+        }
+
+        bool p = CS.getPowerState();
+        if(p!=lastPower) {
+            lastPower = p;
+            broadcastPower();
+        }
+        if(dirtySlots!=0) sendLocoChanges();
+
+        if(millis()-lastPurge > 1000) {
+            lastPurge = millis();
+            for(auto it=clients.begin(); it!=clients.end(); ) {
+                if(millis()-it->lastSeen > CLIENT_TIMEOUT_MS) it = clients.erase(it); else ++it;
+            }
+        }
+    }
+
+    /// A freed loco is dropped from subscriptions, it is not announced any more.
+    void onSlotPurge(uint8_t slot, CommandStation::SlotAge age) override {
+        if(age!=CommandStation::SlotAge::FREE) return;
+        uint16_t za = CS.getLocoAddr(slot).addr();
+        for(auto &c: clients) {
+            for(auto it=c.locos.begin(); it!=c.locos.end(); ++it)
+                if(*it==za) { c.locos.erase(it); break; }
+        }
+        if(slot<32) dirtySlots &= ~(1UL<<slot);
+    }
+
+    void onSlotChange(uint8_t slot) override {
+        if(slot<32) dirtySlots |= 1UL<<slot;
+    }
+
+    const Stats& getStats() {
+        stats.clients = clients.size();
+        return stats;
+    }
+
+private:
+
+    uint16_t port;
+    WiFiUDP udp;
+
+    struct Client {
+        IPAddress ip;
+        uint16_t port;
+        uint32_t flags;
+        uint32_t lastSeen;
+        /// Z21 loco addresses, oldest first
+        etl::vector<uint16_t, MAX_LOCO_SUBS> locos;
+    };
+    etl::vector<Client, MAX_CLIENTS> clients;
+
+    uint8_t rxBuf[512];
+
+    /// Messages for one client, sent as one datagram.
+    struct Reply {
+        uint8_t buf[256];
+        uint16_t len = 0;
+    };
+
+    static_assert(CommandStation::MAX_SLOTS<32, "dirtySlots is 32 bits");
+    uint32_t dirtySlots = 0;
+    bool lastPower = false;
+    uint32_t lastPurge = 0;
+
+    Stats stats = {};
+
+    enum: uint16_t {
+        LAN_GET_SERIAL_NUMBER = 0x10,
+        LAN_GET_HWINFO = 0x1A,
+        LAN_LOGOFF = 0x30,
+        LAN_X = 0x40,
+        LAN_SET_BROADCASTFLAGS = 0x50,
+        LAN_GET_BROADCASTFLAGS = 0x51,
+        LAN_SYSTEMSTATE_DATACHANGED = 0x84,
+        LAN_SYSTEMSTATE_GETDATA = 0x85
+    };
+
+    Client* findClient(IPAddress ip, uint16_t port, bool create) {
+        for(auto &c: clients)
+            if(c.ip==ip && c.port==port) return &c;
+        if(!create) return nullptr;
+        if(clients.full()) {
+            // replace the client heard from least recently
+            auto oldest = clients.begin();
+            for(auto it=clients.begin(); it!=clients.end(); ++it)
+                if(millis()-it->lastSeen > millis()-oldest->lastSeen) oldest = it;
+            clients.erase(oldest);
+        }
+        clients.push_back(Client{ip, port, 0, millis(), {}});
+        Z21_LOGI("New client %s:%d", ip.toString().c_str(), port);
+        return &clients.back();
+    }
+
+    void processPacket(IPAddress ip, uint16_t rport, const uint8_t *p, int len) {
+        stats.rxPackets++;
+        Client *c = findClient(ip, rport, true);
+        c->lastSeen = millis();
+        Reply r;
+        // a datagram may carry several messages: [DataLen LE16][Header LE16][Data]
+        while(len >= 4) {
+            uint16_t mlen = p[0] | p[1]<<8;
+            if(mlen<4 || mlen>len) { stats.unknown++; break; }
+            stats.rxMessages++;
+            if(!processMessage(c, p[2] | p[3]<<8, p+4, mlen-4, r)) break; // client logged off
+            p += mlen;
+            len -= mlen;
+        }
+        if(r.len>0 && findClient(ip, rport, false)!=nullptr) send(ip, rport, r);
+    }
+
+    /// @return false if client was removed
+    bool processMessage(Client *c, uint16_t header, const uint8_t *d, uint16_t len, Reply &r) {
+        switch(header) {
+            case LAN_GET_SERIAL_NUMBER: {
+                uint8_t v[4] = {1, 0, 0, 0};
+                add(r, LAN_GET_SERIAL_NUMBER, v, 4);
+                break;
+            }
+            case LAN_GET_HWINFO: {
+                // hardware type Z21 (2013), firmware 1.40
+                uint8_t v[8] = {0x01, 0x02, 0, 0,  0x40, 0x01, 0, 0};
+                add(r, LAN_GET_HWINFO, v, 8);
+                break;
+            }
+            case LAN_LOGOFF:
+                for(auto it=clients.begin(); it!=clients.end(); ++it)
+                    if(&*it==c) { clients.erase(it); break; }
+                return false;
+            case LAN_SET_BROADCASTFLAGS:
+                if(len>=4) c->flags = d[0] | d[1]<<8 | (uint32_t)d[2]<<16 | (uint32_t)d[3]<<24;
+                break;
+            case LAN_GET_BROADCASTFLAGS: {
+                uint8_t v[4] = { (uint8_t)c->flags, (uint8_t)(c->flags>>8), (uint8_t)(c->flags>>16), (uint8_t)(c->flags>>24) };
+                add(r, LAN_GET_BROADCASTFLAGS, v, 4);
+                break;
+            }
+            case LAN_SYSTEMSTATE_GETDATA:
+                addSystemState(r);
+                break;
+            case LAN_X:
+                processX(c, d, len, r);
+                break;
+            default:
+                stats.unknown++;
+                break;
+        }
+        return true;
+    }
+
+    void processX(Client *c, const uint8_t *d, uint16_t len, Reply &r) {
+        uint8_t x = 0;
+        for(uint16_t i=0; i<len; i++) x ^= d[i];
+        if(len<2 || x!=0) { stats.unknown++; return; }
+
+        switch(d[0]) {
+            case 0x21:
+                switch(d[1]) {
+                    case 0x21: { uint8_t v[] = {0x63, 0x21, 0x30, 0x12}; addX(r, v, sizeof(v)); return; } // X-Bus 3.0, Z21
+                    case 0x24: { uint8_t v[] = {0x62, 0x22, centralState()}; addX(r, v, sizeof(v)); return; }
+                    case 0x80: CS.setPowerState(false); return; // broadcast from loop()
+                    case 0x81: CS.setPowerState(true); return;
+                }
+                break;
+            case 0x80: // stop all locos
+                if(d[1]!=0x80) break;
+                for(uint8_t s=1; s<=CommandStation::MAX_SLOTS; s++)
+                    if(CS.isSlotAllocated(s)) CS.setLocoSpeed(s, 1);
+                {
+                    uint8_t v[] = {0x81, 0x00};
+                    broadcastX(v, sizeof(v), BC_DRIVING_SWITCHING);
+                }
+                return;
+            case 0xF1: // firmware version 1.40
+                if(d[1]==0x0A) { uint8_t v[] = {0xF3, 0x0A, 0x01, 0x40}; addX(r, v, sizeof(v)); return; }
+                break;
+            case 0xE3: // get loco info
+                if(d[1]==0xF0 && len>=5) {
+                    uint16_t za = (d[2]&0x3F)<<8 | d[3];
+                    subscribe(c, za);
+                    addLocoInfo(r, za);
+                    return;
+                }
+                break;
+            case 0xE4:
+                if(len<6) break;
+                if((d[1]&0xF0)==0x10) { setLocoDrive(c, (d[2]&0x3F)<<8 | d[3], d[1]&0x0F, d[4]); return; }
+                if(d[1]==0xF8) { setLocoFunction(c, (d[2]&0x3F)<<8 | d[3], d[4]); return; }
+                break;
+            case 0x43: // get turnout info
+                if(len>=4) { addTurnoutInfo(r, d[1]<<8 | d[2]); return; }
+                break;
+            case 0x53: // set turnout
+                if(len>=5) { setTurnout(d[1]<<8 | d[2], d[3]); return; }
+                break;
+        }
+        stats.unknown++;
+        uint8_t v[] = {0x61, 0x82}; // LAN_X_UNKNOWN_COMMAND
+        addX(r, v, sizeof(v));
+    }
+
+    /// Z21 addresses from 128 up are long DCC addresses.
+    static LocoAddress locoAddr(uint16_t za) {
+        return za<128 ? LocoAddress::shortAddr(za) : LocoAddress::longAddr(za);
+    }
+
+    void subscribe(Client *c, uint16_t za) {
+        for(auto a: c->locos) if(a==za) return;
+        if(c->locos.full()) c->locos.erase(c->locos.begin());
+        c->locos.push_back(za);
+    }
+
+    /**
+     * @param steps 0: 14, 2: 28, 3: 128 speed steps
+     * @param rv direction (bit 7, 1=forward) and speed in Z21 encoding
+     */
+    void setLocoDrive(Client *c, uint16_t za, uint8_t steps, uint8_t rv) {
+        if(za==0) return;
+        uint8_t slot = CS.findOrAllocateLocoSlot(locoAddr(za));
+        if(slot==0) return;
+        subscribe(c, za);
+        CS.touchLocoSlot(slot);
+        CS.setLocoDir(slot, rv>>7);
+        CS.setLocoSpeed(slot, toDccSpeed(steps, rv & 0x7F));
+    }
+
+    /// @param tn bits 7-6: 0 off, 1 on, 2 toggle; bits 5-0: function number
+    void setLocoFunction(Client *c, uint16_t za, uint8_t tn) {
+        if(za==0) return;
+        uint8_t fn = tn & 0x3F;
+        if(fn>28) return;
+        uint8_t slot = CS.findOrAllocateLocoSlot(locoAddr(za));
+        if(slot==0) return;
+        subscribe(c, za);
+        CS.touchLocoSlot(slot);
+        switch(tn>>6) {
+            case 0: CS.setLocoFn(slot, fn, false); break;
+            case 1: CS.setLocoFn(slot, fn, true); break;
+            case 2: CS.setLocoFn(slot, fn, !CS.getLocoFn(slot, fn)); break;
+        }
+    }
+
+    /**
+     * Converts Z21 speed of given step mode to DCC 128-step speed of CommandStation (0 stop, 1 e-stop, 2..127).
+     * Step n becomes the highest speed that a 14 or 28 step decoder is sent as step n, so the top step is 127.
+     */
+    static uint8_t toDccSpeed(uint8_t steps, uint8_t v) {
+        uint8_t n, max;
+        switch(steps) {
+            case 0: // 14 steps: 0000VVVV
+                v &= 0x0F;
+                if(v<2) return v;
+                n = v-1; max = 14;
+                break;
+            case 2: // 28 steps: 000 V0 V4..V1, V0 is the lowest bit
+                if((v&0x0F)<2) return v&0x01;
+                n = ((v&0x0F)<<1 | (v>>4 & 1)) - 3; max = 28;
+                break;
+            default:
+                return v;
+        }
+        return 1 + (n*126 + max-1)/max;
+    }
+
+    /// Converts CommandStation speed to Z21 encoding of 14, 28 or 128 steps, rounding as DCC packets do.
+    static uint8_t toZ21Speed(uint8_t steps, uint8_t speed) {
+        if(steps!=14 && steps!=28) return speed & 0x7F;
+        uint8_t step = speed<2 ? 0 : 1 + (speed-2)*steps/126;
+        if(steps==14) return step!=0 ? step+1 : speed&1;
+        uint8_t s5 = step!=0 ? step+3 : (speed&1)<<1;
+        return (s5&1)<<4 | s5>>1;
+    }
+
+    void setTurnout(uint16_t fAddr, uint8_t v) {
+        // 10Q0A00P: only activation is acted upon, CS switches the output off itself
+        if((v & 0x08)==0) return;
+        uint16_t addr = fAddr+1;
+        if(addr<1 || addr>AccessoryStore::MAX_ADDR) return;
+        // as a roster command, so switching from a Z21 app does not add turnouts to the roster
+        CS.turnoutAction(addr, true, (v & 0x01) ? TurnoutState::CLOSED : TurnoutState::THROWN);
+        Reply r;
+        addTurnoutInfo(r, fAddr);
+        broadcast(r, BC_DRIVING_SWITCHING);
+    }
+
+    uint8_t centralState() {
+        return CS.getPowerState() ? 0x00 : 0x02; // csTrackVoltageOff
+    }
+
+    /// Appends message with header and data.
+    void add(Reply &r, uint16_t header, const uint8_t *d, uint8_t len) {
+        if(r.len+4+len > (int)sizeof(r.buf)) return;
+        uint8_t *p = r.buf+r.len;
+        p[0] = 4+len; p[1] = 0;
+        p[2] = header & 0xFF; p[3] = header>>8;
+        memcpy(p+4, d, len);
+        r.len += 4+len;
+        stats.txMessages++;
+    }
+
+    /// Appends LAN_X message, adding XOR byte.
+    void addX(Reply &r, const uint8_t *d, uint8_t len) {
+        uint8_t v[16];
+        uint8_t x = 0;
+        for(uint8_t i=0; i<len; i++) x ^= v[i] = d[i];
+        v[len] = x;
+        add(r, LAN_X, v, len+1);
+    }
+
+    void addSystemState(Reply &r) {
+        uint8_t v[16] = {};
+        v[12] = centralState();
+        add(r, LAN_SYSTEMSTATE_DATACHANGED, v, sizeof(v));
+    }
+
+    void addLocoInfo(Reply &r, uint16_t za) {
+        uint8_t v[9];
+        v[0] = 0xEF;
+        v[1] = (za>>8) | (za>=128 ? 0xC0 : 0);
+        v[2] = za & 0xFF;
+        v[3] = 0x04; // 128 steps
+        uint8_t slot = CS.findLocoSlot(locoAddr(za));
+        if(slot==0) {
+            memset(v+4, 0, 5);
+            v[4] = 0x80; // forward, stopped
+        } else {
+            uint32_t f = CS.getLocoFns(slot);
+            uint8_t steps = CS.getLocoSpeedSteps(slot);
+            v[3] = steps==14 ? 0x00 : steps==28 ? 0x02 : 0x04;
+            v[4] = (CS.getLocoDir(slot) ? 0x80 : 0) | toZ21Speed(steps, CS.getLocoSpeed(slot));
+            v[5] = (f&1)<<4 | ((f>>1) & 0x0F);
+            v[6] = (f>>5) & 0xFF;
+            v[7] = (f>>13) & 0xFF;
+            v[8] = (f>>21) & 0xFF;
+        }
+        addX(r, v, sizeof(v));
+    }
+
+    void addTurnoutInfo(Reply &r, uint16_t fAddr) {
+        uint8_t zz = 0;
+        switch(CS.getTurnoutState(fAddr+1)) {
+            case TurnoutState::THROWN: zz = 0x01; break;
+            case TurnoutState::CLOSED: zz = 0x02; break;
+            default: break;
+        }
+        uint8_t v[] = {0x43, (uint8_t)(fAddr>>8), (uint8_t)(fAddr & 0xFF), zz};
+        addX(r, v, sizeof(v));
+    }
+
+    void send(IPAddress ip, uint16_t rport, const Reply &r) {
+        udp.beginPacket(ip, rport);
+        udp.write(r.buf, r.len);
+        udp.endPacket();
+        stats.txPackets++;
+    }
+
+    void broadcast(const Reply &r, uint32_t flags) {
+        for(auto &c: clients)
+            if(c.flags & flags) send(c.ip, c.port, r);
+    }
+
+    void broadcastX(const uint8_t *d, uint8_t len, uint32_t flags) {
+        Reply r;
+        addX(r, d, len);
+        broadcast(r, flags);
+    }
+
+    void broadcastPower() {
+        uint8_t v[] = {0x61, (uint8_t)(lastPower ? 0x01 : 0x00)};
+        Reply r;
+        addX(r, v, sizeof(v));
+        broadcast(r, BC_DRIVING_SWITCHING);
+        Reply s;
+        addSystemState(s);
+        broadcast(s, BC_SYSTEM_STATE);
+    }
+
+    /// Sends LAN_X_LOCO_INFO of changed slots, one datagram per interested client.
+    void sendLocoChanges() {
+        uint16_t addrs[CommandStation::MAX_SLOTS];
+        uint8_t n = 0;
+        for(uint8_t s=1; s<=CommandStation::MAX_SLOTS; s++) {
+            if( (dirtySlots & (1UL<<s))==0 || !CS.isSlotAllocated(s) ) continue;
+            addrs[n++] = CS.getLocoAddr(s).addr();
+        }
+        dirtySlots = 0;
+        for(auto &c: clients) {
+            Reply r;
+            for(uint8_t i=0; i<n; i++) {
+                bool sub = (c.flags & BC_ALL_LOCOS)!=0;
+                for(auto a: c.locos) if(a==addrs[i]) { sub = true; break; }
+                if(sub) addLocoInfo(r, addrs[i]);
+            }
+            if(r.len>0) send(c.ip, c.port, r);
+        }
+    }
+
+};
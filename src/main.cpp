@@ -9,6 +9,11 @@
 
 #include "LocoNetSerial.h"
 #include "LbServer.h"
+#include "LbBinaryServer.h"
+#include "LocoNetStateCache.h"
+#include "ReflexRules.h"
+#include "LnRoute.h"
+#include "LnRecorder.h"
 
 
 #include <WiFi.h>
@@ -16,6 +21,8 @@
 #include <WiFiManager.h>
 
 #include "WiThrottle.h"
+#include "Z21Server.h"
+#include "DccExServer.h"
 
 LocoNetBus bus;
 
@@ -27,11 +34,27 @@ LocoNetBus bus;
 //LocoNetESP32Hybrid locoNetPhy(&bus, LOCONET_PIN_RX, LOCONET_PIN_TX, 1, false, true, 0 );
 #include <LocoNetESP32.h>
 LocoNetESP32 locoNetPhy(&bus, LOCONET_PIN_RX, LOCONET_PIN_TX, 0);
+/// first consumer on the bus, so sensor reactions don't wait for logging and other consumers
+ReflexRules reflexRules(&bus);
+/// Sensor reactions in ReflexRules text format, e.g. -DREFLEX_RULES='"12 active stop short 3\n"'
+#ifndef REFLEX_RULES
+#define REFLEX_RULES ""
+#endif
 LocoNetDispatcher parser(&bus);
+LocoNetStateCache stateCache(&bus);
+/// last 512 bus messages; connect to CAPTURE_TCP_PORT to download them (e.g. nc station 1236 > bus.lncp)
+LnRecorder<512> lnRecorder(&bus);
 
 
 #define LBSERVER_TCP_PORT  1234
 LbServer lbServer(LBSERVER_TCP_PORT, &bus);
+#define LBBINARY_TCP_PORT  1235
+LbBinaryServer lbBinaryServer(LBBINARY_TCP_PORT, &bus);
+#define CAPTURE_TCP_PORT  1236
+WiFiServer captureServer(CAPTURE_TCP_PORT);
+/// capture being sent, one chunk per loop()
+WiFiClient captureClient;
+LnRecorder<512>::DumpCursor captureCursor;
 
 //LocoNetSerial lSerial(&Serial, &bus);
 
@@ -53,6 +76,19 @@ LocoNetSlotManager slotMan(&bus);
 
 WiThrottleServer withrottleServer;
 
+Z21Server z21Server;
+
+#define DCCEX_TCP_PORT 2560
+/// pass &Serial as second parameter to also serve DCC-EX over USB (debug output will mix in)
+DccExServer dccExServer(DCCEX_TCP_PORT);
+
+/// "turnouts" partition in partitions.csv
+PartitionJournalStorage turnoutStorage;
+
+/// "roster" partition in partitions.csv
+PartitionRosterStorage rosterStorage;
+LocoRoster locoRoster;
+
 
 #define PIN_BT 13
 #define PIN_BT2 15
@@ -92,14 +128,6 @@ void setup() {
     });
 
 
-    parser.onSwitchRequest([](uint16_t address, bool output, bool direction) {
-        Serial.print("Switch Request: ");
-        Serial.print(address, DEC);
-        Serial.print(':');
-        Serial.print(direction ? "Closed" : "Thrown");
-        Serial.print(" - ");
-        Serial.println(output ? "On" : "Off");
-    });
     parser.onSwitchReport([](uint16_t address, bool state, bool sensor) {
         Serial.print("Switch/Sensor Report: ");
         Serial.print(address, DEC);
@@ -121,6 +149,28 @@ void setup() {
     CS.setDccMain(&dccMain);
     CS.setDccProg(&dccProg);
     CS.setLocoNetBus(&bus);
+    int nRules = reflexRules.load(REFLEX_RULES);
+    if(nRules<0) Serial.printf("REFLEX_RULES: error in line %d\n", -nRules);
+    CS.addSlotListener(&slotMan);
+    slotMan.setPhy(&locoNetPhy);
+    CS.addSlotListener(&withrottleServer);
+    CS.addTurnoutListener(&withrottleServer);
+    CS.addSlotListener(&z21Server);
+    CS.addSlotListener(&dccExServer);
+
+    if(turnoutStorage.begin()) {
+        CS.setTurnoutStorage(&turnoutStorage);
+        CS.loadTurnouts();
+    } else {
+        Serial.println("Failed to open turnout journal partition");
+    }
+    if(rosterStorage.begin()) {
+        locoRoster.begin(&rosterStorage);
+        CS.setLocoRoster(&locoRoster);
+        dccExServer.setLocoRoster(&locoRoster);
+    } else {
+        Serial.println("Failed to open loco roster partition");
+    }
     
 
     
@@ -152,8 +202,13 @@ void setup() {
     dccMain.setPower(true);
     dccProg.setPower(true);
 
+    lbServer.setStateCache(&stateCache);
     lbServer.begin();
+    lbBinaryServer.begin();
+    captureServer.begin();
     withrottleServer.begin(); 
+    z21Server.begin();
+    dccExServer.begin();
 
     ledFire();
 
@@ -162,8 +217,23 @@ void setup() {
 
 void loop() {
 
+    reflexRules.loop();
+
     lbServer.loop();
+    lbBinaryServer.loop();
+    if(!captureCursor.active) {
+        captureClient = captureServer.available();
+        if(captureClient) lnRecorder.dumpBegin(captureCursor);
+    } else if(!lnRecorder.dumpStep(captureCursor, captureClient)) {
+        captureClient.stop();
+        Serial.printf("capture: %d bytes sent\n", (int)captureCursor.total);
+    }
     withrottleServer.loop();
+    z21Server.loop();
+    dccExServer.loop();
+    CS.loop();
+    locoRoster.loop();
+    slotMan.loop();
     //lSerial.loop();
     
     /*
@@ -189,8 +259,11 @@ void loop() {
             
             //Serial.printf("main(): readCVProg: %d\n", r);
             Serial.printf( "reporting sensor %d\n", v==HIGH) ;
-            reportSensor(&bus, 1, v==HIGH);
-            Serial.printf("errs: rx:%d,  tx:%d\n", locoNetPhy.getRxStats()->rxErrors, locoNetPhy.getTxStats()->txErrors );
+            {
+                LnRoute::OriginScope o(LnOrigin::STATION);
+                reportSensor(&bus, 1, v==HIGH);
+            }
+            Serial.printf("errs: rx:%d,  tx:%d\n", (int)locoNetPhy.getRxStats()->rxErrors, (int)locoNetPhy.getTxStats()->txErrors );
         }
         inState = v;
 
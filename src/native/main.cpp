@@ -0,0 +1,259 @@
+/**
+ * Host build of the command station (pio run -e native). Same objects as main.cpp, on top of lib/NativeHal:
+ * servers listen on the same ports of the local machine, DCC timer runs in a thread, turnouts and roster
+ * are kept in files in the working directory. There is no LocoNet phy, the bus only connects the
+ * consumers in this process (use LbServer or -r to put messages on it).
+ *
+ * Options:
+ *   -r capture.lncp  replay a capture made with LnRecorder into the bus after startup
+ *   -s speed         replay speed factor, 0 sends everything at once (default 1)
+ *   -t seconds       exit after this time and print stats (default: run until SIGINT/SIGTERM)
+ *   -x rules.txt     load sensor reactions (ReflexRules text format)
+ *
+ * Not built into unit tests (pio test -e native), they have their own main().
+ */
+#ifndef PIO_UNIT_TESTING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <Arduino.h>
+
+#include <DCC.h>
+
+#include "CommandStation.h"
+
+#include "LocoNetSlotManager.h"
+
+#include "LbServer.h"
+#include "LbBinaryServer.h"
+#include "LocoNetStateCache.h"
+#include "ReflexRules.h"
+#include "LnRoute.h"
+#include "LnRecorder.h"
+#include "LnReplay.h"
+
+#include <WiFi.h>
+
+#include "WiThrottle.h"
+#include "Z21Server.h"
+#include "DccExServer.h"
+
+LocoNetBus bus;
+
+ReflexRules reflexRules(&bus);
+LocoNetDispatcher parser(&bus);
+LocoNetStateCache stateCache(&bus);
+LnRecorder<512> lnRecorder(&bus);
+LnReplay lnReplay(&bus);
+
+#define LBSERVER_TCP_PORT  1234
+LbServer lbServer(LBSERVER_TCP_PORT, &bus);
+#define LBBINARY_TCP_PORT  1235
+LbBinaryServer lbBinaryServer(LBBINARY_TCP_PORT, &bus);
+#define CAPTURE_TCP_PORT  1236
+WiFiServer captureServer(CAPTURE_TCP_PORT);
+/// capture being sent, one chunk per loop()
+WiFiClient captureClient;
+LnRecorder<512>::DumpCursor captureCursor;
+
+/// same pins as the station, so NativeHal::setAnalog etc. can be used with the numbers from main.cpp
+#define DCC_MAIN_PIN 25
+#define DCC_MAIN_PIN_EN 32
+#define DCC_MAIN_PIN_SENSE 36
+#define DCC_PROG_PIN 26
+#define DCC_PROG_PIN_EN 33
+#define DCC_PROG_PIN_SENSE 39
+
+DCCESP32Channel<10> dccMain(DCC_MAIN_PIN, DCC_MAIN_PIN_EN, DCC_MAIN_PIN_SENSE);
+DCCESP32Channel<2> dccProg(DCC_PROG_PIN, DCC_PROG_PIN_EN, DCC_PROG_PIN_SENSE);
+DCCESP32SignalGenerator dccTimer(1);
+
+LocoNetSlotManager slotMan(&bus);
+
+WiThrottleServer withrottleServer;
+
+Z21Server z21Server;
+
+#define DCCEX_TCP_PORT 2560
+DccExServer dccExServer(DCCEX_TCP_PORT);
+
+/// same size and erase blocks as the "turnouts" partition
+FileJournalStorage turnoutStorage("turnouts.bin", 0x6000, 4096);
+
+/// same size as the "roster" partition
+FileRosterStorage rosterStorage("roster.bin", 0x8000);
+LocoRoster locoRoster;
+
+static uint8_t *replayData = nullptr;
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int) { stopRequested = 1; }
+
+/// @return number of rules, or <0 on error
+static int loadRules(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if(f==nullptr) return -1;
+    static char text[4096];
+    size_t n = fread(text, 1, sizeof(text)-1, f);
+    fclose(f);
+    text[n] = 0;
+    int ret = reflexRules.load(text);
+    if(ret<0) fprintf(stderr, "%s:%d: bad rule\n", path, -ret);
+    return ret;
+}
+
+static bool loadReplay(const char *path, uint16_t speed) {
+    FILE *f = fopen(path, "rb");
+    if(f==nullptr) return false;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    replayData = (uint8_t*)malloc(len>0 ? len : 1);
+    bool ok = len>0 && fread(replayData, 1, len, f)==(size_t)len;
+    fclose(f);
+    return ok && lnReplay.begin(replayData, len, speed);
+}
+
+void setup() {
+
+    Serial.begin(115200);
+    Serial.println("Ultimate LocoNet Command Station (native)");
+
+    parser.onSensorChange([](uint16_t address, bool state) {
+        Serial.printf("Sensor: %d - %s\n", address, state ? "Active" : "Inactive");
+    });
+
+    dccTimer.setMainChannel(&dccMain);
+    dccTimer.setProgChannel(&dccProg);
+
+    CS.setDccMain(&dccMain);
+    CS.setDccProg(&dccProg);
+    CS.setLocoNetBus(&bus);
+    CS.addSlotListener(&slotMan);
+    CS.addSlotListener(&withrottleServer);
+    CS.addTurnoutListener(&withrottleServer);
+    CS.addSlotListener(&z21Server);
+    CS.addSlotListener(&dccExServer);
+
+    CS.setTurnoutStorage(&turnoutStorage);
+    CS.loadTurnouts();
+    locoRoster.begin(&rosterStorage);
+    CS.setLocoRoster(&locoRoster);
+    dccExServer.setLocoRoster(&locoRoster);
+
+    Serial.print("IP address: ");
+    Serial.println(WiFi.localIP());
+
+    dccTimer.begin();
+
+    dccMain.setPower(true);
+    dccProg.setPower(true);
+
+    lbServer.setStateCache(&stateCache);
+    lbServer.begin();
+    lbBinaryServer.begin();
+    captureServer.begin();
+    withrottleServer.begin();
+    z21Server.begin();
+    dccExServer.begin();
+}
+
+void loop() {
+
+    reflexRules.loop();
+
+    lbServer.loop();
+    lbBinaryServer.loop();
+    if(!captureCursor.active) {
+        captureClient = captureServer.available();
+        if(captureClient) lnRecorder.dumpBegin(captureCursor);
+    } else if(!lnRecorder.dumpStep(captureCursor, captureClient)) {
+        captureClient.stop();
+        Serial.printf("capture: %d bytes sent\n", (int)captureCursor.total);
+    }
+    withrottleServer.loop();
+    z21Server.loop();
+    dccExServer.loop();
+    CS.loop();
+    locoRoster.loop();
+    slotMan.loop();
+    if(!lnReplay.done()) lnReplay.loop();
+
+    static uint32_t lastCurrentCheck = millis();
+    if(millis()-lastCurrentCheck > 1) {
+        lastCurrentCheck = millis();
+        if(!dccMain.checkOvercurrent()) {
+            withrottleServer.notifyPowerStatus();
+            Serial.println("Overcurrent on main");
+        }
+        if(!dccProg.checkOvercurrent()) {
+            Serial.println("Overcurrent on prog");
+        }
+    }
+}
+
+static void printStats() {
+    LnTxQueue::Stats tx = slotMan.getTxStats();
+    Serial.printf("slotman tx: sent %d, retries %d, dropped %d\n", (int)tx.sent, (int)tx.retries, (int)tx.dropped);
+    const LbServer::TxStats &ls = lbServer.getTxStats();
+    Serial.printf("lbserver: sent %d, dropped %d, client drops %d, slow clients closed %d\n",
+        (int)ls.sent, (int)ls.dropped, (int)ls.clientDrops, (int)ls.slowClosed);
+    const LbBinaryServer::Stats &bs = lbBinaryServer.getStats();
+    Serial.printf("lbbinary: %d frames, %d bytes, client drops %d, slow clients closed %d\n",
+        (int)bs.txFrames, (int)bs.txBytes, (int)bs.clientDrops, (int)bs.slowClosed);
+    ReflexRules::Stats xs = reflexRules.getStats();
+    Serial.printf("reflex: %d events, %d fired, max reaction %d us\n", (int)xs.events, (int)xs.fired, (int)xs.maxReactionUs);
+    const LnReplay::Stats &rs = lnReplay.getStats();
+    Serial.printf("replay: %d messages, %d failed, max late %d us%s\n",
+        (int)rs.messages, (int)rs.failed, (int)rs.maxLateUs, rs.corrupt ? ", corrupt" : "");
+}
+
+int main(int argc, char **argv) {
+    const char *replayPath = nullptr;
+    const char *rulesPath = nullptr;
+    uint16_t replaySpeed = 1;
+    long runTime = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "r:s:t:x:"))!=-1) {
+        switch(opt) {
+            case 'r': replayPath = optarg; break;
+            case 's': replaySpeed = atoi(optarg); break;
+            case 't': runTime = atol(optarg); break;
+            case 'x': rulesPath = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-r capture.lncp] [-s speed] [-t seconds] [-x rules.txt]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    setup();
+
+    if(rulesPath!=nullptr && loadRules(rulesPath)<0) {
+        fprintf(stderr, "Can't load rules from %s\n", rulesPath);
+        return 1;
+    }
+
+    if(replayPath!=nullptr && !loadReplay(replayPath, replaySpeed)) {
+        fprintf(stderr, "Can't replay %s\n", replayPath);
+        return 1;
+    }
+
+    uint32_t start = millis();
+    while(!stopRequested && (runTime==0 || millis()-start < runTime*1000)) {
+        loop();
+        delay(1);
+    }
+
+    // roster edits are written after a delay, don't lose the last ones
+    locoRoster.rebuild();
+    printStats();
+    free(replayData);
+    return 0;
+}
+
+#endif // PIO_UNIT_TESTING
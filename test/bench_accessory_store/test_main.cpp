@@ -0,0 +1,97 @@
+/**
+ * AccessoryStore against the turnout map it replaced (etl::map keyed by address) and a std::map
+ * holding every address. Same pseudo-random sequence of get/set for all three; prints ns per
+ * operation and RAM. pio test -e native -f bench_accessory_store
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <chrono>
+#include <map>
+#include <etl/map.h>
+
+#include "AccessoryStore.h"
+
+static const int OPS = 2000000;
+static volatile uint32_t sink;
+
+/// xorshift, so every container sees the same addresses
+struct Rng {
+    uint32_t s = 2463534242u;
+    uint32_t next() { s ^= s<<13; s ^= s>>17; s ^= s<<5; return s; }
+};
+
+template<class F>
+static double nsPerOp(F f) {
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(t1-t0).count() / OPS;
+}
+
+/// 3 of 4 operations are reads, as in WiThrottle/LbServer state queries vs. throws.
+template<class Get, class Set>
+static void workload(uint16_t addrCount, const uint16_t *addrs, Get get, Set set) {
+    Rng r;
+    uint32_t acc = 0;
+    for(int i=0; i<OPS; i++) {
+        uint32_t x = r.next();
+        uint16_t a = addrs[x % addrCount];
+        if((x>>16 & 3)==0) set(a, (TurnoutState)(x>>20 & 1));
+        else acc += (uint32_t)get(a);
+    }
+    sink = acc;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+/// Old layout: at most 15 turnouts (MAX_TURNOUTS before the change).
+void test_against_old_map(void) {
+    uint16_t addrs[15];
+    for(uint16_t i=0; i<15; i++) addrs[i] = 1 + i*97;
+
+    AccessoryStore store;
+    etl::map<uint16_t, TurnoutState, 15> old;
+    for(auto a: addrs) old[a] = TurnoutState::CLOSED;
+
+    double tStore = nsPerOp([&]{ workload(15, addrs,
+        [&](uint16_t a){ return store.get(a); },
+        [&](uint16_t a, TurnoutState s){ store.set(a, s); }); });
+    double tOld = nsPerOp([&]{ workload(15, addrs,
+        [&](uint16_t a){ auto it = old.find(a); return it!=old.end() ? it->second : TurnoutState::UNKNOWN; },
+        [&](uint16_t a, TurnoutState s){ auto it = old.find(a); if(it!=old.end()) it->second = s; }); });
+
+    printf("15 turnouts:   AccessoryStore %.2f ns/op (%d B), etl::map<15> %.2f ns/op (%d B)\n",
+        tStore, (int)sizeof(store), tOld, (int)sizeof(old));
+    TEST_ASSERT_TRUE(tStore < tOld);
+}
+
+/// All addresses: the table keeps states the old map had to drop.
+void test_against_full_map(void) {
+    static uint16_t addrs[AccessoryStore::MAX_ADDR];
+    for(uint16_t i=0; i<AccessoryStore::MAX_ADDR; i++) addrs[i] = i+1;
+
+    AccessoryStore store;
+    std::map<uint16_t, TurnoutState> full;
+    for(auto a: addrs) full[a] = TurnoutState::CLOSED;
+
+    double tStore = nsPerOp([&]{ workload(AccessoryStore::MAX_ADDR, addrs,
+        [&](uint16_t a){ return store.get(a); },
+        [&](uint16_t a, TurnoutState s){ store.set(a, s); }); });
+    double tFull = nsPerOp([&]{ workload(AccessoryStore::MAX_ADDR, addrs,
+        [&](uint16_t a){ return full[a]; },
+        [&](uint16_t a, TurnoutState s){ full[a] = s; }); });
+
+    printf("2048 addresses: AccessoryStore %.2f ns/op (%d B), std::map %.2f ns/op (>%d B heap)\n",
+        tStore, (int)sizeof(store), tFull, (int)(full.size()*(sizeof(uint16_t)+sizeof(TurnoutState)+3*sizeof(void*))));
+    TEST_ASSERT_TRUE(tStore < tFull);
+    TEST_ASSERT_EQUAL(AccessoryStore::MAX_ADDR/4 + AccessoryStore::MAX_ADDR/8, sizeof(store));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_against_old_map);
+    RUN_TEST(test_against_full_map);
+    return UNITY_END();
+}
@@ -0,0 +1,225 @@
+/**
+ * Command latency of DccExServer against the LbServer path (LbServer, bus, LocoNetSlotManager) for a
+ * JMRI-like throttle: taking a loco, then speed changes. Latency is the time from the client's write until
+ * CommandStation has the new speed, and until the client has the station's answer. The station loop runs
+ * as in main.cpp, without pauses while a command is pending.
+ * pio test -e native -f bench_dccex_latency
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "DccExServer.h"
+#include "LbServer.h"
+#include "LocoNetSlotManager.h"
+
+static const uint16_t DCCEX_PORT = 44490;
+static const uint16_t LB_PORT = 44491;
+static const int COMMANDS = 2000;
+
+/// Takes packets instead of generating a signal.
+class NullChannel: public IDCCChannel {
+public:
+    void begin() override {}
+    void end() override {}
+    void unloadSlot(uint8_t) override {}
+    void setPower(bool v) override { power = v; }
+    bool getPower() override { return power; }
+    uint16_t readCurrentAdc() override { return 0; }
+protected:
+    void timerFunc() override {}
+    bool loadPacket(int, uint8_t*, uint8_t, int) override { return true; }
+private:
+    bool power = true;
+};
+
+static NullChannel dcc;
+static LocoNetBus bus;
+static LbServer lbServer(LB_PORT, &bus);
+static LocoNetSlotManager slotMan(&bus);
+static DccExServer dccExServer(DCCEX_PORT);
+
+/// The parts of main.cpp loop() on the paths measured.
+static void stationLoop() {
+    lbServer.loop();
+    dccExServer.loop();
+    CS.loop();
+    slotMan.loop();
+}
+
+static double usSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now()-t0).count();
+}
+
+static int connectTo(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT_EQUAL(0, connect(fd, (sockaddr*)&a, sizeof(a)));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+struct Latency {
+    double appliedUs;   ///< until CommandStation has it
+    double answerUs;    ///< until the client has the answer
+};
+
+/// Client of one protocol, driven from the station's thread between loop() passes.
+class Client {
+public:
+    explicit Client(uint16_t port): fd(connectTo(port)) {}
+    ~Client() { close(fd); }
+
+    /// Writes cmd and runs the station until `applied` holds and a received line starts with `answer`.
+    void request(const std::string &cmd, const char *answer, std::function<bool()> applied, Latency &l) {
+        auto t0 = std::chrono::steady_clock::now();
+        TEST_ASSERT_EQUAL((ssize_t)cmd.size(), send(fd, cmd.data(), cmd.size(), 0));
+        l.appliedUs = l.answerUs = -1;
+        while(l.appliedUs<0 || l.answerUs<0) {
+            TEST_ASSERT_TRUE_MESSAGE(usSince(t0) < 1e6, cmd.c_str());
+            stationLoop();
+            if(l.appliedUs<0 && applied()) l.appliedUs = usSince(t0);
+            if(l.answerUs<0 && received(answer)) l.answerUs = usSince(t0);
+            // lets the AsyncTCP thread run on a single core
+            if(l.appliedUs<0 || l.answerUs<0) usleep(1);
+        }
+    }
+
+    /// Reads everything pending, keeps what comes after the line found.
+    bool received(const char *answer) {
+        char buf[2048];
+        ssize_t n;
+        while((n = recv(fd, buf, sizeof(buf), 0)) > 0) rx.append(buf, n);
+        size_t b = 0, eol;
+        while((eol = rx.find_first_of(">\n", b))!=std::string::npos) {
+            std::string l = rx.substr(b, eol+1-b);
+            b = eol+1;
+            if(l.compare(0, strlen(answer), answer)==0) {
+                rx.erase(0, b);
+                return true;
+            }
+        }
+        rx.erase(0, b);
+        return false;
+    }
+
+private:
+    int fd;
+    std::string rx;
+};
+
+/// "SEND XX XX ...\n" with checksum.
+static std::string lbSend(std::vector<uint8_t> m) {
+    uint8_t chk = 0xFF;
+    for(uint8_t b: m) chk ^= b;
+    m.push_back(chk);
+    std::string s = "SEND";
+    char h[4];
+    for(uint8_t b: m) { snprintf(h, sizeof(h), " %02X", b); s += h; }
+    return s + "\n";
+}
+
+static void report(const char *name, const Latency &take, std::vector<Latency> &cmds) {
+    auto pct = [&](double Latency::*f, double p) {
+        std::vector<double> v;
+        for(auto &l: cmds) v.push_back(l.*f);
+        std::sort(v.begin(), v.end());
+        return v[(size_t)(p*(v.size()-1))];
+    };
+    printf("%s: take loco %.0f us; speed applied median %.0f us, p99 %.0f us; answer median %.0f us, p99 %.0f us\n",
+        name, take.answerUs, pct(&Latency::appliedUs, 0.5), pct(&Latency::appliedUs, 0.99),
+        pct(&Latency::answerUs, 0.5), pct(&Latency::answerUs, 0.99));
+}
+
+static double median(std::vector<Latency> &cmds) {
+    std::vector<double> v;
+    for(auto &l: cmds) v.push_back(l.appliedUs);
+    std::sort(v.begin(), v.end());
+    return v[v.size()/2];
+}
+
+static LocoAddress dccExLoco = LocoAddress::shortAddr(3);
+static LocoAddress lbLoco = LocoAddress::shortAddr(4);
+static Latency dccExTake, lbTake;
+static std::vector<Latency> dccExCmds, lbCmds;
+
+void setUp(void) {}
+void tearDown(void) {}
+
+/// <t cab speed dir> takes the loco and sets speed in one command; CS speed is DCC-EX speed + 1.
+void test_dccex(void) {
+    Client c(DCCEX_PORT);
+    c.request("<t 3 0 1>", "<l 3 ", []{ return CS.findLocoSlot(dccExLoco)!=0; }, dccExTake);
+    uint8_t slot = CS.findLocoSlot(dccExLoco);
+    for(int i=0; i<COMMANDS; i++) {
+        int spd = 1 + i%126;
+        char cmd[24];
+        snprintf(cmd, sizeof(cmd), "<t 3 %d 1>", spd);
+        Latency l;
+        c.request(cmd, "<l 3 ", [&]{ return CS.getLocoSpeed(slot)==spd+1; }, l);
+        dccExCmds.push_back(l);
+    }
+    report("DCC-EX  ", dccExTake, dccExCmds);
+}
+
+/**
+ * Address request, null move to take the slot, then OPC_LOCO_SPD answered with SENT OK. Each request is
+ * answered with slot data, which LnTxQueue paces at LocoNet line rate like on the station.
+ */
+void test_lbserver(void) {
+    Client c(LB_PORT);
+    Latency l1, l2;
+    c.request(lbSend({OPC_LOCO_ADR, 0, 4}), "RECEIVE E7 0E",
+        []{ return CS.findLocoSlot(lbLoco)!=0; }, l1);
+    uint8_t slot = CS.findLocoSlot(lbLoco);
+    TEST_ASSERT_NOT_EQUAL(0, slot);
+    c.request(lbSend({OPC_MOVE_SLOTS, slot, slot}), "RECEIVE E7 0E", []{ return true; }, l2);
+    lbTake.appliedUs = l1.appliedUs + l2.appliedUs;
+    lbTake.answerUs = l1.answerUs + l2.answerUs;
+    for(int i=0; i<COMMANDS; i++) {
+        uint8_t spd = 2 + i%126;
+        Latency l;
+        c.request(lbSend({OPC_LOCO_SPD, slot, spd}), "SENT OK", [&]{ return CS.getLocoSpeed(slot)==spd; }, l);
+        lbCmds.push_back(l);
+    }
+    report("LbServer", lbTake, lbCmds);
+}
+
+void test_compare(void) {
+    TEST_ASSERT_EQUAL(COMMANDS, dccExCmds.size());
+    TEST_ASSERT_EQUAL(COMMANDS, lbCmds.size());
+    printf("DCC-EX: %.0f%% of LbServer time to take a loco, %.0f%% of its median time to apply speed\n",
+        100*dccExTake.answerUs/lbTake.answerUs, 100*median(dccExCmds)/median(lbCmds));
+    // one command instead of two slot protocol round trips
+    TEST_ASSERT_TRUE(dccExTake.answerUs < lbTake.answerUs);
+}
+
+int main(int argc, char **argv) {
+    CS.setDccMain(&dcc);
+    CS.addSlotListener(&slotMan);
+    CS.addSlotListener(&dccExServer);
+    lbServer.begin();
+    dccExServer.begin();
+    UNITY_BEGIN();
+    RUN_TEST(test_dccex);
+    RUN_TEST(test_lbserver);
+    RUN_TEST(test_compare);
+    return UNITY_END();
+}
@@ -0,0 +1,208 @@
+/**
+ * LbBinaryServer against the LbServer text protocol: the same JMRI-like messages sent by a client in
+ * another process, in windows of 32, each message acknowledged and echoed back. Prints bytes per message
+ * in both directions and server CPU time (AsyncTCP task and loop() together) per message.
+ * pio test -e native -f bench_lb_binary
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "LbServer.h"
+#include "LbBinaryServer.h"
+
+static const uint16_t TEXT_PORT = 44480;
+static const uint16_t BINARY_PORT = 44481;
+static const int MESSAGES = 20000;
+static const int WINDOW = 32;
+
+static LocoNetBus bus;
+static LbServer textServer(TEXT_PORT, &bus);
+static LbBinaryServer binaryServer(BINARY_PORT, &bus);
+
+/// Speed, direction and switch messages, as a JMRI throttle session sends them.
+static LnMsg message(int i) {
+    static const uint8_t OPS[] = { OPC_LOCO_SPD, OPC_LOCO_SPD, OPC_LOCO_DIRF, OPC_SW_REQ };
+    LnMsg m = {};
+    m.data[0] = OPS[i % sizeof(OPS)];
+    m.data[1] = 1 + i%8;
+    m.data[2] = (i*7) & 0x7F;
+    m.data[3] = 0xFF ^ m.data[0] ^ m.data[1] ^ m.data[2];
+    return m;
+}
+
+struct Traffic {
+    uint64_t sent;
+    uint64_t received;
+    double serverCpuMs;   ///< filled in by the server process
+};
+
+static int connectTo(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (sockaddr*)&a, sizeof(a))!=0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/// Client process, text protocol: a window of SEND lines in one write, then wait for SENT OK and RECEIVE of each.
+static Traffic textClient(int fd) {
+    Traffic t = {};
+    std::string in;
+    char buf[8192];
+    // greeting
+    while(in.find('\n')==std::string::npos) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n<=0) return t;
+        in.append(buf, n);
+        t.received += n;
+    }
+    in.erase(0, in.find('\n')+1);
+    for(int i=0; i<MESSAGES; i+=WINDOW) {
+        std::string out;
+        for(int j=i; j<i+WINDOW; j++) {
+            LnMsg m = message(j);
+            char line[32];
+            snprintf(line, sizeof(line), "SEND %02X %02X %02X %02X\n", m.data[0], m.data[1], m.data[2], m.data[3]);
+            out += line;
+        }
+        send(fd, out.data(), out.size(), 0);
+        t.sent += out.size();
+        int oks = 0, echoes = 0;
+        while(oks<WINDOW || echoes<WINDOW) {
+            size_t eol;
+            while((eol = in.find('\n'))!=std::string::npos) {
+                if(in.compare(0, 7, "SENT OK")==0) oks++;
+                else if(in.compare(0, 7, "RECEIVE")==0) echoes++;
+                in.erase(0, eol+1);
+            }
+            if(oks>=WINDOW && echoes>=WINDOW) break;
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if(n<=0) return t;
+            in.append(buf, n);
+            t.received += n;
+        }
+    }
+    return t;
+}
+
+/// Client process, binary protocol: a window of MSG frames in one write, then wait for the ACK and the echoes.
+static Traffic binaryClient(int fd) {
+    Traffic t = {};
+    std::string in;
+    uint8_t buf[8192];
+    uint8_t seq = 0;
+    for(int i=0; i<MESSAGES; i+=WINDOW) {
+        std::string out;
+        for(int j=i; j<i+WINDOW; j++) {
+            LnMsg m = message(j);
+            uint8_t f[LbBinaryServer::HEADER_SIZE+4] = { LbBinaryServer::MSG, seq++, 4 };
+            memcpy(f+LbBinaryServer::HEADER_SIZE, m.data, 4);
+            out.append((const char*)f, sizeof(f));
+        }
+        send(fd, out.data(), out.size(), 0);
+        t.sent += out.size();
+        uint8_t last = seq-1;
+        bool acked = false;
+        int echoes = 0;
+        while(!acked || echoes<WINDOW) {
+            while(in.size()>=LbBinaryServer::HEADER_SIZE
+                    && in.size()>=LbBinaryServer::HEADER_SIZE+(size_t)(uint8_t)in[2]) {
+                if(in[0]==LbBinaryServer::MSG) echoes++;
+                else if(in[0]==LbBinaryServer::ACK && (uint8_t)in[1]==last) acked = true;
+                in.erase(0, LbBinaryServer::HEADER_SIZE+(uint8_t)in[2]);
+            }
+            if(acked && echoes>=WINDOW) break;
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if(n<=0) return t;
+            in.append((const char*)buf, n);
+            t.received += n;
+        }
+    }
+    return t;
+}
+
+static double cpuMs() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+static double wallMs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+/// Runs client in a child process, so this process's CPU time is the server's. Server loop runs meanwhile.
+template<class Client, class Loop>
+static Traffic run(const char *name, uint16_t port, Client client, Loop loop) {
+    int pipefd[2];
+    TEST_ASSERT_EQUAL(0, pipe(pipefd));
+    double cpu0 = cpuMs(), wall0 = wallMs();
+    pid_t pid = fork();
+    if(pid==0) {
+        close(pipefd[0]);
+        int fd = connectTo(port);
+        Traffic t = fd<0 ? Traffic{} : client(fd);
+        if(write(pipefd[1], &t, sizeof(t))!=sizeof(t)) _exit(1);
+        _exit(0);
+    }
+    close(pipefd[1]);
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+    Traffic t = {};
+    while(read(pipefd[0], &t, sizeof(t))!=sizeof(t)) {
+        loop();
+        usleep(50);
+        TEST_ASSERT_TRUE_MESSAGE(wallMs()-wall0 < 30000, "client did not finish");
+    }
+    double wall = wallMs()-wall0;
+    t.serverCpuMs = cpuMs()-cpu0;
+    int status;
+    waitpid(pid, &status, 0);
+    close(pipefd[0]);
+    // let the server see the disconnect
+    for(int i=0; i<20; i++) { loop(); usleep(1000); }
+
+    printf("%s: %.1f B/msg to server, %.1f B/msg from server, %.2f us server CPU/msg, %.0f ms\n",
+        name, (double)t.sent/MESSAGES, (double)t.received/MESSAGES, t.serverCpuMs*1000/MESSAGES, wall);
+    return t;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_text_vs_binary(void) {
+    Traffic text = run("text  ", TEXT_PORT, textClient, []{ textServer.loop(); });
+    Traffic bin = run("binary", BINARY_PORT, binaryClient, []{ binaryServer.loop(); });
+
+    TEST_ASSERT_TRUE(text.sent>0 && bin.sent>0);
+    TEST_ASSERT_EQUAL(MESSAGES, binaryServer.getStats().rxFrames);
+    TEST_ASSERT_EQUAL(0, binaryServer.getStats().naks);
+    TEST_ASSERT_LESS_THAN(text.sent + text.received, bin.sent + bin.received);
+    printf("binary: %.0f%% of text bytes, %.0f%% of text server CPU\n",
+        100.0*(bin.sent+bin.received)/(text.sent+text.received), 100.0*bin.serverCpuMs/text.serverCpuMs);
+    TEST_ASSERT_TRUE(bin.serverCpuMs < text.serverCpuMs);
+}
+
+int main(int argc, char **argv) {
+    textServer.begin();
+    binaryServer.begin();
+    UNITY_BEGIN();
+    RUN_TEST(test_text_vs_binary);
+    return UNITY_END();
+}
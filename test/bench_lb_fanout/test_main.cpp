@@ -0,0 +1,163 @@
+/**
+ * LbServer fan-out: bus messages pushed in bursts between loop() passes are sent as RECEIVE lines to every
+ * connected loopback client. Prints messages per second through the server and lines delivered per second
+ * over all clients, with clients that all read and with one client that stops reading, whose lost
+ * messages are the only clientDrops.
+ * pio test -e native -f bench_lb_fanout
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "LbServer.h"
+
+static const uint16_t PORT = 44492;
+static const int MESSAGES = 20000;
+/// LbServer::MAX_CLIENTS
+static const int CLIENTS = 5;
+/// messages broadcast per loop() pass, within the server's transmit queue
+static const int BURST = 16;
+
+static LocoNetBus bus;
+static LbServer lbServer(PORT, &bus);
+
+struct Client {
+    int fd = -1;
+    bool reading = true;
+    uint32_t lines = 0;
+};
+
+static Client clients[CLIENTS];
+
+static double msSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-t0).count();
+}
+
+/// Receive buffer set before connecting limits what a client that does not read takes in.
+static int connectTo(uint16_t port, int rcvBuf) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(rcvBuf>0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT_EQUAL(0, connect(fd, (sockaddr*)&a, sizeof(a)));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/// Counts lines received by clients that read.
+static void receive() {
+    char buf[8192];
+    for(auto &c: clients) {
+        if(!c.reading) continue;
+        ssize_t n;
+        while((n = recv(c.fd, buf, sizeof(buf), 0)) > 0)
+            for(ssize_t i=0; i<n; i++) if(buf[i]=='\n') c.lines++;
+    }
+}
+
+/// Connects all clients and runs loop() until each has its greeting and is set up.
+static void connectAll(int stalled) {
+    for(int i=0; i<CLIENTS; i++) {
+        clients[i] = Client();
+        clients[i].fd = connectTo(PORT, i==stalled ? 4096 : 0);
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    for(auto &c: clients) {
+        while(c.lines==0) {
+            TEST_ASSERT_TRUE_MESSAGE(msSince(t0) < 1000, "no greeting");
+            lbServer.loop();
+            usleep(100);
+            receive();
+        }
+        c.lines = 0;
+    }
+    for(int i=0; i<10; i++) { lbServer.loop(); usleep(1000); }
+    for(int i=0; i<CLIENTS; i++) clients[i].reading = i!=stalled;
+}
+
+static void closeAll() {
+    for(auto &c: clients) close(c.fd);
+    // let the server see the disconnects
+    for(int i=0; i<20; i++) { lbServer.loop(); usleep(1000); }
+}
+
+static bool readersDone() {
+    for(auto &c: clients) if(c.reading && c.lines<MESSAGES) return false;
+    return true;
+}
+
+/// Broadcasts MESSAGES in bursts and runs the server until every reading client has all of them.
+static void fanOut(const char *name) {
+    LbServer::TxStats s0 = lbServer.getTxStats();
+    int readers = 0;
+    for(auto &c: clients) if(c.reading) readers++;
+    auto t0 = std::chrono::steady_clock::now();
+    int sent = 0;
+    while(!readersDone()) {
+        TEST_ASSERT_TRUE_MESSAGE(msSince(t0) < 30000, "clients did not get all messages");
+        for(int j=0; j<BURST && sent<MESSAGES; j++, sent++) {
+            LnMsg m = {};
+            m.data[0] = OPC_LOCO_SPD;
+            m.data[1] = 1 + sent%8;
+            m.data[2] = sent & 0x7F;
+            writeChecksum(m);
+            bus.broadcast(m);
+        }
+        lbServer.loop();
+        // lets the AsyncTCP thread run on a single core
+        usleep(1);
+        receive();
+    }
+    double ms = msSince(t0);
+    LbServer::TxStats s = lbServer.getTxStats();
+    printf("%s: %d messages to %d clients (%d reading) in %.0f ms: %.0f msgs/s, %.0f lines/s delivered, "
+        "%u writes, clientDrops %u, queue max depth %u\n",
+        name, MESSAGES, CLIENTS, readers, ms, MESSAGES*1000/ms, readers*MESSAGES*1000/ms,
+        (unsigned)(s.writes-s0.writes), (unsigned)(s.clientDrops-s0.clientDrops), (unsigned)s.maxDepth);
+
+    TEST_ASSERT_EQUAL(MESSAGES, s.queued-s0.queued);
+    TEST_ASSERT_EQUAL(0, s.dropped-s0.dropped);
+    for(auto &c: clients) if(c.reading) TEST_ASSERT_EQUAL(MESSAGES, c.lines);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_all_clients_read(void) {
+    connectAll(-1);
+    uint32_t drops = lbServer.getTxStats().clientDrops;
+    fanOut("all reading");
+    TEST_ASSERT_EQUAL(drops, lbServer.getTxStats().clientDrops);
+    closeAll();
+}
+
+/// A client that stops reading loses messages once its buffer is full; the others get all of them.
+void test_stalled_client(void) {
+    connectAll(0);
+    uint32_t drops = lbServer.getTxStats().clientDrops;
+    fanOut("one stalled ");
+    uint32_t d = lbServer.getTxStats().clientDrops - drops;
+    TEST_ASSERT_GREATER_THAN(0, d);
+    TEST_ASSERT_LESS_OR_EQUAL(MESSAGES, d);
+    closeAll();
+}
+
+int main(int argc, char **argv) {
+    lbServer.begin();
+    UNITY_BEGIN();
+    RUN_TEST(test_all_clients_read);
+    RUN_TEST(test_stalled_client);
+    return UNITY_END();
+}
@@ -0,0 +1,239 @@
+/**
+ * LbParser throughput on JMRI-like SEND traffic against the byte-at-a-time parser LbServer had before,
+ * in TCP-sized and in 1-byte segments. Then a fuzz run: a corpus of real lines mutated at random and fed
+ * in random segment sizes; every line must come out exactly as a plain reference decoder sees it.
+ * pio test -e native -f bench_lb_parser
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "LbParser.h"
+
+static const int STREAM_LINES = 200000;
+static const int FUZZ_LINES = 300000;
+static const size_t SEGMENT = 1436;
+static volatile uint32_t sink;
+
+/// xorshift, so every run sees the same input
+struct Rng {
+    uint32_t s = 2463534242u;
+    uint32_t next() { s ^= s<<13; s ^= s>>17; s ^= s<<5; return s; }
+    uint32_t below(uint32_t n) { return next() % n; }
+};
+
+/// Lines seen from JMRI and throttles, plus some that are not SEND or not valid.
+static const char *CORPUS[] = {
+    "SEND BF 00 03 43",             // loco address request
+    "SEND BB 01 00 45",             // slot read
+    "SEND A0 01 20 7E",             // speed
+    "SEND A1 01 10 4F",             // dirf
+    "SEND B0 2F 10 70",             // switch request
+    "SEND BC 2F 10 7C",             // switch state
+    "SEND 82 7D",                   // power off
+    "SEND 83 7C",                   // power on
+    "SEND E5 10 01 01 01 01 00 00 00 00 00 00 00 00 00 00",                 // peer xfer (bad checksum)
+    "SEND EF 0E 01 03 03 00 00 07 00 00 00 00 00 18",                       // write slot
+    "SEND ED 0B 7F 32 13 7F 03 00 00 00 3B",                                // immediate packet
+    "SEND\tb0 2f\t10 70",
+    "SEND  B0  2F  10  70 ",
+    "STATUS",
+    "VERSION JMRI",
+    "SEND",
+    "SEND B0 2F 10",
+    "SEND B0 2F 10 71",
+    "SEND B02F 10 60",
+    "SEND B0 2F 1G 60",
+    "SENDB0 2F 10 60",
+};
+static const int CORPUS_SIZE = sizeof(CORPUS)/sizeof(CORPUS[0]);
+
+/// Valid SEND lines in the proportions of a JMRI session: mostly speed and direction.
+static std::string jmriStream(int lines) {
+    static const char *MIX[] = { CORPUS[2], CORPUS[2], CORPUS[2], CORPUS[3], CORPUS[4], CORPUS[1], CORPUS[9] };
+    Rng r;
+    std::string s;
+    for(int i=0; i<lines; i++) {
+        s += MIX[r.below(sizeof(MIX)/sizeof(MIX[0]))];
+        s += i%2 ? "\r\n" : "\n";
+    }
+    return s;
+}
+
+/// LbServer::processRx before LbParser: one call per byte, line copied, bytes taken before each space.
+class ByteParser {
+public:
+    uint32_t messages = 0;
+    void feed(const char *data, size_t len) {
+        for(size_t i=0; i<len; i++) processRx(data[i]);
+    }
+private:
+    static const int BUF_SIZE = LbParser::LINE_MAX;
+    char lbStr[BUF_SIZE+2];
+    int lbPos = 0;
+    LnMsg msg;
+    uint8_t msgPos = 0;
+
+    static uint8_t fromHex(char c) { return c>'9' ? (c & ~0x20)-'A'+0xA : c-'0'; }
+
+    void processRx(char v) {
+        lbStr[lbPos] = v;
+        if(v=='\n' || v=='\r') {
+            if(lbPos==0) return;
+            lbStr[lbPos] = ' '; lbStr[lbPos+1] = 0;
+            if(strncmp("SEND ", lbStr, 5)==0) {
+                msgPos = 0;
+                for(int i=5; i<=lbPos; i++) {
+                    if(lbStr[i]!=' ') continue;
+                    uint8_t val = fromHex(lbStr[i-2])<<4 | fromHex(lbStr[i-1]);
+                    if(msgPos<sizeof(msg.data)) msg.data[msgPos++] = val;
+                    if(msgPos>=2 && msgPos==msg.length()) { messages++; msgPos = 0; }
+                }
+            }
+            lbPos = 0;
+        } else if(lbPos<BUF_SIZE) {
+            lbPos++;
+        }
+    }
+};
+
+template<class F>
+static double nsPerLine(int lines, F f) {
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(t1-t0).count() / lines;
+}
+
+static uint32_t parseAll(LbParser &p, const std::string &s, size_t segment) {
+    uint32_t n = 0;
+    for(size_t i=0; i<s.size(); i+=segment) {
+        size_t len = s.size()-i < segment ? s.size()-i : segment;
+        p.feed(s.data()+i, len, [&](LbParser::Line l, const LnMsg &msg, const char*, size_t) {
+            if(l==LbParser::Line::SEND) n += msg.data[0];
+        });
+    }
+    return n;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_throughput(void) {
+    std::string s = jmriStream(STREAM_LINES);
+    for(size_t seg: {SEGMENT, (size_t)1}) {
+        LbParser p;
+        double tNew = nsPerLine(STREAM_LINES, [&]{ sink = parseAll(p, s, seg); });
+        TEST_ASSERT_EQUAL(STREAM_LINES, p.getStats().messages);
+        ByteParser old;
+        double tOld = nsPerLine(STREAM_LINES, [&]{
+            for(size_t i=0; i<s.size(); i+=seg) old.feed(s.data()+i, s.size()-i < seg ? s.size()-i : seg);
+        });
+        TEST_ASSERT_EQUAL(STREAM_LINES, old.messages);
+        printf("%4d B segments: LbParser %.1f ns/line (%.0f MB/s), byte parser %.1f ns/line\n",
+            (int)seg, tNew, s.size()/(tNew*STREAM_LINES)*1000, tOld);
+        if(seg==SEGMENT) TEST_ASSERT_TRUE(tNew < tOld);
+    }
+}
+
+/// Straightforward decoder the parser must agree with.
+static LbParser::Line reference(const std::string &line) {
+    if(line.compare(0, 4, "SEND")!=0) return LbParser::Line::OTHER;
+    if(line.size()>4 && line[4]!=' ' && line[4]!='\t') return LbParser::Line::OTHER;
+    std::vector<uint8_t> bytes;
+    size_t i = 4;
+    while(i<line.size()) {
+        if(line[i]==' ' || line[i]=='\t') { i++; continue; }
+        size_t j = i;
+        while(j<line.size() && line[j]!=' ' && line[j]!='\t') j++;
+        if(j-i!=2 || !isxdigit((unsigned char)line[i]) || !isxdigit((unsigned char)line[i+1])) return LbParser::Line::MALFORMED;
+        bytes.push_back((uint8_t)strtoul(line.substr(i, 2).c_str(), nullptr, 16));
+        i = j;
+    }
+    if(bytes.size()<2 || bytes.size()>sizeof(LnMsg::data) || (bytes[0] & 0x80)==0) return LbParser::Line::MALFORMED;
+    LnMsg m = {};
+    memcpy(m.data, bytes.data(), bytes.size());
+    if(m.length()!=bytes.size()) return LbParser::Line::MALFORMED;
+    uint8_t chk = 0;
+    for(uint8_t b: bytes) chk ^= b;
+    return chk==0xFF ? LbParser::Line::SEND : LbParser::Line::MALFORMED;
+}
+
+static std::string mutate(Rng &r, std::string s) {
+    static const char CHARS[] = "0123456789ABCDEFabcdefSENDG \t\r\n";
+    int n = r.below(4);
+    for(int k=0; k<n; k++) {
+        size_t pos = s.empty() ? 0 : r.below(s.size());
+        switch(r.below(6)) {
+            case 0: if(!s.empty()) s[pos] = CHARS[r.below(sizeof(CHARS)-1)]; break;
+            case 1: if(!s.empty()) s.erase(pos, 1); break;
+            case 2: s.insert(pos, 1, CHARS[r.below(sizeof(CHARS)-1)]); break;
+            case 3: s.resize(pos); break;
+            case 4: s.insert(pos, r.below(2*LbParser::LINE_MAX), 'F'); break;
+            case 5: if(!s.empty()) s[pos] = (char)r.next(); break;
+        }
+    }
+    return s;
+}
+
+void test_fuzz_corpus(void) {
+    Rng r;
+    std::string stream;
+    for(int i=0; i<FUZZ_LINES; i++) {
+        std::string l = CORPUS[r.below(CORPUS_SIZE)];
+        if(r.below(2)) l = mutate(r, l);
+        stream += l;
+        stream += r.below(3) ? "\n" : "\r\n";
+    }
+    // lines as the reference splits them
+    std::vector<std::string> expect;
+    size_t b = 0;
+    for(size_t i=0; i<stream.size(); i++) {
+        if(stream[i]!='\n' && stream[i]!='\r') continue;
+        if(i>b) expect.push_back(stream.substr(b, i-b));
+        b = i+1;
+    }
+
+    LbParser p;
+    size_t next = 0, dropped = 0, sends = 0;
+    auto check = [&](LbParser::Line l, const LnMsg &msg, const char *s, size_t len) {
+        std::string got(s, len);
+        // lines longer than LINE_MAX may be dropped when split over segments, nothing else
+        while(next<expect.size() && expect[next]!=got && expect[next].size()>LbParser::LINE_MAX) { next++; dropped++; }
+        TEST_ASSERT_TRUE_MESSAGE(next<expect.size() && expect[next]==got, "line lost or changed");
+        TEST_ASSERT_TRUE_MESSAGE(l==reference(got), got.c_str());
+        if(l==LbParser::Line::SEND) {
+            uint8_t chk = 0;
+            for(uint8_t j=0; j<msg.length(); j++) chk ^= msg.data[j];
+            TEST_ASSERT_EQUAL_HEX8(0xFF, chk);
+            sends++;
+        }
+        next++;
+    };
+    auto t0 = std::chrono::steady_clock::now();
+    for(size_t i=0; i<stream.size(); ) {
+        size_t len = 1 + r.below(r.below(4)==0 ? 8 : SEGMENT);
+        if(len>stream.size()-i) len = stream.size()-i;
+        p.feed(stream.data()+i, len, check);
+        i += len;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-t0).count();
+    while(next<expect.size() && expect[next].size()>LbParser::LINE_MAX) { next++; dropped++; }
+    TEST_ASSERT_EQUAL(expect.size(), next);
+    TEST_ASSERT_EQUAL(dropped, p.getStats().overflows);
+
+    const LbParser::Stats &st = p.getStats();
+    printf("fuzz: %d lines in %.1f ms, %u SEND, %u malformed, %u overlong dropped\n",
+        (int)expect.size(), ms, (unsigned)sends, (unsigned)st.malformed, (unsigned)st.overflows);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_throughput);
+    RUN_TEST(test_fuzz_corpus);
+    return UNITY_END();
+}
@@ -0,0 +1,133 @@
+/**
+ * JMRI slot scan at LocoNet speed: OPC_RQ_SL_DATA for slots 0-127, each request put on the bus as soon as
+ * the previous one has left the wire, while LocoNetSlotManager answers through its paced transmit queue.
+ * Prints the time until the last answer against the time the bus needs for requests and answers, and
+ * loop() CPU time per request.
+ * pio test -e native -f bench_slot_scan
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#include "LocoNetSlotManager.h"
+
+static const uint8_t REQUESTS = 128;
+/// on the wire: 10 bit times per byte, then carrier detect backoff
+static const uint32_t REQUEST_US = 4*10*LnTxQueue::BIT_US + LnTxQueue::CD_BACKOFF_US;
+static const uint32_t ANSWER_US = 14*10*LnTxQueue::BIT_US + LnTxQueue::CD_BACKOFF_US;
+
+/// Takes packets instead of generating a signal.
+class NullChannel: public IDCCChannel {
+public:
+    void begin() override {}
+    void end() override {}
+    void unloadSlot(uint8_t) override {}
+    void setPower(bool v) override { power = v; }
+    bool getPower() override { return power; }
+    uint16_t readCurrentAdc() override { return 0; }
+protected:
+    void timerFunc() override {}
+    bool loadPacket(int, uint8_t*, uint8_t, int) override { return true; }
+private:
+    bool power = true;
+};
+
+/// JMRI side: checks and counts answers.
+class Scanner: public LocoNetConsumer {
+public:
+    int slotData = 0;
+    int lacks = 0;
+    int badChecksum = 0;
+    int inUse = 0;
+    uint32_t lastUs = 0;
+    LN_STATUS onMessage(const LnMsg &m) override {
+        uint8_t x = 0;
+        for(uint8_t i=0; i<m.length(); i++) x ^= m.data[i];
+        if(x!=0xFF) badChecksum++;
+        if(m.data[0]==OPC_SL_RD_DATA) {
+            slotData++;
+            if((m.sd.stat & LOCO_IN_USE)!=LOCO_FREE) inUse++;
+        } else if(m.data[0]==OPC_LONG_ACK) {
+            lacks++;
+        } else {
+            return LN_DONE;
+        }
+        lastUs = micros();
+        return LN_DONE;
+    }
+};
+
+static NullChannel dcc;
+static LocoNetBus bus;
+static LocoNetSlotManager slotMan(&bus);
+static Scanner jmri;
+
+static double cpuUs() {
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec*1e6 + t.tv_nsec/1e3;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_full_scan_at_bus_speed(void) {
+    // three locos in use, the rest of the scan answers free slots
+    for(uint16_t a=3; a<=5; a++) CS.findOrAllocateLocoSlot(LocoAddress::shortAddr(a));
+    // their slot data broadcasts are out before the scan starts
+    for(int i=0; i<200; i++) { slotMan.loop(); delay(1); }
+    TEST_ASSERT_EQUAL(0, slotMan.getTxStats().depth);
+    jmri.slotData = jmri.lacks = jmri.inUse = 0;
+
+    /// CPU time of loop() passes that handled a request or sent an answer; idle passes are left out
+    double cpu = 0;
+    uint32_t t0 = micros();
+    uint32_t nextRq = t0;
+    uint8_t sent = 0;
+    while(jmri.slotData + jmri.lacks < REQUESTS) {
+        TEST_ASSERT_TRUE_MESSAGE(micros()-t0 < 10000000, "scan not answered");
+        if(sent<REQUESTS && (int32_t)(micros()-nextRq) >= 0) {
+            LnMsg m = {};
+            m.data[0] = OPC_RQ_SL_DATA;
+            m.data[1] = sent++;
+            writeChecksum(m);
+            bus.broadcast(m, &jmri);
+            nextRq = micros() + REQUEST_US;
+        }
+        uint32_t work = slotMan.getTxStats().sent + slotMan.getInboxStats().delivered;
+        double c0 = cpuUs();
+        slotMan.loop();
+        double c = cpuUs()-c0;
+        if(slotMan.getTxStats().sent + slotMan.getInboxStats().delivered != work) cpu += c;
+    }
+    uint32_t total = jmri.lastUs - t0;
+    uint8_t answered = LocoNetSlotManager::LN_SLOTS-1;
+    uint32_t wire = REQUESTS*REQUEST_US + answered*ANSWER_US + (REQUESTS-answered)*(4*10*LnTxQueue::BIT_US + LnTxQueue::CD_BACKOFF_US);
+    uint32_t answersOnly = answered*ANSWER_US;
+    LnTxQueue::Stats tx = slotMan.getTxStats();
+    printf("%d requests: %d slot data, %d LACK, last answer after %.1f ms\n",
+        REQUESTS, jmri.slotData, jmri.lacks, total/1000.0);
+    printf("bus time of answers alone %.1f ms (%.0f%% used), requests and answers on a shared bus %.1f ms\n",
+        answersOnly/1000.0, 100.0*answersOnly/total, wire/1000.0);
+    printf("loop() CPU %.1f us per request, tx queue max depth %d, dropped %d\n",
+        cpu/REQUESTS, tx.maxDepth, tx.dropped);
+
+    TEST_ASSERT_EQUAL(answered, jmri.slotData);
+    TEST_ASSERT_EQUAL(REQUESTS-answered, jmri.lacks);
+    TEST_ASSERT_EQUAL(3, jmri.inUse);
+    TEST_ASSERT_EQUAL(0, jmri.badChecksum);
+    TEST_ASSERT_EQUAL(0, tx.dropped);
+    TEST_ASSERT_EQUAL(0, slotMan.getInboxStats().dropped);
+    // the transmit queue is the only limit: answers go out back to back
+    TEST_ASSERT_LESS_THAN(answersOnly*11/10 + REQUEST_US*2, total);
+}
+
+int main(int argc, char **argv) {
+    CS.setDccMain(&dcc);
+    CS.addSlotListener(&slotMan);
+    bus.addConsumer(&jmri);
+    UNITY_BEGIN();
+    RUN_TEST(test_full_scan_at_bus_speed);
+    return UNITY_END();
+}
@@ -0,0 +1,111 @@
+/**
+ * 16 WiThrottle clients waiting to be started in the same loop() pass, with a full turnout list and loco
+ * roster in the handshake. Every client is sent the handshake from the shared buffer, resumed by flush()
+ * where the send buffer is short. Prints time and loop passes until every client has all of it.
+ * pio test -e native -f bench_withrottle_connect
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "WiThrottle.h"
+
+static const uint16_t PORT = 44470;
+static const int CLIENTS = WT_MAX_CLIENTS;
+
+static const char *ROSTER_PATH = "bench_withrottle_roster.bin";
+
+static double msSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-t0).count();
+}
+
+static int connectClient() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(PORT);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT_EQUAL(0, connect(fd, (sockaddr*)&a, sizeof(a)));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/// Handshake ends with the heartbeat line.
+static bool complete(const std::string &s) {
+    return s.size()>=5 && s.compare(s.size()-5, 5, "*30\r\n")==0;
+}
+
+void setUp(void) { remove(ROSTER_PATH); }
+void tearDown(void) { remove(ROSTER_PATH); }
+
+void test_simultaneous_connects(void) {
+    for(uint16_t i=0; i<CommandStation::MAX_TURNOUTS; i++)
+        CS.turnoutAction(1+i*7, false, i%2 ? TurnoutState::THROWN : TurnoutState::CLOSED);
+    FileRosterStorage storage(ROSTER_PATH, 0x8000);
+    LocoRoster roster;
+    roster.begin(&storage);
+    char name[LocoRoster::NAME_MAX+1];
+    for(uint16_t i=0; i<LocoRoster::MAX_LOCOS; i++) {
+        snprintf(name, sizeof(name), "Locomotive %u", (unsigned)i);
+        TEST_ASSERT_TRUE(roster.put(LocoAddress::longAddr(1000+i), name, 128));
+        // edits are kept in a short list until written
+        if(i%LocoRoster::MAX_PENDING == LocoRoster::MAX_PENDING-1) TEST_ASSERT_TRUE(roster.rebuild());
+    }
+    CS.setLocoRoster(&roster);
+
+    WiThrottleServer wt(PORT);
+    wt.begin();
+
+    // accepted one by one (listen backlog is 5, like AsyncTCP), none started before loop() runs
+    int fds[CLIENTS];
+    for(int i=0; i<CLIENTS; i++) {
+        fds[i] = connectClient();
+        auto t = std::chrono::steady_clock::now();
+        while(wt.getStats().connects < (uint32_t)i+1 && msSince(t) < 100) usleep(50);
+    }
+    TEST_ASSERT_EQUAL(CLIENTS, wt.getStats().connects);
+
+    std::string got[CLIENTS];
+    char buf[4096];
+    uint32_t loops = 0;
+    int done = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    while(done<CLIENTS) {
+        wt.loop();
+        loops++;
+        TEST_ASSERT_TRUE_MESSAGE(msSince(t0) < 5000, "handshake not complete");
+        done = 0;
+        for(int i=0; i<CLIENTS; i++) {
+            ssize_t n;
+            while((n = recv(fds[i], buf, sizeof(buf), 0)) > 0) got[i].append(buf, n);
+            if(complete(got[i])) done++;
+        }
+    }
+    double ms = msSince(t0);
+
+    const WiThrottleServer::Stats &st = wt.getStats();
+    printf("%d clients: %d B handshake each, all received in %.2f ms, %u loop passes, %u builds\n",
+        CLIENTS, (int)got[0].size(), ms, (unsigned)loops, (unsigned)st.handshakeBuilds);
+    for(int i=1; i<CLIENTS; i++) TEST_ASSERT_TRUE(got[i]==got[0]);
+    TEST_ASSERT_EQUAL(0, st.rejected);
+    TEST_ASSERT_EQUAL(0, st.txDropped);
+    TEST_ASSERT_EQUAL(1, st.handshakeBuilds);
+
+    for(int i=0; i<CLIENTS; i++) close(fds[i]);
+    wt.end();
+    CS.setLocoRoster(nullptr);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_simultaneous_connects);
+    return UNITY_END();
+}
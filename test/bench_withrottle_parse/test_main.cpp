@@ -0,0 +1,171 @@
+/**
+ * WiThrottle command handling time and heap use: a phone client sends speed slider updates mixed with
+ * direction, function, query and heartbeat lines, and every heap allocation made by loop() is counted.
+ * Commands must be handled without any. malloc is interposed (glibc), so operator new and C code are counted.
+ * pio test -e native -f bench_withrottle_parse
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "WiThrottle.h"
+
+static const uint16_t PORT = 44472;
+static const int COMMANDS = 20000;
+/// lines per write; a batch stays under the receive buffer of a client
+static const int BATCH = 16;
+
+/// Allocations of the thread that sets `counting`; the AsyncTCP thread is not measured.
+static thread_local bool counting = false;
+static uint64_t allocations = 0;
+
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void*, size_t);
+
+void *malloc(size_t n) {
+    if(counting) allocations++;
+    return __libc_malloc(n);
+}
+void *calloc(size_t n, size_t size) {
+    if(counting) allocations++;
+    return __libc_calloc(n, size);
+}
+void *realloc(void *p, size_t n) {
+    if(counting) allocations++;
+    return __libc_realloc(p, n);
+}
+}
+
+/// Takes packets instead of generating a signal.
+class NullChannel: public IDCCChannel {
+public:
+    void begin() override {}
+    void end() override {}
+    void unloadSlot(uint8_t) override {}
+    void setPower(bool v) override { power = v; }
+    bool getPower() override { return power; }
+    uint16_t readCurrentAdc() override { return 0; }
+protected:
+    void timerFunc() override {}
+    bool loadPacket(int, uint8_t*, uint8_t, int) override { return true; }
+private:
+    bool power = true;
+};
+
+static NullChannel dcc;
+static WiThrottleServer wt(PORT);
+static int fd = -1;
+static std::string rx;
+
+static double msSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-t0).count();
+}
+
+static void receive() {
+    char buf[4096];
+    ssize_t n;
+    while((n = recv(fd, buf, sizeof(buf), 0)) > 0) rx.append(buf, n);
+}
+
+/// Runs loop() until output contains `expect`.
+static void runUntil(const char *expect) {
+    auto t0 = std::chrono::steady_clock::now();
+    while(rx.find(expect)==std::string::npos) {
+        TEST_ASSERT_TRUE_MESSAGE(msSince(t0) < 1000, expect);
+        wt.loop();
+        usleep(100);
+        receive();
+    }
+    rx.clear();
+}
+
+/// Line i of the command stream: mostly slider updates, as a phone sends them while the slider moves.
+static int command(int i, char *line, size_t size) {
+    switch(i%8) {
+        case 2: return snprintf(line, size, "MTAS3<;>R%d\n", i/8%2);
+        case 4: return snprintf(line, size, "MTAS3<;>F1%d\n", i/8%29);
+        case 5: return snprintf(line, size, "MTAS3<;>F0%d\n", i/8%29);
+        case 6: return snprintf(line, size, i/8%2 ? "MTAS3<;>qV\n" : "*\n");
+        default: return snprintf(line, size, "MTAS3<;>V%d\n", i%126);
+    }
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_commands_do_not_allocate(void) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(PORT);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT_EQUAL(0, connect(fd, (sockaddr*)&a, sizeof(a)));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    runUntil("*30\r\n");
+    const char *start = "NBench phone\nHU1234\n*+\nMT+S3<;>S3\n";
+    send(fd, start, strlen(start), 0);
+    runUntil("MTAS3<;>s1");
+    uint8_t slot = CS.findLocoSlot(LocoAddress::shortAddr(3));
+    TEST_ASSERT_NOT_EQUAL(0, slot);
+
+    uint64_t passes = 0;
+    double loopMs = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for(int i=0; i<COMMANDS; i+=BATCH) {
+        char out[BATCH*16];
+        int len = 0;
+        for(int j=i; j<i+BATCH; j++) len += command(j, out+len, sizeof(out)-len);
+        // batch ends with a slider update, so it is done once the speed is set
+        int last = (i+BATCH-1)%126;
+        TEST_ASSERT_EQUAL(len, send(fd, out, len, 0));
+        do {
+            usleep(20);
+            auto l0 = std::chrono::steady_clock::now();
+            counting = true;
+            wt.loop();
+            counting = false;
+            loopMs += msSince(l0);
+            passes++;
+            receive();
+            TEST_ASSERT_TRUE(msSince(t0) < 30000);
+        } while(CS.getLocoSpeed(slot)!=last);
+        rx.clear();
+    }
+    double ms = msSince(t0);
+
+    printf("%d commands: %llu allocations, %.2f us in loop() per command, %.1f commands per pass, %.0f ms\n",
+        COMMANDS, (unsigned long long)allocations, loopMs*1000/COMMANDS, (double)COMMANDS/passes, ms);
+    TEST_ASSERT_EQUAL(0, allocations);
+    TEST_ASSERT_EQUAL(0, wt.getStats().rxDropped);
+    TEST_ASSERT_EQUAL(0, wt.getStats().txDropped);
+    TEST_ASSERT_EQUAL(0, wt.getStats().heartbeatTimeouts);
+
+    // the counter does see allocations
+    counting = true;
+    std::string s(64, 'x');
+    counting = false;
+    TEST_ASSERT_EQUAL(1, allocations);
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    CS.setDccMain(&dcc);
+    CS.addSlotListener(&wt);
+    wt.begin();
+    UNITY_BEGIN();
+    RUN_TEST(test_commands_do_not_allocate);
+    return UNITY_END();
+}
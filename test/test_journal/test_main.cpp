@@ -0,0 +1,378 @@
+/**
+ * TurnoutJournal on FileJournalStorage: replay after reopen, torn record and checkpoint writes, compaction,
+ * and the flash layout with erase blocks.
+ * pio test -e native -f test_journal
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <map>
+
+#include "TurnoutJournal.h"
+
+static const char *PATH = "test_journal.bin";
+/// two checkpoint banks and a ring of 32 records
+static const size_t SIZE = 2*TurnoutJournal::CP_BANK_SIZE + 32*TurnoutJournal::RECORD_SIZE;
+/// flash: two banks and four ring blocks of 1 KB, 255 records each
+static const size_t BLOCK = 1024;
+static const size_t FLASH_SIZE = 6*BLOCK;
+
+/// Storage that loses power after `budget` more bytes: the write in progress is cut short, later ones are lost.
+class TornStorage: public FileJournalStorage {
+public:
+    TornStorage(const char *path, size_t size, size_t eraseSize=0): FileJournalStorage(path, size, eraseSize) {}
+    long budget = -1;
+    void write(size_t pos, const uint8_t *buf, size_t len) override {
+        if(budget<0) { FileJournalStorage::write(pos, buf, len); return; }
+        size_t n = (size_t)budget < len ? budget : len;
+        if(n>0) FileJournalStorage::write(pos, buf, n);
+        budget -= n;
+    }
+};
+
+struct Replayed {
+    std::map<uint16_t, bool> state;   ///< turnouts in roster and their state
+    std::map<uint16_t, uint8_t> ids;
+    std::map<uint8_t, uint16_t> routeSteps;  ///< routeArg -> address, 0 ends the route
+    int records = 0;
+};
+
+static void apply(void *ctx, TurnoutJournal::RecordKind kind, const TurnoutJournal::Entry &e) {
+    Replayed &r = *(Replayed*)ctx;
+    r.records++;
+    switch(kind) {
+        case TurnoutJournal::RecordKind::DEFINE:
+            r.ids[e.addr] = e.id;
+            r.state[e.addr] = e.thrown;
+            break;
+        case TurnoutJournal::RecordKind::STATE:
+            if(r.state.count(e.addr)) r.state[e.addr] = e.thrown;
+            break;
+        case TurnoutJournal::RecordKind::REMOVE:
+            r.state.erase(e.addr);
+            r.ids.erase(e.addr);
+            break;
+        case TurnoutJournal::RecordKind::ROUTE:
+            r.routeSteps[e.id] = e.addr;
+            break;
+    }
+}
+
+/// Opens the file again, as after a reboot.
+static bool reload(Replayed &r, size_t size=SIZE, size_t eraseSize=0) {
+    FileJournalStorage st(PATH, size, eraseSize);
+    TurnoutJournal j;
+    j.setStorage(&st);
+    return j.load(apply, &r);
+}
+
+static void writeCheckpoint(TurnoutJournal &j, const std::map<uint16_t, bool> &state, const std::map<uint16_t, uint8_t> &ids) {
+    j.checkpointBegin();
+    for(auto &t: state) TEST_ASSERT_TRUE(j.checkpointAdd({t.first, ids.at(t.first), t.second}));
+    TEST_ASSERT_TRUE(j.checkpointCommit());
+}
+
+void setUp(void) { remove(PATH); }
+void tearDown(void) { remove(PATH); }
+
+void test_empty_storage_has_no_checkpoint(void) {
+    FileJournalStorage st(PATH, SIZE);
+    TurnoutJournal j;
+    j.setStorage(&st);
+    Replayed r;
+    TEST_ASSERT_FALSE(j.load(apply, &r));
+    TEST_ASSERT_TRUE(j.needsCompaction());
+    TEST_ASSERT_FALSE(j.appendState(1, true)); // nothing to append to before the first checkpoint
+}
+
+void test_replay_after_reopen(void) {
+    {
+        FileJournalStorage st(PATH, SIZE);
+        TurnoutJournal j;
+        j.setStorage(&st);
+        Replayed r;
+        j.load(apply, &r);
+        writeCheckpoint(j, {{10, false}}, {{10, 1}});
+        TEST_ASSERT_TRUE(j.appendDefine(2047, 2, true));
+        TEST_ASSERT_TRUE(j.appendState(10, true));
+        TEST_ASSERT_TRUE(j.appendDefine(300, 3, false));
+        TEST_ASSERT_TRUE(j.appendRemove(2047));
+        TEST_ASSERT_TRUE(j.appendState(300, true));
+        TEST_ASSERT_EQUAL(5, j.getStats().ringUsed);
+        TEST_ASSERT_TRUE(st.commit());
+    }
+    Replayed r;
+    TEST_ASSERT_TRUE(reload(r));
+    TEST_ASSERT_EQUAL(6, r.records);
+    TEST_ASSERT_EQUAL(2, r.state.size());
+    TEST_ASSERT_TRUE(r.state[10]);
+    TEST_ASSERT_TRUE(r.state[300]);
+    TEST_ASSERT_EQUAL(3, r.ids[300]);
+    TEST_ASSERT_EQUAL(0, r.state.count(2047));
+}
+
+void test_torn_record_is_not_replayed(void) {
+    for(long cut=0; cut<(long)TurnoutJournal::RECORD_SIZE; cut++) {
+        remove(PATH);
+        {
+            TornStorage st(PATH, SIZE);
+            TurnoutJournal j;
+            j.setStorage(&st);
+            Replayed r;
+            j.load(apply, &r);
+            writeCheckpoint(j, {{5, false}, {6, false}}, {{5, 1}, {6, 2}});
+            TEST_ASSERT_TRUE(j.appendState(5, true));
+            st.budget = cut;
+            j.appendState(6, true);
+        }
+        Replayed r;
+        TEST_ASSERT_TRUE(reload(r));
+        TEST_ASSERT_EQUAL_MESSAGE(3, r.records, "torn record replayed");
+        TEST_ASSERT_TRUE(r.state[5]);
+        TEST_ASSERT_FALSE(r.state[6]);
+
+        // journal continues over the torn record after reboot
+        {
+            FileJournalStorage st(PATH, SIZE);
+            TurnoutJournal j;
+            j.setStorage(&st);
+            Replayed r2;
+            TEST_ASSERT_TRUE(j.load(apply, &r2));
+            TEST_ASSERT_TRUE(j.appendState(6, true));
+        }
+        Replayed r3;
+        TEST_ASSERT_TRUE(reload(r3));
+        TEST_ASSERT_EQUAL(4, r3.records);
+        TEST_ASSERT_TRUE(r3.state[6]);
+    }
+}
+
+void test_torn_checkpoint_falls_back_to_previous(void) {
+    const long cpBytes = 3*TurnoutJournal::RECORD_SIZE + TurnoutJournal::CP_HEADER_SIZE;
+    for(long cut=0; cut<cpBytes; cut++) {
+        remove(PATH);
+        {
+            TornStorage st(PATH, SIZE);
+            TurnoutJournal j;
+            j.setStorage(&st);
+            Replayed r;
+            j.load(apply, &r);
+            writeCheckpoint(j, {{1, false}, {2, false}}, {{1, 1}, {2, 2}});
+            TEST_ASSERT_TRUE(j.appendState(1, true));
+            TEST_ASSERT_TRUE(j.appendDefine(3, 3, true));
+            st.budget = cut;
+            j.checkpointBegin();
+            j.checkpointAdd({1, 1, false});
+            j.checkpointAdd({2, 2, true});
+            j.checkpointAdd({3, 3, false});
+            j.checkpointCommit();
+        }
+        Replayed r;
+        TEST_ASSERT_TRUE(reload(r));
+        TEST_ASSERT_EQUAL(3, r.state.size());
+        TEST_ASSERT_TRUE(r.state[1]);
+        TEST_ASSERT_FALSE(r.state[2]);
+        TEST_ASSERT_TRUE(r.state[3]);
+    }
+}
+
+void test_compaction_keeps_state_over_ring_wraps(void) {
+    std::map<uint16_t, bool> state;
+    std::map<uint16_t, uint8_t> ids;
+    for(uint16_t a=0; a<TurnoutJournal::MAX_CP_ENTRIES; a++) {
+        state[a*31 % 2048] = false;
+        ids[a*31 % 2048] = a+1;
+    }
+    uint32_t compactions = 0;
+    {
+        FileJournalStorage st(PATH, SIZE);
+        TurnoutJournal j;
+        j.setStorage(&st);
+        Replayed r;
+        j.load(apply, &r);
+        writeCheckpoint(j, state, ids);
+        // ten times around the ring, so epochs advance and both banks are reused
+        for(int i=0; i<320; i++) {
+            uint16_t a = (i*7 % TurnoutJournal::MAX_CP_ENTRIES)*31 % 2048;
+            state[a] = !state[a];
+            if(!j.appendState(a, state[a]) || j.needsCompaction()) {
+                writeCheckpoint(j, state, ids);
+                compactions++;
+            }
+        }
+        TEST_ASSERT_LESS_THAN(32, j.getStats().ringUsed);
+        TEST_ASSERT_TRUE(st.commit());
+    }
+    TEST_ASSERT_GREATER_OR_EQUAL(10, compactions);
+    Replayed r;
+    TEST_ASSERT_TRUE(reload(r));
+    TEST_ASSERT_TRUE(r.state == state);
+    TEST_ASSERT_TRUE(r.ids == ids);
+}
+
+void test_route_steps_in_ring_and_checkpoint(void) {
+    {
+        FileJournalStorage st(PATH, SIZE);
+        TurnoutJournal j;
+        j.setStorage(&st);
+        Replayed r;
+        j.load(apply, &r);
+        writeCheckpoint(j, {{1, false}}, {{1, 1}});
+        TEST_ASSERT_TRUE(j.appendRouteStep(16, 0, 2047, true));
+        TEST_ASSERT_TRUE(j.appendRouteStep(16, 1, 0, false));
+        TEST_ASSERT_TRUE(st.commit());
+    }
+    Replayed r;
+    TEST_ASSERT_TRUE(reload(r));
+    TEST_ASSERT_EQUAL(2047, r.routeSteps[TurnoutJournal::routeArg(16, 0)]);
+    TEST_ASSERT_EQUAL(0, r.routeSteps[TurnoutJournal::routeArg(16, 1)]);
+    TEST_ASSERT_EQUAL(16, TurnoutJournal::routeOf(TurnoutJournal::routeArg(16, 15)));
+    TEST_ASSERT_EQUAL(15, TurnoutJournal::stepOf(TurnoutJournal::routeArg(16, 15)));
+
+    // compacted: route steps are checkpoint entries
+    {
+        FileJournalStorage st(PATH, SIZE);
+        TurnoutJournal j;
+        j.setStorage(&st);
+        Replayed r2;
+        TEST_ASSERT_TRUE(j.load(apply, &r2));
+        j.checkpointBegin();
+        j.checkpointAdd({1, 1, false});
+        j.checkpointAdd({5, TurnoutJournal::routeArg(2, 0), true}, TurnoutJournal::RecordKind::ROUTE);
+        TEST_ASSERT_TRUE(j.checkpointCommit());
+    }
+    Replayed r3;
+    TEST_ASSERT_TRUE(reload(r3));
+    TEST_ASSERT_EQUAL(2, r3.records);
+    TEST_ASSERT_EQUAL(1, r3.state.size());
+    TEST_ASSERT_EQUAL(1, r3.routeSteps.size());
+    TEST_ASSERT_EQUAL(5, r3.routeSteps[TurnoutJournal::routeArg(2, 0)]);
+}
+
+void test_full_ring_refuses_append(void) {
+    FileJournalStorage st(PATH, SIZE);
+    TurnoutJournal j;
+    j.setStorage(&st);
+    Replayed r;
+    j.load(apply, &r);
+    writeCheckpoint(j, {{7, false}}, {{7, 1}});
+    int n = 0;
+    while(j.appendState(7, n%2==0)) n++;
+    TEST_ASSERT_EQUAL(32, n);
+    // the record at replay start was not overwritten
+    TEST_ASSERT_TRUE(st.commit());
+    Replayed r2;
+    TEST_ASSERT_TRUE(reload(r2));
+    TEST_ASSERT_EQUAL(33, r2.records);
+}
+
+/// Toggles turnouts as CommandStation does: a checkpoint when append fails or the ring is filled.
+void test_flash_counts_bytes_and_erases(void) {
+    std::map<uint16_t, bool> state;
+    std::map<uint16_t, uint8_t> ids;
+    for(uint16_t a=1; a<=20; a++) {
+        state[a] = false;
+        ids[a] = a;
+    }
+    const uint32_t cpBytes = TurnoutJournal::CP_HEADER_SIZE + 20*TurnoutJournal::RECORD_SIZE;
+    uint32_t records = 0, checkpoints = 1;
+    {
+        FileJournalStorage st(PATH, FLASH_SIZE, BLOCK);
+        TurnoutJournal j;
+        j.setStorage(&st);
+        TEST_ASSERT_EQUAL(1020, j.getStats().ringSize);
+        Replayed r;
+        j.load(apply, &r);
+        writeCheckpoint(j, state, ids);
+        for(int i=0; i<5000; i++) {
+            uint16_t a = 1 + i*7 % 20;
+            state[a] = !state[a];
+            if(j.appendState(a, state[a])) records++;
+            if(j.needsCompaction()) {
+                writeCheckpoint(j, state, ids);
+                checkpoints++;
+            }
+        }
+        const TurnoutJournal::Stats &s = j.getStats();
+        printf("%u records, %u checkpoints: %u bytes written, %u erases\n",
+            (unsigned)records, (unsigned)checkpoints, (unsigned)s.bytesWritten, (unsigned)s.erases);
+        TEST_ASSERT_EQUAL(5000, records);
+        TEST_ASSERT_EQUAL(records*TurnoutJournal::RECORD_SIZE + checkpoints*cpBytes, s.bytesWritten);
+        // one erase per checkpoint bank, one per ring block entered
+        TEST_ASSERT_GREATER_OR_EQUAL(checkpoints + records/255, s.erases);
+        TEST_ASSERT_LESS_OR_EQUAL(checkpoints + records/255 + 1, s.erases);
+    }
+    Replayed r;
+    TEST_ASSERT_TRUE(reload(r, FLASH_SIZE, BLOCK));
+    TEST_ASSERT_TRUE(r.state == state);
+    TEST_ASSERT_TRUE(r.ids == ids);
+}
+
+/// A block still holding records after replay start is not erased: append fails until a checkpoint.
+void test_flash_block_with_replay_start_is_kept(void) {
+    FileJournalStorage st(PATH, FLASH_SIZE, BLOCK);
+    TurnoutJournal j;
+    j.setStorage(&st);
+    Replayed r;
+    j.load(apply, &r);
+    writeCheckpoint(j, {{7, false}}, {{7, 1}});
+    for(int i=0; i<100; i++) TEST_ASSERT_TRUE(j.appendState(7, i%2==0));
+    writeCheckpoint(j, {{7, true}}, {{7, 1}}); // replay starts at record 100, in the first block
+    int n = 0;
+    while(j.appendState(7, n%2==0)) n++;
+    TEST_ASSERT_EQUAL(1020-100, n);
+    TEST_ASSERT_TRUE(st.commit());
+    Replayed r2;
+    TEST_ASSERT_TRUE(reload(r2, FLASH_SIZE, BLOCK));
+    TEST_ASSERT_EQUAL(1+n, r2.records);
+}
+
+void test_flash_torn_record_is_skipped(void) {
+    for(long cut=1; cut<(long)TurnoutJournal::RECORD_SIZE; cut++) {
+        remove(PATH);
+        {
+            TornStorage st(PATH, FLASH_SIZE, BLOCK);
+            TurnoutJournal j;
+            j.setStorage(&st);
+            Replayed r;
+            j.load(apply, &r);
+            writeCheckpoint(j, {{5, false}, {6, false}}, {{5, 1}, {6, 2}});
+            TEST_ASSERT_TRUE(j.appendState(5, true));
+            st.budget = cut;
+            j.appendState(6, true);
+        }
+        {
+            FileJournalStorage st(PATH, FLASH_SIZE, BLOCK);
+            TurnoutJournal j;
+            j.setStorage(&st);
+            Replayed r;
+            TEST_ASSERT_TRUE(j.load(apply, &r));
+            TEST_ASSERT_EQUAL_MESSAGE(3, r.records, "torn record replayed");
+            // bytes of the torn record can't be written again
+            TEST_ASSERT_TRUE(j.needsCompaction());
+            TEST_ASSERT_FALSE(j.appendState(6, true));
+            writeCheckpoint(j, {{5, true}, {6, true}}, {{5, 1}, {6, 2}});
+            TEST_ASSERT_TRUE(j.appendState(5, false));
+        }
+        Replayed r;
+        TEST_ASSERT_TRUE(reload(r, FLASH_SIZE, BLOCK));
+        TEST_ASSERT_EQUAL(3, r.records);
+        TEST_ASSERT_FALSE(r.state[5]);
+        TEST_ASSERT_TRUE(r.state[6]);
+    }
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_empty_storage_has_no_checkpoint);
+    RUN_TEST(test_replay_after_reopen);
+    RUN_TEST(test_torn_record_is_not_replayed);
+    RUN_TEST(test_torn_checkpoint_falls_back_to_previous);
+    RUN_TEST(test_compaction_keeps_state_over_ring_wraps);
+    RUN_TEST(test_route_steps_in_ring_and_checkpoint);
+    RUN_TEST(test_full_ring_refuses_append);
+    RUN_TEST(test_flash_counts_bytes_and_erases);
+    RUN_TEST(test_flash_block_with_replay_start_is_kept);
+    RUN_TEST(test_flash_torn_record_is_skipped);
+    return UNITY_END();
+}
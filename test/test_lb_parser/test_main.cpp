@@ -0,0 +1,124 @@
+/**
+ * LbParser: SEND decoding, lines split across TCP segments, CRLF, overlong lines.
+ * pio test -e native -f test_lb_parser
+ */
+#include <unity.h>
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "LbParser.h"
+
+struct Parsed {
+    LbParser::Line kind;
+    LnMsg msg;
+    std::string text;
+};
+
+static std::vector<Parsed> lines;
+
+static void feed(LbParser &p, const char *s) {
+    p.feed(s, strlen(s), [](LbParser::Line l, const LnMsg &msg, const char *s, size_t n) {
+        // msg is only decoded for SEND lines
+        lines.push_back({l, l==LbParser::Line::SEND ? msg : LnMsg{}, std::string(s, n)});
+    });
+}
+
+static LbParser::Line decode(const char *s) {
+    LnMsg msg;
+    return LbParser::decode(s, strlen(s), msg);
+}
+
+void setUp(void) { lines.clear(); }
+void tearDown(void) {}
+
+void test_decode_send(void) {
+    LnMsg msg;
+    const char *s = "SEND B0 00 50 1F";
+    TEST_ASSERT_EQUAL(LbParser::Line::SEND, LbParser::decode(s, strlen(s), msg));
+    TEST_ASSERT_EQUAL_HEX8(0xB0, msg.data[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x50, msg.data[2]);
+    TEST_ASSERT_EQUAL(LbParser::Line::SEND, decode("SEND\tb0  00\t50 1f"));   // case and spacing don't matter
+    TEST_ASSERT_EQUAL(LbParser::Line::SEND, decode("SEND 83 7C"));
+}
+
+void test_decode_malformed(void) {
+    TEST_ASSERT_EQUAL(LbParser::Line::MALFORMED, decode("SEND B0 00 50 1E"));     // checksum
+    TEST_ASSERT_EQUAL(LbParser::Line::MALFORMED, decode("SEND B0 00 50"));        // too short for opcode
+    TEST_ASSERT_EQUAL(LbParser::Line::MALFORMED, decode("SEND 83 7C 00"));        // too long for opcode
+    TEST_ASSERT_EQUAL(LbParser::Line::MALFORMED, decode("SEND B0 0 50 1F"));      // one digit
+    TEST_ASSERT_EQUAL(LbParser::Line::MALFORMED, decode("SEND B000 50 1F"));      // no separator
+    TEST_ASSERT_EQUAL(LbParser::Line::MALFORMED, decode("SEND B0 00 5G 1F"));     // not hex
+    TEST_ASSERT_EQUAL(LbParser::Line::MALFORMED, decode("SEND 30 00 50 9F"));     // no opcode
+    TEST_ASSERT_EQUAL(LbParser::Line::MALFORMED, decode("SEND"));
+    TEST_ASSERT_EQUAL(LbParser::Line::MALFORMED, decode("SEND 83"));
+    // more bytes than a message can have
+    TEST_ASSERT_EQUAL(LbParser::Line::MALFORMED,
+        decode("SEND E5 10 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00"));
+}
+
+void test_decode_other(void) {
+    TEST_ASSERT_EQUAL(LbParser::Line::OTHER, decode("RECEIVE 83 7C"));
+    TEST_ASSERT_EQUAL(LbParser::Line::OTHER, decode("SENDX 83 7C"));
+    TEST_ASSERT_EQUAL(LbParser::Line::OTHER, decode("SEN"));
+    TEST_ASSERT_EQUAL(LbParser::Line::OTHER, decode("send 83 7C"));
+}
+
+void test_lines_split_across_segments(void) {
+    LbParser p;
+    feed(p, "SEND B0 0");
+    TEST_ASSERT_EQUAL(0, lines.size());
+    feed(p, "0 50 1F\nSEND 83");
+    feed(p, " 7C\r\nSTATUS\n");
+    TEST_ASSERT_EQUAL(3, lines.size());
+    TEST_ASSERT_EQUAL(LbParser::Line::SEND, lines[0].kind);
+    TEST_ASSERT_EQUAL_STRING("SEND B0 00 50 1F", lines[0].text.c_str());
+    TEST_ASSERT_EQUAL(LbParser::Line::SEND, lines[1].kind);
+    TEST_ASSERT_EQUAL_HEX8(0x83, lines[1].msg.data[0]);
+    TEST_ASSERT_EQUAL(LbParser::Line::OTHER, lines[2].kind);
+    TEST_ASSERT_EQUAL(3, p.getStats().lines);   // CR of CRLF is not a line
+    TEST_ASSERT_EQUAL(2, p.getStats().messages);
+
+    // every split point of the same input gives the same lines
+    const char *in = "SEND B0 00 50 1F\r\nSEND 83 7C\n";
+    for(size_t cut=0; cut<=strlen(in); cut++) {
+        LbParser q;
+        lines.clear();
+        std::string a(in, cut), b(in+cut);
+        feed(q, a.c_str());
+        feed(q, b.c_str());
+        TEST_ASSERT_EQUAL(2, lines.size());
+        TEST_ASSERT_EQUAL(LbParser::Line::SEND, lines[0].kind);
+        TEST_ASSERT_EQUAL(LbParser::Line::SEND, lines[1].kind);
+    }
+}
+
+void test_overlong_line_is_skipped(void) {
+    LbParser p;
+    std::string junk(LbParser::LINE_MAX, 'x');
+    feed(p, junk.substr(0, 60).c_str());
+    feed(p, junk.substr(60).c_str());
+    feed(p, "more junk\nSEND 83 7C\n");
+    TEST_ASSERT_EQUAL(1, lines.size());
+    TEST_ASSERT_EQUAL(LbParser::Line::SEND, lines[0].kind);
+    TEST_ASSERT_EQUAL(1, p.getStats().overflows);
+
+    // a line that fits exactly is kept
+    lines.clear();
+    std::string full = "SEND 83 7C" + std::string(LbParser::LINE_MAX-10, ' ');
+    feed(p, full.c_str());
+    feed(p, "\n");
+    TEST_ASSERT_EQUAL(1, lines.size());
+    TEST_ASSERT_EQUAL(LbParser::Line::SEND, lines[0].kind);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_decode_send);
+    RUN_TEST(test_decode_malformed);
+    RUN_TEST(test_decode_other);
+    RUN_TEST(test_lines_split_across_segments);
+    RUN_TEST(test_overlong_line_is_skipped);
+    return UNITY_END();
+}
@@ -0,0 +1,247 @@
+/**
+ * LnRoute: origin seen by consumers during a broadcast, nested scopes, per-task origin, origin kept
+ * through LnInbox, and a serial route looped back by an echoing peer putting no duplicates on the bus.
+ * pio test -e native -f test_ln_route
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "LnRoute.h"
+#include "LnInbox.h"
+#include "LocoNetSerial.h"
+
+/// Records origin of every message it is given.
+class OriginLog: public LocoNetConsumer {
+public:
+    std::vector<LnOrigin> seen;
+    LN_STATUS onMessage(const lnMsg&) override {
+        seen.push_back(LnRoute::origin());
+        return LN_DONE;
+    }
+};
+
+/// Handles messages later in the main loop, like LbServer.
+class Deferred: public LocoNetConsumer {
+public:
+    LnInbox<4> inbox;
+    LN_STATUS onMessage(const lnMsg &msg) override {
+        inbox.push(msg);
+        return LN_DONE;
+    }
+};
+
+/// Far end of a serial link that returns everything written to it, like a LocoBuffer on another bus.
+class EchoingPeer: public Stream {
+public:
+    int available() override { return toStation.size(); }
+    int read() override {
+        if(toStation.empty()) return -1;
+        int c = toStation.front();
+        toStation.pop_front();
+        return c;
+    }
+    int peek() override { return toStation.empty() ? -1 : toStation.front(); }
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const uint8_t *buf, size_t len) override {
+        toStation.insert(toStation.end(), buf, buf+len);
+        return len;
+    }
+    /// A message from the far bus.
+    void send(const LnMsg &m) { toStation.insert(toStation.end(), m.data, m.data+m.length()); }
+private:
+    std::deque<uint8_t> toStation;
+};
+
+/// Messages the serial route put on the bus.
+class SerialLog: public LocoNetConsumer {
+public:
+    std::vector<LnMsg> seen;
+    uint32_t bytes = 0;
+    LN_STATUS onMessage(const lnMsg &msg) override {
+        if(LnRoute::origin()!=LnOrigin::SERIAL_LINK) return LN_DONE;
+        seen.push_back(msg);
+        bytes += msg.length();
+        return LN_DONE;
+    }
+};
+
+static LocoNetBus bus;
+static OriginLog first;
+static OriginLog second;
+static Deferred deferred;
+
+static LnMsg idle() {
+    LnMsg m = {};
+    m.data[0] = OPC_IDLE;
+    m.data[1] = 0xFF ^ OPC_IDLE;
+    return m;
+}
+
+void setUp(void) {
+    first.seen.clear();
+    second.seen.clear();
+    deferred.inbox.drain([](const LnMsg&) {});
+}
+void tearDown(void) {}
+
+void test_consumers_see_origin(void) {
+    TEST_ASSERT_EQUAL(LN_DONE, LnRoute::broadcast(&bus, idle(), LnOrigin::LBSERVER));
+    TEST_ASSERT_EQUAL(1, first.seen.size());
+    TEST_ASSERT_EQUAL(LnOrigin::LBSERVER, first.seen[0]);
+    TEST_ASSERT_EQUAL(LnOrigin::LBSERVER, second.seen[0]);
+    // back to PHY after the broadcast
+    TEST_ASSERT_EQUAL(LnOrigin::PHY, LnRoute::origin());
+    bus.broadcast(idle());
+    TEST_ASSERT_EQUAL(LnOrigin::PHY, first.seen[1]);
+}
+
+void test_sender_is_not_called_back(void) {
+    LnRoute::broadcast(&bus, idle(), LnOrigin::SLOTMAN, &first);
+    TEST_ASSERT_EQUAL(0, first.seen.size());
+    TEST_ASSERT_EQUAL(1, second.seen.size());
+    TEST_ASSERT_EQUAL(LnOrigin::SLOTMAN, second.seen[0]);
+}
+
+void test_nested_scopes(void) {
+    {
+        LnRoute::OriginScope a(LnOrigin::STATION);
+        bus.broadcast(idle());
+        // a consumer that answers on the bus from onMessage
+        LnRoute::broadcast(&bus, idle(), LnOrigin::LBBINARY);
+        TEST_ASSERT_EQUAL(LnOrigin::STATION, LnRoute::origin());
+        bus.broadcast(idle());
+    }
+    TEST_ASSERT_EQUAL(LnOrigin::PHY, LnRoute::origin());
+    TEST_ASSERT_EQUAL(3, first.seen.size());
+    TEST_ASSERT_EQUAL(LnOrigin::STATION, first.seen[0]);
+    TEST_ASSERT_EQUAL(LnOrigin::LBBINARY, first.seen[1]);
+    TEST_ASSERT_EQUAL(LnOrigin::STATION, first.seen[2]);
+}
+
+void test_origin_is_per_task(void) {
+    LnRoute::OriginScope a(LnOrigin::SERIAL_LINK);
+    LnOrigin other = LnOrigin::COUNT;
+    std::thread t([&]() { other = LnRoute::origin(); });
+    t.join();
+    TEST_ASSERT_EQUAL(LnOrigin::PHY, other);
+    TEST_ASSERT_EQUAL(LnOrigin::SERIAL_LINK, LnRoute::origin());
+}
+
+void test_inbox_keeps_origin(void) {
+    LnRoute::broadcast(&bus, idle(), LnOrigin::LBSERVER);
+    std::thread t([]() { LnRoute::broadcast(&bus, idle(), LnOrigin::SERIAL_LINK); });
+    t.join();
+    std::vector<LnOrigin> drained;
+    uint16_t n = deferred.inbox.drain([&](const LnMsg&) { drained.push_back(LnRoute::origin()); });
+    TEST_ASSERT_EQUAL(2, n);
+    TEST_ASSERT_EQUAL(LnOrigin::LBSERVER, drained[0]);
+    TEST_ASSERT_EQUAL(LnOrigin::SERIAL_LINK, drained[1]);
+    TEST_ASSERT_EQUAL(LnOrigin::PHY, LnRoute::origin());
+
+    // full inbox drops and counts, without blocking the broadcast
+    for(int i=0; i<6; i++) LnRoute::broadcast(&bus, idle(), LnOrigin::STATION);
+    TEST_ASSERT_EQUAL(2, deferred.inbox.getStats().dropped);
+}
+
+static LnMsg switchRequest(uint16_t addr) {
+    LnMsg m = {};
+    m.data[0] = OPC_SW_REQ;
+    m.data[1] = addr & 0x7F;
+    m.data[2] = (addr>>7) & 0x0F;
+    m.data[3] = 0xFF ^ m.data[0] ^ m.data[1] ^ m.data[2];
+    return m;
+}
+
+static bool same(const LnMsg &a, const LnMsg &b) {
+    return a.length()==b.length() && memcmp(a.data, b.data, a.length())==0;
+}
+
+/**
+ * Station sends 300 messages out over the serial route (each third one twice in a row); the peer echoes all
+ * and sends 100 of its own, half of them the same bytes as a message it has just been given.
+ * @return messages the route put on the bus, in order
+ */
+static std::vector<LnMsg> runLoop(bool echoing, uint32_t &busBytes) {
+    // consumers can't be removed from the bus: live until exit
+    EchoingPeer *peer = new EchoingPeer();
+    LocoNetSerial *ser = new LocoNetSerial(peer, &bus);
+    SerialLog *log = new SerialLog();
+    bus.addConsumer(log);
+    ser->setEchoing(echoing);
+    uint16_t sent = 0;
+    for(int i=0; i<300; i++) {
+        LnRoute::broadcast(&bus, switchRequest(i - i%3/2), LnOrigin::STATION);
+        sent++;
+        if(i%3==2) {
+            ser->loop();
+            // far bus answers, sometimes with the very message it got
+            peer->send(switchRequest(i%6==5 ? i : 1000+i));
+        }
+    }
+    ser->loop();
+    ser->loop();
+    TEST_ASSERT_EQUAL(sent, ser->getStats().txMessages);
+    TEST_ASSERT_EQUAL(0, ser->getInboxStats().dropped);
+    TEST_ASSERT_EQUAL(echoing ? sent : 0, ser->getStats().echoes);
+    busBytes = log->bytes;
+    return log->seen;
+}
+
+void test_echoing_serial_route(void) {
+    uint32_t plainBytes, matchedBytes;
+    uint32_t before = LnRoute::suppressed(LnOrigin::SERIAL_LINK);
+    std::vector<LnMsg> plain = runLoop(false, plainBytes);
+    TEST_ASSERT_EQUAL(before, LnRoute::suppressed(LnOrigin::SERIAL_LINK));
+    std::vector<LnMsg> matched = runLoop(true, matchedBytes);
+    TEST_ASSERT_EQUAL(before+300, LnRoute::suppressed(LnOrigin::SERIAL_LINK));
+
+    // without matching every station message comes back onto the bus
+    TEST_ASSERT_EQUAL(400, plain.size());
+    // with it only the peer's own 100, including the 50 that repeat a message it was sent
+    TEST_ASSERT_EQUAL(100, matched.size());
+    for(int k=0; k<100; k++) {
+        int i = 3*k+2;
+        TEST_ASSERT_TRUE(same(switchRequest(i%6==5 ? i : 1000+i), matched[k]));
+    }
+    printf("serial route loop: %u bytes on the bus without echo matching, %u with it (peer's own: %u)\n",
+        (unsigned)plainBytes, (unsigned)matchedBytes, 100*4);
+    TEST_ASSERT_EQUAL(100*4, matchedBytes);
+}
+
+void test_echo_match_order_and_timeout(void) {
+    LnEchoMatch<4> m(LnOrigin::LBBINARY);
+    uint32_t before = LnRoute::suppressed(LnOrigin::LBBINARY);
+    m.sent(switchRequest(1));
+    m.sent(switchRequest(2));
+    // only the oldest outstanding message is the next echo
+    TEST_ASSERT_FALSE(m.isEcho(switchRequest(2)));
+    TEST_ASSERT_TRUE(m.isEcho(switchRequest(1)));
+    TEST_ASSERT_TRUE(m.isEcho(switchRequest(2)));
+    // each written message cancels one received message
+    TEST_ASSERT_FALSE(m.isEcho(switchRequest(2)));
+    TEST_ASSERT_EQUAL(before+2, LnRoute::suppressed(LnOrigin::LBBINARY));
+    m.sent(switchRequest(3));
+    delay(LnEchoMatch<4>::TIMEOUT_MS + 10);
+    TEST_ASSERT_FALSE(m.isEcho(switchRequest(3)));
+    TEST_ASSERT_EQUAL(0, m.pending());
+}
+
+int main(int argc, char **argv) {
+    bus.addConsumer(&first);
+    bus.addConsumer(&second);
+    bus.addConsumer(&deferred);
+    UNITY_BEGIN();
+    RUN_TEST(test_consumers_see_origin);
+    RUN_TEST(test_sender_is_not_called_back);
+    RUN_TEST(test_nested_scopes);
+    RUN_TEST(test_origin_is_per_task);
+    RUN_TEST(test_inbox_keeps_origin);
+    RUN_TEST(test_echo_match_order_and_timeout);
+    // last: its consumers stay on the bus
+    RUN_TEST(test_echoing_serial_route);
+    return UNITY_END();
+}
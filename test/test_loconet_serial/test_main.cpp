@@ -0,0 +1,236 @@
+/**
+ * LocoNetSerial on a loopback stream fed at USB-UART line rate (2 Mbaud, the CP2104 maximum) by a PC-side
+ * thread: every message reaches the bus in order with loop() running once per millisecond, and from its own
+ * task. Bus messages go out with one write each; garbage is counted and skipped.
+ * pio test -e native -f test_loconet_serial
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "LocoNetSerial.h"
+
+/// 2 Mbaud, 10 bits per byte
+static const uint32_t RATE_BPS = 200000;
+static const uint32_t MESSAGES = 40000;
+
+/// Both directions of a serial port. The station side is the Stream; the PC side is used from another thread.
+class LoopbackStream: public Stream {
+public:
+    int available() override {
+        std::lock_guard<std::mutex> g(lock);
+        return toStation.size();
+    }
+    int read() override {
+        std::lock_guard<std::mutex> g(lock);
+        if(toStation.empty()) return -1;
+        int c = toStation.front();
+        toStation.pop_front();
+        return c;
+    }
+    int peek() override {
+        std::lock_guard<std::mutex> g(lock);
+        return toStation.empty() ? -1 : toStation.front();
+    }
+    size_t readBytes(char *buf, size_t len) override {
+        std::lock_guard<std::mutex> g(lock);
+        size_t n = len<toStation.size() ? len : toStation.size();
+        std::copy(toStation.begin(), toStation.begin()+n, buf);
+        toStation.erase(toStation.begin(), toStation.begin()+n);
+        return n;
+    }
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const uint8_t *buf, size_t len) override {
+        std::lock_guard<std::mutex> g(lock);
+        toPc.insert(toPc.end(), buf, buf+len);
+        writes++;
+        return len;
+    }
+
+    /// PC side
+    void pcWrite(const uint8_t *buf, size_t len) {
+        std::lock_guard<std::mutex> g(lock);
+        toStation.insert(toStation.end(), buf, buf+len);
+    }
+    std::vector<uint8_t> pcRead() {
+        std::lock_guard<std::mutex> g(lock);
+        std::vector<uint8_t> r(toPc.begin(), toPc.end());
+        toPc.clear();
+        return r;
+    }
+    uint32_t writes = 0;
+
+private:
+    std::mutex lock;
+    std::deque<uint8_t> toStation;
+    std::deque<uint8_t> toPc;
+};
+
+/// Message number i: 4 byte speed, 2 byte, or 6+ byte variable length, so framing of every kind is exercised.
+static LnMsg message(uint32_t i) {
+    LnMsg m = {};
+    uint8_t len;
+    switch(i%3) {
+        case 0: m.data[0] = OPC_LOCO_SPD; m.data[1] = i & 0x7F; m.data[2] = (i>>7) & 0x7F; len = 4; break;
+        case 1: m.data[0] = OPC_IDLE; len = 2; break;
+        default:
+            len = 6 + i%10;
+            m.data[0] = OPC_PEER_XFER; m.data[1] = len;
+            for(uint8_t j=2; j<len-1; j++) m.data[j] = (i>>(j%3*7)) & 0x7F;
+    }
+    uint8_t chk = 0xFF;
+    for(uint8_t j=0; j<len-1; j++) chk ^= m.data[j];
+    m.data[len-1] = chk;
+    return m;
+}
+
+/// Checks that messages from the serial link arrive complete and in order.
+class Checker: public LocoNetConsumer {
+public:
+    std::atomic<uint32_t> received{0};
+    std::atomic<uint32_t> wrong{0};
+    LN_STATUS onMessage(const lnMsg &msg) override {
+        if(LnRoute::origin()!=LnOrigin::SERIAL_LINK) return LN_DONE;
+        LnMsg m = message(received);
+        if(msg.length()!=m.length() || memcmp(msg.data, m.data, m.length())!=0) wrong++;
+        received++;
+        return LN_DONE;
+    }
+};
+
+/// Live until exit: consumers can't be removed from the bus, and in task mode the serial task can't be stopped.
+static LocoNetBus *bus = new LocoNetBus();
+static Checker *checker = new Checker();
+
+static double msSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-t0).count();
+}
+
+/// PC side: writes all messages at RATE_BPS, in the bursts a USB bridge delivers them.
+static void feed(LoopbackStream *s) {
+    std::vector<uint8_t> all;
+    for(uint32_t i=0; i<MESSAGES; i++) {
+        LnMsg m = message(i);
+        all.insert(all.end(), m.data, m.data+m.length());
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    size_t sent = 0;
+    while(sent<all.size()) {
+        size_t due = (size_t)(msSince(t0)*RATE_BPS/1000);
+        if(due>all.size()) due = all.size();
+        if(due>sent) {
+            s->pcWrite(all.data()+sent, due-sent);
+            sent = due;
+        }
+        usleep(125);  // USB full speed frame
+    }
+}
+
+static void waitReceived(uint32_t n, std::function<void()> loop) {
+    auto t0 = std::chrono::steady_clock::now();
+    while(checker->received < n && msSince(t0) < 10000) loop();
+}
+
+void setUp(void) {
+    checker->received = 0;
+    checker->wrong = 0;
+}
+void tearDown(void) {}
+
+void test_pc_to_bus_from_loop(void) {
+    LoopbackStream *stream = new LoopbackStream();
+    LocoNetSerial *ser = new LocoNetSerial(stream, bus);
+    ser->begin();
+    auto t0 = std::chrono::steady_clock::now();
+    std::thread pc(feed, stream);
+    // main loop runs once per ms, as in the host build
+    waitReceived(MESSAGES, [&]{ ser->loop(); usleep(1000); });
+    double ms = msSince(t0);
+    pc.join();
+
+    const LocoNetSerial::Stats &st = ser->getStats();
+    printf("loop(): %u messages, %u bytes in %.0f ms (%.0f B/s), max latency %u us\n",
+        (unsigned)st.rxMessages, (unsigned)st.rxBytes, ms, st.rxBytes*1000/ms, (unsigned)st.maxLatencyUs);
+    TEST_ASSERT_EQUAL(MESSAGES, checker->received);
+    TEST_ASSERT_EQUAL(0, checker->wrong);
+    TEST_ASSERT_EQUAL(0, st.framingErrors);
+    TEST_ASSERT_EQUAL(0, st.checksumErrors);
+    // kept up with the line: not much longer than the data takes on the wire
+    TEST_ASSERT_LESS_THAN(st.rxBytes*1000/RATE_BPS * 1.2 + 50, ms);
+}
+
+void test_pc_to_bus_own_task(void) {
+    LoopbackStream *stream = new LoopbackStream();
+    LocoNetSerial *ser = new LocoNetSerial(stream, bus);
+    ser->begin(true);
+    std::thread pc(feed, stream);
+    waitReceived(MESSAGES, [&]{ usleep(1000); });
+    pc.join();
+
+    const LocoNetSerial::Stats &st = ser->getStats();
+    printf("own task: %u messages, max latency %u us\n", (unsigned)st.rxMessages, (unsigned)st.maxLatencyUs);
+    TEST_ASSERT_EQUAL(MESSAGES, checker->received);
+    TEST_ASSERT_EQUAL(0, checker->wrong);
+    TEST_ASSERT_EQUAL(0, st.framingErrors);
+}
+
+void test_bus_to_pc(void) {
+    LoopbackStream *stream = new LoopbackStream();
+    LocoNetSerial *ser = new LocoNetSerial(stream, bus);
+    std::vector<uint8_t> expect, got;
+    const uint32_t N = 3000;
+    for(uint32_t i=0; i<N; i++) {
+        LnMsg m = message(i);
+        expect.insert(expect.end(), m.data, m.data+m.length());
+        bus->broadcast(m);
+        // inbox holds 32, loop() empties it
+        if(i%16==15) ser->loop();
+    }
+    ser->loop();
+    got = stream->pcRead();
+    TEST_ASSERT_TRUE(got==expect);
+    TEST_ASSERT_EQUAL(N, stream->writes);
+    TEST_ASSERT_EQUAL(N, ser->getStats().txMessages);
+    TEST_ASSERT_EQUAL(0, ser->getInboxStats().dropped);
+}
+
+void test_garbage_is_skipped(void) {
+    LoopbackStream *stream = new LoopbackStream();
+    LocoNetSerial *ser = new LocoNetSerial(stream, bus);
+    LnMsg ok0 = message(0), ok1 = message(1), ok2 = message(2);
+    std::vector<uint8_t> in;
+    in.insert(in.end(), {0x12, 0x34});                          // 2 bytes outside a message
+    in.insert(in.end(), ok0.data, ok0.data+ok0.length());
+    in.insert(in.end(), {OPC_LOCO_SPD, 0x01});                  // cut short by next opcode
+    in.insert(in.end(), ok1.data, ok1.data+ok1.length());
+    in.insert(in.end(), {OPC_PEER_XFER, 0x7F});                 // impossible length, 1 error
+    in.insert(in.end(), {OPC_LOCO_SPD, 0x01, 0x02, 0x00});      // bad checksum
+    in.insert(in.end(), ok2.data, ok2.data+ok2.length());
+    stream->pcWrite(in.data(), in.size());
+    ser->loop();
+    const LocoNetSerial::Stats &st = ser->getStats();
+    TEST_ASSERT_EQUAL(3, checker->received);
+    TEST_ASSERT_EQUAL(0, checker->wrong);
+    TEST_ASSERT_EQUAL(4, st.framingErrors);
+    TEST_ASSERT_EQUAL(1, st.checksumErrors);
+    TEST_ASSERT_EQUAL(in.size(), st.rxBytes);
+}
+
+int main(int argc, char **argv) {
+    bus->addConsumer(checker);
+    UNITY_BEGIN();
+    RUN_TEST(test_pc_to_bus_from_loop);
+    RUN_TEST(test_bus_to_pc);
+    RUN_TEST(test_garbage_is_skipped);
+    // last: its task keeps running
+    RUN_TEST(test_pc_to_bus_own_task);
+    return UNITY_END();
+}
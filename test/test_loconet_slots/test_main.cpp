@@ -0,0 +1,175 @@
+/**
+ * LocoNetSlotManager with scripted throttle sessions: functions over the classic, immediate packet and
+ * expanded paths are counted in getFnStats(), and changes made by the command station itself are broadcast
+ * as deltas against what LocoNet knows of the slot, also after the slot has gone to another loco.
+ * pio test -e native -f test_loconet_slots
+ */
+#include <unity.h>
+
+#include <vector>
+
+#include "LocoNetSlotManager.h"
+
+/// Takes packets instead of generating a signal.
+class NullChannel: public IDCCChannel {
+public:
+    void begin() override {}
+    void end() override {}
+    void unloadSlot(uint8_t) override {}
+    void setPower(bool v) override { power = v; }
+    bool getPower() override { return power; }
+    uint16_t readCurrentAdc() override { return 0; }
+protected:
+    void timerFunc() override {}
+    bool loadPacket(int, uint8_t*, uint8_t, int) override { return true; }
+private:
+    bool power = true;
+};
+
+/// Throttle side: keeps what the station sends.
+class Throttle: public LocoNetConsumer {
+public:
+    std::vector<LnMsg> rx;
+    LN_STATUS onMessage(const LnMsg &m) override {
+        rx.push_back(m);
+        return LN_DONE;
+    }
+    /// Last slot data received, 0 if none.
+    uint8_t slotData() const {
+        for(auto it=rx.rbegin(); it!=rx.rend(); ++it)
+            if(it->data[0]==OPC_SL_RD_DATA) return it->sd.slot;
+        return 0;
+    }
+};
+
+static NullChannel dcc;
+static LocoNetBus bus;
+static LocoNetSlotManager slotMan(&bus);
+static Throttle throttle;
+
+/// Runs the slot manager for `ms`, long enough for the delta window and the paced transmit queue.
+static void run(uint32_t ms = LocoNetSlotManager::DELTA_WINDOW_MS*2) {
+    uint32_t t0 = millis();
+    while(millis()-t0 < ms) { slotMan.loop(); delay(1); }
+}
+
+static void send(std::vector<uint8_t> d) {
+    LnMsg m = {};
+    for(size_t i=0; i<d.size(); i++) m.data[i] = d[i];
+    writeChecksum(m);
+    bus.broadcast(m, &throttle);
+    run();
+}
+
+/// OPC_LOCO_ADR, then null move; returns the slot taken.
+static uint8_t take(uint8_t addr) {
+    throttle.rx.clear();
+    send({OPC_LOCO_ADR, 0, addr});
+    uint8_t slot = throttle.slotData();
+    TEST_ASSERT_NOT_EQUAL(0, slot);
+    send({OPC_MOVE_SLOTS, slot, slot});
+    TEST_ASSERT_EQUAL(slot, CS.findLocoSlot(LocoAddress::shortAddr(addr)));
+    throttle.rx.clear();
+    return slot;
+}
+
+static LocoNetSlotManager::FnStats fn0;
+static LocoNetSlotManager::DeltaStats delta0;
+
+static uint32_t fnMessages(LocoNetSlotManager::FnPath p) { return slotMan.getFnStats().messages[p] - fn0.messages[p]; }
+static uint32_t fnBytes(LocoNetSlotManager::FnPath p) { return slotMan.getFnStats().bytes[p] - fn0.bytes[p]; }
+
+void setUp(void) {
+    fn0 = slotMan.getFnStats();
+    delta0 = slotMan.getDeltaStats();
+}
+void tearDown(void) {}
+
+void test_fn_paths_are_counted(void) {
+    uint8_t slot = take(3);
+    send({OPC_LOCO_DIRF, slot, DIRF_DIR | DIRF_F0 | 0x01}); // F0, F1
+    send({OPC_LOCO_F9F12, slot, 0x02});            // F10
+    send({OPC_UHLI_FUN, 0x20, slot, 0x08, 0x04});  // F15
+    // DCC function group one for address 3, F4: 03 88 8B; high bits of the bytes in the IMM byte
+    send({OPC_IMM_PACKET, 0x0B, 0x7F, 0x30, 0x06, 0x03, 0x08, 0x0B, 0x00, 0x00});
+
+    TEST_ASSERT_EQUAL(1, fnMessages(LocoNetSlotManager::FN_CLASSIC));
+    TEST_ASSERT_EQUAL(4, fnBytes(LocoNetSlotManager::FN_CLASSIC));
+    TEST_ASSERT_EQUAL(2, fnMessages(LocoNetSlotManager::FN_EXPANDED));
+    TEST_ASSERT_EQUAL(4+6, fnBytes(LocoNetSlotManager::FN_EXPANDED));
+    TEST_ASSERT_EQUAL(1, fnMessages(LocoNetSlotManager::FN_IMMEDIATE));
+    TEST_ASSERT_EQUAL(11, fnBytes(LocoNetSlotManager::FN_IMMEDIATE));
+
+    uint32_t f = CS.getLocoFns(slot);
+    TEST_ASSERT_EQUAL_UINT32(1UL<<0 | 1UL<<1 | 1UL<<10 | 1UL<<15, f);
+    // what came from LocoNet is not echoed back as a delta
+    TEST_ASSERT_EQUAL(delta0.changes, slotMan.getDeltaStats().changes);
+    send({OPC_SLOT_STAT1, slot, LOCO_FREE | DEC_MODE_128});
+    TEST_ASSERT_EQUAL(0, CS.findLocoSlot(LocoAddress::shortAddr(3)));
+}
+
+void test_station_change_is_sent_as_delta(void) {
+    uint8_t slot = take(3);
+    CS.setLocoFns(slot, 1UL<<20, 1UL<<20);
+    run();
+    LocoNetSlotManager::DeltaStats d = slotMan.getDeltaStats();
+    TEST_ASSERT_EQUAL(1, d.changes - delta0.changes);
+    TEST_ASSERT_EQUAL(1, d.messages - delta0.messages);
+    TEST_ASSERT_EQUAL(6, d.bytes - delta0.bytes);
+    TEST_ASSERT_EQUAL(14, d.fullSlotBytes - delta0.fullSlotBytes);
+    TEST_ASSERT_EQUAL(1, throttle.rx.size());
+    TEST_ASSERT_EQUAL_HEX8(OPC_EXP_SEND_FUNCTION_OR_SPEED_AND_DIR, throttle.rx[0].data[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x20, throttle.rx[0].data[1] & 0xF8);
+    TEST_ASSERT_EQUAL_HEX8(0x40, throttle.rx[0].data[4]);
+    send({OPC_SLOT_STAT1, slot, LOCO_FREE | DEC_MODE_128});
+}
+
+/// Uhlenbrock groups: 0x07 F5-F11, 0x05 F12/F20/F28, 0x08 F13-F19, 0x09 F21-F27.
+void test_uhli_groups(void) {
+    uint8_t slot = take(3);
+    send({OPC_UHLI_FUN, 0x20, slot, 0x07, 0x41});  // F5, F11
+    send({OPC_UHLI_FUN, 0x20, slot, 0x05, 0x50});  // F12, F28
+    send({OPC_UHLI_FUN, 0x20, slot, 0x08, 0x40});  // F19
+    send({OPC_UHLI_FUN, 0x20, slot, 0x09, 0x01});  // F21
+    TEST_ASSERT_EQUAL_UINT32(1UL<<5 | 1UL<<11 | 1UL<<12 | 1UL<<19 | 1UL<<21 | 1UL<<28, CS.getLocoFns(slot));
+    TEST_ASSERT_EQUAL(4, fnMessages(LocoNetSlotManager::FN_EXPANDED));
+    TEST_ASSERT_EQUAL(delta0.changes, slotMan.getDeltaStats().changes);
+    send({OPC_UHLI_FUN, 0x20, slot, 0x07, 0x00});
+    TEST_ASSERT_EQUAL_UINT32(1UL<<12 | 1UL<<19 | 1UL<<21 | 1UL<<28, CS.getLocoFns(slot));
+    send({OPC_SLOT_STAT1, slot, LOCO_FREE | DEC_MODE_128});
+}
+
+/// A slot freed with F9-F28 on and taken for another loco starts from no functions.
+void test_reused_slot_has_no_functions(void) {
+    uint8_t slot = take(3);
+    send({OPC_LOCO_F9F12, slot, 0x02});
+    send({OPC_UHLI_FUN, 0x20, slot, 0x08, 0x04});
+    send({OPC_SLOT_STAT1, slot, LOCO_FREE | DEC_MODE_128});
+    delta0 = slotMan.getDeltaStats();
+
+    uint8_t other = take(4);
+    TEST_ASSERT_EQUAL(slot, other);
+    TEST_ASSERT_EQUAL(0, CS.getLocoFns(other));
+    CS.setLocoSpeed(other, 20);
+    run();
+    LocoNetSlotManager::DeltaStats d = slotMan.getDeltaStats();
+    TEST_ASSERT_EQUAL(1, d.changes - delta0.changes);
+    TEST_ASSERT_EQUAL(1, d.messages - delta0.messages);
+    TEST_ASSERT_EQUAL(4, d.bytes - delta0.bytes);
+    TEST_ASSERT_EQUAL(1, throttle.rx.size());
+    TEST_ASSERT_EQUAL_HEX8(OPC_LOCO_SPD, throttle.rx[0].data[0]);
+    TEST_ASSERT_EQUAL(20, throttle.rx[0].data[2]);
+    send({OPC_SLOT_STAT1, other, LOCO_FREE | DEC_MODE_128});
+}
+
+int main(int argc, char **argv) {
+    CS.setDccMain(&dcc);
+    CS.addSlotListener(&slotMan);
+    bus.addConsumer(&throttle);
+    UNITY_BEGIN();
+    RUN_TEST(test_fn_paths_are_counted);
+    RUN_TEST(test_station_change_is_sent_as_delta);
+    RUN_TEST(test_uhli_groups);
+    RUN_TEST(test_reused_slot_has_no_functions);
+    return UNITY_END();
+}
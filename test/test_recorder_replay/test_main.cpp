@@ -0,0 +1,181 @@
+/**
+ * LnRecorder capture fed back by LnReplay: same messages with the same origins, ring keeps the newest N,
+ * chunked dump into a slow output, recorded timing and speed factor, damaged captures.
+ * pio test -e native -f test_recorder_replay
+ */
+#include <unity.h>
+
+#include <unistd.h>
+#include <vector>
+
+#include "LnRecorder.h"
+#include "LnReplay.h"
+
+/// Capture output that takes at most `chunk` bytes per write, like a TCP client with a small send buffer.
+class Sink: public Print {
+public:
+    std::vector<uint8_t> data;
+    size_t chunk = SIZE_MAX;
+    size_t write(uint8_t b) override { data.push_back(b); return 1; }
+    size_t write(const uint8_t *buf, size_t size) override {
+        size_t n = size<chunk ? size : chunk;
+        data.insert(data.end(), buf, buf+n);
+        return n;
+    }
+};
+
+struct Seen {
+    LnMsg msg;
+    LnOrigin origin;
+    uint32_t us;
+};
+
+/// Everything that comes over the bus, with origin and time.
+class Collector: public LocoNetConsumer {
+public:
+    std::vector<Seen> seen;
+    LN_STATUS onMessage(const lnMsg &msg) override {
+        seen.push_back({msg, LnRoute::origin(), micros()});
+        return LN_DONE;
+    }
+};
+
+static const uint16_t RING = 16;
+
+static LocoNetBus bus;
+static LnRecorder<RING> recorder(&bus);
+static Collector collector;
+static LnReplay replay(&bus);
+
+/// 2, 4 or variable length message, different for each i.
+static LnMsg message(int i) {
+    LnMsg m = {};
+    uint8_t len;
+    switch(i%3) {
+        case 0: m.data[0] = OPC_IDLE; len = 2; break;
+        case 1: m.data[0] = OPC_SW_REQ; m.data[1] = i & 0x7F; m.data[2] = 0x30; len = 4; break;
+        default:
+            len = 6 + i%8;
+            m.data[0] = OPC_PEER_XFER; m.data[1] = len;
+            for(uint8_t j=2; j<len-1; j++) m.data[j] = (i+j) & 0x7F;
+    }
+    uint8_t chk = 0xFF;
+    for(uint8_t j=0; j<len-1; j++) chk ^= m.data[j];
+    m.data[len-1] = chk;
+    return m;
+}
+
+static LnOrigin originOf(int i) { return (LnOrigin)(i % (int)LnOrigin::COUNT); }
+
+static bool same(const LnMsg &a, const LnMsg &b) {
+    return a.length()==b.length() && memcmp(a.data, b.data, a.length())==0;
+}
+
+void setUp(void) {
+    recorder.setEnabled(true);
+    recorder.clear();
+    collector.seen.clear();
+}
+void tearDown(void) {}
+
+void test_round_trip(void) {
+    for(int i=0; i<10; i++) LnRoute::broadcast(&bus, message(i), originOf(i));
+    Sink out;
+    size_t n = recorder.dump(out);
+    TEST_ASSERT_EQUAL(out.data.size(), n);
+
+    recorder.setEnabled(false);
+    collector.seen.clear();
+    TEST_ASSERT_TRUE(replay.begin(out.data.data(), out.data.size(), LnReplay::FLAT_OUT));
+    TEST_ASSERT_EQUAL(10, replay.runAll());
+    TEST_ASSERT_FALSE(replay.getStats().corrupt);
+    TEST_ASSERT_EQUAL(10, collector.seen.size());
+    for(int i=0; i<10; i++) {
+        TEST_ASSERT_TRUE(same(message(i), collector.seen[i].msg));
+        TEST_ASSERT_EQUAL(originOf(i), collector.seen[i].origin);
+    }
+}
+
+void test_ring_keeps_newest(void) {
+    for(int i=0; i<40; i++) LnRoute::broadcast(&bus, message(i), originOf(i));
+    TEST_ASSERT_EQUAL(40-RING, recorder.getStats().overwritten);
+
+    // one record or less per write, so every record is split over dumpStep() calls
+    Sink out;
+    out.chunk = 3;
+    LnRecorder<RING>::DumpCursor c;
+    recorder.dumpBegin(c);
+    int steps = 0;
+    while(recorder.dumpStep(c, out)) steps++;
+    TEST_ASSERT_EQUAL(out.data.size(), c.total);
+    TEST_ASSERT_GREATER_THAN(RING, steps);
+
+    recorder.setEnabled(false);
+    collector.seen.clear();
+    TEST_ASSERT_TRUE(replay.begin(out.data.data(), out.data.size(), LnReplay::FLAT_OUT));
+    replay.runAll();
+    TEST_ASSERT_EQUAL(RING, collector.seen.size());
+    for(int i=0; i<RING; i++) {
+        TEST_ASSERT_TRUE(same(message(40-RING+i), collector.seen[i].msg));
+        TEST_ASSERT_EQUAL(originOf(40-RING+i), collector.seen[i].origin);
+    }
+}
+
+void test_timing_and_speed(void) {
+    const uint32_t GAP_US = 20000;
+    for(int i=0; i<3; i++) {
+        if(i>0) usleep(GAP_US);
+        LnRoute::broadcast(&bus, message(i), LnOrigin::PHY);
+    }
+    Sink out;
+    recorder.dump(out);
+    recorder.setEnabled(false);
+
+    for(uint16_t speed: {1, 2}) {
+        collector.seen.clear();
+        TEST_ASSERT_TRUE(replay.begin(out.data.data(), out.data.size(), speed));
+        while(replay.loop()) usleep(100);
+        TEST_ASSERT_EQUAL(3, collector.seen.size());
+        uint32_t span = collector.seen[2].us - collector.seen[0].us;
+        // not earlier than recorded, and not much later
+        TEST_ASSERT_GREATER_OR_EQUAL(2*GAP_US/speed, span);
+        TEST_ASSERT_LESS_THAN(2*GAP_US/speed + 15000, span);
+    }
+}
+
+void test_damaged_capture(void) {
+    for(int i=0; i<5; i++) LnRoute::broadcast(&bus, message(i), originOf(i));
+    Sink out;
+    recorder.dump(out);
+    recorder.setEnabled(false);
+    collector.seen.clear();
+
+    // cut in the middle of the last record: the complete ones are still replayed
+    TEST_ASSERT_TRUE(replay.begin(out.data.data(), out.data.size()-1, LnReplay::FLAT_OUT));
+    TEST_ASSERT_EQUAL(4, replay.runAll());
+    TEST_ASSERT_TRUE(replay.getStats().corrupt);
+
+    // unknown origin
+    std::vector<uint8_t> bad = out.data;
+    bad[LnCapture::HEADER_SIZE+1] = (uint8_t)LnOrigin::COUNT;
+    TEST_ASSERT_TRUE(replay.begin(bad.data(), bad.size(), LnReplay::FLAT_OUT));
+    TEST_ASSERT_EQUAL(0, replay.runAll());
+    TEST_ASSERT_TRUE(replay.getStats().corrupt);
+
+    // wrong header or version
+    bad = out.data;
+    bad[sizeof(LnCapture::MAGIC)] = LnCapture::VERSION+1;
+    TEST_ASSERT_FALSE(replay.begin(bad.data(), bad.size()));
+    TEST_ASSERT_FALSE(replay.begin(out.data.data(), 3));
+    TEST_ASSERT_TRUE(replay.done());
+}
+
+int main(int argc, char **argv) {
+    bus.addConsumer(&collector);
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_ring_keeps_newest);
+    RUN_TEST(test_timing_and_speed);
+    RUN_TEST(test_damaged_capture);
+    return UNITY_END();
+}
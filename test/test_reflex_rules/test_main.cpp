@@ -0,0 +1,144 @@
+/**
+ * ReflexRules on the host: rule text, rules executed only by loop(), and a simulation with sensor messages
+ * broadcast from another thread (as the LocoNet receive task does) while the main loop runs. Prints reaction
+ * time from sensor message to DCC packet loaded.
+ * pio test -e native -f test_reflex_rules
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "ReflexRules.h"
+
+/// Records speed packets instead of generating a signal.
+class PacketLog: public IDCCChannel {
+public:
+    void begin() override {}
+    void end() override {}
+    void unloadSlot(uint8_t) override {}
+    void setPower(bool v) override { power = v; }
+    bool getPower() override { return power; }
+    uint16_t readCurrentAdc() override { return 0; }
+
+    std::atomic<uint32_t> packets{0};
+    uint8_t last[6];
+protected:
+    void timerFunc() override {}
+    bool loadPacket(int, uint8_t *b, uint8_t n, int) override {
+        memcpy(last, b, n<sizeof(last) ? n : sizeof(last));
+        packets++;
+        return true;
+    }
+private:
+    bool power = true;
+};
+
+static LnMsg sensorMsg(uint16_t sensor, bool active) {
+    uint16_t i = sensor-1;
+    LnMsg m = {};
+    m.data[0] = OPC_INPUT_REP;
+    m.data[1] = (i>>1) & 0x7F;
+    m.data[2] = 0x40 | ((i>>8) & 0x0F) | (i&1)<<5 | (active ? 0x10 : 0);
+    m.data[3] = 0xFF ^ m.data[0] ^ m.data[1] ^ m.data[2];
+    return m;
+}
+
+static LocoNetBus bus;
+static ReflexRules rules(&bus);
+static PacketLog dcc;
+static uint8_t slot;
+
+static const char *RULES =
+    "# block 12 protects loco 3\n"
+    "12 active stop short 3\n"
+    "13 inactive estop long 1234\n"
+    "\n"
+    "100 active throw acc 17   # and set the turnout\n"
+    "101 active close acc 17\n";
+
+void setUp(void) {
+    CS.setDccMain(&dcc);
+    slot = CS.findOrAllocateLocoSlot(LocoAddress::shortAddr(3));
+    CS.setLocoSpeed(slot, 40);
+    TEST_ASSERT_EQUAL(4, rules.load(RULES));
+}
+void tearDown(void) {}
+
+void test_load_rejects_bad_lines(void) {
+    TEST_ASSERT_EQUAL(-2, rules.load("12 active stop short 3\n12 active throw short 3\n"));
+    TEST_ASSERT_EQUAL(-1, rules.load("5000 active stop slot 1"));
+    TEST_ASSERT_EQUAL(-3, rules.load("\n# x\n12 sometimes stop slot 1\n"));
+    // nothing is kept from a bad text
+    bus.broadcast(sensorMsg(12, true));
+    rules.loop();
+    TEST_ASSERT_EQUAL(40, CS.getLocoSpeed(slot));
+    TEST_ASSERT_EQUAL(2, rules.load("1 active stop slot 1\n\n2 inactive close acc 1"));
+}
+
+void test_action_runs_in_loop(void) {
+    uint32_t fired = rules.getStats().fired;
+    bus.broadcast(sensorMsg(12, false));   // rule is for active
+    bus.broadcast(sensorMsg(11, true));    // no rule
+    bus.broadcast(sensorMsg(12, true));
+    TEST_ASSERT_EQUAL(40, CS.getLocoSpeed(slot));
+    rules.loop();
+    TEST_ASSERT_EQUAL(0, CS.getLocoSpeed(slot));
+    TEST_ASSERT_EQUAL(0, dcc.last[2] & 0x7F);
+    TEST_ASSERT_EQUAL(fired+1, rules.getStats().fired);
+}
+
+void test_accessory_rules(void) {
+    bus.broadcast(sensorMsg(100, true));
+    rules.loop();
+    TEST_ASSERT_EQUAL((int)TurnoutState::THROWN, (int)CS.getTurnoutState(17));
+    bus.broadcast(sensorMsg(101, true));
+    rules.loop();
+    TEST_ASSERT_EQUAL((int)TurnoutState::CLOSED, (int)CS.getTurnoutState(17));
+}
+
+/// Sensor messages from a receive thread every 2 ms; main loop stops the loco and a throttle sets it moving again.
+void test_simulated_reaction_time(void) {
+    const int EVENTS = 300;
+    std::atomic<bool> running{true};
+    std::thread rx([&] {
+        for(int i=0; i<EVENTS; i++) {
+            usleep(2000);
+            bus.broadcast(sensorMsg(12, true));
+        }
+        usleep(5000);
+        running = false;
+    });
+    std::vector<uint32_t> reaction;
+    uint32_t fired = rules.getStats().fired;
+    while(running) {
+        rules.loop();
+        ReflexRules::Stats st = rules.getStats();
+        if(st.fired!=fired) {
+            fired = st.fired;
+            reaction.push_back(st.lastReactionUs);
+            TEST_ASSERT_EQUAL(0, CS.getLocoSpeed(slot));
+            CS.setLocoSpeed(slot, 40);
+        }
+        usleep(100);   // rest of the main loop
+    }
+    rx.join();
+    std::sort(reaction.begin(), reaction.end());
+    TEST_ASSERT_EQUAL(EVENTS, reaction.size());
+    printf("%d sensor events: reaction median %u us, p99 %u us, max %u us\n", EVENTS,
+        (unsigned)reaction[EVENTS/2], (unsigned)reaction[EVENTS*99/100], (unsigned)reaction.back());
+    TEST_ASSERT_LESS_THAN(2000, reaction[EVENTS/2]);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_load_rejects_bad_lines);
+    RUN_TEST(test_action_runs_in_loop);
+    RUN_TEST(test_accessory_rules);
+    RUN_TEST(test_simulated_reaction_time);
+    return UNITY_END();
+}
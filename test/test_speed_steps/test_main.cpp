@@ -0,0 +1,133 @@
+/**
+ * Speed instructions for 14, 28 and 128 step decoders, and slots taking their mode from the loco roster.
+ * pio test -e native -f test_speed_steps
+ */
+#include <unity.h>
+
+#include <stdio.h>
+
+#include "CommandStation.h"
+
+/// Keeps the last packet instead of generating a signal.
+class PacketLog: public IDCCChannel {
+public:
+    void begin() override {}
+    void end() override {}
+    void unloadSlot(uint8_t) override {}
+    void setPower(bool v) override {}
+    bool getPower() override { return true; }
+    uint16_t readCurrentAdc() override { return 0; }
+
+    uint8_t last[6];
+    uint8_t len = 0;
+    int packets = 0;
+    /// speed instruction byte of last packet to a short address
+    uint8_t speedByte() const { return last[1]; }
+protected:
+    void timerFunc() override {}
+    bool loadPacket(int, uint8_t *b, uint8_t n, int) override {
+        memcpy(last, b, n);
+        len = n;
+        packets++;
+        return true;
+    }
+};
+
+static PacketLog dcc;
+static const char *ROSTER_PATH = "test_speed_steps_roster.bin";
+
+void setUp(void) { CS.setDccMain(&dcc); }
+void tearDown(void) {}
+
+void test_128_steps(void) {
+    dcc.sendThrottle(1, LocoAddress::shortAddr(3), 127, 1);
+    TEST_ASSERT_EQUAL(3, dcc.len);
+    TEST_ASSERT_EQUAL_HEX8(0x3F, dcc.last[1]);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, dcc.last[2]);
+    dcc.sendThrottle(1, LocoAddress::longAddr(1234), 1, 0);
+    TEST_ASSERT_EQUAL(4, dcc.len);
+    TEST_ASSERT_EQUAL_HEX8(0xC4, dcc.last[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xD2, dcc.last[1]);
+    TEST_ASSERT_EQUAL_HEX8(0x01, dcc.last[3]);
+}
+
+void test_28_steps(void) {
+    LocoAddress a = LocoAddress::shortAddr(3);
+    struct { uint8_t speed, dir, expect; } cases[] = {
+        {0, 1, 0x60},     // stop
+        {1, 1, 0x61},     // e-stop: SSSS=1 C=0
+        {2, 1, 0x62},     // step 1: SSSS=2 C=0
+        {7, 0, 0x52},     // step 2: SSSS=2 C=1
+        {127, 1, 0x7F},   // step 28
+    };
+    for(auto &c: cases) {
+        dcc.sendThrottle(1, a, c.speed, c.dir, 28);
+        TEST_ASSERT_EQUAL(2, dcc.len);
+        TEST_ASSERT_EQUAL_HEX8(c.expect, dcc.speedByte());
+    }
+    // every step is reached, in order
+    uint8_t prev = 0;
+    int distinct = 0;
+    for(uint8_t s=2; s<=127; s++) {
+        dcc.sendThrottle(1, a, s, 1, 28);
+        uint8_t v = dcc.speedByte();
+        uint8_t step = (((v&0x0F)<<1) | (v>>4 & 1)) - 3;
+        TEST_ASSERT_TRUE(step>=prev && step<=prev+1);
+        if(step!=prev) distinct++;
+        prev = step;
+    }
+    TEST_ASSERT_EQUAL(28, distinct);
+}
+
+void test_14_steps_carry_fl(void) {
+    LocoAddress a = LocoAddress::shortAddr(3);
+    dcc.sendThrottle(1, a, 0, 1, 14, true);
+    TEST_ASSERT_EQUAL_HEX8(0x70, dcc.speedByte());
+    dcc.sendThrottle(1, a, 1, 0, 14, false);
+    TEST_ASSERT_EQUAL_HEX8(0x41, dcc.speedByte());
+    dcc.sendThrottle(1, a, 2, 1, 14, false);
+    TEST_ASSERT_EQUAL_HEX8(0x62, dcc.speedByte());
+    dcc.sendThrottle(1, a, 127, 1, 14, true);
+    TEST_ASSERT_EQUAL_HEX8(0x7F, dcc.speedByte());
+}
+
+void test_slot_uses_roster_steps(void) {
+    remove(ROSTER_PATH);
+    FileRosterStorage st(ROSTER_PATH, 0x8000);
+    LocoRoster roster;
+    roster.begin(&st);
+    TEST_ASSERT_TRUE(roster.put(LocoAddress::shortAddr(14), "Old", 14));
+    TEST_ASSERT_TRUE(roster.put(LocoAddress::shortAddr(28), "Older", 28));
+    TEST_ASSERT_TRUE(roster.rebuild());
+    CS.setLocoRoster(&roster);
+
+    uint8_t s14 = CS.findOrAllocateLocoSlot(LocoAddress::shortAddr(14));
+    uint8_t s28 = CS.findOrAllocateLocoSlot(LocoAddress::shortAddr(28));
+    TEST_ASSERT_EQUAL(14, CS.getLocoSpeedSteps(s14));
+    TEST_ASSERT_EQUAL(28, CS.getLocoSpeedSteps(s28));
+
+    CS.setLocoSpeed(s28, 127);
+    TEST_ASSERT_EQUAL_HEX8(0x7F, dcc.speedByte());
+
+    CS.setLocoSpeed(s14, 2);
+    TEST_ASSERT_EQUAL_HEX8(0x62, dcc.speedByte());
+    // F0 of a 14 step decoder goes with the speed instruction too
+    CS.setLocoFn(s14, 0, true);
+    TEST_ASSERT_EQUAL_HEX8(0x72, dcc.speedByte());
+    CS.setLocoFns(s14, 1, 0);
+    TEST_ASSERT_EQUAL_HEX8(0x62, dcc.speedByte());
+
+    CS.releaseLocoSlot(s14);
+    CS.releaseLocoSlot(s28);
+    CS.setLocoRoster(nullptr);
+    remove(ROSTER_PATH);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_128_steps);
+    RUN_TEST(test_28_steps);
+    RUN_TEST(test_14_steps_carry_fl);
+    RUN_TEST(test_slot_uses_roster_steps);
+    return UNITY_END();
+}
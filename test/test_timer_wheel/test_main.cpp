@@ -0,0 +1,86 @@
+/**
+ * TimerWheel with explicit times: timers fire after their delay, never before it, also when scheduled while
+ * loop() has not run for a while, and timers beyond level 0 cascade down.
+ * pio test -e native -f test_timer_wheel
+ */
+#include <unity.h>
+
+#include "TimerWheel.h"
+
+static const uint16_t TICK = 100;
+
+/// millis() of the last firing of each timer, 0 if not fired.
+static uint32_t fired[4];
+static uint32_t now;
+
+static void onTimer(void*, uint8_t id) { fired[id] = now; }
+
+static TimerWheel<4, TICK> *wheel;
+
+/// Runs loop() every ms until `until`.
+static void runTo(uint32_t until) {
+    while(now < until) { now++; wheel->loop(now); }
+}
+
+void setUp(void) {
+    for(auto &f: fired) f = 0;
+    now = 0;
+    wheel = new TimerWheel<4, TICK>(onTimer, nullptr);
+}
+void tearDown(void) { delete wheel; }
+
+void test_fires_after_delay(void) {
+    runTo(1050);
+    wheel->schedule(0, 500, now);
+    TEST_ASSERT_TRUE(wheel->pending(0));
+    runTo(3000);
+    TEST_ASSERT_GREATER_OR_EQUAL(1050+500, fired[0]);
+    TEST_ASSERT_LESS_OR_EQUAL(1050+500+2*TICK, fired[0]);
+    TEST_ASSERT_FALSE(wheel->pending(0));
+}
+
+/// loop() last ran at 1000; a timer of 3s set at 11000 fires at 14000, not when loop() catches up.
+void test_scheduled_while_loop_behind(void) {
+    runTo(1000);
+    now = 11000;
+    wheel->schedule(1, 3000, now);
+    wheel->loop(now);
+    TEST_ASSERT_EQUAL(0, fired[1]);
+    runTo(13999);
+    TEST_ASSERT_EQUAL(0, fired[1]);
+    runTo(20000);
+    TEST_ASSERT_GREATER_OR_EQUAL(14000, fired[1]);
+    TEST_ASSERT_LESS_OR_EQUAL(14000+2*TICK, fired[1]);
+}
+
+/// Scheduled before loop() ever ran, at a time far from 0.
+void test_scheduled_before_first_loop(void) {
+    now = 500000;
+    wheel->schedule(2, 1000, now);
+    wheel->loop(now);
+    TEST_ASSERT_EQUAL(0, fired[2]);
+    runTo(502000);
+    TEST_ASSERT_GREATER_OR_EQUAL(501000, fired[2]);
+    TEST_ASSERT_LESS_OR_EQUAL(501000+2*TICK, fired[2]);
+}
+
+void test_long_timer_cascades(void) {
+    wheel->schedule(3, 200000, now);
+    wheel->schedule(0, 10, now);
+    wheel->cancel(0);
+    runTo(199000);
+    TEST_ASSERT_EQUAL(0, fired[3]);
+    TEST_ASSERT_EQUAL(0, fired[0]);
+    runTo(201000);
+    TEST_ASSERT_GREATER_OR_EQUAL(200000, fired[3]);
+    TEST_ASSERT_LESS_OR_EQUAL(200000+2*TICK, fired[3]);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_fires_after_delay);
+    RUN_TEST(test_scheduled_while_loop_behind);
+    RUN_TEST(test_scheduled_before_first_loop);
+    RUN_TEST(test_long_timer_cascades);
+    return UNITY_END();
+}
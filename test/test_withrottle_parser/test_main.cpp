@@ -0,0 +1,241 @@
+/**
+ * WiThrottle commands from a client over a local socket: lines split across segments, CRLF, loco add,
+ * speed, direction, functions and release, turnouts, power, overlong and unknown lines, locos purged or
+ * not added for lack of slots.
+ * pio test -e native -f test_withrottle_parser
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "WiThrottle.h"
+
+static const uint16_t PORT = 44471;
+
+/// Takes packets instead of generating a signal.
+class NullChannel: public IDCCChannel {
+public:
+    void begin() override {}
+    void end() override {}
+    void unloadSlot(uint8_t) override {}
+    void setPower(bool v) override { power = v; }
+    bool getPower() override { return power; }
+    uint16_t readCurrentAdc() override { return 0; }
+protected:
+    void timerFunc() override {}
+    bool loadPacket(int, uint8_t*, uint8_t, int) override { return true; }
+private:
+    bool power = true;
+};
+
+static NullChannel dcc;
+static WiThrottleServer wt(PORT);
+static int fd = -1;
+static std::string rx;
+
+static double msSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-t0).count();
+}
+
+static void send(const char *s) {
+    TEST_ASSERT_EQUAL((ssize_t)strlen(s), ::send(fd, s, strlen(s), 0));
+}
+
+/// Runs loop() until received output contains `expect`, or a while if it is nullptr. @return output since last call
+static std::string run(const char *expect=nullptr) {
+    char buf[4096];
+    auto t0 = std::chrono::steady_clock::now();
+    while(msSince(t0) < (expect!=nullptr ? 1000 : 30)) {
+        wt.loop();
+        ssize_t n;
+        while((n = recv(fd, buf, sizeof(buf), 0)) > 0) rx.append(buf, n);
+        if(expect!=nullptr && rx.find(expect)!=std::string::npos) break;
+        usleep(200);
+    }
+    std::string ret;
+    ret.swap(rx);
+    return ret;
+}
+
+static bool has(const std::string &s, const char *part) { return s.find(part)!=std::string::npos; }
+
+void setUp(void) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(PORT);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT_EQUAL(0, connect(fd, (sockaddr*)&a, sizeof(a)));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    rx.clear();
+    TEST_ASSERT_TRUE(has(run("*30\r\n"), "VN2.0"));
+}
+
+void tearDown(void) {
+    close(fd);
+    // slot is released for the next test
+    run();
+}
+
+void test_loco_commands(void) {
+    send("NTest throttle\n");
+    std::string out = run("*30");
+    TEST_ASSERT_TRUE(has(out, "*30\r\n"));
+
+    // split in the middle of the delimiter, with CRLF
+    send("MT+S3<");
+    run();
+    send(";>S3\r\n");
+    out = run("MTAS3<;>s1");
+    TEST_ASSERT_TRUE(has(out, "MT+S3<;>\r\n"));
+    TEST_ASSERT_TRUE(has(out, "MTAS3<;>F028\r\n"));
+    TEST_ASSERT_TRUE(has(out, "MTAS3<;>V0\r\n"));
+    uint8_t slot = CS.findLocoSlot(LocoAddress::shortAddr(3));
+    TEST_ASSERT_NOT_EQUAL(0, slot);
+
+    send("MTAS3<;>V50\nMTAS3<;>R0\nMTAS3<;>qV\n");
+    out = run("MTAS3<;>V50");
+    TEST_ASSERT_EQUAL(50, CS.getLocoSpeed(slot));
+    TEST_ASSERT_EQUAL(0, CS.getLocoDir(slot));
+
+    // function button press toggles
+    send("MTAS3<;>F12\n");
+    out = run("MTAS3<;>F12\r\n");
+    TEST_ASSERT_TRUE(CS.getLocoFn(slot, 2));
+
+    // '*' addresses every loco of the throttle
+    send("MTA*<;>X\n");
+    run();
+    TEST_ASSERT_EQUAL(1, CS.getLocoSpeed(slot));
+    send("MT-*<;>r\n");
+    out = run("MT-S3<;>");
+    TEST_ASSERT_TRUE(has(out, "MT-S3<;>\r\n"));
+}
+
+void test_long_address_and_second_throttle(void) {
+    send("MS+L1234<;>L1234\nMT+S5<;>S5\n");
+    std::string out = run("MTAS5<;>s1");
+    TEST_ASSERT_TRUE(has(out, "MS+L1234<;>\r\n"));
+    uint8_t slot = CS.findLocoSlot(LocoAddress::longAddr(1234));
+    TEST_ASSERT_NOT_EQUAL(0, slot);
+    send("MSAL1234<;>V99\nMTAS5<;>V7\n");
+    run();
+    TEST_ASSERT_EQUAL(99, CS.getLocoSpeed(slot));
+    TEST_ASSERT_EQUAL(7, CS.getLocoSpeed(CS.findLocoSlot(LocoAddress::shortAddr(5))));
+    send("MS-L1234<;>r\nMT-S5<;>r\n");
+    run("MT-S5");
+}
+
+void test_turnouts_and_power(void) {
+    send("PTA2100\n");
+    std::string out = run("PTA2100");
+    TEST_ASSERT_TRUE(has(out, "PTA2100\r\n"));
+    TEST_ASSERT_EQUAL(TurnoutState::CLOSED, CS.getTurnoutState(100));
+    send("PTAT100\n");
+    out = run("PTA4100");
+    TEST_ASSERT_EQUAL(TurnoutState::THROWN, CS.getTurnoutState(100));
+    send("PTA3100\n");
+    out = run("PTA2100");
+    TEST_ASSERT_EQUAL(TurnoutState::CLOSED, CS.getTurnoutState(100));
+
+    send("PPA0\n");
+    out = run("PPA0");
+    TEST_ASSERT_FALSE(CS.getPowerState());
+    send("PPA1\n");
+    out = run("PPA1");
+    TEST_ASSERT_TRUE(CS.getPowerState());
+}
+
+void test_bad_lines_are_ignored(void) {
+    std::string junk(200, 'M');   // longer than a command line, shorter than the receive buffer
+    junk += "\n";
+    send(junk.c_str());
+    run();
+    send("\n\r\nX\nP\nPT\nPTA\nMT\nMT+\nMTA\nMTAS3\nMT+Z9<;>Z9\n*\n");
+    std::string out = run();
+    TEST_ASSERT_EQUAL(0, out.size());
+    TEST_ASSERT_EQUAL(0, wt.getStats().rxDropped);
+    // and the client still works
+    send("MT+S4<;>S4\n");
+    TEST_ASSERT_TRUE(has(run("MTAS4<;>s1"), "MT+S4<;>"));
+    send("MT-S4<;>r\n");
+    run("MT-S4");
+}
+
+void test_no_free_slot(void) {
+    // every slot taken by this client, two locos per throttle
+    const char TH[] = "ABCDE";
+    char line[64];
+    for(int i=0; i<CommandStation::MAX_SLOTS; i++) {
+        snprintf(line, sizeof(line), "M%c+S%d<;>S%d\n", TH[i/2], 10+i, 10+i);
+        send(line);
+        snprintf(line, sizeof(line), "M%cAS%d<;>s", TH[i/2], 10+i);
+        run(line);
+    }
+    send("MF+S30<;>S30\n");
+    std::string out = run("HM");
+    TEST_ASSERT_TRUE(has(out, "HMNo free slot for loco S30"));
+    TEST_ASSERT_FALSE(has(out, "MF+S30"));
+    TEST_ASSERT_EQUAL(0, CS.findLocoSlot(LocoAddress::shortAddr(30)));
+    // a third loco on a throttle is not taken either
+    send("MA+S31<;>S31\n");
+    TEST_ASSERT_TRUE(has(run("HM"), "HMThrottle A is full"));
+    // actions for the loco that was not added go nowhere
+    send("MFAS30<;>V50\nMFAS30<;>F11\nMF-S30<;>r\n");
+    run();
+    for(uint8_t s=1; s<=CommandStation::MAX_SLOTS; s++) TEST_ASSERT_EQUAL(0, CS.getLocoSpeed(s));
+    send("MA-*<;>r\nMB-*<;>r\nMC-*<;>r\nMD-*<;>r\nME-*<;>r\n");
+    run("ME-S19");
+}
+
+void test_purged_loco(void) {
+    // timer is set when the slot is taken
+    CS.setSlotPurgeTimes(50, 50);
+    send("MT+S6<;>S6\n");
+    run("MTAS6<;>s1");
+    uint8_t slot = CS.findLocoSlot(LocoAddress::shortAddr(6));
+    TEST_ASSERT_NOT_EQUAL(0, slot);
+    // client stays quiet, the slot becomes common and then free
+    auto t0 = std::chrono::steady_clock::now();
+    while(CS.isSlotAllocated(slot) && msSince(t0) < 1000) { CS.loop(); usleep(1000); }
+    CS.setSlotPurgeTimes(CommandStation::DEFAULT_PURGE_ACTIVE_MS, CommandStation::DEFAULT_PURGE_COMMON_MS);
+    TEST_ASSERT_FALSE(CS.isSlotAllocated(slot));
+    TEST_ASSERT_TRUE(has(run("MT-S6"), "MT-S6<;>"));
+    // the phone has not processed the removal yet
+    send("MTAS6<;>V50\nMTAS6<;>F12\nMTAS6<;>qV\nMTA*<;>V40\nMT-S6<;>r\n");
+    // only the release is confirmed
+    TEST_ASSERT_EQUAL_STRING("MT-S6<;>\r\n", run().c_str());
+    TEST_ASSERT_EQUAL(0, CS.findLocoSlot(LocoAddress::shortAddr(6)));
+    for(uint8_t s=1; s<=CommandStation::MAX_SLOTS; s++) TEST_ASSERT_FALSE(CS.isSlotAllocated(s));
+}
+
+void test_quit(void) {
+    send("Q\n");
+    run();
+    char b;
+    TEST_ASSERT_EQUAL(0, recv(fd, &b, 1, 0));   // closed by server
+    TEST_ASSERT_EQUAL(0, wt.getStats().rejected);
+}
+
+int main(int argc, char **argv) {
+    CS.setDccMain(&dcc);
+    CS.addSlotListener(&wt);
+    wt.begin();
+    UNITY_BEGIN();
+    RUN_TEST(test_loco_commands);
+    RUN_TEST(test_long_address_and_second_throttle);
+    RUN_TEST(test_turnouts_and_power);
+    RUN_TEST(test_bad_lines_are_ignored);
+    RUN_TEST(test_no_free_slot);
+    RUN_TEST(test_purged_loco);
+    RUN_TEST(test_quit);
+    return UNITY_END();
+}
@@ -0,0 +1,215 @@
+/**
+ * Z21Server over UDP loopback: serial number, loco drive and loco info in 128, 28 and 14 steps,
+ * turnouts kept out of the roster, and subscriptions dropped when a loco is purged.
+ * pio test -e native -f test_z21_server
+ */
+#include <unity.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Z21Server.h"
+#include "LocoRoster.h"
+
+static const uint16_t PORT = 44521;
+static const char *ROSTER_PATH = "test_z21_roster.bin";
+
+/// Takes packets instead of generating a signal.
+class NullChannel: public IDCCChannel {
+public:
+    void begin() override {}
+    void end() override {}
+    void unloadSlot(uint8_t) override {}
+    void setPower(bool v) override { power = v; }
+    bool getPower() override { return power; }
+    uint16_t readCurrentAdc() override { return 0; }
+protected:
+    void timerFunc() override {}
+    bool loadPacket(int, uint8_t*, uint8_t, int) override { return true; }
+private:
+    bool power = true;
+};
+
+static NullChannel dcc;
+static Z21Server z21(PORT);
+static int fd = -1;
+
+using Bytes = std::vector<uint8_t>;
+
+static double msSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-t0).count();
+}
+
+static void sendPacket(const Bytes &b) {
+    sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(PORT);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT_EQUAL((ssize_t)b.size(), sendto(fd, b.data(), b.size(), 0, (sockaddr*)&a, sizeof(a)));
+}
+
+/// Runs the station for up to `ms` and returns the first datagram received, empty if none came.
+static Bytes receive(int ms=500) {
+    auto t0 = std::chrono::steady_clock::now();
+    uint8_t buf[512];
+    while(msSince(t0) < ms) {
+        z21.loop();
+        CS.loop();
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n>0) return Bytes(buf, buf+n);
+        usleep(100);
+    }
+    return Bytes();
+}
+
+/// LAN_X message with length, header and XOR byte.
+static Bytes lanX(Bytes x) {
+    uint8_t chk = 0;
+    for(uint8_t b: x) chk ^= b;
+    x.push_back(chk);
+    Bytes m = {(uint8_t)(4+x.size()), 0, 0x40, 0x00};
+    m.insert(m.end(), x.begin(), x.end());
+    return m;
+}
+
+/// LAN_X_SET_LOCO_DRIVE; steps 0: 14, 2: 28, 3: 128
+static Bytes drive(uint16_t za, uint8_t steps, uint8_t rv) {
+    return lanX({0xE4, (uint8_t)(0x10 | steps), (uint8_t)(za>>8), (uint8_t)(za & 0xFF), rv});
+}
+
+/// Checks LAN_X_LOCO_INFO: address, step mode (DB2) and direction and speed (DB3).
+static void assertLocoInfo(const Bytes &p, uint16_t za, uint8_t db2, uint8_t db3) {
+    TEST_ASSERT_TRUE_MESSAGE(p.size()>=14, "no LAN_X_LOCO_INFO");
+    TEST_ASSERT_EQUAL_HEX8(0x40, p[2]);
+    TEST_ASSERT_EQUAL_HEX8(0xEF, p[4]);
+    TEST_ASSERT_EQUAL(za, (p[5]&0x3F)<<8 | p[6]);
+    TEST_ASSERT_EQUAL_HEX8(db2, p[7]);
+    TEST_ASSERT_EQUAL_HEX8(db3, p[8]);
+    uint8_t x = 0;
+    for(size_t i=4; i<p[0]; i++) x ^= p[i];
+    TEST_ASSERT_EQUAL_HEX8(0, x);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_serial_number(void) {
+    sendPacket({0x04, 0x00, 0x10, 0x00});
+    Bytes p = receive();
+    TEST_ASSERT_EQUAL(8, p.size());
+    const uint8_t expect[] = {0x08, 0x00, 0x10, 0x00, 0x01, 0x00, 0x00, 0x00};
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expect, p.data(), 8);
+}
+
+void test_loco_drive_128_steps(void) {
+    sendPacket(drive(3, 3, 0x80 | 50));
+    Bytes p = receive();
+    assertLocoInfo(p, 3, 0x04, 0x80 | 50);
+    uint8_t slot = CS.findLocoSlot(LocoAddress::shortAddr(3));
+    TEST_ASSERT_NOT_EQUAL(0, slot);
+    TEST_ASSERT_EQUAL(50, CS.getLocoSpeed(slot));
+    TEST_ASSERT_EQUAL(1, CS.getLocoDir(slot));
+    CS.releaseLocoSlot(slot);
+}
+
+/// Locos of a 14 or 28 step roster entry are reported in their own mode, and the speed round trips.
+void test_loco_info_in_slot_steps(void) {
+    remove(ROSTER_PATH);
+    FileRosterStorage st(ROSTER_PATH, 0x8000);
+    LocoRoster roster;
+    roster.begin(&st);
+    TEST_ASSERT_TRUE(roster.put(LocoAddress::shortAddr(14), "Old", 14));
+    TEST_ASSERT_TRUE(roster.put(LocoAddress::shortAddr(28), "Older", 28));
+    TEST_ASSERT_TRUE(roster.rebuild());
+    CS.setLocoRoster(&roster);
+
+    // 28 steps: step 15 is SSSSC 18, sent as 000C SSSS
+    sendPacket(drive(28, 2, 0x80 | 0x09));
+    assertLocoInfo(receive(), 28, 0x02, 0x80 | 0x09);
+    uint8_t s28 = CS.findLocoSlot(LocoAddress::shortAddr(28));
+    TEST_ASSERT_EQUAL(28, CS.getLocoSpeedSteps(s28));
+    // every step reads back as sent
+    for(uint8_t step=1; step<=28; step++) {
+        uint8_t s5 = step+3;
+        uint8_t v = (s5&1)<<4 | s5>>1;
+        sendPacket(drive(28, 2, v));
+        assertLocoInfo(receive(), 28, 0x02, v);
+    }
+
+    sendPacket(drive(14, 0, 0x80 | 15));
+    assertLocoInfo(receive(), 14, 0x00, 0x80 | 15);
+    uint8_t s14 = CS.findLocoSlot(LocoAddress::shortAddr(14));
+    TEST_ASSERT_EQUAL(127, CS.getLocoSpeed(s14));
+    for(uint8_t step=1; step<=14; step++) {
+        sendPacket(drive(14, 0, step+1));
+        assertLocoInfo(receive(), 14, 0x00, step+1);
+    }
+    sendPacket(drive(14, 0, 0x80 | 1)); // e-stop
+    assertLocoInfo(receive(), 14, 0x00, 0x80 | 1);
+
+    CS.releaseLocoSlot(s14);
+    CS.releaseLocoSlot(s28);
+    CS.setLocoRoster(nullptr);
+    remove(ROSTER_PATH);
+}
+
+void test_set_turnout_keeps_roster(void) {
+    sendPacket({0x08, 0x00, 0x50, 0x00, 0x01, 0x00, 0x00, 0x00}); // LAN_SET_BROADCASTFLAGS: driving and switching
+    uint16_t count = CS.getTurnoutCount();
+    // address 5 (Z21 4), activate output 1: closed
+    sendPacket(lanX({0x53, 0x00, 0x04, 0x89}));
+    Bytes p = receive();
+    TEST_ASSERT_EQUAL(9, p.size());
+    const uint8_t closed[] = {0x09, 0x00, 0x40, 0x00, 0x43, 0x00, 0x04, 0x02, 0x45};
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(closed, p.data(), 9);
+    TEST_ASSERT_EQUAL(TurnoutState::CLOSED, CS.getTurnoutState(5));
+
+    sendPacket(lanX({0x53, 0x00, 0x04, 0x88}));
+    p = receive();
+    TEST_ASSERT_EQUAL(9, p.size());
+    TEST_ASSERT_EQUAL_HEX8(0x01, p[7]);
+    TEST_ASSERT_EQUAL(TurnoutState::THROWN, CS.getTurnoutState(5));
+    TEST_ASSERT_FALSE(CS.isTurnoutInRoster(5));
+    TEST_ASSERT_EQUAL(count, CS.getTurnoutCount());
+}
+
+void test_purged_loco_is_unsubscribed(void) {
+    CS.setSlotPurgeTimes(50, 50);
+    sendPacket(drive(7, 3, 0x80 | 20));
+    assertLocoInfo(receive(), 7, 0x04, 0x80 | 20);
+    LocoAddress a = LocoAddress::shortAddr(7);
+    auto t0 = std::chrono::steady_clock::now();
+    while(CS.findLocoSlot(a)!=0) {
+        TEST_ASSERT_TRUE_MESSAGE(msSince(t0) < 2000, "loco not purged");
+        receive(10);
+    }
+    CS.setSlotPurgeTimes(CommandStation::DEFAULT_PURGE_ACTIVE_MS, CommandStation::DEFAULT_PURGE_COMMON_MS);
+
+    // another throttle takes the loco: the Z21 client does not hear of it any more
+    uint8_t slot = CS.findOrAllocateLocoSlot(a);
+    CS.setLocoSpeed(slot, 40);
+    TEST_ASSERT_EQUAL(0, receive(200).size());
+    CS.releaseLocoSlot(slot);
+}
+
+int main(int argc, char **argv) {
+    CS.setDccMain(&dcc);
+    CS.addSlotListener(&z21);
+    z21.begin();
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    UNITY_BEGIN();
+    RUN_TEST(test_serial_number);
+    RUN_TEST(test_loco_drive_128_steps);
+    RUN_TEST(test_loco_info_in_slot_steps);
+    RUN_TEST(test_set_turnout_keeps_roster);
+    RUN_TEST(test_purged_loco_is_unsubscribed);
+    return UNITY_END();
+}